@@ -1,22 +1,8 @@
-
-
-#include "numstore/core/error.h"
 #include <nsfilecli.h>
-#include <string.h>
+#include <stdio.h>
 
 int
 main (int argc, char **argv)
 {
-  struct nsfilecli_args args;
-
-  error e = error_create ();
-
-  nsfilecli_args_parse (&args, argc, argv, &e);
-
-  if (e.cause_code)
-    {
-      return e.cause_code;
-    }
-
-  return 0;
+  return nsfilecli_main (argc, argv, stdout);
 }
@@ -24,20 +24,44 @@
 
 #include <numstore/intf/types.h>
 
+// Fixed per build (-DPAGE_POW=14 for 16 KiB pages), not per database. Every page
+// layout is sized off it at compile time, so the root page records it and
+// rn_check_format refuses a database created with another size
+#ifndef PAGE_POW
 #define PAGE_POW 12
+#endif
 #define PAGE_SIZE ((p_size)1 << PAGE_POW)
-#define MEMORY_PAGE_LEN ((u32)20)
+#define MEMORY_PAGE_LEN ((u32)20) // Default (and minimum) number of buffer pool frames
+#define MIN_PARTITION_FRAMES 256 // Buffer pool frames per partition before splitting further
+#define MAX_POOL_PARTITIONS 64
+#define META_TIER_PCT 10      // Share of the buffer pool kept for root, catalog and inner node pages
+#define CLEANER_TARGET_PCT 75 // Share of each buffer pool partition the cleaner keeps clean
+#define CLEANER_BATCH 32      // Max pages the cleaner writes per partition per pass
+#define UNDO_SLAB_PAGES 16    // Before images per slab for pages held in X
+#define READ_AHEAD_PAGES 16   // Max data_list pages a sequential read prefetches ahead of itself
+#define READ_AHEAD_TRIGGER 2  // Leaf advances before a read counts as sequential
+#define AIO_QUEUE_DEPTH 64    // Most requests in one batched I/O submission
+#define FPGR_EXTENT_MIN 16    // Pages the database file grows by at first
+#define FPGR_EXTENT_MAX 2048  // Growth doubles until it reaches this many pages per step
+#define FPGR_CMP_BLOCK 4096   // File system block - a compressed page has to free at least one
+#define VACUUM_FILL_PCT 90    // Leaf fill a vacuum repacks data_list pages to
+#define UNLOGGED_EXTENT 64    // Pages an unlogged transaction takes off the end of the file per logged root update
 #define MAX_VSTR 10000
 #define MAX_TSTR 10000
 #define TXN_TBL_SIZE 512
 #define WAL_BUFFER_CAP 1000000
+#define WAL_BUFFERS 2          // The flusher starts on the WAL buffer once a 1 / WAL_BUFFERS slice of it fills
+#define WAL_COMMIT_DELAY_US 0 // Longest the WAL flusher waits for more committers. 0 = don't wait
+#define WAL_COMMIT_BATCH 8     // ... and how many it waits for
 #define MAX_NUPD_SIZE 200
 #define CURSOR_POOL_SIZE 100
 #define CLI_MAX_FILTERS 32
 #define MAX_TIDS 1000
 #define MAX_OPEN_FILES 10
+#define MAX_STRIPE_DIRS 16 // Directories a segmented database can spread its files over
 #define MAX_FILE_NAME 4096
 #define WAL_SEGMENT_SIZE (16 * 1024 * 1024) // 16 MB
+#define WAL_SEGMENT_SPARES 2                // Truncated segments kept (renamed) for the log to grow into
 
 // Address: [ file type ] [ file number ] [ file offset ]
 #define FILE_TYPE_BITS 4
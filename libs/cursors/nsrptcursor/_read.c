@@ -19,15 +19,21 @@
  */
 
 #include <numstore/core/error.h>
+#include <numstore/core/math.h>
 #include <numstore/pager.h>
 #include <numstore/pager/data_list.h>
+#include <numstore/pager/inner_node.h>
 #include <numstore/pager/page.h>
 #include <numstore/pager/page_h.h>
 #include <numstore/pager/pager_routines.h>
+#include <numstore/intf/os.h>
+#include <numstore/rptree/oneoff.h>
 #include <numstore/rptree/rptree_cursor.h>
 #include <numstore/test/page_fixture.h>
 #include <numstore/test/testing.h>
 
+#include <config.h>
+
 DEFINE_DBG_ASSERT (
     struct rptree_cursor, rptc_reading, r,
     {
@@ -60,8 +66,22 @@ rptc_seeked_to_read (
     .total_bread = 0,
     .max_bread = max_nread * bsize,
     .state = DLREAD_ACTIVE,
+    .nadvance = 0,
+    .ra_parent = false,
   };
 
+  // The seek left the parent on top of the stack, pointing at us
+  if (r->stack_state.sp > 0)
+    {
+      struct seek_v *parent = &r->stack_state.stack[r->stack_state.sp - 1];
+      if (in_get_leaf (page_h_ro (&parent->pg), parent->lidx) == page_h_pgno (&r->cur))
+        {
+          r->reader.ra_parent = true;
+          r->reader.ra_pidx = parent->lidx;
+          r->reader.ra_upto = parent->lidx;
+        }
+    }
+
   r->state = RPTS_DL_READING;
 
   DBG_ASSERT (rptc_reading, r);
@@ -93,6 +113,55 @@ rptc_read_next (struct rptree_cursor *r)
   return next;
 }
 
+/**
+ * Called after each step onto the next leaf. Once the read looks
+ * sequential, keep the next READ_AHEAD_PAGES leaves of the parent
+ * inner node on their way into the pool. The chain and the parent agree
+ * until the read walks off the end of the parent, after which every
+ * leaf is a plain synchronous fetch again
+ */
+static void
+rptc_read_ahead (struct rptree_cursor *r)
+{
+  struct rptc_read *rd = &r->reader;
+
+  if (!rd->ra_parent)
+    {
+      return;
+    }
+
+  const page *parent = page_h_ro (&r->stack_state.stack[r->stack_state.sp - 1].pg);
+  p_size len = in_get_len (parent);
+
+  // Follow cur through the parent
+  if (rd->ra_pidx + 1 >= len || in_get_leaf (parent, rd->ra_pidx + 1) != page_h_pgno (&r->cur))
+    {
+      rd->ra_parent = false;
+      return;
+    }
+  rd->ra_pidx++;
+
+  // Only top up once half the window is used
+  if (++rd->nadvance < READ_AHEAD_TRIGGER || rd->ra_upto >= rd->ra_pidx + READ_AHEAD_PAGES / 2)
+    {
+      return;
+    }
+
+  pgno pgs[READ_AHEAD_PAGES];
+  u32 npgs = 0;
+  p_size end = MIN (rd->ra_pidx + READ_AHEAD_PAGES, len - 1);
+  for (p_size i = MAX (rd->ra_upto, rd->ra_pidx) + 1; i <= end; ++i)
+    {
+      pgs[npgs++] = in_get_leaf (parent, i);
+    }
+  rd->ra_upto = end;
+
+  if (npgs > 0)
+    {
+      pgr_prefetch (r->pager, PG_DATA_LIST, pgs, npgs);
+    }
+}
+
 err_t
 rptc_read_execute (struct rptree_cursor *r, error *e)
 {
@@ -134,6 +203,7 @@ rptc_read_execute (struct rptree_cursor *r, error *e)
 
                   r->lidx = 0;
                   r->cur = page_h_xfer_ownership (&next_page);
+                  rptc_read_ahead (r);
 
                   return SUCCESS;
                 }
@@ -230,3 +300,95 @@ rptc_read_to_unseeked (struct rptree_cursor *r, error *e)
 
   return SUCCESS;
 }
+
+#ifndef NTEST
+#define RA_TEST_PAGES 64
+
+TEST (TT_UNIT, rptc_read_ahead)
+{
+  static u32 src[RA_TEST_PAGES * DL_DATA_SIZE / sizeof (u32)];
+  static u32 dest[arrlen (src)];
+  arr_range (src);
+
+  struct pgr_fixture f;
+  test_err_t_wrap (pgr_fixture_create (&f), &f.e);
+
+  // Spread src over enough leaves that a full read goes sequential
+  pgno root;
+  {
+    struct txn tx;
+    struct rptree_cursor r;
+    test_err_t_wrap (pgr_begin_txn (&tx, f.p, &f.e), &f.e);
+    rptc_new (&r, &tx, f.p, &f.lt);
+    rptc_enter_transaction (&r, &tx);
+    test_err_t_wrap (rptof_insert (&r, src, 0, sizeof (u32), arrlen (src), &f.e), &f.e);
+    root = r.root;
+    test_err_t_wrap (rptc_cleanup (&r, &f.e), &f.e);
+    test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
+  }
+
+  // Start with every leaf on disk only
+  test_err_t_wrap (pgr_close (f.p, &f.e), &f.e);
+  f.p = pgr_open ("test.db", "test.wal", &f.lt, f.tp, &f.e);
+  test_fail_if_null (f.p);
+
+  // Read-ahead only runs with somewhere to run
+  test_err_t_wrap (tp_spin (f.tp, 1, &f.e), &f.e);
+
+  TEST_CASE ("Contiguous read of every leaf")
+  {
+    struct rptree_cursor r;
+    struct pgr_stats s;
+    test_err_t_wrap (rptc_open (&r, root, f.p, &f.lt, &f.e), &f.e);
+
+    /**
+     * Just enough leaves to count as sequential - the ones they hint at
+     * aren't read until the task has had its go
+     */
+    const u32 head = (READ_AHEAD_TRIGGER + 1) * (DL_DATA_SIZE / sizeof (u32));
+
+    i_memset (dest, 0, sizeof (dest));
+    sb_size nread = rptof_read (&r, dest, sizeof (u32), 0, 1, head, &f.e);
+    test_assert_int_equal (nread, head);
+
+    do
+      {
+        i_thread_yield ();
+        pgr_get_stats (f.p, &s);
+      }
+    while (s.readahead == 0);
+
+    nread = rptof_read (&r, dest + head, sizeof (u32), head * sizeof (u32), 1, arrlen (src) - head, &f.e);
+    test_assert_int_equal (nread, arrlen (src) - head);
+    test_assert_memequal (dest, src, sizeof (src));
+
+    pgr_get_stats (f.p, &s);
+    test_assert (s.readahead > 0);
+    test_assert (s.readahead_hits > 0);
+
+    test_err_t_wrap (rptc_cleanup (&r, &f.e), &f.e);
+  }
+
+  TEST_CASE ("Strided read of every leaf")
+  {
+    struct rptree_cursor r;
+    test_err_t_wrap (rptc_open (&r, root, f.p, &f.lt, &f.e), &f.e);
+
+    i_memset (dest, 0, sizeof (dest));
+    sb_size nread = rptof_read (&r, dest, sizeof (u32), sizeof (u32), 3, arrlen (src) / 3, &f.e);
+    test_assert_int_equal (nread, arrlen (src) / 3);
+    for (u32 i = 0; i < arrlen (src) / 3; ++i)
+      {
+        test_assert_int_equal (dest[i], 1 + 3 * i);
+      }
+
+    test_err_t_wrap (rptc_cleanup (&r, &f.e), &f.e);
+  }
+
+  // Queued read-ahead finishes before the pool goes away
+  test_err_t_wrap (pgr_close (f.p, &f.e), &f.e);
+  test_err_t_wrap (tp_stop (f.tp, &f.e), &f.e);
+  test_err_t_wrap (tp_free (f.tp, &f.e), &f.e);
+  lockt_destroy (&f.lt);
+}
+#endif
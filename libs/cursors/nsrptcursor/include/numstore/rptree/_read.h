@@ -40,6 +40,12 @@ struct rptc_read
     DLREAD_ACTIVE,
     DLREAD_SKIPPING,
   } state;
+
+  // Read-ahead over the leaves of the parent inner node on the seek stack
+  u32 nadvance;   // Leaves stepped over so far
+  bool ra_parent; // ra_pidx still points at cur in the parent
+  p_size ra_pidx; // Index of cur in the parent
+  p_size ra_upto; // Leaves of the parent up to here were prefetched
 };
 
 err_t rptc_read_execute (struct rptree_cursor *r, error *e);
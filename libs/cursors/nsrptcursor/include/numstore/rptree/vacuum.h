@@ -0,0 +1,39 @@
+#pragma once
+
+/*
+ * Copyright 2025 Theo Lincke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *   Online compaction of an R+ tree. Repacks the leaves under one bottom
+ *   inner node at a time and moves the nodes above them to lower pages so
+ *   the end of the file frees up.
+ */
+
+#include <numstore/rptree/rptree_cursor.h>
+
+/**
+ * One step of a vacuum, meant to be its own transaction so a vacuum
+ * never holds much for long. Steps walk the tree left to right by byte
+ * offset - start [*bofst] at 0 and keep going until it reaches
+ * r->total_size. Each one:
+ *
+ *   1. Moves every node on the path down to the next bottom inner
+ *      node to the lowest free page below it
+ *   2. Rewrites that node's leaves into as few pages as fill at
+ *      [fill_pct] percent, allocated lowest free page first
+ *
+ * The tree's size and contents never change. r->root might
+ */
+err_t rptv_vacuum_step (struct rptree_cursor *r, b_size *bofst, u32 fill_pct, error *e);
@@ -782,6 +782,7 @@ rptc_new (struct rptree_cursor *r, struct txn *tx, struct pager *p, struct lockt
   r->pager = p;
   r->lt = lt;
   r->root = PGNO_NULL;
+  r->total_size = 0;
   r->tx = tx;
   r->cur = page_h_create ();
   r->lidx = 0;
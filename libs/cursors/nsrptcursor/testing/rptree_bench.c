@@ -0,0 +1,201 @@
+/*
+ * Copyright 2025 Theo Lincke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *   R+ tree benchmarks (TT_PROFILE). Run with `./test PROFILE rptc_bench`.
+ *   Page size is fixed per build - `make bench-page-size` runs these at
+ *   4 KiB, 16 KiB and 64 KiB.
+ */
+
+#include <numstore/core/assert.h>
+#include <numstore/core/error.h>
+#include <numstore/core/macros.h>
+#include <numstore/intf/logging.h>
+#include <numstore/intf/os.h>
+#include <numstore/pager.h>
+#include <numstore/pager/inner_node.h>
+#include <numstore/pager/lock_table.h>
+#include <numstore/pager/page_h.h>
+#include <numstore/rptree/oneoff.h>
+#include <numstore/rptree/rptree_cursor.h>
+#include <numstore/test/testing.h>
+#include <numstore/test/testing_test.h>
+
+#include <config.h>
+
+#ifndef NTEST
+
+#define RPTB_BYTES ((b_size)64 * 1024 * 1024) // One f64 variable this big
+#define RPTB_CHUNK ((b_size)1024 * 1024)      // Bytes per append / read call
+#define RPTB_BUDGET ((u64)8 * 1024 * 1024)    // Buffer pool - an eighth of the data
+#define RPTB_INSERTS 2000                     // Inserts in the middle
+#define RPTB_INSERT_ELEMS 64                  // f64s per middle insert
+#define RPTB_INSERTS_PER_TXN 100
+
+struct rptc_bench
+{
+  error e;
+  struct pager *p;
+  struct lockt lt;
+  struct thread_pool *tp;
+  struct rptree_cursor r;
+  i_timer timer;
+};
+
+static err_t
+rptc_bench_open (struct rptc_bench *b)
+{
+  b->e = error_create ();
+
+  err_t_wrap (i_remove_quiet ("bench.db", &b->e), &b->e);
+  err_t_wrap (i_remove_quiet ("bench.wal", &b->e), &b->e);
+  err_t_wrap (lockt_init (&b->lt, &b->e), &b->e);
+
+  b->tp = tp_open (&b->e);
+  if (b->tp == NULL)
+    {
+      lockt_destroy (&b->lt);
+      return b->e.cause_code;
+    }
+
+  b->p = pgr_open_with ("bench.db", "bench.wal", &b->lt, b->tp, (struct pgr_params){ .memory_budget = RPTB_BUDGET }, &b->e);
+  if (b->p == NULL)
+    {
+      tp_free (b->tp, &b->e);
+      lockt_destroy (&b->lt);
+      return b->e.cause_code;
+    }
+
+  return i_timer_create (&b->timer, &b->e);
+}
+
+static err_t
+rptc_bench_close (struct rptc_bench *b)
+{
+  i_timer_free (&b->timer);
+  pgr_close (b->p, &b->e);
+  tp_free (b->tp, &b->e);
+  lockt_destroy (&b->lt);
+  i_remove_quiet ("bench.db", &b->e);
+  i_remove_quiet ("bench.wal", &b->e);
+  return b->e.cause_code;
+}
+
+static err_t
+rptc_bench_height (struct rptc_bench *b, u32 *dest)
+{
+  page_h h = page_h_create ();
+  pgno pg = b->r.root;
+  *dest = 1;
+
+  while (true)
+    {
+      err_t_wrap (pgr_get (&h, PG_INNER_NODE | PG_DATA_LIST, pg, b->p, &b->e), &b->e);
+      if (page_h_type (&h) == PG_DATA_LIST)
+        {
+          return pgr_release (b->p, &h, PG_DATA_LIST, &b->e);
+        }
+      pg = in_get_leaf (page_h_ro (&h), 0);
+      (*dest)++;
+      err_t_wrap (pgr_release (b->p, &h, PG_INNER_NODE, &b->e), &b->e);
+    }
+}
+
+static void
+rptc_bench_report (const char *label, b_size nbytes, u64 nops, u64 elapsed)
+{
+  elapsed = MAX (elapsed, (u64)1);
+  i_log_info ("rptc_bench %6" PRp_size " B pages  %-16s %9.1f MB/s %10.0f ops/s\n",
+              PAGE_SIZE, label,
+              (f64)nbytes * 1e3 / (f64)elapsed,
+              (f64)nops * 1e9 / (f64)elapsed);
+}
+
+/**
+ * A multi GB f64 array in miniature - build it by appending, scan it
+ * front to back, then insert into the middle of it a little at a time.
+ * The pool only holds an eighth of it so page size shows in the I/O
+ */
+TEST (TT_PROFILE, rptc_bench_page_size)
+{
+  static f64 buf[RPTB_CHUNK / sizeof (f64)];
+  struct rptc_bench b;
+  error *e = &b.e;
+  test_err_t_wrap (rptc_bench_open (&b), e);
+
+  struct txn tx;
+  u64 start;
+
+  TEST_CASE ("Append")
+  {
+    test_err_t_wrap (pgr_begin_txn (&tx, b.p, e), e);
+    rptc_new (&b.r, &tx, b.p, &b.lt);
+    rptc_enter_transaction (&b.r, &tx);
+
+    start = i_timer_now_ns (&b.timer);
+    for (b_size ofst = 0; ofst < RPTB_BYTES; ofst += RPTB_CHUNK)
+      {
+        for (u32 i = 0; i < arrlen (buf); ++i)
+          {
+            buf[i] = (f64)(ofst / sizeof (f64) + i);
+          }
+        test_err_t_wrap (rptof_insert (&b.r, buf, ofst, sizeof (f64), arrlen (buf), e), e);
+      }
+    rptc_leave_transaction (&b.r);
+    test_err_t_wrap (pgr_commit (b.p, &tx, e), e);
+    rptc_bench_report ("append", RPTB_BYTES, RPTB_BYTES / RPTB_CHUNK, i_timer_now_ns (&b.timer) - start);
+  }
+
+  TEST_CASE ("Sequential read")
+  {
+    start = i_timer_now_ns (&b.timer);
+    for (b_size ofst = 0; ofst < RPTB_BYTES; ofst += RPTB_CHUNK)
+      {
+        sb_size nread = rptof_read (&b.r, buf, sizeof (f64), ofst, 1, arrlen (buf), e);
+        test_assert_equal (nread, (sb_size)arrlen (buf));
+      }
+    rptc_bench_report ("sequential read", RPTB_BYTES, RPTB_BYTES / RPTB_CHUNK, i_timer_now_ns (&b.timer) - start);
+    test_assert_equal (buf[arrlen (buf) - 1], (f64)(RPTB_BYTES / sizeof (f64) - 1));
+  }
+
+  TEST_CASE ("Insert in the middle")
+  {
+    start = i_timer_now_ns (&b.timer);
+    for (u32 i = 0; i < RPTB_INSERTS; i += RPTB_INSERTS_PER_TXN)
+      {
+        test_err_t_wrap (pgr_begin_txn (&tx, b.p, e), e);
+        rptc_enter_transaction (&b.r, &tx);
+        for (u32 j = 0; j < RPTB_INSERTS_PER_TXN; ++j)
+          {
+            b_size mid = b.r.total_size / 2 / sizeof (f64) * sizeof (f64);
+            test_err_t_wrap (rptof_insert (&b.r, buf, mid, sizeof (f64), RPTB_INSERT_ELEMS, e), e);
+          }
+        rptc_leave_transaction (&b.r);
+        test_err_t_wrap (pgr_commit (b.p, &tx, e), e);
+      }
+    rptc_bench_report ("insert middle", (b_size)RPTB_INSERTS * RPTB_INSERT_ELEMS * sizeof (f64), RPTB_INSERTS,
+                       i_timer_now_ns (&b.timer) - start);
+  }
+
+  u32 height;
+  test_err_t_wrap (rptc_bench_height (&b, &height), e);
+  i_log_info ("rptc_bench %6" PRp_size " B pages  height %" PRIu32 ", %" PRp_size " pages on disk\n",
+              PAGE_SIZE, height, pgr_get_npages (b.p));
+
+  test_err_t_wrap (rptc_cleanup (&b.r, e), e);
+  test_err_t_wrap (rptc_bench_close (&b), e);
+}
+
+#endif
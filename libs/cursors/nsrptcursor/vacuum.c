@@ -0,0 +1,442 @@
+/*
+ * Copyright 2025 Theo Lincke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *   Implements vacuum.h. Repacks R+ tree leaves and relocates nodes to the
+ *   front of the file one bottom inner node per transaction.
+ */
+
+#include <numstore/rptree/vacuum.h>
+
+#include <numstore/core/assert.h>
+#include <numstore/core/error.h>
+#include <numstore/core/math.h>
+#include <numstore/intf/logging.h>
+#include <numstore/intf/os.h>
+#include <numstore/pager/data_list.h>
+#include <numstore/pager/inner_node.h>
+#include <numstore/pager/page_delegate.h>
+#include <numstore/rptree/oneoff.h>
+#include <numstore/test/page_fixture.h>
+#include <numstore/test/testing.h>
+
+/**
+ * Move [cur] (child [idx] of [parent], or the root) to the lowest free
+ * page below it and point everything that referenced it at the new page
+ */
+static err_t
+rptv_relocate (struct rptree_cursor *r, page_h *parent, p_size idx, page_h *cur, error *e)
+{
+  page_h dest = page_h_create ();
+  err_t_wrap (pgr_relocate (&dest, r->pager, r->tx, cur, e), e);
+
+  if (dest.mode == PHM_NONE)
+    {
+      return SUCCESS;
+    }
+
+  pgno pg = page_h_pgno (&dest);
+  pgno prev = dlgt_get_prev (page_h_ro (&dest));
+  pgno next = dlgt_get_next (page_h_ro (&dest));
+  *cur = page_h_xfer_ownership (&dest);
+
+  if (parent->mode == PHM_NONE)
+    {
+      r->root = pg;
+    }
+  else
+    {
+      err_t_wrap (pgr_maybe_make_writable (r->pager, r->tx, parent, e), e);
+      in_set_leaf (page_h_w (parent), idx, pg);
+    }
+
+  // Same level neighbours
+  page_h sib = page_h_create ();
+  if (prev != PGNO_NULL)
+    {
+      err_t_wrap (pgr_get_writable (&sib, r->tx, PG_INNER_NODE | PG_DATA_LIST, prev, r->pager, e), e);
+      dlgt_set_next (page_h_w (&sib), pg);
+      err_t_wrap (pgr_release (r->pager, &sib, page_h_type (&sib), e), e);
+    }
+  if (next != PGNO_NULL)
+    {
+      err_t_wrap (pgr_get_writable (&sib, r->tx, PG_INNER_NODE | PG_DATA_LIST, next, r->pager, e), e);
+      dlgt_set_prev (page_h_w (&sib), pg);
+      err_t_wrap (pgr_release (r->pager, &sib, page_h_type (&sib), e), e);
+    }
+
+  return SUCCESS;
+}
+
+/**
+ * Link the neighbour at [pg] (if any) to the first / last new leaf
+ */
+static err_t
+rptv_stitch (struct rptree_cursor *r, pgno pg, pgno to, bool is_prev, error *e)
+{
+  if (pg == PGNO_NULL)
+    {
+      return SUCCESS;
+    }
+
+  page_h h = page_h_create ();
+  err_t_wrap (pgr_get_writable (&h, r->tx, PG_DATA_LIST, pg, r->pager, e), e);
+  if (is_prev)
+    {
+      dl_set_next (page_h_w (&h), to);
+    }
+  else
+    {
+      dl_set_prev (page_h_w (&h), to);
+    }
+  return pgr_release (r->pager, &h, PG_DATA_LIST, e);
+}
+
+/**
+ * Rewrite the leaves under bottom inner node [in]. Its size doesn't
+ * change so nothing above it needs to know
+ */
+static err_t
+rptv_repack (struct rptree_cursor *r, page_h *in, u32 fill_pct, error *e)
+{
+  p_size n = in_get_len (page_h_ro (in));
+  b_size total = in_get_size (page_h_ro (in));
+  p_size target = MAX ((p_size)((u32)DL_DATA_SIZE * fill_pct / 100), 1);
+  p_size m = (p_size)MIN ((total + target - 1) / target, (b_size)n);
+
+  // Already as tight as it gets and in file order - leave it be
+  bool in_order = m == n;
+  for (p_size i = 1; i < n && in_order; ++i)
+    {
+      in_order = in_get_leaf (page_h_ro (in), i) == in_get_leaf (page_h_ro (in), i - 1) + 1;
+    }
+  if (in_order)
+    {
+      return SUCCESS;
+    }
+
+  u8 *buf = i_malloc (total, 1, e);
+  if (buf == NULL)
+    {
+      return e->cause_code;
+    }
+
+  err_t ret = SUCCESS;
+  page_h leaf = page_h_create ();
+  page_h prev = page_h_create ();
+  pgno before = PGNO_NULL;
+  pgno after = PGNO_NULL;
+  b_size ofst = 0;
+
+  // Pull the data out and free the old leaves first so the new ones can reuse them
+  for (p_size i = 0; i < n; ++i)
+    {
+      if ((ret = pgr_get (&leaf, PG_DATA_LIST, in_get_leaf (page_h_ro (in), i), r->pager, e)))
+        {
+          goto theend;
+        }
+
+      if (i == 0)
+        {
+          before = dl_get_prev (page_h_ro (&leaf));
+        }
+      if (i == n - 1)
+        {
+          after = dl_get_next (page_h_ro (&leaf));
+        }
+
+      ofst += dl_read (page_h_ro (&leaf), buf + ofst, 0, dl_used (page_h_ro (&leaf)));
+
+      if ((ret = pgr_delete_and_release (r->pager, r->tx, &leaf, e)))
+        {
+          goto theend;
+        }
+    }
+  ASSERT (ofst == total);
+
+  if ((ret = pgr_maybe_make_writable (r->pager, r->tx, in, e)))
+    {
+      goto theend;
+    }
+  in_set_len (page_h_w (in), 0);
+
+  // Lowest free page first - the new leaves land in order at the front
+  ofst = 0;
+  for (p_size j = 0; j < m; ++j)
+    {
+      p_size len = (p_size)(total / m + (j < total % m));
+
+      if ((ret = pgr_new (&leaf, r->pager, r->tx, PG_DATA_LIST, e)))
+        {
+          goto theend;
+        }
+
+      dl_append (page_h_w (&leaf), buf + ofst, len);
+      ofst += len;
+      in_push_end (page_h_w (in), len, page_h_pgno (&leaf));
+
+      if (prev.mode == PHM_NONE)
+        {
+          dl_set_prev (page_h_w (&leaf), before);
+        }
+      else
+        {
+          dlgt_link (page_h_w (&prev), page_h_w (&leaf));
+          if ((ret = pgr_release (r->pager, &prev, PG_DATA_LIST, e)))
+            {
+              goto theend;
+            }
+        }
+
+      prev = page_h_xfer_ownership (&leaf);
+    }
+
+  dl_set_next (page_h_w (&prev), after);
+  pgno last = page_h_pgno (&prev);
+  if ((ret = pgr_release (r->pager, &prev, PG_DATA_LIST, e)))
+    {
+      goto theend;
+    }
+
+  if ((ret = rptv_stitch (r, before, in_get_leaf (page_h_ro (in), 0), true, e)))
+    {
+      goto theend;
+    }
+  ret = rptv_stitch (r, after, last, false, e);
+
+theend:
+  pgr_release_if_exists (r->pager, &leaf, PG_DATA_LIST, e);
+  pgr_release_if_exists (r->pager, &prev, PG_DATA_LIST, e);
+  i_free (buf);
+  return ret;
+}
+
+err_t
+rptv_vacuum_step (struct rptree_cursor *r, b_size *bofst, u32 fill_pct, error *e)
+{
+  DBG_ASSERT (rptc_unseeked, r);
+  ASSERT (r->tx);
+  ASSERT (fill_pct > 0 && fill_pct <= 100);
+
+  if (r->root == PGNO_NULL || *bofst >= r->total_size)
+    {
+      *bofst = r->total_size;
+      return SUCCESS;
+    }
+
+  page_h parent = page_h_create ();
+  page_h cur = page_h_create ();
+  page_h child = page_h_create ();
+  p_size idx = 0;  // cur's slot in parent
+  b_size left = 0; // Bytes left of cur
+
+  err_t_wrap (pgr_get (&cur, PG_INNER_NODE | PG_DATA_LIST, r->root, r->pager, e), e);
+
+  while (true)
+    {
+      // Top down - a parent is already as low as it goes before its children look
+      if (rptv_relocate (r, &parent, idx, &cur, e))
+        {
+          goto theend;
+        }
+
+      // A lone leaf is the whole tree
+      if (page_h_type (&cur) == PG_DATA_LIST)
+        {
+          *bofst = r->total_size;
+          goto theend;
+        }
+
+      p_size cidx;
+      b_size nleft;
+      in_choose_lidx (&cidx, &nleft, page_h_ro (&cur), *bofst - left);
+
+      if (pgr_get (&child, PG_INNER_NODE | PG_DATA_LIST, in_get_leaf (page_h_ro (&cur), cidx), r->pager, e))
+        {
+          goto theend;
+        }
+
+      if (page_h_type (&child) == PG_DATA_LIST)
+        {
+          if (pgr_release (r->pager, &child, PG_DATA_LIST, e))
+            {
+              goto theend;
+            }
+          if (rptv_repack (r, &cur, fill_pct, e))
+            {
+              goto theend;
+            }
+          *bofst = left + in_get_size (page_h_ro (&cur));
+          goto theend;
+        }
+
+      if (pgr_release_if_exists (r->pager, &parent, PG_INNER_NODE, e))
+        {
+          goto theend;
+        }
+
+      parent = page_h_xfer_ownership (&cur);
+      cur = page_h_xfer_ownership (&child);
+      idx = cidx;
+      left += nleft;
+    }
+
+theend:
+  if (child.mode != PHM_NONE)
+    {
+      pgr_release (r->pager, &child, page_h_type (&child), e);
+    }
+  if (cur.mode != PHM_NONE)
+    {
+      pgr_release (r->pager, &cur, page_h_type (&cur), e);
+    }
+  pgr_release_if_exists (r->pager, &parent, PG_INNER_NODE, e);
+  return e->cause_code;
+}
+
+#ifndef NTEST
+#define VACUUM_TEST_PAGES (640 * 4096 / PAGE_SIZE) // Same bytes whatever the page size
+
+static err_t
+rptv_count_leaves (u32 *dest, struct pager *p, pgno root, error *e)
+{
+  page_h h = page_h_create ();
+  *dest = 0;
+
+  // Leftmost leaf then along the list
+  pgno pg = root;
+  while (true)
+    {
+      err_t_wrap (pgr_get (&h, PG_INNER_NODE | PG_DATA_LIST, pg, p, e), e);
+      if (page_h_type (&h) == PG_DATA_LIST)
+        {
+          break;
+        }
+      pg = in_get_leaf (page_h_ro (&h), 0);
+      err_t_wrap (pgr_release (p, &h, PG_INNER_NODE, e), e);
+    }
+
+  while (true)
+    {
+      (*dest)++;
+      pgno next = dl_get_next (page_h_ro (&h));
+      err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, e), e);
+      if (next == PGNO_NULL)
+        {
+          return SUCCESS;
+        }
+      err_t_wrap (pgr_get (&h, PG_DATA_LIST, next, p, e), e);
+    }
+}
+
+TEST (TT_UNIT, rptv_vacuum_step)
+{
+  static u32 src[VACUUM_TEST_PAGES * DL_DATA_SIZE / sizeof (u32)];
+  static u32 dest[arrlen (src)];
+  static u32 expect[arrlen (src)];
+  arr_range (src);
+
+  struct pgr_fixture f;
+  error *e = &f.e;
+  test_err_t_wrap (pgr_fixture_create (&f), e);
+
+  struct rptree_cursor r;
+  struct txn tx;
+
+  // Grow it from the middle then punch holes in it - lots of half full leaves
+  test_err_t_wrap (pgr_begin_txn (&tx, f.p, e), e);
+  rptc_new (&r, &tx, f.p, &f.lt);
+  rptc_enter_transaction (&r, &tx);
+  test_err_t_wrap (rptof_insert (&r, src, 0, sizeof (u32), arrlen (src) / 2, e), e);
+  test_err_t_wrap (rptof_insert (&r, src + arrlen (src) / 2, sizeof (u32) * 10, sizeof (u32), arrlen (src) / 2, e), e);
+  test_err_t_wrap (rptof_read (&r, expect, sizeof (u32), 0, 1, arrlen (src), e), e);
+
+  u32 nleft = 0;
+  for (u32 i = 0; i < arrlen (src); i += 2)
+    {
+      expect[nleft++] = expect[i];
+    }
+  test_err_t_wrap (rptof_remove (&r, NULL, sizeof (u32), sizeof (u32), 2, arrlen (src) / 2, e), e);
+  rptc_leave_transaction (&r);
+  test_err_t_wrap (pgr_commit (f.p, &tx, e), e);
+  test_assert_equal (r.total_size, nleft * sizeof (u32));
+
+  u32 before;
+  test_err_t_wrap (rptv_count_leaves (&before, f.p, r.root, e), e);
+  p_size npages = pgr_get_npages (f.p);
+
+  TEST_CASE ("Repacks, relocates and shrinks")
+  {
+    // A transaction a step
+    b_size bofst = 0;
+    u32 nsteps = 0;
+    while (bofst < r.total_size)
+      {
+        test_err_t_wrap (pgr_begin_txn (&tx, f.p, e), e);
+        rptc_enter_transaction (&r, &tx);
+        test_err_t_wrap (rptv_vacuum_step (&r, &bofst, 100, e), e);
+        rptc_leave_transaction (&r);
+        test_err_t_wrap (pgr_commit (f.p, &tx, e), e);
+        nsteps++;
+      }
+    if (before > IN_MAX_KEYS)
+      {
+        test_assert (nsteps > 1);
+      }
+
+    test_err_t_wrap (rptc_validate (&r, e), e);
+
+    u32 after;
+    test_err_t_wrap (rptv_count_leaves (&after, f.p, r.root, e), e);
+    test_assert (after < before);
+    test_assert (after <= (r.total_size + DL_DATA_SIZE - 1) / DL_DATA_SIZE + nsteps);
+
+    test_err_t_wrap (pgr_shrink (f.p, e), e);
+    test_assert (pgr_get_npages (f.p) < npages);
+  }
+
+  TEST_CASE ("Same data")
+  {
+    i_memset (dest, 0, sizeof (dest));
+    sb_size nread = rptof_read (&r, dest, sizeof (u32), 0, 1, nleft, e);
+    test_assert_int_equal (nread, nleft);
+    test_assert_memequal (dest, expect, nleft * sizeof (u32));
+  }
+
+  TEST_CASE ("Vacuuming again doesn't undo it")
+  {
+    u32 nleaves;
+    test_err_t_wrap (rptv_count_leaves (&nleaves, f.p, r.root, e), e);
+
+    b_size bofst = 0;
+    test_err_t_wrap (pgr_begin_txn (&tx, f.p, e), e);
+    rptc_enter_transaction (&r, &tx);
+    while (bofst < r.total_size)
+      {
+        test_err_t_wrap (rptv_vacuum_step (&r, &bofst, 100, e), e);
+      }
+    rptc_leave_transaction (&r);
+    test_err_t_wrap (pgr_commit (f.p, &tx, e), e);
+
+    u32 again;
+    test_err_t_wrap (rptv_count_leaves (&again, f.p, r.root, e), e);
+    test_assert_equal (again, nleaves);
+    test_err_t_wrap (rptc_validate (&r, e), e);
+  }
+
+  test_err_t_wrap (rptc_cleanup (&r, e), e);
+  test_err_t_wrap (pgr_fixture_teardown (&f), e);
+}
+#endif
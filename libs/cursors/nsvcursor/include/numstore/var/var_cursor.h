@@ -93,6 +93,12 @@ err_t vpc_delete (
     const struct string name,
     error *e);
 
+// Every variable in hash order - start from PGNO_NULL, PGNO_NULL again at the end
+err_t vpc_next_id (
+    struct var_cursor *v,
+    pgno *id,
+    error *e);
+
 // Transactions
 void varc_enter_transaction (struct var_cursor *r, struct txn *tx);
 void varc_leave_transaction (struct var_cursor *r);
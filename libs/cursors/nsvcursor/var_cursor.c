@@ -745,6 +745,68 @@ theend:
   return e->cause_code;
 }
 
+err_t
+vpc_next_id (struct var_cursor *v, pgno *id, error *e)
+{
+  DBG_ASSERT (var_cursor, v);
+  ASSERT (id);
+
+  p_size pos = 0;
+
+  if (*id != PGNO_NULL)
+    {
+      if ((pgr_get (&v->cur, PG_VAR_PAGE, *id, v->pager, e)))
+        {
+          goto theend;
+        }
+
+      pgno next = vp_get_next (page_h_ro (&v->cur));
+
+      // End of its chain - carry on from the bucket after this one
+      if (next == PGNO_NULL)
+        {
+          if ((vpc_read_var_page_here (v, e)))
+            {
+              goto theend;
+            }
+          pos = vh_get_hash_pos ((struct string){ .len = v->vlen, .data = (const char *)v->vstr }) + 1;
+        }
+
+      if ((pgr_release (v->pager, &v->cur, PG_VAR_PAGE, e)))
+        {
+          goto theend;
+        }
+
+      if (next != PGNO_NULL)
+        {
+          *id = next;
+          goto theend;
+        }
+    }
+
+  *id = PGNO_NULL;
+
+  if ((pgr_get (&v->cur, PG_VAR_HASH_PAGE, VHASH_PGNO, v->pager, e)))
+    {
+      goto theend;
+    }
+
+  for (; pos < VH_HASH_LEN && *id == PGNO_NULL; ++pos)
+    {
+      *id = vh_get_hash_value (page_h_ro (&v->cur), pos);
+    }
+
+  if ((pgr_release (v->pager, &v->cur, PG_VAR_HASH_PAGE, e)))
+    {
+      goto theend;
+    }
+
+theend:
+  v->vlen = 0;
+  v->tlen = 0;
+  return e->cause_code;
+}
+
 err_t
 vpc_delete (struct var_cursor *v, const struct string name, error *e)
 {
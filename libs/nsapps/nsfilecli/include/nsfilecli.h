@@ -3,6 +3,8 @@
 #include <numstore/core/error.h>
 #include <numstore/intf/types.h>
 
+#include <stdio.h>
+
 void print_usage (const char *arg0);
 void print_help_short (const char *arg0);
 void print_help_long (const char *arg0);
@@ -15,7 +17,9 @@ struct nsfilecli_args
     NSFCLI_INSERT,
     NSFCLI_WRITE,
     NSFCLI_REMOVE,
-    NSFCLI_TAKE
+    NSFCLI_TAKE,
+    NSFCLI_VACUUM,
+    NSFCLI_STATS
   } command;
 
   const char *db_file;
@@ -34,4 +38,8 @@ struct nsfilecli_args
 
 err_t nsfilecli_args_parse (struct nsfilecli_args *dest, int argc, char **argv, error *e);
 
-err_t nsfilecli_execute (struct nsfilecli_args args, error *e);
+// Runs a parsed command - anything it prints goes to [out]
+err_t nsfilecli_execute (struct nsfilecli_args args, FILE *out, error *e);
+
+// Parses and runs one command line, returns the process exit code
+int nsfilecli_main (int argc, char **argv, FILE *out);
@@ -1,7 +1,11 @@
 #include "numstore/compiler/lexer.h"
 #include "numstore/compiler/parser/stride.h"
 #include "numstore/core/error.h"
+#include "numstore/intf/os/file_system.h"
+#include "numstore/intf/os/memory.h"
+#include "numstore/test/testing.h"
 #include <nsfilecli.h>
+#include <nsfslite.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,7 +14,7 @@ void
 print_usage (const char *program_name)
 {
   fprintf (stderr, "Usage: %s <command> <db_file> [wal_file] [args]\n", program_name);
-  fprintf (stderr, "Commands: read, insert, write, remove, take\n");
+  fprintf (stderr, "Commands: read, insert, write, remove, take, vacuum, stats\n");
   fprintf (stderr, "Try '%s -h' for more information\n", program_name);
 }
 
@@ -23,7 +27,9 @@ print_help_short (const char *program_name)
   fprintf (stderr, "  insert <db> [wal] [offset]        Insert records at index from stdin (default: end)\n");
   fprintf (stderr, "  write  <db> [wal] [slice ]        Overwrite records at index from stdin (default: start)\n");
   fprintf (stderr, "  remove <db> [wal] [slice ]        Remove records in slice (default: all)\n");
-  fprintf (stderr, "  take   <db> [wal] [slice ]        Remove and output records in slice (default: all)\n\n");
+  fprintf (stderr, "  take   <db> [wal] [slice ]        Remove and output records in slice (default: all)\n");
+  fprintf (stderr, "  vacuum <db> [wal]                 Repack records and shrink the file\n");
+  fprintf (stderr, "  stats  <db> [wal]                 Print buffer pool and I/O counters\n\n");
   fprintf (stderr, "Slice format: \"[start:step:count]\" (e.g., \"[0:10:100]\")\n");
   fprintf (stderr, "WAL file is optional - omit for no crash recovery\n");
   fprintf (stderr, "Use '%s --help' for detailed information\n", program_name);
@@ -67,6 +73,16 @@ print_help_long (const char *program_name)
   printf ("      Example: %s take test.db test.wal \"[0:10:100]\" > out\n", program_name);
   printf ("      Example: %s take test.db > all.out\n\n", program_name);
 
+  printf ("  vacuum <db> [wal]\n");
+  printf ("      Repack records into as few pages as possible, in order, and\n");
+  printf ("      give the freed space at the end of the file back to the OS\n");
+  printf ("      Example: %s vacuum test.db test.wal\n\n", program_name);
+
+  printf ("  stats <db> [wal]\n");
+  printf ("      Print buffer pool hit ratio, evictions, pinned and dirty frames,\n");
+  printf ("      page I/O and WAL fsync counts and latencies since open\n");
+  printf ("      Example: %s stats test.db test.wal\n\n", program_name);
+
   printf ("SLICE NOTATION:\n");
   printf ("  Format: \"[start:step:count]\"\n");
   printf ("    start - Starting index (0-based)\n");
@@ -98,27 +114,27 @@ parse_slice (sb_size *start, sb_size *step, sb_size *stop, const char *data, u32
   struct stride_parser p;
   err_t_wrap (parse_stride (l.tokens, l.ntokens, &p, e), e);
 
-  if (p.has_start)
+  if (p.dest.present & START_PRESENT)
     {
-      *start = p.start;
+      *start = p.dest.start;
     }
   else
     {
       *start = 0;
     }
 
-  if (p.has_step)
+  if (p.dest.present & STEP_PRESENT)
     {
-      *step = p.step;
+      *step = p.dest.step;
     }
   else
     {
       *step = 1;
     }
 
-  if (p.has_stop)
+  if (p.dest.present & STOP_PRESENT)
     {
-      *stop = p.stop;
+      *stop = p.dest.stop;
     }
   else
     {
@@ -173,10 +189,18 @@ nsfilecli_args_parse (struct nsfilecli_args *dest, int argc, char **argv, error
     {
       dest->command = NSFCLI_TAKE;
     }
+  else if (strcmp (command, "vacuum") == 0)
+    {
+      dest->command = NSFCLI_VACUUM;
+    }
+  else if (strcmp (command, "stats") == 0)
+    {
+      dest->command = NSFCLI_STATS;
+    }
   else
     {
       print_usage (argv[0]);
-      return SUCCESS;
+      return error_causef (e, ERR_INVALID_ARGUMENT, "Unknown command: %s", command);
     }
 
   // Initialize defaults
@@ -262,6 +286,11 @@ nsfilecli_args_parse (struct nsfilecli_args *dest, int argc, char **argv, error
           i++;
         }
       break;
+
+    case NSFCLI_VACUUM:
+    case NSFCLI_STATS:
+      // No arguments
+      break;
     }
 
   // Check for extra arguments
@@ -274,33 +303,164 @@ nsfilecli_args_parse (struct nsfilecli_args *dest, int argc, char **argv, error
   return SUCCESS;
 }
 
-/**
 err_t
-nsfilecli_execute (struct nsfilecli_args args, error *e)
+nsfilecli_execute (struct nsfilecli_args args, FILE *out, error *e)
 {
   switch (args.command)
     {
-    case NSFCLI_READ:
+    case NSFCLI_VACUUM:
       {
-        nsfile *f = nsfile_open (args.db_file, args.wal_file, e);
-        if (f == NULL)
+        nsfslite *n = nsfslite_open (args.db_file, args.wal_file, e);
+        if (n == NULL)
           {
             return e->cause_code;
           }
-        nsfile_read (nsfile * n, void *dest, t_size size, struct stride stride, error *e)
+        nsfslite_vacuum (n, 0, e);
+        nsfslite_close (n, e);
+        return e->cause_code;
       }
-    case NSFCLI_INSERT:
+
+    case NSFCLI_STATS:
       {
+        nsfslite *n = nsfslite_open (args.db_file, args.wal_file, e);
+        if (n == NULL)
+          {
+            return e->cause_code;
+          }
+        nsfslite_fprint_stats (n, out);
+        nsfslite_close (n, e);
+        return e->cause_code;
       }
+
+    case NSFCLI_READ:
+    case NSFCLI_INSERT:
     case NSFCLI_WRITE:
-      {
-      }
     case NSFCLI_REMOVE:
-      {
-      }
     case NSFCLI_TAKE:
-      {
-      }
+      break;
     }
+
+  return error_causef (e, ERR_INVALID_ARGUMENT, "Command is not supported from the command line yet");
+}
+
+int
+nsfilecli_main (int argc, char **argv, FILE *out)
+{
+  struct nsfilecli_args args;
+  error e = error_create ();
+
+  if (nsfilecli_args_parse (&args, argc, argv, &e))
+    {
+      error_log_consume (&e);
+      return 1;
+    }
+
+  if (nsfilecli_execute (args, out, &e))
+    {
+      error_log_consume (&e);
+      return 1;
+    }
+
+  return 0;
+}
+
+#ifndef NTEST
+static i64
+nsfilecli_test_fsize (const char *fname, error *e)
+{
+  i_file fp;
+  err_t_wrap (i_open_r (&fp, fname, e), e);
+  i64 ret = i_file_size (&fp, e);
+  err_t_wrap (i_close (&fp, e), e);
+  return ret;
+}
+
+// Fills a u32 variable with [n] values and removes all but the last [keep]
+static err_t
+nsfilecli_test_fill (const char *db, const char *wal, u32 n, u32 keep, error *e)
+{
+  nsfslite *f = nsfslite_open (db, wal, e);
+  if (f == NULL)
+    {
+      return e->cause_code;
+    }
+
+  u32 *data = i_malloc (n, sizeof *data, e);
+  if (data == NULL)
+    {
+      goto theend;
+    }
+  for (u32 i = 0; i < n; ++i)
+    {
+      data[i] = i;
+    }
+
+  spgno id = nsfslite_new (f, NULL, "a", "u32", e);
+  if (id < 0)
+    {
+      goto theend;
+    }
+  if (nsfslite_insert (f, id, NULL, data, 0, n, e))
+    {
+      goto theend;
+    }
+
+  char stride[64];
+  snprintf (stride, sizeof stride, "[0:1:%" PRIu32 "]", n - keep);
+  nsfslite_remove (f, id, NULL, NULL, stride, e);
+
+theend:
+  i_free (data);
+  nsfslite_close (f, e);
+  return e->cause_code;
+}
+
+TEST (TT_UNIT, nsfilecli_execute)
+{
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("nsfilecli.db", &e));
+  test_fail_if (i_remove_quiet ("nsfilecli.wal", &e));
+
+  test_err_t_wrap (nsfilecli_test_fill ("nsfilecli.db", "nsfilecli.wal", 200000, 1000, &e), &e);
+  i64 before = nsfilecli_test_fsize ("nsfilecli.db", &e);
+  test_assert (before > 0);
+
+  TEST_CASE ("nsfile vacuum shrinks the file")
+  {
+    char *argv[] = { "nsfile", "vacuum", "nsfilecli.db", "nsfilecli.wal" };
+    test_assert_int_equal (nsfilecli_main (4, argv, stdout), 0);
+
+    i64 after = nsfilecli_test_fsize ("nsfilecli.db", &e);
+    test_assert (after > 0);
+    test_assert (after < before);
+  }
+
+  TEST_CASE ("nsfile stats prints the counters")
+  {
+    FILE *out = tmpfile ();
+    test_fail_if_null (out);
+
+    char *argv[] = { "nsfile", "stats", "nsfilecli.db", "nsfilecli.wal" };
+    test_assert_int_equal (nsfilecli_main (4, argv, out), 0);
+
+    char buf[4096];
+    rewind (out);
+    size_t len = fread (buf, 1, sizeof buf - 1, out);
+    buf[len] = '\0';
+    fclose (out);
+
+    test_assert (strstr (buf, "Buffer pool:") != NULL);
+    test_assert (strstr (buf, "page reads:") != NULL);
+    test_assert (strstr (buf, "WAL:") != NULL);
+  }
+
+  TEST_CASE ("Unknown commands fail")
+  {
+    char *argv[] = { "nsfile", "squash", "nsfilecli.db" };
+    test_assert (nsfilecli_main (3, argv, stdout) != 0);
+  }
+
+  test_fail_if (i_remove_quiet ("nsfilecli.db", &e));
+  test_fail_if (i_remove_quiet ("nsfilecli.wal", &e));
 }
-*/
+#endif
@@ -1049,16 +1049,14 @@ cbuffer_read_from_file (i_file *src, struct cbuffer *b, u32 len, error *e)
   return nread;
 }
 
-i32
-cbuffer_write_to_file_1 (i_file *dest, const struct cbuffer *b, u32 len, error *e)
+u32
+cbuffer_data_segments (struct bytes iov[2], const struct cbuffer *b, u32 len)
 {
-  ASSERT (dest);
   ASSERT (b);
 
   u32 btoread = MIN (cbuffer_len (b), len);
   u32 bread = 0;
-  struct bytes iov[2];
-  int iovcnt = 0;
+  u32 iovcnt = 0;
   u32 newtail = b->tail;
 
   while (bread < btoread)
@@ -1082,12 +1080,25 @@ cbuffer_write_to_file_1 (i_file *dest, const struct cbuffer *b, u32 len, error *
       bread += next;
     }
 
+  return iovcnt;
+}
+
+i32
+cbuffer_write_to_file_1 (i_file *dest, const struct cbuffer *b, u32 len, error *e)
+{
+  ASSERT (dest);
+  ASSERT (b);
+
+  u32 btoread = MIN (cbuffer_len (b), len);
+  struct bytes iov[2];
+  u32 iovcnt = cbuffer_data_segments (iov, b, btoread);
+
   if (btoread == 0)
     {
       return 0;
     }
 
-  err_t err = i_writev_all (dest, iov, iovcnt, e);
+  err_t err = i_writev_all (dest, iov, (int)iovcnt, e);
   if (err != SUCCESS)
     {
       return e->cause_code;
@@ -20,23 +20,187 @@
 #include <numstore/core/checksums.h>
 
 #include <numstore/core/assert.h>
+#include <numstore/intf/logging.h>
+#include <numstore/intf/os.h>
+#include <numstore/intf/stdlib.h>
 #include <numstore/test/testing.h>
 
-// core
-static u32 _crc32c_tbl[256];
-static int _crc32c_inited = 0;
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42
+#endif
 
-static void
-_crc32c_init (void)
+/**
+ * All three implementations run on the raw (inverted) crc register.
+ * Every one of them is the same CRC32C (Castagnoli) - a WAL written
+ * with one verifies with any other
+ */
+typedef u32 (*crc32c_func) (u32 c, const u8 *data, u32 len);
+
+// _crc32c_tbl[k][b] is the crc of byte b followed by k zero bytes
+static u32 _crc32c_tbl[8][256];
+
+static u32
+crc32c_byte (u32 c, const u8 *data, u32 len)
+{
+  for (u32 i = 0; i < len; ++i)
+    {
+      c = (c >> 8) ^ _crc32c_tbl[0][(c ^ data[i]) & 0xFF];
+    }
+  return c;
+}
+
+/**
+ * Slicing-by-8: eight table lookups retire eight bytes with no
+ * dependency between them but the final xor
+ */
+static u32
+crc32c_slice8 (u32 c, const u8 *data, u32 len)
+{
+  while (len >= 8)
+    {
+      u32 lo = c ^ ((u32)data[0] | (u32)data[1] << 8 | (u32)data[2] << 16 | (u32)data[3] << 24);
+      u32 hi = (u32)data[4] | (u32)data[5] << 8 | (u32)data[6] << 16 | (u32)data[7] << 24;
+
+      c = _crc32c_tbl[7][lo & 0xFF]
+          ^ _crc32c_tbl[6][(lo >> 8) & 0xFF]
+          ^ _crc32c_tbl[5][(lo >> 16) & 0xFF]
+          ^ _crc32c_tbl[4][lo >> 24]
+          ^ _crc32c_tbl[3][hi & 0xFF]
+          ^ _crc32c_tbl[2][(hi >> 8) & 0xFF]
+          ^ _crc32c_tbl[1][(hi >> 16) & 0xFF]
+          ^ _crc32c_tbl[0][hi >> 24];
+
+      data += 8;
+      len -= 8;
+    }
+
+  return crc32c_byte (c, data, len);
+}
+
+#ifdef CRC32C_HAVE_SSE42
+/**
+ * crc32 has a 3 cycle latency but issues every cycle, so a single
+ * dependent chain leaves two thirds of it idle. Big buffers run as three
+ * interleaved chains over consecutive CRC32C_BLOCK byte blocks that get
+ * stitched back together with a multiply by x^(8 * len) mod P
+ */
+#define CRC32C_BLOCK 1024
+
+static u32 _crc32c_shift1; // x^(8 * CRC32C_BLOCK) mod P
+static u32 _crc32c_shift2; // x^(16 * CRC32C_BLOCK) mod P
+
+// a * b mod P, both reflected
+static u32
+crc32c_multmodp (u32 a, u32 b)
+{
+  u32 m = (u32)1 << 31;
+  u32 p = 0;
+  while (m)
+    {
+      if (a & m)
+        {
+          p ^= b;
+        }
+      m >>= 1;
+      b = (b >> 1) ^ (0x82F63B78u & -(b & 1));
+    }
+  return p;
+}
+
+__attribute__ ((target ("sse4.2"))) static u32
+crc32c_sse42 (u32 c, const u8 *data, u32 len)
+{
+  u64 c0 = c;
+
+  while (len >= 3 * CRC32C_BLOCK)
+    {
+      u64 c1 = 0;
+      u64 c2 = 0;
+      for (u32 i = 0; i < CRC32C_BLOCK; i += 8)
+        {
+          u64 w0, w1, w2;
+          i_memcpy (&w0, data + i, sizeof (w0));
+          i_memcpy (&w1, data + CRC32C_BLOCK + i, sizeof (w1));
+          i_memcpy (&w2, data + 2 * CRC32C_BLOCK + i, sizeof (w2));
+          c0 = _mm_crc32_u64 (c0, w0);
+          c1 = _mm_crc32_u64 (c1, w1);
+          c2 = _mm_crc32_u64 (c2, w2);
+        }
+
+      c0 = crc32c_multmodp (_crc32c_shift2, (u32)c0)
+           ^ crc32c_multmodp (_crc32c_shift1, (u32)c1)
+           ^ (u32)c2;
+
+      data += 3 * CRC32C_BLOCK;
+      len -= 3 * CRC32C_BLOCK;
+    }
+
+  while (len >= 8)
+    {
+      u64 word;
+      i_memcpy (&word, data, sizeof (word));
+      c0 = _mm_crc32_u64 (c0, word);
+      data += 8;
+      len -= 8;
+    }
+
+  c = (u32)c0;
+  while (len-- > 0)
+    {
+      c = _mm_crc32_u8 (c, *data++);
+    }
+  return c;
+}
+#endif
+
+static crc32c_func _crc32c = crc32c_slice8;
+static const char *_crc32c_name = "slicing-by-8";
+
+/**
+ * Runs before main so the tables and the choice are fixed before any
+ * thread can race to set them up
+ */
+__attribute__ ((constructor)) static void
+crc32c_init (void)
 {
   for (u32 i = 0; i < 256; ++i)
     {
       u32 c = i;
       for (int k = 0; k < 8; ++k)
-        c = (c >> 1) ^ (0x82F63B78u & -(c & 1));
-      _crc32c_tbl[i] = c;
+        {
+          c = (c >> 1) ^ (0x82F63B78u & -(c & 1));
+        }
+      _crc32c_tbl[0][i] = c;
     }
-  _crc32c_inited = 1;
+
+  for (u32 i = 0; i < 256; ++i)
+    {
+      u32 c = _crc32c_tbl[0][i];
+      for (u32 k = 1; k < 8; ++k)
+        {
+          c = (c >> 8) ^ _crc32c_tbl[0][c & 0xFF];
+          _crc32c_tbl[k][i] = c;
+        }
+    }
+
+#ifdef CRC32C_HAVE_SSE42
+  // Shifting the polynomial 1 through zero bytes leaves x^(8n) mod P
+  u32 x = (u32)1 << 31;
+  for (u32 i = 0; i < CRC32C_BLOCK; ++i)
+    {
+      x = (x >> 8) ^ _crc32c_tbl[0][x & 0xFF];
+    }
+  _crc32c_shift1 = x;
+  _crc32c_shift2 = crc32c_multmodp (x, x);
+
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("sse4.2"))
+    {
+      _crc32c = crc32c_sse42;
+      _crc32c_name = "sse4.2";
+    }
+#endif
 }
 
 u32
@@ -52,17 +216,13 @@ checksum_execute (u32 *state, const u8 *data, u32 len)
   ASSERT (data);
   ASSERT (len > 0);
 
-  if (!_crc32c_inited)
-    {
-      _crc32c_init ();
-    }
+  *state = ~_crc32c (~(*state), data, len);
+}
 
-  u32 c = ~(*state);
-  for (u32 i = 0; i < len; ++i)
-    {
-      c = (c >> 8) ^ _crc32c_tbl[(c ^ data[i]) & 0xFF];
-    }
-  *state = ~c;
+const char *
+checksum_impl (void)
+{
+  return _crc32c_name;
 }
 
 #ifndef NTEST
@@ -104,4 +264,96 @@ TEST (TT_UNIT, checksum_execute_incremental)
 
   test_assert_equal (state1, state2);
 }
+
+TEST (TT_UNIT, checksum_execute_known)
+{
+  // The standard CRC32C check value
+  const u8 data[] = "123456789";
+  u32 state = checksum_init ();
+  checksum_execute (&state, data, 9);
+  test_assert_int_equal (state, 0xE3069283);
+}
+
+TEST (TT_UNIT, checksum_execute_impls_agree)
+{
+  static u8 data[4096 + 16];
+  for (u32 i = 0; i < sizeof (data); ++i)
+    {
+      data[i] = (u8)(i * 31 + 7);
+    }
+
+  // Whatever dispatch picked is checked against both portable ones
+  crc32c_func impls[] = { crc32c_byte, crc32c_slice8, _crc32c };
+
+  // Every alignment and every tail length
+  for (u32 ofst = 0; ofst < 8; ++ofst)
+    {
+      for (u32 len = 0; len < 64; ++len)
+        {
+          u32 expect = crc32c_byte (~0u, data + ofst, len);
+          for (u32 i = 0; i < arrlen (impls); ++i)
+            {
+              test_assert_int_equal (impls[i] (~0u, data + ofst, len), expect);
+            }
+        }
+    }
+
+  // Page sized and bigger - long enough to split into interleaved streams
+  for (u32 len = 3000; len <= 4096; len += 91)
+    {
+      u32 expect = crc32c_byte (~0u, data + 3, len);
+      test_assert_int_equal (crc32c_slice8 (~0u, data + 3, len), expect);
+      test_assert_int_equal (_crc32c (~0u, data + 3, len), expect);
+    }
+}
+
+#define CKSM_BENCH_BYTES (64 * 1024 * 1024)
+#define CKSM_BENCH_CHUNK 4096
+
+// Keeps the loops from being optimized out
+static volatile u32 checksum_bench_sink;
+
+static void
+checksum_bench_run (const char *label, crc32c_func fn, const u8 *data)
+{
+  i_timer timer;
+  error e = error_create ();
+  if (i_timer_create (&timer, &e))
+    {
+      return;
+    }
+
+  // Page sized pieces - the size every page image and flush checksums
+  u32 c = 0;
+  u64 start = i_timer_now_ns (&timer);
+  for (u32 i = 0; i < CKSM_BENCH_BYTES / CKSM_BENCH_CHUNK; ++i)
+    {
+      c ^= fn (~0u, data + (i % 16) * CKSM_BENCH_CHUNK, CKSM_BENCH_CHUNK);
+    }
+  u64 elapsed = MAX (i_timer_now_ns (&timer) - start, (u64)1);
+  i_timer_free (&timer);
+
+  checksum_bench_sink = c;
+
+  i_log_info ("checksum_bench %-14s %6.2f GB/s\n", label, (f64)CKSM_BENCH_BYTES / (f64)elapsed);
+}
+
+TEST (TT_PROFILE, checksum_bench)
+{
+  static u8 data[16 * CKSM_BENCH_CHUNK];
+  for (u32 i = 0; i < sizeof (data); ++i)
+    {
+      data[i] = (u8)(i * 131 + 17);
+    }
+
+  checksum_bench_run ("byte-at-a-time", crc32c_byte, data);
+  checksum_bench_run ("slicing-by-8", crc32c_slice8, data);
+#ifdef CRC32C_HAVE_SSE42
+  if (_crc32c == crc32c_sse42)
+    {
+      checksum_bench_run ("sse4.2", crc32c_sse42, data);
+    }
+#endif
+  i_log_info ("checksum_bench in use: %s\n", checksum_impl ());
+}
 #endif
@@ -0,0 +1,522 @@
+/*
+ * Copyright 2025 Theo Lincke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *   Implements compress.h. Lane split + delta filter in front of an LZ77
+ *   coder with an LZ4 style sequence format.
+ */
+
+#include <numstore/core/compress.h>
+
+#include <numstore/core/assert.h>
+#include <numstore/core/macros.h>
+#include <numstore/core/random.h>
+#include <numstore/intf/logging.h>
+#include <numstore/intf/os.h>
+#include <numstore/test/testing.h>
+
+#define CMP_LANES 8     // Bytes of the widest element - i64, u64, f64
+#define CMP_MINMATCH 4  // Shortest match worth a sequence
+#define CMP_HASH_BITS 12 // Largest table - small inputs use a smaller one, cheaper to clear
+#define CMP_HASH_BITS_MIN 10
+#define CMP_MAX_OFST 0xFFFF
+#define CMP_TAIL 5 // The last bytes are always literals - a match probe never reads past the end
+
+////////////////////////////////////////////////////////////
+/// Filter
+
+/**
+ * Byte k of every 8 byte word goes to lane k, stored as the difference
+ * from the byte before it in the lane. Whole words first, all lanes at
+ * once, then the n % 8 bytes left over
+ */
+static void
+cmp_split (u8 *dest, const u8 *src, u32 n)
+{
+  u32 nwords = n / CMP_LANES;
+  u32 rem = n % CMP_LANES;
+  u8 prev[CMP_LANES] = { 0 };
+  u32 start[CMP_LANES];
+
+  for (u32 lane = 0, k = 0; lane < CMP_LANES; ++lane)
+    {
+      start[lane] = k;
+      k += nwords + (lane < rem);
+    }
+
+  for (u32 w = 0; w < nwords; ++w)
+    {
+      for (u32 lane = 0; lane < CMP_LANES; ++lane)
+        {
+          u8 b = src[w * CMP_LANES + lane];
+          dest[start[lane] + w] = (u8)(b - prev[lane]);
+          prev[lane] = b;
+        }
+    }
+
+  for (u32 lane = 0; lane < rem; ++lane)
+    {
+      dest[start[lane] + nwords] = (u8)(src[nwords * CMP_LANES + lane] - prev[lane]);
+    }
+}
+
+static void
+cmp_join (u8 *dest, const u8 *src, u32 n)
+{
+  u32 nwords = n / CMP_LANES;
+  u32 rem = n % CMP_LANES;
+  u8 prev[CMP_LANES] = { 0 };
+  u32 start[CMP_LANES];
+
+  for (u32 lane = 0, k = 0; lane < CMP_LANES; ++lane)
+    {
+      start[lane] = k;
+      k += nwords + (lane < rem);
+    }
+
+  for (u32 w = 0; w < nwords; ++w)
+    {
+      for (u32 lane = 0; lane < CMP_LANES; ++lane)
+        {
+          prev[lane] = (u8)(prev[lane] + src[start[lane] + w]);
+          dest[w * CMP_LANES + lane] = prev[lane];
+        }
+    }
+
+  for (u32 lane = 0; lane < rem; ++lane)
+    {
+      dest[nwords * CMP_LANES + lane] = (u8)(prev[lane] + src[start[lane] + nwords]);
+    }
+}
+
+////////////////////////////////////////////////////////////
+/// LZ77
+///
+/// A run of sequences, each:
+///   [token: literal count << 4 | match length - 4]
+///   [literal count - 15 as 255, 255, ..., rest] if the nibble is 15
+///   [literals]
+///   [match offset: u16 little endian]
+///   [match length - 19 the same way] if the nibble is 15
+/// The last sequence stops after its literals
+
+static inline u32
+cmp_read32 (const u8 *p)
+{
+  u32 v;
+  i_memcpy (&v, p, sizeof (v));
+  return v;
+}
+
+static inline u32
+cmp_hash (u32 v, u32 bits)
+{
+  return (v * 2654435761u) >> (32 - bits);
+}
+
+static inline bool
+cmp_put_len (u8 *dest, u32 cap, u32 *op, u32 len)
+{
+  while (len >= 255)
+    {
+      if (*op >= cap)
+        {
+          return false;
+        }
+      dest[(*op)++] = 255;
+      len -= 255;
+    }
+
+  if (*op >= cap)
+    {
+      return false;
+    }
+  dest[(*op)++] = (u8)len;
+
+  return true;
+}
+
+// [mlen] is 0 for the last sequence
+static bool
+cmp_put_seq (u8 *dest, u32 cap, u32 *op, const u8 *lit, u32 nlit, u32 ofst, u32 mlen)
+{
+  u32 ml = mlen ? mlen - CMP_MINMATCH : 0;
+
+  if (*op >= cap)
+    {
+      return false;
+    }
+  dest[(*op)++] = (u8)((MIN (nlit, 15u) << 4) | MIN (ml, 15u));
+
+  if (nlit >= 15 && !cmp_put_len (dest, cap, op, nlit - 15))
+    {
+      return false;
+    }
+
+  if (cap - *op < nlit)
+    {
+      return false;
+    }
+  i_memcpy (dest + *op, lit, nlit);
+  *op += nlit;
+
+  if (mlen == 0)
+    {
+      return true;
+    }
+
+  if (cap - *op < 2)
+    {
+      return false;
+    }
+  dest[(*op)++] = (u8)ofst;
+  dest[(*op)++] = (u8)(ofst >> 8);
+
+  if (ml >= 15 && !cmp_put_len (dest, cap, op, ml - 15))
+    {
+      return false;
+    }
+
+  return true;
+}
+
+static inline bool
+cmp_get_len (const u8 *src, u32 slen, u32 *ip, u32 *len)
+{
+  while (true)
+    {
+      if (*ip >= slen || *len > COMPRESS_MAX_LEN)
+        {
+          return false;
+        }
+      u8 b = src[(*ip)++];
+      *len += b;
+      if (b != 255)
+        {
+          return true;
+        }
+    }
+}
+
+u32
+compress_execute (u8 *dest, u32 cap, const u8 *src, u32 n)
+{
+  ASSERT (n <= COMPRESS_MAX_LEN);
+
+  u8 t[COMPRESS_MAX_LEN];
+  u32 table[1 << CMP_HASH_BITS]; // Position + 1 where a hash was last seen
+
+  u32 bits = CMP_HASH_BITS_MIN;
+  while (bits < CMP_HASH_BITS && (1u << (bits + 2)) < n)
+    {
+      bits++;
+    }
+  i_memset (table, 0, sizeof (u32) << bits);
+
+  cmp_split (t, src, n);
+
+  u32 op = 0;
+  u32 anchor = 0;
+  u32 ip = 0;
+  u32 limit = n > CMP_TAIL ? n - CMP_TAIL : 0;
+
+  while (ip < limit)
+    {
+      u32 h = cmp_hash (cmp_read32 (t + ip), bits);
+      u32 ref = table[h];
+      table[h] = ip + 1;
+
+      if (ref == 0 || ip - (ref - 1) > CMP_MAX_OFST || cmp_read32 (t + ref - 1) != cmp_read32 (t + ip))
+        {
+          ip++;
+          continue;
+        }
+
+      u32 m = ref - 1;
+      u32 len = CMP_MINMATCH;
+      while (ip + len < n && t[m + len] == t[ip + len])
+        {
+          len++;
+        }
+
+      if (!cmp_put_seq (dest, cap, &op, t + anchor, ip - anchor, ip - m, len))
+        {
+          return 0;
+        }
+
+      ip += len;
+      anchor = ip;
+    }
+
+  if (!cmp_put_seq (dest, cap, &op, t + anchor, n - anchor, 0, 0))
+    {
+      return 0;
+    }
+
+  return op;
+}
+
+err_t
+decompress_execute (u8 *dest, u32 n, const u8 *src, u32 slen, error *e)
+{
+  ASSERT (n <= COMPRESS_MAX_LEN);
+
+  u8 t[COMPRESS_MAX_LEN];
+  u32 ip = 0;
+  u32 op = 0;
+
+  while (true)
+    {
+      if (ip >= slen)
+        {
+          goto corrupt;
+        }
+      u8 token = src[ip++];
+
+      // Literals
+      u32 nlit = token >> 4;
+      if (nlit == 15 && !cmp_get_len (src, slen, &ip, &nlit))
+        {
+          goto corrupt;
+        }
+      if (slen - ip < nlit || n - op < nlit)
+        {
+          goto corrupt;
+        }
+      i_memcpy (t + op, src + ip, nlit);
+      ip += nlit;
+      op += nlit;
+
+      if (ip == slen)
+        {
+          break;
+        }
+
+      // Match
+      if (slen - ip < 2)
+        {
+          goto corrupt;
+        }
+      u32 ofst = (u32)src[ip] | ((u32)src[ip + 1] << 8);
+      ip += 2;
+
+      u32 mlen = token & 15;
+      if (mlen == 15 && !cmp_get_len (src, slen, &ip, &mlen))
+        {
+          goto corrupt;
+        }
+      mlen += CMP_MINMATCH;
+
+      if (ofst == 0 || ofst > op || n - op < mlen)
+        {
+          goto corrupt;
+        }
+
+      if (ofst >= mlen)
+        {
+          i_memcpy (t + op, t + op - ofst, mlen);
+        }
+      else if (ofst == 1)
+        {
+          // A run - the common case in a lane of equal deltas
+          i_memset (t + op, t[op - 1], mlen);
+        }
+      else
+        {
+          // Byte at a time - the match overlaps what it's copying
+          for (u32 i = 0; i < mlen; ++i)
+            {
+              t[op + i] = t[op + i - ofst];
+            }
+        }
+      op += mlen;
+    }
+
+  if (op != n)
+    {
+      goto corrupt;
+    }
+
+  cmp_join (dest, t, n);
+  return SUCCESS;
+
+corrupt:
+  return error_causef (e, ERR_CORRUPT, "Compressed buffer is malformed");
+}
+
+#ifndef NTEST
+static void
+compress_fill_ramp (u8 *dest, u32 n)
+{
+  for (u32 i = 0; i + sizeof (i64) <= n; i += sizeof (i64))
+    {
+      i64 v = 1000000 + 3 * (i64)i;
+      i_memcpy (dest + i, &v, sizeof (v));
+    }
+}
+
+static void
+compress_fill_smooth (u8 *dest, u32 n)
+{
+  for (u32 i = 0; i + sizeof (f64) <= n; i += sizeof (f64))
+    {
+      f64 x = (f64)i / 1024.0;
+      f64 v = 20.0 + x * (1.0 - x / 8.0);
+      i_memcpy (dest + i, &v, sizeof (v));
+    }
+}
+
+TEST (TT_UNIT, compress_roundtrip)
+{
+  static u8 src[COMPRESS_MAX_LEN];
+  static u8 cmp[COMPRESS_MAX_LEN];
+  static u8 out[COMPRESS_MAX_LEN];
+  error e = error_create ();
+
+  TEST_CASE ("Zeros")
+  {
+    i_memset (src, 0, sizeof (src));
+    u32 len = compress_execute (cmp, sizeof (cmp), src, sizeof (src));
+    test_assert (len > 0 && len < sizeof (src) / 64);
+    test_err_t_wrap (decompress_execute (out, sizeof (out), cmp, len, &e), &e);
+    test_assert_memequal (out, src, sizeof (src));
+  }
+
+  TEST_CASE ("Integer ramp")
+  {
+    i_memset (src, 0, sizeof (src));
+    compress_fill_ramp (src, sizeof (src));
+    u32 len = compress_execute (cmp, sizeof (cmp), src, sizeof (src));
+    test_assert (len > 0 && len < sizeof (src) / 4);
+    test_err_t_wrap (decompress_execute (out, sizeof (out), cmp, len, &e), &e);
+    test_assert_memequal (out, src, sizeof (src));
+  }
+
+  TEST_CASE ("Smooth doubles")
+  {
+    i_memset (src, 0, sizeof (src));
+    compress_fill_smooth (src, sizeof (src));
+    u32 len = compress_execute (cmp, sizeof (cmp), src, sizeof (src));
+    test_assert (len > 0 && len < sizeof (src));
+    test_err_t_wrap (decompress_execute (out, sizeof (out), cmp, len, &e), &e);
+    test_assert_memequal (out, src, sizeof (src));
+  }
+
+  TEST_CASE ("Odd lengths")
+  {
+    for (u32 n = 1; n < 64; ++n)
+      {
+        rand_bytes (src, n);
+        u32 len = compress_execute (cmp, sizeof (cmp), src, n);
+        test_assert (len > 0);
+        test_err_t_wrap (decompress_execute (out, n, cmp, len, &e), &e);
+        test_assert_memequal (out, src, n);
+      }
+  }
+
+  TEST_CASE ("Random bytes don't fit in less")
+  {
+    rand_bytes (src, sizeof (src));
+    test_assert_int_equal (compress_execute (cmp, sizeof (cmp) - 64, src, sizeof (src)), 0);
+  }
+
+  TEST_CASE ("Malformed input")
+  {
+    compress_fill_ramp (src, sizeof (src));
+    u32 len = compress_execute (cmp, sizeof (cmp), src, sizeof (src));
+    test_assert (len > 0);
+
+    test_err_t_check (decompress_execute (out, sizeof (out), cmp, len - 1, &e), ERR_CORRUPT, &e);
+    test_err_t_check (decompress_execute (out, sizeof (out) - 1, cmp, len, &e), ERR_CORRUPT, &e);
+    test_err_t_check (decompress_execute (out, sizeof (out), cmp, 0, &e), ERR_CORRUPT, &e);
+  }
+}
+
+#define CMP_BENCH_ROUNDS 2048
+
+static volatile u32 compress_bench_sink;
+
+static void
+compress_bench_run (const char *label, const u8 *src)
+{
+  static u8 cmp[COMPRESS_MAX_LEN];
+  static u8 out[COMPRESS_MAX_LEN];
+  error e = error_create ();
+
+  i_timer timer;
+  if (i_timer_create (&timer, &e))
+    {
+      return;
+    }
+
+  u32 len = 0;
+  u64 start = i_timer_now_ns (&timer);
+  for (u32 i = 0; i < CMP_BENCH_ROUNDS; ++i)
+    {
+      len = compress_execute (cmp, COMPRESS_MAX_LEN, src, COMPRESS_MAX_LEN);
+    }
+  u64 enc = MAX (i_timer_now_ns (&timer) - start, (u64)1);
+
+  u64 dec = 1;
+  if (len > 0)
+    {
+      start = i_timer_now_ns (&timer);
+      for (u32 i = 0; i < CMP_BENCH_ROUNDS; ++i)
+        {
+          decompress_execute (out, COMPRESS_MAX_LEN, cmp, len, &e);
+        }
+      dec = MAX (i_timer_now_ns (&timer) - start, (u64)1);
+      compress_bench_sink = out[len % COMPRESS_MAX_LEN];
+    }
+  i_timer_free (&timer);
+
+  u64 bytes = (u64)CMP_BENCH_ROUNDS * COMPRESS_MAX_LEN;
+  if (len == 0)
+    {
+      i_log_info ("compress_bench %-16s incompressible  encode %6.2f GB/s\n", label, (f64)bytes / (f64)enc);
+      return;
+    }
+  i_log_info ("compress_bench %-16s ratio %6.2fx  encode %6.2f GB/s  decode %6.2f GB/s\n",
+              label,
+              (f64)COMPRESS_MAX_LEN / (f64)len,
+              (f64)bytes / (f64)enc,
+              (f64)bytes / (f64)dec);
+}
+
+TEST (TT_PROFILE, compress_bench)
+{
+  static u8 src[COMPRESS_MAX_LEN];
+
+  i_memset (src, 0, sizeof (src));
+  compress_fill_ramp (src, sizeof (src));
+  compress_bench_run ("i64 ramp", src);
+
+  i_memset (src, 0, sizeof (src));
+  compress_fill_smooth (src, sizeof (src));
+  compress_bench_run ("f64 smooth", src);
+
+  // A sensor style random walk, 1/100th resolution
+  f64 v = 100.0;
+  for (u32 i = 0; i + sizeof (f64) <= sizeof (src); i += sizeof (f64))
+    {
+      v += (f64)((i32)randu32r (0, 20) - 10) / 100.0;
+      i_memcpy (src + i, &v, sizeof (v));
+    }
+  compress_bench_run ("f64 random walk", src);
+
+  rand_bytes (src, sizeof (src));
+  compress_bench_run ("random", src);
+}
+#endif
@@ -3,50 +3,46 @@
 #include <numstore/core/file_pool.h>
 #include <numstore/core/latch.h>
 #include <numstore/intf/os/file_system.h>
+#include <numstore/intf/stdlib.h>
 #include <numstore/test/testing.h>
 
 #include <config.h>
 
 err_t
-fpool_init (struct file_pool *dest, const char *base, error *e)
+fpool_init (struct file_pool *dest, const char *const *dirs, u32 ndirs, error *e)
 {
-  // Check if base directory exists
-  bool exists;
-  err_t_wrap (i_dir_exists (base, &exists, e), e);
-  if (!exists)
+  if (ndirs == 0 || ndirs > MAX_STRIPE_DIRS)
     {
-      return error_causef (e, ERR_INVALID_ARGUMENT, "Directory: %s doesn't exist", base);
+      return error_causef (e, ERR_INVALID_ARGUMENT, "File pool needs between 1 and %d directories, got %" PRIu32, MAX_STRIPE_DIRS, ndirs);
     }
 
-  // Add a trailing slash and copy into temp_fname
-  u32 base_len = i_strlen (base);
-  bool needs_slash = (base_len > 0 && base[base_len - 1] != '/');
-  if (needs_slash)
-    {
-      dest->baselen = i_snprintf (dest->temp_fname, MAX_FILE_NAME, "%s/numstore/", base);
-    }
-  else
+  for (u32 i = 0; i < ndirs; ++i)
     {
-      dest->baselen = i_snprintf (dest->temp_fname, MAX_FILE_NAME, "%snumstore/", base);
-    }
+      // Check if base directory exists
+      bool exists;
+      err_t_wrap (i_dir_exists (dirs[i], &exists, e), e);
+      if (!exists)
+        {
+          return error_causef (e, ERR_INVALID_ARGUMENT, "Directory: %s doesn't exist", dirs[i]);
+        }
 
-  // Create directory
-  err_t_wrap (i_dir_exists (dest->temp_fname, &exists, e), e);
-  if (!exists)
-    {
-      err_t_wrap (i_mkdir (dest->temp_fname, e), e);
+      // Create [dir]/numstore/
+      i_snprintf (dest->temp_fname, MAX_FILE_NAME, "%s/numstore/", dirs[i]);
+      err_t_wrap (i_dir_exists (dest->temp_fname, &exists, e), e);
+      if (!exists)
+        {
+          err_t_wrap (i_mkdir (dest->temp_fname, e), e);
+        }
+
+      dest->dirs[i] = dirs[i];
     }
+  dest->ndirs = ndirs;
 
   ht_init_fp (&dest->table, dest->data, arrlen (dest->data));
   i_memset (dest->files, 0, sizeof (dest->files));
   dest->clock = 0;
   latch_init (&dest->l);
 
-  for (u32 i = 0; i < arrlen (dest->files); ++i)
-    {
-      latch_init (&dest->files[i].l);
-    }
-
   return SUCCESS;
 }
 
@@ -66,211 +62,366 @@ fpool_init (struct file_pool *dest, const char *base, error *e)
 #define FILE_TYPE(addr) (((addr)&FILE_TYPE_MASK) >> FILE_TYPE_SHIFT)
 #define FILE_NUM(addr) (((addr)&FILE_NUM_MASK) >> FILE_NUM_SHIFT)
 #define FILE_OFST(addr) ((addr)&FILE_OFST_MASK)
-
-// String lengths - calculate decimal digits needed for max value
-// Formula: ceil(N * log10(2)) = ceil(N * 0.30103) ≈ (N * 30103 + 99999) / 100000
-#define FILE_TYPE_LEN ((FILE_TYPE_BITS * 30103UL + 99999UL) / 100000UL) // 2
-#define FILE_NUM_LEN ((FILE_NUM_BITS * 30103UL + 99999UL) / 100000UL)   // 11
-
-static inline void
-fpool_append_folder (struct file_pool *f, u64 addr)
+#define FILE_ADDR(addr) ((addr) & ~FILE_OFST_MASK) // Type and number - the key of a file
+
+/**
+ * Writes [dir]/numstore/[type]/ of [fadr] into temp_fname, creating
+ * the type folder if [mkdirs]. Returns the length written
+ */
+static inline u32
+fpool_append_folder (struct file_pool *f, u64 fadr, bool mkdirs, error *e)
 {
-  u8 type = FILE_TYPE (addr);
-  u32 ofst = f->baselen;
-  u32 len = i_snprintf (f->temp_fname + ofst, MAX_FILE_NAME - ofst, "%02u/", type);
+  const char *dir = f->dirs[FILE_NUM (fadr) % f->ndirs];
+  u32 len = i_snprintf (f->temp_fname, MAX_FILE_NAME, "%s/numstore/%02u/", dir, (u32)FILE_TYPE (fadr));
+  ASSERT (len < MAX_FILE_NAME);
 
-  ASSERT (ofst + len < MAX_FILE_NAME);
+  if (mkdirs)
+    {
+      bool exists;
+      if (i_dir_exists (f->temp_fname, &exists, e))
+        {
+          return 0;
+        }
+      if (!exists && i_mkdir (f->temp_fname, e))
+        {
+          return 0;
+        }
+    }
+
+  return len;
 }
 
-static inline void
-fpool_append_file (struct file_pool *f, u64 addr)
+static inline err_t
+fpool_append_file (struct file_pool *f, u64 fadr, bool mkdirs, error *e)
 {
-  u8 type = FILE_TYPE (addr);
-  u32 file_num = FILE_NUM (addr);
-
-  u32 ofst = f->baselen + 2 + 1; // "00/"
-  u32 len = i_snprintf (f->temp_fname + ofst, MAX_FILE_NAME - ofst, "%09u", file_num);
+  u32 ofst = fpool_append_folder (f, fadr, mkdirs, e);
+  if (e->cause_code)
+    {
+      return e->cause_code;
+    }
 
+  u32 len = i_snprintf (f->temp_fname + ofst, MAX_FILE_NAME - ofst, "%09" PRIu64, (u64)FILE_NUM (fadr));
   ASSERT (ofst + len < MAX_FILE_NAME);
+
+  return SUCCESS;
 }
 
 static inline err_t
 fpool_open_file (struct file_pool *f, struct i_file *dest, u64 fadr, error *e)
 {
-  fpool_append_folder (f, fadr);
-
-  // Check if folder exists
-  bool exists;
-  err_t_wrap (i_dir_exists (f->temp_fname, &exists, e), e);
-
-  if (!exists)
-    {
-      err_t_wrap (i_mkdir (f->temp_fname, e), e);
-    }
-
-  // Append file name at the end
-  fpool_append_file (f, fadr);
+  err_t_wrap (fpool_append_file (f, fadr, true, e), e);
 
   // Open the file
+  bool exists;
   err_t_wrap (i_file_exists (f->temp_fname, &exists, e), e);
   err_t_wrap (i_open_rw (dest, f->temp_fname, e), e);
 
   if (!exists)
     {
       // Pre allocate segments
-      err_t_wrap (i_fallocate (dest, 1 << FILE_OFST_BITS, e), e);
+      if (i_fallocate (dest, FPOOL_SEGMENT_SIZE, e))
+        {
+          i_close (dest, e);
+          return e->cause_code;
+        }
     }
 
   return SUCCESS;
 }
 
-static struct ifframe *
-fpool_getf (struct file_pool *f, u64 adr, error *e)
+/**
+ * Closes an unpinned open file. Anything written to it is fsynced
+ * first - once closed fpool_sync can't get to it
+ */
+static inline err_t
+fpool_evict (struct file_pool *f, struct ifframe *fr, error *e)
 {
-  latch_lock (&f->l);
+  ASSERT (fr->flag > 0 && fr->pin == 0);
+
+  ht_delete_expect_fp (&f->table, NULL, fr->faddr);
+  fr->flag = 0;
 
-  // Just the file part
-  u64 fadr = FILE_TYPE (adr) | FILE_NUM (adr);
+  if (fr->dirty)
+    {
+      fr->dirty = false;
+      if (i_fsync (&fr->fp, e))
+        {
+          i_close (&fr->fp, e);
+          return e->cause_code;
+        }
+    }
 
+  return i_close (&fr->fp, e);
+}
+
+/**
+ * Caller holds f->l. Returns NULL (and no error) if every file is pinned
+ */
+static struct ifframe *
+fpool_getf_locked (struct file_pool *f, u64 fadr, error *e)
+{
   hdata_fp entry;
-  switch (ht_get_fp (&f->table, &entry, fadr))
+  if (ht_get_fp (&f->table, &entry, fadr) == HTAR_SUCCESS)
     {
-    case HTAR_DOESNT_EXIST:
-      {
-        break;
-      }
-    case HTAR_SUCCESS:
-      {
-        struct ifframe *ret = &f->files[entry.value];
-        latch_lock (&f->files[entry.value].l);
-        f->files[entry.value].flag = 2;
-        latch_unlock (&f->files[entry.value].l);
-
-        latch_unlock (&f->l);
-
-        return ret;
-      }
+      struct ifframe *ret = &f->files[entry.value];
+      ret->flag = 2;
+      ret->pin++;
+      return ret;
     }
 
-  // First pass
-  // If flag == 0 (not present) - read
-  for (u32 i = 0; i < arrlen (f->data); ++i)
+  // Second chance - an accessed file gets one more lap, pinned ones are skipped
+  for (u32 i = 0; i < 2 * arrlen (f->files); ++i)
     {
       u32 k = f->clock;
-      latch_lock (&f->files[k].l);
+      struct ifframe *fr = &f->files[k];
+      f->clock = (f->clock + 1) % arrlen (f->files);
 
-      // Empty - use this spot
-      if (f->files[k].flag == 0)
+      if (fr->flag > 0 && fr->pin > 0)
         {
-          // Open the file
-          if (fpool_open_file (f, &f->files[k].fp, fadr, e))
-            {
-              latch_unlock (&f->files[k].l);
-              latch_unlock (&f->l);
-              return NULL;
-            }
-
-          // Add to hash table
-          hdata_fp new_entry = { .key = fadr, .value = k };
-          ht_insert_expect_fp (&f->table, new_entry);
-
-          // Initialize meta data
-          f->files[k].flag = 2;
-          f->files[k].faddr = fadr;
-          struct ifframe *ret = &f->files[k];
-          f->clock = (f->clock + 1) % arrlen (f->files);
-
-          latch_unlock (&f->files[k].l);
-          latch_unlock (&f->l);
+          continue;
+        }
 
-          return ret;
+      if (fr->flag == 2)
+        {
+          fr->flag = 1;
+          continue;
         }
 
-      latch_unlock (&f->files[k].l);
-      f->clock = (f->clock + 1) % arrlen (f->files);
+      // Not present or not accessed - evict + read
+      if (fr->flag == 1 && fpool_evict (f, fr, e))
+        {
+          return NULL;
+        }
+
+      if (fpool_open_file (f, &fr->fp, fadr, e))
+        {
+          return NULL;
+        }
+
+      hdata_fp new_entry = { .key = fadr, .value = k };
+      ht_insert_expect_fp (&f->table, new_entry);
+
+      fr->flag = 2;
+      fr->pin = 1;
+      fr->dirty = false;
+      fr->faddr = fadr;
+      return fr;
     }
 
-  // Second pass
-  // If flag == 1 (not accessed) - evict + read
-  for (u32 i = 0; i < 2 * arrlen (f->data); ++i)
-    {
-      u32 k = f->clock;
-      latch_lock (&f->files[k].l);
+  return NULL;
+}
 
-      if (f->files[k].flag == 1)
-        {
-          // Remove entry from the hash table
-          ht_delete_expect_fp (&f->table, NULL, f->files[k].faddr);
-
-          // Evict this file
-          if (i_close (&f->files[k].fp, e))
-            {
-              latch_unlock (&f->files[k].l);
-              latch_unlock (&f->l);
-              return NULL;
-            }
-
-          // Open the file
-          if (fpool_open_file (f, &f->files[k].fp, fadr, e))
-            {
-              latch_unlock (&f->files[k].l);
-              latch_unlock (&f->l);
-              return NULL;
-            }
-
-          // Add new entry to hash table
-          hdata_fp new_entry = { .key = fadr, .value = k };
-          ht_insert_expect_fp (&f->table, new_entry);
-
-          // Update entry meta data
-          f->files[k].flag = 2;
-          f->files[k].faddr = fadr;
-          struct ifframe *ret = &f->files[k];
-          f->clock = (f->clock + 1) % arrlen (f->files);
-
-          latch_unlock (&f->files[k].l);
-          latch_unlock (&f->l);
+struct ifframe *
+fpool_trygetf (struct file_pool *f, u64 addr, error *e)
+{
+  latch_lock (&f->l);
+  struct ifframe *ret = fpool_getf_locked (f, FILE_ADDR (addr), e);
+  latch_unlock (&f->l);
+  return ret;
+}
 
+struct ifframe *
+fpool_getf (struct file_pool *f, u64 addr, error *e)
+{
+  while (true)
+    {
+      struct ifframe *ret = fpool_trygetf (f, addr, e);
+      if (ret != NULL || e->cause_code)
+        {
           return ret;
         }
-
-      // Subtract one from this file
-      ASSERT (f->files[k].flag == 2);
-      f->files[k].flag -= 1;
-
-      latch_unlock (&f->files[k].l);
-      f->clock = (f->clock + 1) % arrlen (f->files);
+      // Every file has I/O in flight - one of them finishes soon
     }
+}
 
-  UNREACHABLE ();
+void
+fpool_putf (struct file_pool *f, struct ifframe *frame, bool wrote)
+{
+  latch_lock (&f->l);
+  ASSERT (frame->pin > 0);
+  frame->pin--;
+  frame->dirty = frame->dirty || wrote;
+  latch_unlock (&f->l);
 }
 
 err_t
 fpool_pread (struct file_pool *f, void *dest, u64 n, u64 addr, error *e)
 {
+  ASSERT (FILE_OFST (addr) + n <= FPOOL_SEGMENT_SIZE);
+
   struct ifframe *frame = fpool_getf (f, addr, e);
   if (frame == NULL)
     {
       return e->cause_code;
     }
 
-  u64 ofst = FILE_OFST (addr);
+  i64 nread = i_pread_all (&frame->fp, dest, n, FILE_OFST (addr), e);
+  fpool_putf (f, frame, false);
 
-  return i_pread_all (&frame->fp, dest, n, ofst, e);
+  if (nread < 0)
+    {
+      return e->cause_code;
+    }
+  if ((u64)nread < n)
+    {
+      return error_causef (e, ERR_CORRUPT, "File pool: short read at %" PRIu64 " - segment is truncated", addr);
+    }
+
+  return SUCCESS;
 }
 
 err_t
 fpool_pwrite (struct file_pool *f, const void *src, u64 n, u64 addr, error *e)
 {
+  ASSERT (FILE_OFST (addr) + n <= FPOOL_SEGMENT_SIZE);
+
+  struct ifframe *frame = fpool_getf (f, addr, e);
+  if (frame == NULL)
+    {
+      return e->cause_code;
+    }
+
+  err_t ret = i_pwrite_all (&frame->fp, src, n, FILE_OFST (addr), e);
+  fpool_putf (f, frame, ret == SUCCESS);
+
+  return ret;
+}
+
+err_t
+fpool_stat (struct file_pool *f, u64 addr, bool *exists, u64 *size, error *e)
+{
+  latch_lock (&f->l);
+  err_t ret = fpool_append_file (f, FILE_ADDR (addr), false, e);
+  if (ret == SUCCESS)
+    {
+      ret = i_file_exists (f->temp_fname, exists, e);
+    }
+  latch_unlock (&f->l);
+
+  if (ret || !*exists)
+    {
+      return ret;
+    }
+
+  struct ifframe *frame = fpool_getf (f, addr, e);
+  if (frame == NULL)
+    {
+      return e->cause_code;
+    }
+
+  i64 len = i_file_size (&frame->fp, e);
+  fpool_putf (f, frame, false);
+
+  if (len < 0)
+    {
+      return e->cause_code;
+    }
+
+  *size = (u64)len;
+  return SUCCESS;
+}
+
+/**
+ * Grows the segment holding [addr] (preallocated where the file
+ * system can) or cuts it down to [nbytes]
+ */
+err_t
+fpool_resize (struct file_pool *f, u64 addr, u64 nbytes, error *e)
+{
+  ASSERT (nbytes <= FPOOL_SEGMENT_SIZE);
+
   struct ifframe *frame = fpool_getf (f, addr, e);
   if (frame == NULL)
     {
       return e->cause_code;
     }
 
-  u64 ofst = FILE_OFST (addr);
+  err_t ret = SUCCESS;
+  i64 len = i_file_size (&frame->fp, e);
+  if (len < 0)
+    {
+      ret = e->cause_code;
+    }
+  else if ((u64)len < nbytes && i_fallocate (&frame->fp, nbytes, e))
+    {
+      // Not every file system can preallocate
+      e->cause_code = SUCCESS;
+      ret = i_truncate (&frame->fp, nbytes, e);
+    }
+  else if ((u64)len > nbytes)
+    {
+      ret = i_truncate (&frame->fp, nbytes, e);
+    }
+
+  fpool_putf (f, frame, ret == SUCCESS);
+  return ret;
+}
+
+/**
+ * Deletes the segment holding [addr]. Nobody can be doing I/O on it
+ */
+err_t
+fpool_remove (struct file_pool *f, u64 addr, error *e)
+{
+  u64 fadr = FILE_ADDR (addr);
+
+  latch_lock (&f->l);
+
+  hdata_fp entry;
+  if (ht_get_fp (&f->table, &entry, fadr) == HTAR_SUCCESS)
+    {
+      struct ifframe *fr = &f->files[entry.value];
+      ASSERT (fr->pin == 0);
+
+      // About to be gone - no point syncing it
+      fr->dirty = false;
+      if (fpool_evict (f, fr, e))
+        {
+          latch_unlock (&f->l);
+          return e->cause_code;
+        }
+    }
 
-  return i_pwrite_all (&frame->fp, src, n, ofst, e);
+  err_t ret = fpool_append_file (f, fadr, false, e);
+  if (ret == SUCCESS)
+    {
+      ret = i_remove_quiet (f->temp_fname, e);
+    }
+
+  latch_unlock (&f->l);
+  return ret;
+}
+
+/**
+ * The fsyncs happen outside the latch - the written files are
+ * pinned so they stay open, and marked dirty again on failure
+ */
+err_t
+fpool_sync (struct file_pool *f, error *e)
+{
+  struct ifframe *tosync[MAX_OPEN_FILES];
+  u32 n = 0;
+
+  latch_lock (&f->l);
+  for (u32 i = 0; i < arrlen (f->files); ++i)
+    {
+      struct ifframe *fr = &f->files[i];
+      if (fr->flag > 0 && fr->dirty)
+        {
+          fr->dirty = false;
+          fr->pin++;
+          tosync[n++] = fr;
+        }
+    }
+  latch_unlock (&f->l);
+
+  for (u32 i = 0; i < n; ++i)
+    {
+      bool failed = e->cause_code != SUCCESS || i_fsync (&tosync[i]->fp, e);
+      fpool_putf (f, tosync[i], failed);
+    }
+
+  return e->cause_code;
 }
 
 err_t
@@ -279,13 +430,11 @@ fpool_close (struct file_pool *f, error *e)
   latch_lock (&f->l);
   for (u32 i = 0; i < arrlen (f->files); ++i)
     {
-      latch_lock (&f->files[i].l);
       if (f->files[i].flag > 0)
         {
-          i_close (&f->files[i].fp, e);
-          f->files[i].flag = 0;
+          ASSERT (f->files[i].pin == 0);
+          fpool_evict (f, &f->files[i], e);
         }
-      latch_unlock (&f->files[i].l);
     }
   latch_unlock (&f->l);
 
@@ -326,31 +475,31 @@ TEST (TT_UNIT, page_to_addr_conversion)
   test_assert_int_equal (FILE_NUM (addr), 0);
   test_assert_int_equal (FILE_OFST (addr), 0);
 
-  // Test page 2 (offset = 2 * 4096 = 8192)
+  // Test page 2 (offset = 2 * PAGE_SIZE)
   addr = page_to_addr (2);
   test_assert_int_equal (FILE_TYPE (addr), 0);
   test_assert_int_equal (FILE_NUM (addr), 0);
-  test_assert_int_equal (FILE_OFST (addr), 8192);
+  test_assert_int_equal (FILE_OFST (addr), 2 * PAGE_SIZE);
 
   // Test page that fits exactly in first file
-  // First file holds: 2^24 bytes / 4096 bytes/page = 4096 pages (0-4095)
+  // First file holds: 2^24 bytes / PAGE_SIZE bytes/page
   u64 pages_per_file = (1ULL << FILE_OFST_BITS) >> PAGE_POW;
   addr = page_to_addr (pages_per_file - 1); // Last page of first file
   test_assert_int_equal (FILE_TYPE (addr), 0);
   test_assert_int_equal (FILE_NUM (addr), 0);
   test_assert_int_equal (FILE_OFST (addr), (1ULL << FILE_OFST_BITS) - PAGE_SIZE);
 
-  // Test first page of second file (page 4096)
+  // Test first page of second file
   addr = page_to_addr (pages_per_file);
   test_assert_int_equal (FILE_TYPE (addr), 0);
   test_assert_int_equal (FILE_NUM (addr), 1);
   test_assert_int_equal (FILE_OFST (addr), 0);
 
-  // Test page in second file (page 4097)
+  // Test second page in second file
   addr = page_to_addr (pages_per_file + 1);
   test_assert_int_equal (FILE_TYPE (addr), 0);
   test_assert_int_equal (FILE_NUM (addr), 1);
-  test_assert_int_equal (FILE_OFST (addr), 4096);
+  test_assert_int_equal (FILE_OFST (addr), PAGE_SIZE);
 }
 
 TEST (TT_UNIT, lsn_to_addr_conversion)
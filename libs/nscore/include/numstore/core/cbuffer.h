@@ -163,6 +163,7 @@ u32 cbuffer_cbuffer_copy (struct cbuffer *dest, u32 size, u32 n, const struct cb
 ////////////////////////////////////////////////////////////
 // IO Read / Write
 
+u32 cbuffer_data_segments (struct bytes iov[2], const struct cbuffer *b, u32 len); /* Up to 2 contiguous runs of the first len bytes */
 i32 cbuffer_write_to_file_1 (i_file *dest, const struct cbuffer *b, u32 len, error *e);
 err_t cbuffer_write_to_file_1_expect (i_file *dest, const struct cbuffer *b, u32 len, error *e);
 void cbuffer_write_to_file_2 (struct cbuffer *b, u32 nwritten);
@@ -16,7 +16,9 @@
  * limitations under the License.
  *
  * Description:
- *   Checksum computation interface for data integrity verification.
+ *   Checksum computation interface for data integrity verification. CRC32C,
+ *   with the SSE4.2 crc32 instruction where the CPU has it and slicing-by-8
+ *   everywhere else.
  */
 
 // core
@@ -24,3 +26,6 @@
 
 u32 checksum_init (void);
 void checksum_execute (u32 *dest, const u8 *data, u32 len);
+
+// Name of the implementation checksum_execute picked for this CPU
+const char *checksum_impl (void);
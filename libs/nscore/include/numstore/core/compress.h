@@ -0,0 +1,44 @@
+#pragma once
+
+/*
+ * Copyright 2025 Theo Lincke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *   Lossless compression for page sized buffers of numeric data. Bytes are
+ *   split into 8 lanes (byte i of every 8 byte word), delta coded within a
+ *   lane and then LZ77 compressed. Smooth series leave long runs of zero
+ *   deltas in the high lanes.
+ */
+
+// core
+#include <numstore/core/error.h>
+#include <numstore/intf/types.h>
+
+#include <config.h>
+
+// Largest buffer either side handles
+#define COMPRESS_MAX_LEN PAGE_SIZE
+
+/**
+ * Compresses [n] bytes of [src] into [dest]. Returns the compressed
+ * length, or 0 if it doesn't fit in [cap] bytes
+ */
+u32 compress_execute (u8 *dest, u32 cap, const u8 *src, u32 n);
+
+/**
+ * Restores exactly [n] bytes into [dest]. ERR_CORRUPT if [src] isn't
+ * something compress_execute wrote for [n] bytes - dest is scratch then
+ */
+err_t decompress_execute (u8 *dest, u32 n, const u8 *src, u32 slen, error *e);
@@ -12,31 +12,61 @@
 #undef KTYPE
 #undef SUFFIX
 
+// Bytes in one segment file - the offset part of an address
+#define FPOOL_SEGMENT_SIZE ((u64)1 << FILE_OFST_BITS)
+
+/**
+ * Everything in here is guarded by file_pool.l
+ */
 struct ifframe
 {
-  i_file fp; // The open (or closed) file pointer
-  u32 flag;  // 1 == present (open), 1 == present (no access), 2 == present (access)
-  u64 faddr; // The address that this file represents
-  struct latch l;
+  i_file fp;  // The open (or closed) file pointer
+  u32 flag;   // 0 == not present, 1 == present (no access), 2 == present (access)
+  u32 pin;    // I/O in flight on fp - not evicted while > 0
+  bool dirty; // Written since it was last fsynced
+  u64 faddr;  // The address that this file represents
 };
 
+/**
+ * Segment files are laid out as [dir]/numstore/[type]/[file number],
+ * with file number n of every type in dirs[n % ndirs] - one directory
+ * per disk spreads the I/O over them
+ */
 struct file_pool
 {
   hash_table_fp table;                  // Hash table to index fd into table
-  hentry_fp data[MAX_OPEN_FILES];       // backing for table
+  hentry_fp data[2 * MAX_OPEN_FILES];   // backing for table - never more than half full
   struct ifframe files[MAX_OPEN_FILES]; // the list of files
   u32 clock;                            // Pointer to currently open file
-  char temp_fname[MAX_FILE_NAME];       // Temp util file name
-  u32 baselen;                          // Length of the base in temp_fname
+  const char *dirs[MAX_STRIPE_DIRS];    // Base directories - owned by the caller
+  u32 ndirs;
+  char temp_fname[MAX_FILE_NAME]; // Temp util file name
   struct latch l;
 };
 
 // Lifecycle
-err_t fpool_init (struct file_pool *dest, const char *base, error *e);
+err_t fpool_init (struct file_pool *dest, const char *const *dirs, u32 ndirs, error *e);
 err_t fpool_close (struct file_pool *f, error *e);
 
+// Single I/O - the segment holding [addr] is opened (and created) on demand
 err_t fpool_pread (struct file_pool *f, void *dest, u64 n, u64 addr, error *e);
 err_t fpool_pwrite (struct file_pool *f, const void *src, u64 n, u64 addr, error *e);
 
+/**
+ * Pin the file holding [addr] for I/O the caller does itself (e.g.
+ * batched aio) and put it back with [wrote] set if it was written.
+ * fpool_getf waits for a slot, fpool_trygetf returns NULL without an
+ * error if every open file is pinned - don't wait while holding pins
+ */
+struct ifframe *fpool_getf (struct file_pool *f, u64 addr, error *e);
+struct ifframe *fpool_trygetf (struct file_pool *f, u64 addr, error *e);
+void fpool_putf (struct file_pool *f, struct ifframe *frame, bool wrote);
+
+// Whole segments
+err_t fpool_stat (struct file_pool *f, u64 addr, bool *exists, u64 *size, error *e);
+err_t fpool_resize (struct file_pool *f, u64 addr, u64 nbytes, error *e);
+err_t fpool_remove (struct file_pool *f, u64 addr, error *e);
+err_t fpool_sync (struct file_pool *f, error *e); // fsync every file written since the last sync
+
 u64 page_to_addr (pgno pg);
 u64 lsn_to_addr (lsn l);
@@ -20,6 +20,7 @@
  *   and synchronization primitives (mutexes, spinlocks, rwlocks, threads, condvars).
  */
 
+#include <numstore/intf/os/aio.h>
 #include <numstore/intf/os/file_system.h>
 #include <numstore/intf/os/memory.h>
 #include <numstore/intf/os/threading.h>
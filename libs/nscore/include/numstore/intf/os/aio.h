@@ -0,0 +1,97 @@
+#pragma once
+
+/*
+ * Copyright 2025 Theo Lincke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *   Batched positional I/O over i_file. Backed by io_uring where the
+ *   kernel allows it, otherwise the same requests run one after another
+ *   through the blocking pread / pwrite / fsync path.
+ *
+ *   Submission is synchronous on purpose. The overlap comes from who
+ *   calls it: the page cleaner, read-ahead and checkpoints run on the
+ *   pager's thread pool, so the foreground never waits on their
+ *   batches. A foreground miss can't go on without its page, and a
+ *   dirty victim waits on the WAL flush before its write - a completion
+ *   callback would be waited on straight away. A lone page is one
+ *   pread / pwrite either way, so singles don't go through the ring.
+ */
+
+#include <numstore/core/error.h>
+#include <numstore/intf/os/file_system.h>
+#include <numstore/intf/os/threading.h>
+
+enum i_aio_op
+{
+  I_AIO_READ,
+  I_AIO_WRITE,
+  I_AIO_FSYNC,
+};
+
+struct i_aio_req
+{
+  enum i_aio_op op;
+  i_file *fp;
+  void *buf; // Read into / written from - unused for fsync
+  u32 n;
+  u64 offset;
+
+  // The next request only runs if this one completes in full
+  bool link;
+
+  // Bytes transferred, or -errno
+  i64 res;
+};
+
+typedef struct i_aio i_aio;
+
+struct i_aio
+{
+  i_mutex lock; // One batch in flight at a time
+  u32 depth;
+
+#if PLATFORM_LINUX
+  int ring_fd; // -1 - synchronous fallback
+  void *sq_ring;
+  void *cq_ring;
+  void *sqes;
+  u64 sq_ring_len;
+  u64 cq_ring_len;
+  u64 sqes_len;
+
+  // Pointers into the rings
+  u32 *sq_tail;
+  u32 *sq_mask;
+  u32 *sq_array;
+  u32 *cq_head;
+  u32 *cq_tail;
+  u32 *cq_mask;
+  void *cqes;
+#endif
+};
+
+// [depth] is the largest batch i_aio_submit accepts
+err_t i_aio_open (i_aio *dest, u32 depth, error *e);
+err_t i_aio_open_sync (i_aio *dest, u32 depth, error *e); // Always the fallback path
+void i_aio_close (i_aio *a);
+bool i_aio_is_async (const i_aio *a);
+
+/**
+ * Runs [reqs] and waits for all of them - batches go to the kernel in
+ * one submission but the call is synchronous. Fills in each res. Short
+ * transfers are finished synchronously. Returns the first failure -
+ * requests linked after it come back with -ECANCELED
+ */
+err_t i_aio_submit (i_aio *a, struct i_aio_req *reqs, u32 n, error *e);
@@ -106,10 +106,12 @@ err_t i_write_all (i_file *fp, const void *src, u64 nbytes, error *e);
 // Others
 err_t i_truncate (i_file *fp, u64 bytes, error *e);
 err_t i_fallocate (i_file *fp, u64 bytes, error *e);
+err_t i_punch_hole (i_file *fp, u64 offset, u64 bytes, error *e); // Give [offset, offset + bytes) back to the file system
 i64 i_file_size (i_file *fp, error *e);
 err_t i_remove_quiet (const char *fname, error *e);
 err_t i_mkstemp (i_file *dest, char *tmpl, error *e);
 err_t i_unlink (const char *name, error *e);
+err_t i_rename (const char *from, const char *to, error *e); // Replaces [to] if it exists
 err_t i_mkdir (const char *name, error *e);
 
 typedef enum
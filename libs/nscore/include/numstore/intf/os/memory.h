@@ -49,3 +49,18 @@ void i_free (void *ptr);
         }               \
     }                   \
   while (0)
+
+////////////////////////////////////////////////////////////
+// Arenas
+// Large, page aligned, zeroed region mapped straight from the OS.
+// Used for long lived pools (e.g. the pager buffer pool) that may
+// exceed the u32 limits of i_malloc.
+struct i_arena
+{
+  void *data;
+  u64 len;
+  bool huge; // Backed by explicit huge pages
+};
+
+err_t i_arena_alloc (struct i_arena *dest, u64 bytes, bool huge_pages, error *e);
+void i_arena_free (struct i_arena *a);
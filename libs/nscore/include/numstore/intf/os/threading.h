@@ -84,6 +84,7 @@ typedef struct
 err_t i_thread_create (i_thread *t, void *(*start_routine) (void *), void *arg, error *e);
 err_t i_thread_join (i_thread *t, error *e);
 void i_thread_cancel (i_thread *t);
+void i_thread_yield (void);
 u64 get_available_threads (void);
 
 ////////////////////////////////////////////////////////////
@@ -97,5 +98,6 @@ typedef struct
 err_t i_cond_create (i_cond *c, error *e);
 void i_cond_free (i_cond *c);
 void i_cond_wait (i_cond *c, i_mutex *m);
+bool i_cond_timedwait (i_cond *c, i_mutex *m, u64 ns); // false once [ns] pass without a wake up
 void i_cond_signal (i_cond *c);
 void i_cond_broadcast (i_cond *c);
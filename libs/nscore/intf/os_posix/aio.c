@@ -0,0 +1,613 @@
+/*
+ * Copyright 2025 Theo Lincke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *   POSIX batched I/O implementation. Talks to io_uring through the raw
+ *   syscalls so there's no liburing dependency. If the ring can't be set
+ *   up (old kernel, seccomp, ...) every batch runs synchronously.
+ */
+
+#include <numstore/core/assert.h>
+#include <numstore/core/error.h>
+#include <numstore/intf/logging.h>
+#include <numstore/intf/os.h>
+#include <numstore/test/testing.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if PLATFORM_LINUX && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define I_AIO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#ifndef I_AIO_URING
+#define I_AIO_URING 0
+#endif
+
+DEFINE_DBG_ASSERT (
+    i_aio, i_aio, a,
+    {
+      ASSERT (a);
+      ASSERT (a->depth > 0);
+    })
+
+////////////////////////////////////////////////////////////
+// Synchronous path
+
+/**
+ * Finishes [r] from byte [from] on with blocking calls. Used for the
+ * whole request on the fallback path and to complete short transfers
+ */
+static i64
+i_aio_run_sync (struct i_aio_req *r, u32 from)
+{
+  u8 *buf = r->buf;
+  u32 done = from;
+
+  switch (r->op)
+    {
+    case I_AIO_FSYNC:
+      {
+        while (fsync (r->fp->fd))
+          {
+            if (errno != EINTR)
+              {
+                return -errno;
+              }
+          }
+        return 0;
+      }
+    case I_AIO_READ:
+    case I_AIO_WRITE:
+      {
+        while (done < r->n)
+          {
+            ssize_t ret;
+            if (r->op == I_AIO_READ)
+              {
+                ret = pread (r->fp->fd, buf + done, r->n - done, r->offset + done);
+              }
+            else
+              {
+                ret = pwrite (r->fp->fd, buf + done, r->n - done, r->offset + done);
+              }
+
+            if (ret < 0)
+              {
+                if (errno == EINTR)
+                  {
+                    continue;
+                  }
+                return -errno;
+              }
+
+            // EOF
+            if (ret == 0)
+              {
+                break;
+              }
+
+            done += (u32)ret;
+          }
+        return done;
+      }
+    }
+
+  UNREACHABLE ();
+}
+
+static inline bool
+i_aio_req_ok (const struct i_aio_req *r)
+{
+  return r->res >= 0 && (r->op == I_AIO_FSYNC || r->res == (i64)r->n);
+}
+
+static void
+i_aio_submit_sync (struct i_aio_req *reqs, u32 n)
+{
+  for (u32 i = 0; i < n; ++i)
+    {
+      if (i > 0 && reqs[i - 1].link && !i_aio_req_ok (&reqs[i - 1]))
+        {
+          reqs[i].res = -ECANCELED;
+          continue;
+        }
+      reqs[i].res = i_aio_run_sync (&reqs[i], 0);
+    }
+}
+
+////////////////////////////////////////////////////////////
+// io_uring
+
+#if I_AIO_URING
+
+static int
+i_io_uring_setup (u32 entries, struct io_uring_params *p)
+{
+  return (int)syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+i_io_uring_register (int fd, u32 opcode, void *arg, u32 nargs)
+{
+  return (int)syscall (__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+/**
+ * IORING_OP_READ / WRITE came with 5.6 - a ring on an older kernel
+ * takes them and fails every one with -EINVAL. The probe came in the
+ * same release, so it failing means the same thing
+ */
+static bool
+i_aio_ring_supported (int ring_fd)
+{
+  static const u8 need[] = { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC };
+  enum
+  {
+    NPROBE = 256,
+  };
+
+  // io_uring_probe ends in a flexible array - u64 keeps it aligned
+  u64 buf[(sizeof (struct io_uring_probe) + NPROBE * sizeof (struct io_uring_probe_op)) / sizeof (u64)];
+  memset (buf, 0, sizeof (buf));
+  struct io_uring_probe *probe = (struct io_uring_probe *)buf;
+
+  if (i_io_uring_register (ring_fd, IORING_REGISTER_PROBE, probe, NPROBE) < 0)
+    {
+      return false;
+    }
+
+  for (u32 i = 0; i < arrlen (need); ++i)
+    {
+      if (need[i] >= probe->ops_len || !(probe->ops[need[i]].flags & IO_URING_OP_SUPPORTED))
+        {
+          return false;
+        }
+    }
+
+  return true;
+}
+
+static int
+i_io_uring_enter (int fd, u32 to_submit, u32 min_complete, u32 flags)
+{
+  return (int)syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void
+i_aio_unmap (i_aio *a)
+{
+  if (a->sqes)
+    {
+      munmap (a->sqes, a->sqes_len);
+    }
+  if (a->cq_ring && a->cq_ring != a->sq_ring)
+    {
+      munmap (a->cq_ring, a->cq_ring_len);
+    }
+  if (a->sq_ring)
+    {
+      munmap (a->sq_ring, a->sq_ring_len);
+    }
+  a->sqes = a->cq_ring = a->sq_ring = NULL;
+}
+
+static bool
+i_aio_ring_open (i_aio *a)
+{
+  struct io_uring_params p;
+  memset (&p, 0, sizeof (p));
+
+  a->sq_ring = a->cq_ring = a->sqes = NULL;
+  a->ring_fd = i_io_uring_setup (a->depth, &p);
+  if (a->ring_fd < 0)
+    {
+      i_log_info ("io_uring unavailable (%s), using synchronous I/O\n", strerror (errno));
+      a->ring_fd = -1;
+      return false;
+    }
+
+  if (!i_aio_ring_supported (a->ring_fd))
+    {
+      i_log_info ("io_uring can't read / write on this kernel, using synchronous I/O\n");
+      close (a->ring_fd);
+      a->ring_fd = -1;
+      return false;
+    }
+
+  a->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof (u32);
+  a->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  a->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+
+  bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single)
+    {
+      a->sq_ring_len = MAX (a->sq_ring_len, a->cq_ring_len);
+    }
+
+  a->sq_ring = mmap (NULL, a->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_SQ_RING);
+  if (a->sq_ring == MAP_FAILED)
+    {
+      a->sq_ring = NULL;
+      goto failed;
+    }
+
+  if (single)
+    {
+      a->cq_ring = a->sq_ring;
+    }
+  else
+    {
+      a->cq_ring = mmap (NULL, a->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_CQ_RING);
+      if (a->cq_ring == MAP_FAILED)
+        {
+          a->cq_ring = NULL;
+          goto failed;
+        }
+    }
+
+  a->sqes = mmap (NULL, a->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, a->ring_fd, IORING_OFF_SQES);
+  if (a->sqes == MAP_FAILED)
+    {
+      a->sqes = NULL;
+      goto failed;
+    }
+
+  u8 *sq = a->sq_ring;
+  u8 *cq = a->cq_ring;
+  a->sq_tail = (u32 *)(sq + p.sq_off.tail);
+  a->sq_mask = (u32 *)(sq + p.sq_off.ring_mask);
+  a->sq_array = (u32 *)(sq + p.sq_off.array);
+  a->cq_head = (u32 *)(cq + p.cq_off.head);
+  a->cq_tail = (u32 *)(cq + p.cq_off.tail);
+  a->cq_mask = (u32 *)(cq + p.cq_off.ring_mask);
+  a->cqes = cq + p.cq_off.cqes;
+
+  return true;
+
+failed:
+  i_log_info ("io_uring ring mapping failed (%s), using synchronous I/O\n", strerror (errno));
+  i_aio_unmap (a);
+  close (a->ring_fd);
+  a->ring_fd = -1;
+  return false;
+}
+
+static void
+i_aio_ring_close (i_aio *a)
+{
+  if (a->ring_fd >= 0)
+    {
+      i_aio_unmap (a);
+      close (a->ring_fd);
+      a->ring_fd = -1;
+    }
+}
+
+static err_t
+i_aio_submit_ring (i_aio *a, struct i_aio_req *reqs, u32 n, error *e)
+{
+  struct io_uring_sqe *sqes = a->sqes;
+  struct io_uring_cqe *cqes = a->cqes;
+
+  // Fill the submission queue - we're its only producer
+  u32 tail = *a->sq_tail;
+  for (u32 i = 0; i < n; ++i)
+    {
+      struct i_aio_req *r = &reqs[i];
+      u32 idx = tail & *a->sq_mask;
+      struct io_uring_sqe *sqe = &sqes[idx];
+      memset (sqe, 0, sizeof (*sqe));
+
+      switch (r->op)
+        {
+        case I_AIO_READ:
+          {
+            sqe->opcode = IORING_OP_READ;
+            break;
+          }
+        case I_AIO_WRITE:
+          {
+            sqe->opcode = IORING_OP_WRITE;
+            break;
+          }
+        case I_AIO_FSYNC:
+          {
+            sqe->opcode = IORING_OP_FSYNC;
+            break;
+          }
+        }
+
+      sqe->fd = r->fp->fd;
+      sqe->addr = (u64)(uintptr_t)r->buf;
+      sqe->len = r->op == I_AIO_FSYNC ? 0 : r->n;
+      sqe->off = r->offset;
+      sqe->flags = r->link && i + 1 < n ? IOSQE_IO_LINK : 0;
+      sqe->user_data = i;
+
+      a->sq_array[idx] = idx;
+      tail++;
+    }
+  __atomic_store_n (a->sq_tail, tail, __ATOMIC_RELEASE);
+
+  // Submit and reap
+  u32 submitted = 0;
+  u32 completed = 0;
+  while (completed < n)
+    {
+      int ret = i_io_uring_enter (a->ring_fd, n - submitted, 1, IORING_ENTER_GETEVENTS);
+      if (ret < 0)
+        {
+          if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            {
+              continue;
+            }
+          return error_causef (e, ERR_IO, "io_uring_enter: %s", strerror (errno));
+        }
+      submitted += (u32)ret;
+
+      u32 head = *a->cq_head;
+      u32 ctail = __atomic_load_n (a->cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != ctail; ++head)
+        {
+          struct io_uring_cqe *cqe = &cqes[head & *a->cq_mask];
+          ASSERT (cqe->user_data < n);
+          reqs[cqe->user_data].res = cqe->res;
+          completed++;
+        }
+      __atomic_store_n (a->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+  /**
+   * A short transfer ends a link chain early in the kernel, so finish
+   * it here and pick the chain back up
+   */
+  for (u32 i = 0; i < n; ++i)
+    {
+      struct i_aio_req *r = &reqs[i];
+      if (r->res == -ECANCELED && i > 0 && reqs[i - 1].link && i_aio_req_ok (&reqs[i - 1]))
+        {
+          r->res = i_aio_run_sync (r, 0);
+        }
+      else if (r->res > 0 && r->op != I_AIO_FSYNC && r->res < (i64)r->n)
+        {
+          r->res = i_aio_run_sync (r, (u32)r->res);
+        }
+    }
+
+  return SUCCESS;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////
+// Interface
+
+static err_t
+i_aio_init (i_aio *dest, u32 depth, bool try_ring, error *e)
+{
+  ASSERT (depth > 0);
+
+  err_t_wrap (i_mutex_create (&dest->lock, e), e);
+  dest->depth = depth;
+
+#if PLATFORM_LINUX
+  dest->ring_fd = -1;
+#endif
+#if I_AIO_URING
+  if (try_ring)
+    {
+      i_aio_ring_open (dest);
+    }
+#else
+  (void)try_ring;
+#endif
+
+  DBG_ASSERT (i_aio, dest);
+
+  return SUCCESS;
+}
+
+err_t
+i_aio_open (i_aio *dest, u32 depth, error *e)
+{
+  return i_aio_init (dest, depth, true, e);
+}
+
+err_t
+i_aio_open_sync (i_aio *dest, u32 depth, error *e)
+{
+  return i_aio_init (dest, depth, false, e);
+}
+
+void
+i_aio_close (i_aio *a)
+{
+  DBG_ASSERT (i_aio, a);
+#if I_AIO_URING
+  i_aio_ring_close (a);
+#endif
+  i_mutex_free (&a->lock);
+}
+
+bool
+i_aio_is_async (const i_aio *a)
+{
+#if I_AIO_URING
+  return a->ring_fd >= 0;
+#else
+  (void)a;
+  return false;
+#endif
+}
+
+err_t
+i_aio_submit (i_aio *a, struct i_aio_req *reqs, u32 n, error *e)
+{
+  DBG_ASSERT (i_aio, a);
+  ASSERT (n <= a->depth);
+
+  if (n == 0)
+    {
+      return SUCCESS;
+    }
+
+  i_mutex_lock (&a->lock);
+
+  err_t ret = SUCCESS;
+#if I_AIO_URING
+  if (a->ring_fd >= 0)
+    {
+      ret = i_aio_submit_ring (a, reqs, n, e);
+    }
+  else
+#endif
+    {
+      i_aio_submit_sync (reqs, n);
+    }
+
+  i_mutex_unlock (&a->lock);
+
+  if (ret)
+    {
+      return ret;
+    }
+
+  // First failure wins
+  for (u32 i = 0; i < n; ++i)
+    {
+      const struct i_aio_req *r = &reqs[i];
+      if (r->res < 0)
+        {
+          return error_causef (e, ERR_IO, "%s: %s",
+                               r->op == I_AIO_READ ? "read" : r->op == I_AIO_WRITE ? "write"
+                                                                                     : "fsync",
+                               strerror ((int)-r->res));
+        }
+      if (!i_aio_req_ok (r))
+        {
+          return error_causef (e, ERR_IO, "Short %s: %" PRId64 " of %u bytes at offset %" PRIu64,
+                               r->op == I_AIO_READ ? "read" : "write", r->res, r->n, r->offset);
+        }
+    }
+
+  return SUCCESS;
+}
+
+#ifndef NTEST
+static void
+i_aio_test_batches (i_aio *a)
+{
+  error e = error_create ();
+  i_file fp;
+
+  test_fail_if (i_remove_quiet ("test_aio.bin", &e));
+  test_err_t_wrap (i_open_rw (&fp, "test_aio.bin", &e), &e);
+
+  static u8 src[8][512];
+  static u8 dest[8][512];
+  for (u32 i = 0; i < 8; ++i)
+    {
+      memset (src[i], 'a' + i, sizeof (src[i]));
+    }
+
+  TEST_CASE ("Linked writes then fsync")
+  {
+    struct i_aio_req reqs[9];
+    for (u32 i = 0; i < 8; ++i)
+      {
+        reqs[i] = (struct i_aio_req){
+          .op = I_AIO_WRITE,
+          .fp = &fp,
+          .buf = src[i],
+          .n = sizeof (src[i]),
+          .offset = i * sizeof (src[i]),
+          .link = true,
+        };
+      }
+    reqs[8] = (struct i_aio_req){ .op = I_AIO_FSYNC, .fp = &fp };
+
+    test_err_t_wrap (i_aio_submit (a, reqs, 9, &e), &e);
+    for (u32 i = 0; i < 8; ++i)
+      {
+        test_assert_int_equal ((int)reqs[i].res, 512);
+      }
+    test_assert_int_equal ((int)reqs[8].res, 0);
+  }
+
+  TEST_CASE ("Batched reads come back in place")
+  {
+    struct i_aio_req reqs[8];
+    for (u32 i = 0; i < 8; ++i)
+      {
+        // Reverse order on purpose
+        reqs[i] = (struct i_aio_req){
+          .op = I_AIO_READ,
+          .fp = &fp,
+          .buf = dest[7 - i],
+          .n = sizeof (dest[i]),
+          .offset = (7 - i) * sizeof (dest[i]),
+        };
+      }
+
+    test_err_t_wrap (i_aio_submit (a, reqs, 8, &e), &e);
+    test_assert_memequal (dest, src, sizeof (src));
+  }
+
+  TEST_CASE ("Read past the end fails")
+  {
+    struct i_aio_req req = {
+      .op = I_AIO_READ,
+      .fp = &fp,
+      .buf = dest[0],
+      .n = sizeof (dest[0]),
+      .offset = 100 * sizeof (dest[0]),
+    };
+
+    test_assert_int_equal (i_aio_submit (a, &req, 1, &e), ERR_IO);
+    e.cause_code = SUCCESS;
+  }
+
+  test_err_t_wrap (i_close (&fp, &e), &e);
+  test_fail_if (i_remove_quiet ("test_aio.bin", &e));
+}
+
+TEST (TT_UNIT, i_aio)
+{
+  error e = error_create ();
+  i_aio a;
+
+  TEST_CASE ("Ring (or whatever the kernel allows)")
+  {
+    test_err_t_wrap (i_aio_open (&a, 16, &e), &e);
+    i_aio_test_batches (&a);
+    i_aio_close (&a);
+  }
+
+  TEST_CASE ("Synchronous fallback")
+  {
+    test_err_t_wrap (i_aio_open_sync (&a, 16, &e), &e);
+    test_assert (!i_aio_is_async (&a));
+    i_aio_test_batches (&a);
+    i_aio_close (&a);
+  }
+}
+#endif
@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
 
 ////////////////// Condition Variable
 
@@ -154,6 +155,52 @@ i_cond_wait (i_cond *c, i_mutex *m)
     }
 }
 
+bool
+i_cond_timedwait (i_cond *c, i_mutex *m, u64 ns)
+{
+  ASSERT (c);
+  ASSERT (m);
+
+  // Default condattr - the deadline is on CLOCK_REALTIME
+  struct timespec deadline;
+  clock_gettime (CLOCK_REALTIME, &deadline);
+  u64 nsec = (u64)deadline.tv_nsec + ns;
+  deadline.tv_sec += (time_t)(nsec / 1000000000ULL);
+  deadline.tv_nsec = (long)(nsec % 1000000000ULL);
+
+  int ret = pthread_cond_timedwait (&c->cond, &m->m, &deadline);
+  switch (ret)
+    {
+    case 0:
+      {
+        return true;
+      }
+
+    case ETIMEDOUT:
+      {
+        return false;
+      }
+
+    case EINVAL:
+      {
+        i_log_error ("cond_timedwait: invalid cond, mutex or deadline: %s\n", strerror (ret));
+        UNREACHABLE ();
+      }
+
+    case EPERM:
+      {
+        i_log_error ("cond_timedwait: mutex not owned by thread: %s\n", strerror (ret));
+        UNREACHABLE ();
+      }
+
+    default:
+      {
+        i_log_error ("cond_timedwait: unknown error: %s\n", strerror (ret));
+        UNREACHABLE ();
+      }
+    }
+}
+
 void
 i_cond_signal (i_cond *c)
 {
@@ -40,6 +40,11 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#if PLATFORM_LINUX
+#include <linux/falloc.h>
+#include <sys/syscall.h>
+#endif
+
 // os
 // system
 #undef bool
@@ -749,6 +754,28 @@ i_fallocate (i_file *fp, u64 bytes, error *e)
   return SUCCESS;
 }
 
+/**
+ * Best effort - where the file system can't punch holes the range
+ * just stays allocated
+ */
+err_t
+i_punch_hole (i_file *fp, u64 offset, u64 bytes, error *e)
+{
+#if PLATFORM_LINUX && defined(FALLOC_FL_PUNCH_HOLE)
+  if (syscall (SYS_fallocate, fp->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)bytes) == -1
+      && errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+      return error_causef (e, ERR_IO, "fallocate (punch hole): %s", strerror (errno));
+    }
+#else
+  (void)fp;
+  (void)offset;
+  (void)bytes;
+  (void)e;
+#endif
+  return SUCCESS;
+}
+
 i64
 i_file_size (i_file *fp, error *e)
 {
@@ -800,6 +827,17 @@ i_unlink (const char *name, error *e)
   return SUCCESS;
 }
 
+err_t
+i_rename (const char *from, const char *to, error *e)
+{
+  if (rename (from, to))
+    {
+      error_causef (e, ERR_IO, "rename: %s", strerror (errno));
+      return e->cause_code;
+    }
+  return SUCCESS;
+}
+
 err_t
 i_mkdir (const char *name, error *e)
 {
@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 ////////////////////////////////////////////////////////////
 // MEMORY
@@ -481,3 +482,110 @@ i_free (void *ptr)
   ASSERT (ptr);
   free (ptr);
 }
+
+////////////////////////////////////////////////////////////
+// ARENAS
+
+#define I_HUGE_PAGE_SIZE ((u64)2 * 1024 * 1024)
+
+err_t
+i_arena_alloc (struct i_arena *dest, u64 bytes, bool huge_pages, error *e)
+{
+  ASSERT (dest);
+  ASSERT (bytes > 0);
+
+  dest->data = NULL;
+  dest->len = 0;
+  dest->huge = false;
+
+  if (huge_pages)
+    {
+      u64 len = ((bytes + I_HUGE_PAGE_SIZE - 1) / I_HUGE_PAGE_SIZE) * I_HUGE_PAGE_SIZE;
+
+#ifdef MAP_HUGETLB
+      // Explicit huge pages - only works if the admin reserved some
+      void *ret = mmap (NULL, (size_t)len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (ret != MAP_FAILED)
+        {
+          dest->data = ret;
+          dest->len = len;
+          dest->huge = true;
+          return SUCCESS;
+        }
+#endif
+
+      // Fall back to regular pages and ask for transparent huge pages
+      bytes = len;
+    }
+
+  errno = 0;
+  void *ret = mmap (NULL, (size_t)bytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ret == MAP_FAILED)
+    {
+      return error_causef (e, ERR_NOMEM, "mmap failed to allocate %" PRIu64 " bytes: %s",
+                           bytes, strerror (errno));
+    }
+
+#ifdef MADV_HUGEPAGE
+  if (huge_pages)
+    {
+      // Best effort
+      madvise (ret, (size_t)bytes, MADV_HUGEPAGE);
+    }
+#endif
+
+  dest->data = ret;
+  dest->len = bytes;
+
+  return SUCCESS;
+}
+
+void
+i_arena_free (struct i_arena *a)
+{
+  ASSERT (a);
+  if (a->data)
+    {
+      munmap (a->data, (size_t)a->len);
+    }
+  a->data = NULL;
+  a->len = 0;
+  a->huge = false;
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, i_arena_alloc)
+{
+  error e = error_create ();
+
+  TEST_CASE ("Regular pages are zeroed and writable")
+  {
+    struct i_arena a;
+    test_err_t_wrap (i_arena_alloc (&a, 3 * 4096 + 7, false, &e), &e);
+    test_fail_if_null (a.data);
+    test_assert (a.len >= 3 * 4096 + 7);
+
+    u8 *d = a.data;
+    for (u64 i = 0; i < a.len; ++i)
+      {
+        test_assert_int_equal (d[i], 0);
+      }
+    d[a.len - 1] = 1;
+
+    i_arena_free (&a);
+    test_assert_equal (a.data, NULL);
+  }
+
+  TEST_CASE ("Huge pages are rounded up and fall back when unavailable")
+  {
+    struct i_arena a;
+    test_err_t_wrap (i_arena_alloc (&a, 10, true, &e), &e);
+    test_fail_if_null (a.data);
+    test_assert_int_equal (a.len % I_HUGE_PAGE_SIZE, 0);
+    ((u8 *)a.data)[0] = 1;
+    i_arena_free (&a);
+  }
+}
+#endif
@@ -24,6 +24,7 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -147,6 +148,12 @@ i_thread_cancel (i_thread *t)
     }
 }
 
+void
+i_thread_yield (void)
+{
+  sched_yield ();
+}
+
 u64
 get_available_threads (void)
 {
@@ -26,12 +26,91 @@
 #include <numstore/core/stride.h>
 #include <numstore/intf/types.h>
 
+#include <stdio.h>
+
 typedef struct nsfslite_s nsfslite;
 
+struct nsfslite_options
+{
+  u64 cache_bytes;      // Buffer pool budget in bytes (0 = library default)
+  u64 meta_cache_bytes; // Share of it kept for root, catalog and inner node pages (0 = library default)
+  bool huge_pages; // Back the buffer pool with huge pages when available
+  bool compress;   // Store data pages compressed on disk (large page builds only - refused at the default PAGE_POW)
+
+  // Store the database as segment files striped over these directories
+  // (e.g. one per disk) instead of in fname. The WAL stays in recovery_fname
+  const char *const *data_dirs;
+  u32 ndata_dirs;
+
+  // Cache pages evicted from the buffer pool in this scratch file (e.g. on a
+  // local SSD when the database is on network storage). NULL = off
+  const char *l2_cache_path;
+  u64 l2_cache_bytes;
+
+  // Group commit: how long a commit waits for other threads' commits to share
+  // its log fsync, and how many it waits for (0 = library default)
+  u32 commit_delay_us;
+  u32 commit_batch;
+
+  // Size of the recovery log's segment files when it's created (0 = library default)
+  u64 wal_segment_bytes;
+};
+
+// Buffer pool and I/O counters since open - see struct pgr_stats
+struct nsfslite_stats
+{
+  u32 nframes;
+  u32 npinned;
+  u32 ndirty;
+  u32 nmeta;
+  u32 maxmeta;
+  u64 hits;
+  u64 misses;
+  u64 readahead;
+  u64 readahead_hits;
+  u64 evictions;
+  u64 dirty_evictions;
+  u64 near_full;
+  u64 pager_full;
+
+  u32 l2_pages;
+  u64 l2_hits;
+  u64 l2_misses;
+  u64 l2_writes;
+  u64 l2_evictions;
+
+  u64 page_reads;
+  u64 page_writes;
+  u64 read_ns;
+  u64 write_ns;
+  u64 file_syncs;
+  u64 file_sync_ns;
+  u64 compressed_writes;
+  u64 compressed_bytes;
+
+  u64 wal_fsyncs;
+  u64 wal_bytes;
+  u64 wal_fsync_ns;
+  u64 wal_fsync_max_ns;
+  u64 wal_grouped;
+  u64 wal_full_pages;
+  u64 wal_recycled;
+  u64 wal_removed;
+};
+
 nsfslite *nsfslite_open (const char *fname, const char *recovery_fname, error *e);
+nsfslite *nsfslite_open_with (const char *fname, const char *recovery_fname, struct nsfslite_options opts, error *e);
 err_t nsfslite_close (nsfslite *n, error *e);
 
 struct txn *nsfslite_begin_txn (nsfslite *n, error *e);
+
+/**
+ * A transaction for loading a lot of data. Pages it allocates skip the
+ * recovery log and are written out when it commits, so a multi GB load
+ * isn't logged twice. If it never commits, recovery undoes it like any
+ * other - a variable it created is simply gone
+ */
+struct txn *nsfslite_begin_bulk_txn (nsfslite *n, error *e);
 err_t nsfslite_commit (nsfslite *n, struct txn *tx, error *e);
 
 spgno nsfslite_new (
@@ -88,3 +167,26 @@ err_t nsfslite_remove (
     void *dest,
     const char *stride,
     error *e);
+
+/**
+ * Repacks every variable's leaves to [fill_pct] percent full (0 = library
+ * default), moves them towards the front of the file and truncates the
+ * freed tail. Runs as many short transactions, so it can run alongside
+ * other work
+ */
+err_t nsfslite_vacuum (
+    nsfslite *n,
+    u32 fill_pct,
+    error *e);
+
+/**
+ * Snapshot of the buffer pool and I/O counters. Cheap enough to poll
+ */
+void nsfslite_get_stats (
+    nsfslite *n,
+    struct nsfslite_stats *dest);
+
+// Prints the same snapshot to [out], whatever the log level
+void nsfslite_fprint_stats (nsfslite *n, FILE *out);
+
+void i_log_nsfslite_stats (int log_level, nsfslite *n);
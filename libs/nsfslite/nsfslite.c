@@ -37,11 +37,14 @@
 #include <numstore/rptree/_rebalance.h>
 #include <numstore/rptree/oneoff.h>
 #include <numstore/rptree/rptree_cursor.h>
+#include <numstore/rptree/vacuum.h>
 #include <numstore/var/attr.h>
 #include <numstore/var/var_cursor.h>
 
 #include <pthread.h>
 
+#include <config.h>
+
 union cursor
 {
   struct rptree_cursor rptc;
@@ -94,8 +97,14 @@ nsfslite_auto_commit (nsfslite *n, struct txn *tx, int auto_txn_started, error *
 nsfslite *
 nsfslite_open (const char *fname, const char *recovery_fname, error *e)
 {
-  i_log_info ("nsfslite_open: fname=%s recovery=%s\n",
-              fname, recovery_fname ? recovery_fname : "none");
+  return nsfslite_open_with (fname, recovery_fname, (struct nsfslite_options){ 0 }, e);
+}
+
+nsfslite *
+nsfslite_open_with (const char *fname, const char *recovery_fname, struct nsfslite_options opts, error *e)
+{
+  i_log_info ("nsfslite_open: fname=%s recovery=%s cache=%" PRIu64 "\n",
+              fname, recovery_fname ? recovery_fname : "none", opts.cache_bytes);
 
   // Allocate memory
   nsfslite *ret = i_malloc (1, sizeof *ret, e);
@@ -120,10 +129,33 @@ nsfslite_open (const char *fname, const char *recovery_fname, error *e)
       goto failed;
     }
 
+  // One background worker (page cleaner)
+  if (tp_spin (ret->tp, 1, e))
+    {
+      tp_free (ret->tp, e);
+      lockt_destroy (&ret->lt);
+      i_free (ret);
+      goto failed;
+    }
+
   // Create a new pager
-  ret->p = pgr_open (fname, recovery_fname, &ret->lt, ret->tp, e);
+  struct pgr_params params = {
+    .memory_budget = opts.cache_bytes,
+    .meta_budget = opts.meta_cache_bytes,
+    .huge_pages = opts.huge_pages,
+    .compress = opts.compress,
+    .data_dirs = opts.data_dirs,
+    .ndata_dirs = opts.ndata_dirs,
+    .l2_path = opts.l2_cache_path,
+    .l2_budget = opts.l2_cache_bytes,
+    .commit_delay_us = opts.commit_delay_us,
+    .commit_batch = opts.commit_batch,
+    .wal_segment_bytes = opts.wal_segment_bytes,
+  };
+  ret->p = pgr_open_with (fname, recovery_fname, &ret->lt, ret->tp, params, e);
   if (ret->p == NULL)
     {
+      tp_stop (ret->tp, e);
       tp_free (ret->tp, e);
       lockt_destroy (&ret->lt);
       i_free (ret);
@@ -139,6 +171,9 @@ nsfslite_open (const char *fname, const char *recovery_fname, error *e)
         {
           e->print_msg_on_error = before;
           pgr_close (ret->p, e);
+          tp_stop (ret->tp, e);
+          tp_free (ret->tp, e);
+          lockt_destroy (&ret->lt);
           i_free (ret);
           goto failed;
         }
@@ -161,6 +196,7 @@ nsfslite_close (nsfslite *n, error *e)
 
   pgr_close (n->p, e);
   slab_alloc_destroy (&n->alloc);
+  tp_stop (n->tp, e);
   tp_free (n->tp, e);
   lockt_destroy (&n->lt);
 
@@ -411,6 +447,26 @@ nsfslite_begin_txn (nsfslite *n, error *e)
   return tx;
 }
 
+struct txn *
+nsfslite_begin_bulk_txn (nsfslite *n, error *e)
+{
+  struct txn *tx = i_malloc (1, sizeof *tx, e);
+  if (tx == NULL)
+    {
+      error_log_consume (e);
+      return NULL;
+    }
+
+  if (pgr_begin_unlogged_txn (tx, n->p, e))
+    {
+      error_log_consume (e);
+      i_free (tx);
+      return NULL;
+    }
+
+  return tx;
+}
+
 err_t
 nsfslite_commit (nsfslite *n, struct txn *tx, error *e)
 {
@@ -825,3 +881,222 @@ theend:
       return SUCCESS;
     }
 }
+
+/**
+ * One vacuum step of variable [id] in its own transaction
+ */
+static err_t
+nsfslite_vacuum_step (
+    nsfslite *n,
+    union cursor *rc,
+    union cursor *vc,
+    pgno id,
+    b_size *bofst,
+    u32 fill_pct,
+    bool *done,
+    error *e)
+{
+  struct txn tx;
+  err_t_wrap (pgr_begin_txn (&tx, n->p, e), e);
+
+  struct var_get_by_id_params params = {
+    .id = id,
+  };
+
+  // GET VARIABLE
+  if (vpc_get_by_id (&vc->vpc, NULL, &params, e))
+    {
+      goto theend;
+    }
+
+  if (rptc_open (&rc->rptc, params.pg0, n->p, &n->lt, e))
+    {
+      goto theend;
+    }
+
+  // DO STEP
+  {
+    rptc_enter_transaction (&rc->rptc, &tx);
+
+    if (rptv_vacuum_step (&rc->rptc, bofst, fill_pct, e))
+      {
+        rptc_cleanup (&rc->rptc, e);
+        goto theend;
+      }
+
+    rptc_leave_transaction (&rc->rptc);
+
+    if (rptc_cleanup (&rc->rptc, e))
+      {
+        goto theend;
+      }
+  }
+
+  *done = *bofst >= rc->rptc.total_size;
+
+  // UPDATE VARIABLE META
+  if (rc->rptc.root != params.pg0)
+    {
+      varc_enter_transaction (&vc->vpc, &tx);
+
+      struct var_update_by_id_params uparams = {
+        .id = id,
+        .root = rc->rptc.root,
+        .nbytes = rc->rptc.total_size,
+      };
+      err_t ret = vpc_update_by_id (&vc->vpc, &uparams, e);
+      varc_leave_transaction (&vc->vpc);
+      if (ret)
+        {
+          goto theend;
+        }
+    }
+
+  // COMMIT
+  pgr_commit (n->p, &tx, e);
+
+theend:
+  if (e->cause_code)
+    {
+      pgr_rollback (n->p, &tx, 0, e);
+    }
+  return e->cause_code;
+}
+
+err_t
+nsfslite_vacuum (nsfslite *n, u32 fill_pct, error *e)
+{
+  DBG_ASSERT (nsfslite, n);
+
+  if (fill_pct == 0)
+    {
+      fill_pct = VACUUM_FILL_PCT;
+    }
+  if (fill_pct > 100)
+    {
+      return error_causef (e, ERR_INVALID_ARGUMENT, "Vacuum fill percent must be at most 100, got %" PRIu32, fill_pct);
+    }
+
+  // ALLOCATE MEMORY
+  union cursor *rc = slab_alloc_alloc (&n->alloc, e);
+  if (rc == NULL)
+    {
+      return e->cause_code;
+    }
+  union cursor *vc = slab_alloc_alloc (&n->alloc, e);
+  if (vc == NULL)
+    {
+      slab_alloc_free (&n->alloc, rc);
+      return e->cause_code;
+    }
+
+  if (varc_initialize (&vc->vpc, n->p, e))
+    {
+      goto theend;
+    }
+
+  i_log_info ("Vacuum starting at %" PRp_size " pages\n", pgr_get_npages (n->p));
+
+  // REPACK EVERY VARIABLE - a step at a time so writers get a turn in between
+  pgno id = PGNO_NULL;
+  while (true)
+    {
+      if (vpc_next_id (&vc->vpc, &id, e))
+        {
+          goto theend;
+        }
+      if (id == PGNO_NULL)
+        {
+          break;
+        }
+
+      b_size bofst = 0;
+      bool done = false;
+      while (!done)
+        {
+          if (nsfslite_vacuum_step (n, rc, vc, id, &bofst, fill_pct, &done, e))
+            {
+              goto theend;
+            }
+        }
+    }
+
+  // GIVE BACK THE FREED TAIL
+  if (pgr_shrink (n->p, e))
+    {
+      goto theend;
+    }
+
+  i_log_info ("Vacuum done at %" PRp_size " pages\n", pgr_get_npages (n->p));
+
+theend:
+  slab_alloc_free (&n->alloc, rc);
+  slab_alloc_free (&n->alloc, vc);
+  return e->cause_code;
+}
+
+void
+nsfslite_get_stats (nsfslite *n, struct nsfslite_stats *dest)
+{
+  DBG_ASSERT (nsfslite, n);
+
+  struct pgr_stats s;
+  pgr_get_stats (n->p, &s);
+
+  *dest = (struct nsfslite_stats){
+    .nframes = s.nframes,
+    .npinned = s.npinned,
+    .ndirty = s.ndirty,
+    .nmeta = s.nmeta,
+    .maxmeta = s.maxmeta,
+    .hits = s.hits,
+    .misses = s.misses,
+    .readahead = s.readahead,
+    .readahead_hits = s.readahead_hits,
+    .evictions = s.evictions,
+    .dirty_evictions = s.dirty_evictions,
+    .near_full = s.near_full,
+    .pager_full = s.pager_full,
+    .l2_pages = s.l2_pages,
+    .l2_hits = s.l2_hits,
+    .l2_misses = s.l2_misses,
+    .l2_writes = s.l2_writes,
+    .l2_evictions = s.l2_evictions,
+    .page_reads = s.page_reads,
+    .page_writes = s.page_writes,
+    .read_ns = s.read_ns,
+    .write_ns = s.write_ns,
+    .file_syncs = s.file_syncs,
+    .file_sync_ns = s.file_sync_ns,
+    .compressed_writes = s.compressed_writes,
+    .compressed_bytes = s.compressed_bytes,
+    .wal_fsyncs = s.wal_fsyncs,
+    .wal_bytes = s.wal_bytes,
+    .wal_fsync_ns = s.wal_fsync_ns,
+    .wal_fsync_max_ns = s.wal_fsync_max_ns,
+    .wal_grouped = s.wal_grouped,
+    .wal_full_pages = s.wal_full_pages,
+    .wal_recycled = s.wal_recycled,
+    .wal_removed = s.wal_removed,
+  };
+}
+
+void
+nsfslite_fprint_stats (nsfslite *n, FILE *out)
+{
+  DBG_ASSERT (nsfslite, n);
+
+  struct pgr_stats s;
+  pgr_get_stats (n->p, &s);
+  pgr_stats_fprint (out, &s);
+}
+
+void
+i_log_nsfslite_stats (int log_level, nsfslite *n)
+{
+  DBG_ASSERT (nsfslite, n);
+
+  struct pgr_stats s;
+  pgr_get_stats (n->p, &s);
+  i_log_pgr_stats (log_level, &s);
+}
@@ -7,6 +7,7 @@
 #include <numstore/core/latch.h>
 #include <numstore/core/max_capture.h>
 #include <numstore/core/random.h>
+#include <numstore/core/slab_alloc.h>
 #include <numstore/core/string.h>
 #include <numstore/intf/logging.h>
 #include <numstore/intf/os.h>
@@ -28,6 +29,7 @@
 #include <numstore/test/testing.h>
 
 #include <config.h>
+#include <l2_cache.h>
 #include <wal.h>
 
 #define KTYPE pgno
@@ -47,8 +49,18 @@ enum
   PW_DIRTY = 1u << 1,  // Only used for readable
   PW_PRESENT = 1u << 2,
   PW_X = 1u << 3,
+  PW_HOT = 1u << 4,   // 2Q: graduated out of probation
+  PW_XWAIT = 1u << 5, // A reader is upgrading to X - hold off new readers
+  PW_PREFETCH = 1u << 6, // Brought in by read-ahead, not referenced yet
+  PW_META = 1u << 7,     // Held by the meta tier - leaf traffic can't evict it
+  PW_L2 = 1u << 8,       // Loaded from the second level cache
+  PW_UNLOGGED = 1u << 9, // Allocated by an unlogged transaction that hasn't committed - pgr_save doesn't log it
+  PW_IO = 1u << 10,      // Being read in or written out without pt->l - pinned by whoever does it, lookups wait
 };
 
+// Page types on every lookup path - root, variable catalog and r+tree inner nodes
+#define PG_META_TIER (PG_ROOT_NODE | PG_VAR_HASH_PAGE | PG_VAR_PAGE | PG_VAR_TAIL | PG_INNER_NODE)
+
 static inline bool
 pf_check (const struct page_frame *pf, int flag)
 {
@@ -67,6 +79,45 @@ pf_clr (struct page_frame *pf, int flag)
   pf->flags &= ~flag;
 }
 
+/**
+ * A slice of the buffer pool. Pages hash to exactly one partition,
+ * which owns the frames [start, start + nframes), the clock hand over
+ * them and the pgno -> frame table. Frame indexes stay global so
+ * table values index straight into pager->pages
+ */
+struct pgr_part
+{
+  i_mutex l;
+  i_cond wait;   // Frame state changes - see pgr_part_wait
+  u32 nwaiting; // Threads parked on wait
+  hash_table_idx pgno_to_value;
+  u32 start;
+  u32 nframes;
+  u32 clock; // Relative to start
+  u32 nhot;  // 2Q: frames with PW_HOT
+  u32 ndirty; // Frames with PW_DIRTY
+  u32 npinned; // Frames with pin > 0
+  u32 nmeta;   // Frames with PW_META
+  u32 maxmeta; // Meta tier budget
+  bool meta_waiting; // A meta page was turned away from the full tier this lap
+
+  // Lookups that found / didn't find the page resident
+  u64 hits;
+  u64 misses;
+
+  // Evictions / those that had to write the victim in the foreground
+  u64 evictions;
+  u64 dirty_evictions;
+
+  // Reservations made with all but an eighth of the partition pinned / that gave up with ERR_PAGER_FULL
+  u64 near_full;
+  u64 pager_full;
+
+  // Pages loaded by read-ahead / how many of those were used before eviction
+  u64 readahead;
+  u64 readahead_hits;
+};
+
 enum pgr_flag
 {
   PF_ISNEW = 1u << 0,
@@ -85,17 +136,44 @@ struct pager
 
   txid next_tid;
 
-  hash_table_idx pgno_to_value;
-  struct page_frame pages[MEMORY_PAGE_LEN];
-  hentry_idx _hdata[MEMORY_PAGE_LEN];
-  u32 clock;
+  /**
+   * Buffer pool - sized at open time. Frames and the
+   * pgno -> frame table live back to back in one arena
+   */
+  struct i_arena pool;
+  struct page_frame *pages;
+  struct pgr_part *parts;
+  hentry_idx *_hdata;
+  u32 nframes;
+  u32 nparts;
+  enum pgr_policy policy;
   bool wal_enabled;
 
   struct latch l;
 
+  // Background cleaner - at most one task queued on tp at a time
+  i_mutex cleaner_lock;
+  i_cond cleaner_idle;
+  bool cleaner_scheduled;
+  page *cleaner_buf; // CLEANER_BATCH pages
+
+  // Read-ahead - at most one task queued on tp, shares cleaner_lock
+  bool readahead_scheduled;
+  int readahead_flags;
+  u32 readahead_npgs;
+  pgno readahead_pgs[READ_AHEAD_PAGES];
+
+  // Clean pages evicted from the pool - only if l2_enabled
+  struct l2_cache l2;
+  bool l2_enabled;
+
+  // Before images of pages held in X (page_h.undo)
+  struct slab_alloc undo_alloc;
+
   // CACHE
   lsn master_lsn;
-  pgno first_tombstone;
+  lsn trunc_lsn; // Where the last checkpoint could have cut the log - the next one does
+  pgno fsm_hint; // No free page below this - guarded by LOCK_ROOT
 
   int flags;
 };
@@ -104,5 +182,224 @@ DEFINE_DBG_ASSERT (
     struct pager, pager, p,
     {
       ASSERT (p);
-      ASSERT (p->clock < MEMORY_PAGE_LEN);
+      ASSERT (p->pages);
+      ASSERT (p->parts);
+      ASSERT (p->nframes >= MEMORY_PAGE_LEN);
+      ASSERT (p->nparts > 0 && p->nparts <= p->nframes);
     })
+
+static inline struct pgr_part *
+pgr_part_of (struct pager *p, pgno pg)
+{
+  // Fibonacci hash - pgnos are dense so spread them before the modulo
+  u64 h = (pg * 0x9E3779B97F4A7C15ull) >> 32;
+  return &p->parts[h % p->nparts];
+}
+
+// Caller holds pt->l
+static inline void
+pgr_part_pin (struct pgr_part *pt, struct page_frame *mp)
+{
+  if (mp->pin++ == 0)
+    {
+      pt->npinned++;
+    }
+}
+
+static inline void
+pgr_part_unpin (struct pgr_part *pt, struct page_frame *mp)
+{
+  ASSERT (mp->pin > 0);
+  if (--mp->pin == 0)
+    {
+      ASSERT (pt->npinned > 0);
+      pt->npinned--;
+    }
+}
+
+/**
+ * Park on [pt] until some frame in it changes state (an S or X latch
+ * goes away, PW_IO finishes). Caller holds pt->l and re-checks whatever it was waiting
+ * for - one condition covers every frame in the partition
+ */
+static inline void
+pgr_part_wait (struct pgr_part *pt)
+{
+  pt->nwaiting++;
+  i_cond_wait (&pt->wait, &pt->l);
+  pt->nwaiting--;
+}
+
+// Caller holds pt->l
+static inline void
+pgr_part_wake (struct pgr_part *pt)
+{
+  if (pt->nwaiting > 0)
+    {
+      i_cond_broadcast (&pt->wait);
+    }
+}
+
+static inline struct page_frame *
+pgr_part_clock_frame (struct pager *p, struct pgr_part *pt)
+{
+  return &p->pages[pt->start + pt->clock];
+}
+
+static inline void
+pgr_part_tick (struct pgr_part *pt)
+{
+  pt->clock = (pt->clock + 1) % pt->nframes;
+}
+
+///////////////////////////////////////////////////////////
+////// REPLACEMENT POLICY
+//
+// The clock hand in pgr_reserve asks the policy whether each
+// unpinned resident frame survives the pass.
+//
+// PGR_POLICY_CLOCK - second chance on the access bit
+//
+// PGR_POLICY_2Q - CLOCK flavoured 2Q. Loaded pages start in probation
+// without their access bit, so a page touched once (e.g. a data_list
+// scan) is the first thing evicted. A page referenced again while in
+// probation graduates to the hot set, which is capped at 3/4 of the
+// partition so probation always has room. Hot pages lose their
+// status after a full lap without a reference and go back to probation.
+
+static inline u32
+pgr_2q_maxhot (const struct pgr_part *pt)
+{
+  return pt->nframes - pt->nframes / 4;
+}
+
+static inline void
+pgr_policy_on_load (struct pager *p, struct page_frame *mp)
+{
+  switch (p->policy)
+    {
+    case PGR_POLICY_CLOCK:
+      {
+        // Start page at access_bit = 1
+        pf_set (mp, PW_ACCESS);
+        break;
+      }
+    case PGR_POLICY_2Q:
+      {
+        // The load is the first reference - probation
+        pf_clr (mp, PW_ACCESS | PW_HOT);
+        break;
+      }
+    }
+}
+
+static inline void
+pgr_policy_on_hit (struct pager *p, struct page_frame *mp)
+{
+  (void)p;
+  pf_set (mp, PW_ACCESS);
+}
+
+static inline void
+pgr_policy_on_evict (struct pgr_part *pt, struct page_frame *mp)
+{
+  if (pf_check (mp, PW_HOT))
+    {
+      ASSERT (pt->nhot > 0);
+      pt->nhot--;
+    }
+  if (pf_check (mp, PW_META))
+    {
+      ASSERT (pt->nmeta > 0);
+      pt->nmeta--;
+    }
+}
+
+/**
+ * The meta tier. Root, catalog and inner node pages are touched by
+ * every lookup but are a sliver of the database, so up to pt->maxmeta
+ * of them sit out of the replacement policy's reach and a leaf scan
+ * can't push them out. A page joins when the clock hand reaches it -
+ * pgr_new hands out tombstones and deletes turn pages back into them,
+ * so the type at load time says nothing. If the tier is full and
+ * another meta page is turned away, members that weren't referenced
+ * since the last lap give up their place and go back to the policy.
+ *
+ * Returns true if [mp] is (still) in the tier and should be skipped
+ */
+static inline bool
+pgr_tier_spare (struct pgr_part *pt, struct page_frame *mp)
+{
+  bool meta = (page_get_type (&mp->page) & PG_META_TIER) != 0;
+
+  if (pf_check (mp, PW_META))
+    {
+      bool referenced = pf_check (mp, PW_ACCESS);
+      pf_clr (mp, PW_ACCESS);
+
+      if (meta && (referenced || !pt->meta_waiting))
+        {
+          return true;
+        }
+
+      pf_clr (mp, PW_META);
+      pt->nmeta--;
+      pt->meta_waiting = false;
+      return meta; // Demoted - the policy has it from the next lap
+    }
+
+  if (meta)
+    {
+      if (pt->nmeta < pt->maxmeta)
+        {
+          pf_set (mp, PW_META);
+          pt->nmeta++;
+          return true;
+        }
+      pt->meta_waiting = true;
+    }
+
+  return false;
+}
+
+/**
+ * Returns true if the unpinned frame [mp] under the clock hand
+ * should be skipped this pass, false to evict it
+ */
+static inline bool
+pgr_policy_spare (struct pager *p, struct pgr_part *pt, struct page_frame *mp)
+{
+  bool referenced = pf_check (mp, PW_ACCESS);
+  pf_clr (mp, PW_ACCESS);
+
+  switch (p->policy)
+    {
+    case PGR_POLICY_CLOCK:
+      {
+        return referenced;
+      }
+    case PGR_POLICY_2Q:
+      {
+        if (pf_check (mp, PW_HOT))
+          {
+            if (!referenced)
+              {
+                // Demote - it gets one more lap in probation
+                pf_clr (mp, PW_HOT);
+                pt->nhot--;
+              }
+            return true;
+          }
+
+        if (referenced && pt->nhot < pgr_2q_maxhot (pt))
+          {
+            pf_set (mp, PW_HOT);
+            pt->nhot++;
+          }
+
+        return referenced;
+      }
+    }
+
+  UNREACHABLE ();
+}
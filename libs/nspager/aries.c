@@ -143,11 +143,25 @@ pgr_rollback (struct pager *p, struct txn *tx, lsn save_lsn, error *e)
 
             // IF LogRec is undoable THEN DO
             {
+              // A vacuum may have cut the page off the end of the file since
+              if (pg >= fpgr_get_npages (&p->fp))
+                {
+                  err_t_wrap (fpgr_ensure (&p->fp, pg + 1, e), e);
+                }
+
               // Page := fix&latch(LogRec.PageID, 'X')
-              err_t_wrap (pgr_get_writable_no_tx (&ph, PG_ANY, pg, p, e), e);
+              err_t_wrap (pgr_get_unverified (&ph, pg, p, e), e);
+              err_t_wrap (pgr_make_writable_no_tx (p, &ph, e), e);
+              lsn page_lsn = page_get_page_lsn (page_h_ro (&ph));
 
               // Undo_Update(Page, LogRec)
-              i_memcpy (ph.pgw->page.raw, log_rec->update.undo, PAGE_SIZE);
+              wal_update_undo (page_h_w (&ph)->raw, &log_rec->update);
+
+              // An undone allocation frees its page again - maybe below where pgr_new looks
+              if (page_get_type (page_h_ro (&ph)) & (PG_ROOT_NODE | PG_FREE_LIST))
+                {
+                  p->fsm_hint = 0;
+                }
 
               // Log_Write
               clr_lsn = wal_append_clr_log (
@@ -158,6 +172,10 @@ pgr_rollback (struct pager *p, struct txn *tx, lsn save_lsn, error *e)
                       .pg = pg,                     // LogRec.PageID
                       .undo_next = prev_lsn,        // LogRec.PrevLSN
                       .redo = log_rec->update.undo, // Data
+                      .delta = log_rec->update.delta,
+                      .dlen = log_rec->update.dlen,
+                      .page_lsn = page_lsn,
+                      .image = page_h_ro (&ph)->raw,
                   },
                   e);
 
@@ -503,12 +521,33 @@ theend:
 
   ctx->redo_lsn = dpgt_min_rec_lsn (&ctx->dpt);
 
+  /**
+   * The master lsn is only advanced once every page that was dirty
+   * when the checkpoint began is on disk, so nothing before it needs redo
+   * even if the checkpoint's DPT still lists older rec lsns
+   */
+  if (ctx->redo_lsn > 0 && ctx->master_lsn > 0)
+    {
+      ctx->redo_lsn = MAX (ctx->redo_lsn, ctx->master_lsn);
+    }
+
   return e->cause_code;
 }
 
 //////////////////////////////////////////////////////////////////////////////////
 /////////////////////// REDO (FIGURE 11)
 
+/**
+ * A page the crash tore has a garbage page lsn, so whole page images
+ * go over anything that fails its checksum. Every page gets one as its
+ * first record after a checkpoint begins (see walf_write_update)
+ */
+static inline bool
+aries_page_torn (const page *pg)
+{
+  return page_verify_checksum (pg, NULL) != SUCCESS;
+}
+
 err_t
 pgr_restart_redo (struct pager *p, struct aries_ctx *ctx, error *e)
 {
@@ -541,6 +580,9 @@ pgr_restart_redo (struct pager *p, struct aries_ctx *ctx, error *e)
 
             if (in_dpgt && ctx->redo_lsn >= rec_lsn)
               {
+                // The crash may have cut the file short of this page
+                err_t_wrap (fpgr_ensure (&p->fp, log_rec->update.pg + 1, e), e);
+
                 // fix&latch(LogRec.PageID, 'X')
                 page_h ph = page_h_create ();
                 err_t_wrap (pgr_get_unverified (&ph, log_rec->update.pg, p, e), e);
@@ -548,10 +590,10 @@ pgr_restart_redo (struct pager *p, struct aries_ctx *ctx, error *e)
 
                 // IF Page.LSN < LogRec.LSN
                 lsn page_lsn = page_get_page_lsn (page_h_ro (&ph));
-                if (page_lsn < ctx->redo_lsn)
+                if (page_lsn < ctx->redo_lsn || (!log_rec->update.delta && aries_page_torn (page_h_ro (&ph))))
                   {
                     // Redo_Update(Page, LogRec)
-                    i_memcpy (page_h_w (&ph)->raw, log_rec->update.redo, PAGE_SIZE);
+                    wal_update_redo (page_h_w (&ph)->raw, &log_rec->update);
                     page_set_page_lsn (page_h_w (&ph), ctx->redo_lsn);
                   }
                 else
@@ -571,6 +613,9 @@ pgr_restart_redo (struct pager *p, struct aries_ctx *ctx, error *e)
 
             if (in_dpgt && ctx->redo_lsn >= rec_lsn)
               {
+                // The crash may have cut the file short of this page
+                err_t_wrap (fpgr_ensure (&p->fp, log_rec->clr.pg + 1, e), e);
+
                 // fix&latch(LogRec.PageID, 'X')
                 page_h ph = page_h_create ();
                 err_t_wrap (pgr_get_unverified (&ph, log_rec->clr.pg, p, e), e);
@@ -578,10 +623,10 @@ pgr_restart_redo (struct pager *p, struct aries_ctx *ctx, error *e)
 
                 // IF Page.LSN < LogRec.LSN
                 lsn page_lsn = page_get_page_lsn (page_h_ro (&ph));
-                if (page_lsn < ctx->redo_lsn)
+                if (page_lsn < ctx->redo_lsn || (!log_rec->clr.delta && aries_page_torn (page_h_ro (&ph))))
                   {
                     // Redo_Update(Page, LogRec)
-                    i_memcpy (page_h_w (&ph)->raw, log_rec->clr.redo, PAGE_SIZE);
+                    wal_clr_redo (page_h_w (&ph)->raw, &log_rec->clr);
                     page_set_page_lsn (page_h_w (&ph), ctx->redo_lsn);
                   }
                 else
@@ -590,7 +635,7 @@ pgr_restart_redo (struct pager *p, struct aries_ctx *ctx, error *e)
                   }
 
                 // unfix&unlatch(page)
-                pgr_release_no_tx (p, &ph, PG_ANY, NULL);
+                err_t_wrap (pgr_release_no_tx (p, &ph, PG_ANY, e), e);
               }
             break;
           }
@@ -663,9 +708,16 @@ pgr_restart_undo (struct pager *p, struct aries_ctx *ctx, error *e)
               page_h ph = page_h_create ();
               err_t_wrap (pgr_get_unverified (&ph, log_rec->update.pg, p, e), e);
               err_t_wrap (pgr_make_writable_no_tx (p, &ph, e), e);
+              lsn page_lsn = page_get_page_lsn (page_h_ro (&ph));
 
               // Undo_Update(Page, LogRec)
-              i_memcpy (page_h_w (&ph)->raw, log_rec->update.undo, PAGE_SIZE);
+              wal_update_undo (page_h_w (&ph)->raw, &log_rec->update);
+
+              // An undone allocation frees its page again - maybe below where pgr_new looks
+              if (page_get_type (page_h_ro (&ph)) & (PG_ROOT_NODE | PG_FREE_LIST))
+                {
+                  p->fsm_hint = 0;
+                }
 
               txnt_get_expect (&tx, &ctx->txt, tid);
 
@@ -677,6 +729,10 @@ pgr_restart_undo (struct pager *p, struct aries_ctx *ctx, error *e)
                       .pg = log_rec->update.pg,
                       .undo_next = log_rec->update.prev,
                       .redo = log_rec->update.undo,
+                      .delta = log_rec->update.delta,
+                      .dlen = log_rec->update.dlen,
+                      .page_lsn = page_lsn,
+                      .image = page_h_ro (&ph)->raw,
                   },
                   e);
               err_t_wrap (l, e);
@@ -687,7 +743,7 @@ pgr_restart_undo (struct pager *p, struct aries_ctx *ctx, error *e)
               txn_update_last (tx, l);
 
               // unfix&unlatch(page)
-              pgr_release_no_tx (p, &ph, PG_ANY, NULL);
+              err_t_wrap (pgr_release_no_tx (p, &ph, PG_ANY, e), e);
             } // END;
 
             // Trans_Table[LogRec.TransID].UndoNxtLSN :+ LogRec.PrevLSN
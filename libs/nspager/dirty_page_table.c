@@ -203,12 +203,18 @@ dpge_max (pgno pg, lsn rec_lsn, void *ctx)
 lsn
 dpgt_min_rec_lsn (struct dpg_table *d)
 {
-  lsn min;
+  lsn min = U64_MAX;
 
   latch_lock (&d->l);
   dpgt_foreach (d, dpge_max, &min);
   latch_unlock (&d->l);
 
+  // Empty table - nothing to redo
+  if (min == U64_MAX)
+    {
+      return 0;
+    }
+
   return min;
 }
 
@@ -425,7 +431,7 @@ hnode_foreach_serialize (struct hnode *node, void *ctx)
   latch_lock (&entry->l);
 
   pg = entry->pg;
-  rec_lsn = entry->pg;
+  rec_lsn = entry->rec_lsn;
 
   latch_unlock (&entry->l);
 
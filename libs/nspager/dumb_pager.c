@@ -4,6 +4,7 @@
 #include <numstore/intf/os.h>
 #include <numstore/intf/types.h>
 #include <numstore/pager.h>
+#include <numstore/pager/free_list.h>
 #include <numstore/pager/page.h>
 #include <numstore/pager/page_h.h>
 #include <numstore/pager/root_node.h>
@@ -25,8 +26,7 @@ alloc_page_frame (error *e)
     {
       pf->pin = 0;
       pf->flags = 0;
-      pf->wsibling = -1;
-      latch_init (&pf->latch);
+      pf->nreaders = 0;
     }
   return pf;
 }
@@ -70,8 +70,8 @@ pgr_open (
       page root;
       page_init_empty (&root, PG_ROOT_NODE);
       root.pg = 0;
-      rn_set_first_tmbst (&root, 1);
       rn_set_master_lsn (&root, 0);
+      page_update_checksum (&root);
 
       pgno pg;
       if (fpgr_new (&p->fp, &pg, e) || fpgr_write (&p->fp, root.raw, pg, e))
@@ -85,6 +85,19 @@ pgr_open (
   return p;
 }
 
+struct pager *
+pgr_open_with (
+    const char *fname,
+    const char *walname,
+    struct lockt *t,
+    struct thread_pool *tp,
+    struct pgr_params params,
+    error *e)
+{
+  (void)params; // No buffer pool in dumb pager
+  return pgr_open (fname, walname, t, tp, e);
+}
+
 err_t
 pgr_close (struct pager *p, error *e)
 {
@@ -105,6 +118,13 @@ pgr_get_npages (const struct pager *p)
   return fpgr_get_npages (&p->fp);
 }
 
+u32
+pgr_get_nframes (const struct pager *p)
+{
+  (void)p;
+  return 0;
+}
+
 void
 i_log_page_table (int log_level, struct pager *p)
 {
@@ -113,6 +133,26 @@ i_log_page_table (int log_level, struct pager *p)
   // No page table in dumb pager
 }
 
+void
+pgr_get_stats (struct pager *p, struct pgr_stats *dest)
+{
+  // No buffer pool or WAL - every get is a read
+  struct fpgr_stats fs;
+  fpgr_get_stats (&p->fp, &fs);
+
+  *dest = (struct pgr_stats){
+    .misses = fs.reads,
+    .page_reads = fs.reads,
+    .page_writes = fs.writes,
+    .read_ns = fs.read_ns,
+    .write_ns = fs.write_ns,
+    .file_syncs = fs.syncs,
+    .file_sync_ns = fs.sync_ns,
+    .compressed_writes = fs.cmp_writes,
+    .compressed_bytes = fs.cmp_bytes,
+  };
+}
+
 ///////////////////////////////////////////////////
 //////// Transaction control
 
@@ -125,6 +165,12 @@ pgr_begin_txn (struct txn *tx, struct pager *p, error *e)
   return SUCCESS; // No-op
 }
 
+err_t
+pgr_begin_unlogged_txn (struct txn *tx, struct pager *p, error *e)
+{
+  return pgr_begin_txn (tx, p, e); // Nothing is logged anyway
+}
+
 err_t
 pgr_commit (struct pager *p, struct txn *tx, error *e)
 {
@@ -172,6 +218,13 @@ pgr_get (page_h *dest, int flags, pgno pg, struct pager *p, error *e)
   pgr->page.pg = pg;
   pgr->pin = 1;
 
+  ret = page_verify_checksum (&pgr->page, e);
+  if (ret)
+    {
+      i_free (pgr);
+      return ret;
+    }
+
   // Validate if requested
   if (flags != PG_ANY)
     {
@@ -184,7 +237,7 @@ pgr_get (page_h *dest, int flags, pgno pg, struct pager *p, error *e)
     }
 
   dest->pgr = pgr;
-  dest->pgw = NULL;
+  dest->undo = NULL;
   dest->mode = PHM_S;
   dest->tx = NULL;
 
@@ -193,94 +246,130 @@ pgr_get (page_h *dest, int flags, pgno pg, struct pager *p, error *e)
 
 err_t
 pgr_new (page_h *dest, struct pager *p, struct txn *tx, enum page_type ptype, error *e)
+{
+  return pgr_new_near (dest, p, tx, ptype, PGNO_NULL, e);
+}
+
+// Flips [pg]'s bit in the free space map - root changes are left to the caller
+static err_t
+dumb_fsm_mark (struct pager *p, struct txn *tx, page_h *root, pgno pg, bool free, error *e)
+{
+  if (frlst_map_pgno (pg) == ROOT_PGNO)
+    {
+      frlst_set_free (page_h_w (root), pg, free);
+      return SUCCESS;
+    }
+
+  page_h map = page_h_create ();
+  err_t_wrap (pgr_get_writable (&map, tx, PG_FREE_LIST, frlst_map_pgno (pg), p, e), e);
+  frlst_set_free (page_h_w (&map), pg, free);
+  return pgr_release (p, &map, PG_FREE_LIST, e);
+}
+
+err_t
+pgr_new_near (page_h *dest, struct pager *p, struct txn *tx, enum page_type ptype, pgno near, error *e)
 {
   ASSERT (dest->mode == PHM_NONE);
 
-  // Read root to get first tombstone
+  // No locality here - always the lowest free page
+  (void)near;
+
   page_h root = page_h_create ();
-  err_t ret = pgr_get (&root, PG_ROOT_NODE, 0, p, e);
+  err_t ret = pgr_get_writable (&root, tx, PG_ROOT_NODE, 0, p, e);
   if (ret)
     return ret;
 
-  pgno new_pg = rn_get_first_tmbst (page_h_ro (&root));
-  pgno next_tombstone;
+  pgno end = rn_get_next_pg (page_h_ro (&root));
+  pgno new_pg = PGNO_NULL;
 
-  if (new_pg < fpgr_get_npages (&p->fp))
+  // Walk every span's map
+  for (pgno span = 0; span < end && new_pg == PGNO_NULL; span += FL_SPAN)
     {
-      // Reuse tombstone page - read it first to get next pointer
-      page_h tombstone = page_h_create ();
-      ret = pgr_get (&tombstone, PG_TOMBSTONE, new_pg, p, e);
-      if (ret)
+      page_h map = page_h_create ();
+      const page *bits = page_h_ro (&root);
+
+      if (span != ROOT_PGNO)
         {
-          pgr_release (p, &root, PG_ROOT_NODE, NULL);
-          return ret;
+          ret = pgr_get (&map, PG_FREE_LIST, span, p, e);
+          if (ret)
+            {
+              pgr_release (p, &root, PG_ROOT_NODE, NULL);
+              return ret;
+            }
+          bits = page_h_ro (&map);
         }
 
-      next_tombstone = tmbst_get_next (page_h_ro (&tombstone));
-
-      // Convert to writable for reuse
-      ret = pgr_make_writable (p, tx, &tombstone, e);
-      if (ret)
+      pgno hi = MIN (end - span, FL_SPAN);
+      pgno i = frlst_find_free (bits, 0, hi);
+      if (i < hi)
         {
-          pgr_release (p, &tombstone, PG_TOMBSTONE, NULL);
-          pgr_release (p, &root, PG_ROOT_NODE, NULL);
-          return ret;
+          new_pg = span + i;
         }
 
-      // Initialize as new page type
-      page_init_empty (page_h_w (&tombstone), ptype);
+      if (span != ROOT_PGNO)
+        {
+          pgr_release (p, &map, PG_FREE_LIST, NULL);
+        }
+    }
 
-      // Transfer ownership to dest
-      *dest = tombstone;
+  if (new_pg != PGNO_NULL)
+    {
+      ret = dumb_fsm_mark (p, tx, &root, new_pg, false, e);
     }
   else
     {
-      // Extend file
-      ret = fpgr_new (&p->fp, &new_pg, e);
-      if (ret)
-        {
-          pgr_release (p, &root, PG_ROOT_NODE, NULL);
-          return ret;
-        }
-
-      next_tombstone = fpgr_get_npages (&p->fp);
-
-      // Allocate new page frames
-      struct page_frame *pgr = alloc_page_frame (e);
-      struct page_frame *pgw = alloc_page_frame (e);
-      if (!pgr || !pgw)
+      // Take the next page off the end - the first one of a span holds its map
+      new_pg = end;
+      if (new_pg == frlst_map_pgno (new_pg))
         {
-          if (pgr)
-            i_free (pgr);
-          if (pgw)
-            i_free (pgw);
-          pgr_release (p, &root, PG_ROOT_NODE, NULL);
-          return e->cause_code;
+          page map;
+          page_init_empty (&map, PG_FREE_LIST);
+          map.pg = new_pg;
+          page_update_checksum (&map);
+          ret = fpgr_ensure (&p->fp, new_pg + 1, e);
+          if (ret == SUCCESS)
+            {
+              ret = fpgr_write (&p->fp, map.raw, new_pg, e);
+            }
+          new_pg++;
         }
-
-      page_init_empty (&pgw->page, ptype);
-      pgw->page.pg = new_pg;
-      pgr->page.pg = new_pg;
-      pgr->pin = 1;
-      pgw->pin = 1;
-      pgr->wsibling = 0; // Dummy value, pgw is not in an array
-
-      dest->pgr = pgr;
-      dest->pgw = pgw;
-      dest->mode = PHM_X;
-      dest->tx = tx;
+      rn_set_next_pg (page_h_w (&root), new_pg + 1);
     }
 
-  // Update root's tombstone pointer
-  ret = pgr_make_writable (p, tx, &root, e);
+  if (ret == SUCCESS)
+    {
+      ret = fpgr_ensure (&p->fp, new_pg + 1, e);
+    }
   if (ret)
     {
-      pgr_release (p, dest, ptype, NULL);
       pgr_release (p, &root, PG_ROOT_NODE, NULL);
       return ret;
     }
 
-  rn_set_first_tmbst (page_h_w (&root), next_tombstone);
+  // Allocate the new page frame and its before image - nothing to read
+  struct page_frame *pgr = alloc_page_frame (e);
+  page *undo = i_calloc (1, sizeof (page), e);
+  if (!pgr || !undo)
+    {
+      if (pgr)
+        i_free (pgr);
+      if (undo)
+        i_free (undo);
+      pgr_release (p, &root, PG_ROOT_NODE, NULL);
+      return e->cause_code;
+    }
+
+  page_init_empty (undo, PG_TOMBSTONE);
+  undo->pg = new_pg;
+  page_init_empty (&pgr->page, ptype);
+  pgr->page.pg = new_pg;
+  pgr->pin = 1;
+
+  dest->pgr = pgr;
+  dest->undo = undo;
+  dest->mode = PHM_X;
+  dest->tx = tx;
+
   ret = pgr_save (p, &root, PG_ROOT_NODE, e);
   if (ret)
     {
@@ -300,24 +389,30 @@ pgr_get_unverified (page_h *dest, pgno pg, struct pager *p, error *e)
   return pgr_get (dest, PG_ANY, pg, p, e);
 }
 
+void
+pgr_prefetch (struct pager *p, int flags, const pgno *pgs, u32 npgs)
+{
+  // Every get hits the file anyway
+  (void)p;
+  (void)flags;
+  (void)pgs;
+  (void)npgs;
+}
+
 err_t
 pgr_make_writable (struct pager *p, struct txn *tx, page_h *h, error *e)
 {
   (void)p;
   ASSERT (h->mode == PHM_S);
 
-  // Allocate write buffer
-  struct page_frame *pgw = alloc_page_frame (e);
-  if (!pgw)
+  // Keep the before image, writes go straight into pgr
+  page *undo = i_malloc (1, sizeof (page), e);
+  if (!undo)
     return e->cause_code;
 
-  // Copy read page to write page
-  i_memcpy (pgw->page.raw, h->pgr->page.raw, PAGE_SIZE);
-  pgw->page.pg = h->pgr->page.pg;
-  pgw->pin = 1;
+  i_memcpy (undo, &h->pgr->page, sizeof (page));
 
-  h->pgw = pgw;
-  h->pgr->wsibling = 0; // Dummy value
+  h->undo = undo;
   h->mode = PHM_X;
   h->tx = tx;
 
@@ -374,15 +469,12 @@ pgr_save (struct pager *p, page_h *h, int flags, error *e)
 
   // Write directly to file
   pgno pg = page_h_pgno (h);
+  page_update_checksum (page_h_w (h));
   err_t_wrap (fpgr_write (&p->fp, page_h_w (h)->raw, pg, e), e);
 
-  // Copy to read buffer and downgrade to read mode
-  i_memcpy (h->pgr->page.raw, h->pgw->page.raw, PAGE_SIZE);
-
-  // Free write buffer
-  i_free (h->pgw);
-  h->pgw = NULL;
-  h->pgr->wsibling = -1;
+  // Drop the before image and downgrade to read mode
+  i_free (h->undo);
+  h->undo = NULL;
   h->mode = PHM_S;
 
   return SUCCESS;
@@ -409,9 +501,7 @@ pgr_delete_and_release (struct pager *p, struct txn *tx, page_h *h, error *e)
     }
 
   // Convert page to tombstone
-  pgno old_first = rn_get_first_tmbst (page_h_ro (&root));
   page_init_empty (page_h_w (h), PG_TOMBSTONE);
-  tmbst_set_next (page_h_w (h), old_first);
 
   // Save tombstone page
   ret = pgr_save (p, h, PG_TOMBSTONE, e);
@@ -422,9 +512,12 @@ pgr_delete_and_release (struct pager *p, struct txn *tx, page_h *h, error *e)
       return ret;
     }
 
-  // Update root
-  rn_set_first_tmbst (page_h_w (&root), page_h_pgno (h));
-  ret = pgr_save (p, &root, PG_ROOT_NODE, e);
+  // Mark it free
+  ret = dumb_fsm_mark (p, tx, &root, page_h_pgno (h), true, e);
+  if (ret == SUCCESS)
+    {
+      ret = pgr_save (p, &root, PG_ROOT_NODE, e);
+    }
   if (ret)
     {
       pgr_release (p, &root, PG_ROOT_NODE, NULL);
@@ -439,6 +532,25 @@ pgr_delete_and_release (struct pager *p, struct txn *tx, page_h *h, error *e)
   return SUCCESS;
 }
 
+err_t
+pgr_relocate (page_h *dest, struct pager *p, struct txn *tx, page_h *h, error *e)
+{
+  (void)dest;
+  (void)p;
+  (void)tx;
+  (void)h;
+  (void)e;
+  return SUCCESS; // No free space map to move into - leave it where it is
+}
+
+err_t
+pgr_shrink (struct pager *p, error *e)
+{
+  (void)p;
+  (void)e;
+  return SUCCESS; // Never shrinks
+}
+
 err_t
 pgr_release_if_exists (struct pager *p, page_h *h, int flags, error *e)
 {
@@ -460,25 +572,25 @@ pgr_release (struct pager *p, page_h *h, int flags, error *e)
           // Free both buffers on error
           if (h->pgr)
             i_free (h->pgr);
-          if (h->pgw)
-            i_free (h->pgw);
+          if (h->undo)
+            i_free (h->undo);
           h->mode = PHM_NONE;
           h->pgr = NULL;
-          h->pgw = NULL;
+          h->undo = NULL;
           h->tx = NULL;
           return ret;
         }
     }
 
-  // Free read buffer (write buffer already freed in save)
+  // Free read buffer (before image already freed in save)
   if (h->pgr)
     i_free (h->pgr);
-  if (h->pgw)
-    i_free (h->pgw); // Should be NULL if save succeeded
+  if (h->undo)
+    i_free (h->undo); // Should be NULL if save succeeded
 
   h->mode = PHM_NONE;
   h->pgr = NULL;
-  h->pgw = NULL;
+  h->undo = NULL;
   h->tx = NULL;
 
   return SUCCESS;
@@ -20,8 +20,11 @@
 #include <file_pager.h>
 
 #include <numstore/core/assert.h>
+#include <numstore/core/compress.h>
 #include <numstore/core/error.h>
+#include <numstore/core/random.h>
 #include <numstore/intf/logging.h>
+#include <numstore/pager/page.h>
 #include <numstore/intf/os.h>
 #include <numstore/test/testing.h>
 
@@ -31,8 +34,311 @@ DEFINE_DBG_ASSERT (
     struct file_pager, file_pager, p,
     {
       ASSERT (p);
+      ASSERT (p->npages <= p->nalloc);
     })
 
+static inline void
+fpgr_stat_add (struct file_pager *p, u64 *count, u64 *ns, u64 n, u64 start)
+{
+  __atomic_fetch_add (count, n, __ATOMIC_RELAXED);
+  __atomic_fetch_add (ns, i_timer_now_ns (&p->timer) - start, __ATOMIC_RELAXED);
+}
+
+_Static_assert (FPOOL_SEGMENT_SIZE % PAGE_SIZE == 0, "A segment file should hold a whole number of pages");
+
+static inline pgno
+fpgr_nsegments (pgno npages)
+{
+  return (npages + FPGR_SEGMENT_PAGES - 1) / FPGR_SEGMENT_PAGES;
+}
+
+////////////////////////////////////////////////////////////
+/// Compressed slots
+///
+/// A compressed data_list page sits at the front of its slot:
+///   [u32 FPGR_CMP_MAGIC][pgh 0][pad][u32 payload length][payload]
+/// zero padded to a FPGR_CMP_BLOCK boundary, and the rest of the slot
+/// is punched out of the file. A page in use never has type 0 and an
+/// unwritten one is all zeros, so neither reads as a compressed slot.
+/// Reads fetch the first block and then only as much of the rest as
+/// it says is there - a cold scan only reads the blocks the payloads
+/// are in
+
+#define FPGR_CMP_MAGIC 0x5A504D43u
+#define FPGR_CMP_LEN_OFST 8
+#define FPGR_CMP_HDR 12
+
+// Largest payload that still frees at least one block
+#define FPGR_CMP_CAP (PAGE_SIZE > FPGR_CMP_BLOCK ? (PAGE_SIZE / FPGR_CMP_BLOCK - 1) * FPGR_CMP_BLOCK - FPGR_CMP_HDR : 0)
+
+_Static_assert (PAGE_SIZE % FPGR_CMP_BLOCK == 0 || PAGE_SIZE < FPGR_CMP_BLOCK, "Pages should be whole file system blocks");
+
+/**
+ * Writes the slot image of [src] into [slot]. Returns the bytes to
+ * write, or 0 if the page goes out as is
+ */
+static u32
+fpgr_compress_slot (const struct file_pager *p, u8 *slot, const u8 *src)
+{
+  if (!p->compress || FPGR_CMP_CAP == 0 || src[PG_HEDR_OFST] != PG_DATA_LIST)
+    {
+      return 0;
+    }
+
+  u32 clen = compress_execute (slot + FPGR_CMP_HDR, FPGR_CMP_CAP, src, PAGE_SIZE);
+  if (clen == 0)
+    {
+      return 0;
+    }
+
+  u32 magic = FPGR_CMP_MAGIC;
+  i_memset (slot, 0, FPGR_CMP_HDR);
+  i_memcpy (slot, &magic, sizeof (magic));
+  i_memcpy (slot + FPGR_CMP_LEN_OFST, &clen, sizeof (clen));
+
+  u32 len = FPGR_CMP_HDR + clen;
+  u32 padded = (len + FPGR_CMP_BLOCK - 1) / FPGR_CMP_BLOCK * FPGR_CMP_BLOCK;
+  i_memset (slot + len, 0, padded - len);
+
+  return padded;
+}
+
+/**
+ * How much of a slot holds the page, going by its first block - the
+ * padded payload if it's compressed, else the whole slot
+ */
+static u32
+fpgr_slot_len (const u8 *raw)
+{
+  u32 magic;
+  i_memcpy (&magic, raw, sizeof (magic));
+  if (magic != FPGR_CMP_MAGIC || raw[PG_HEDR_OFST] != 0)
+    {
+      return PAGE_SIZE;
+    }
+
+  u32 clen;
+  i_memcpy (&clen, raw + FPGR_CMP_LEN_OFST, sizeof (clen));
+  if (clen > PAGE_SIZE - FPGR_CMP_HDR)
+    {
+      return PAGE_SIZE;
+    }
+
+  u32 len = FPGR_CMP_HDR + clen;
+  return (len + FPGR_CMP_BLOCK - 1) / FPGR_CMP_BLOCK * FPGR_CMP_BLOCK;
+}
+
+/**
+ * Turns the first [len] bytes of a slot read from disk back into its
+ * page. One that doesn't decode (a torn write) is left as it is, with
+ * the unread tail zeroed like the hole it was - it fails its checksum
+ * like any other torn page, and recovery overwrites it
+ */
+static void
+fpgr_decompress_slot (u8 *raw, u32 len, pgno pg)
+{
+  u32 magic;
+  i_memcpy (&magic, raw, sizeof (magic));
+  if (magic != FPGR_CMP_MAGIC || raw[PG_HEDR_OFST] != 0)
+    {
+      return;
+    }
+
+  u32 clen;
+  i_memcpy (&clen, raw + FPGR_CMP_LEN_OFST, sizeof (clen));
+
+  u8 out[PAGE_SIZE];
+  if (clen > len - FPGR_CMP_HDR || decompress_execute (out, PAGE_SIZE, raw + FPGR_CMP_HDR, clen, NULL))
+    {
+      i_log_warn ("File pager: compressed page %" PRpgno " doesn't decode\n", pg);
+      i_memset (raw + len, 0, PAGE_SIZE - len);
+      return;
+    }
+
+  i_memcpy (raw, out, PAGE_SIZE);
+}
+
+/**
+ * Bytes a read fetches before it knows how long the slot is. With
+ * compression on that's one block - a compressed page is often all in
+ * it, and any other page costs a second read for the rest of the slot
+ */
+static inline u32
+fpgr_read_head (const struct file_pager *p)
+{
+  return p->compress ? FPGR_CMP_BLOCK : PAGE_SIZE;
+}
+
+////////////////////////////////////////////////////////////
+/// Raw I/O
+
+// [n] bytes of page [pg]'s slot from [from] on
+static err_t
+fpgr_pread (struct file_pager *p, u8 *dest, u32 n, pgno pg, u32 from, error *e)
+{
+  if (p->pool)
+    {
+      return fpool_pread (p->pool, dest, n, page_to_addr (pg) + from, e);
+    }
+
+  i64 nread = i_pread_all (&p->f, dest, n, pg * PAGE_SIZE + from, e);
+  if (nread < 0)
+    {
+      return e->cause_code;
+    }
+  if (nread == 0)
+    {
+      return error_causef (e, ERR_CORRUPT, "File pager: empty read");
+    }
+
+  return SUCCESS;
+}
+
+// The first [n] bytes of page [pg]'s slot
+static err_t
+fpgr_pwrite (struct file_pager *p, const u8 *src, u32 n, pgno pg, error *e)
+{
+  if (p->pool)
+    {
+      return fpool_pwrite (p->pool, src, n, page_to_addr (pg), e);
+    }
+
+  return i_pwrite_all (&p->f, src, n, pg * PAGE_SIZE, e);
+}
+
+// Gives page [pg]'s slot past [from] back to the file system
+static err_t
+fpgr_punch (struct file_pager *p, pgno pg, u32 from, error *e)
+{
+  if (p->pool == NULL)
+    {
+      return i_punch_hole (&p->f, pg * PAGE_SIZE + from, PAGE_SIZE - from, e);
+    }
+
+  struct ifframe *fr = fpool_getf (p->pool, page_to_addr (pg), e);
+  if (fr == NULL)
+    {
+      return e->cause_code;
+    }
+  err_t ret = i_punch_hole (&fr->fp, (pg % FPGR_SEGMENT_PAGES) * PAGE_SIZE + from, PAGE_SIZE - from, e);
+  fpool_putf (p->pool, fr, true);
+
+  return ret;
+}
+
+static err_t
+fpgr_read_page (struct file_pager *p, u8 *dest, pgno pg, error *e)
+{
+  u32 head = fpgr_read_head (p);
+  err_t_wrap (fpgr_pread (p, dest, head, pg, 0, e), e);
+
+  u32 len = MAX (fpgr_slot_len (dest), head);
+  if (len > head)
+    {
+      err_t_wrap (fpgr_pread (p, dest + head, len - head, pg, head, e), e);
+    }
+  __atomic_fetch_add (&p->stats.read_bytes, len, __ATOMIC_RELAXED);
+
+  fpgr_decompress_slot (dest, len, pg);
+  return SUCCESS;
+}
+
+static err_t
+fpgr_write_page (struct file_pager *p, const u8 *src, pgno pg, error *e)
+{
+  u8 slot[PAGE_SIZE];
+  u32 len = fpgr_compress_slot (p, slot, src);
+
+  if (len == 0)
+    {
+      return fpgr_pwrite (p, src, PAGE_SIZE, pg, e);
+    }
+
+  err_t_wrap (fpgr_pwrite (p, slot, len, pg, e), e);
+  err_t_wrap (fpgr_punch (p, pg, len, e), e);
+
+  __atomic_fetch_add (&p->stats.cmp_writes, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&p->stats.cmp_bytes, len, __ATOMIC_RELAXED);
+
+  return SUCCESS;
+}
+
+/**
+ * Sets the size on disk to [nalloc] pages. Growing preallocates where
+ * the file system can. Segments wholly past the end are deleted
+ */
+static err_t
+fpgr_resize (struct file_pager *p, pgno nalloc, error *e)
+{
+  if (p->pool == NULL)
+    {
+      if (nalloc > p->nalloc && i_fallocate (&p->f, nalloc * PAGE_SIZE, e))
+        {
+          // Not every file system can preallocate - a sparse extent still saves the syscalls
+          e->cause_code = SUCCESS;
+          return i_truncate (&p->f, nalloc * PAGE_SIZE, e);
+        }
+      if (nalloc < p->nalloc)
+        {
+          return i_truncate (&p->f, nalloc * PAGE_SIZE, e);
+        }
+      return SUCCESS;
+    }
+
+  pgno before = fpgr_nsegments (p->nalloc);
+  pgno after = fpgr_nsegments (nalloc);
+
+  for (pgno s = before; s > after; --s)
+    {
+      err_t_wrap (fpool_remove (p->pool, page_to_addr ((s - 1) * FPGR_SEGMENT_PAGES), e), e);
+    }
+
+  // Only the old last segment and new ones change size
+  for (pgno s = MIN (before, after) > 0 ? MIN (before, after) - 1 : 0; s < after; ++s)
+    {
+      pgno len = MIN (nalloc - s * FPGR_SEGMENT_PAGES, (pgno)FPGR_SEGMENT_PAGES);
+      err_t_wrap (fpool_resize (p->pool, page_to_addr (s * FPGR_SEGMENT_PAGES), len * PAGE_SIZE, e), e);
+    }
+
+  return SUCCESS;
+}
+
+/**
+ * Segments are numbered from 0 with no gaps. Every one but the last
+ * is full - growth fills a segment before it starts the next
+ */
+static err_t
+fpgr_set_len_segmented (struct file_pager *p, error *e)
+{
+  p->nalloc = 0;
+
+  for (pgno s = 0;; ++s)
+    {
+      bool exists;
+      u64 size;
+      err_t_wrap (fpool_stat (p->pool, page_to_addr (s * FPGR_SEGMENT_PAGES), &exists, &size, e), e);
+
+      if (!exists)
+        {
+          break;
+        }
+
+      if (size % PAGE_SIZE != 0 || p->nalloc % FPGR_SEGMENT_PAGES != 0)
+        {
+          return error_causef (
+              e, ERR_CORRUPT,
+              "Database segment %" PRpgno " has %" PRIu64 " bytes - every segment "
+              "but the last should be full and all a multiple of PAGE_SIZE: %" PRp_size,
+              s, size, PAGE_SIZE);
+        }
+
+      p->nalloc += size / PAGE_SIZE;
+    }
+
+  p->npages = p->nalloc;
+  return SUCCESS;
+}
+
 static inline err_t
 fpgr_set_len (struct file_pager *p, error *e)
 {
@@ -53,13 +359,109 @@ fpgr_set_len (struct file_pager *p, error *e)
           PAGE_SIZE, size);
     }
 
-  p->npages = size / PAGE_SIZE;
+  p->nalloc = size / PAGE_SIZE;
+  p->npages = p->nalloc;
+  return SUCCESS;
+}
+
+static bool
+fpgr_is_zero (const u8 *raw)
+{
+  for (u32 i = 0; i < PAGE_SIZE; ++i)
+    {
+      if (raw[i])
+        {
+          return false;
+        }
+    }
+  return true;
+}
+
+/**
+ * A clean close trims the file to its logical size, but after a crash
+ * the preallocated tail is still there. Nothing is ever written there,
+ * so walk back over the trailing zero pages. A page that was handed out
+ * but never written before the crash goes too - if it matters, redo
+ * brings it back through fpgr_ensure. The root page always stays so a
+ * crashed database is never mistaken for a new one
+ */
+static err_t
+fpgr_find_logical_end (struct file_pager *p, error *e)
+{
+  u8 raw[PAGE_SIZE];
+
+  while (p->npages > 1)
+    {
+      err_t_wrap (fpgr_read_page (p, raw, p->npages - 1, e), e);
+      if (!fpgr_is_zero (raw))
+        {
+          break;
+        }
+      p->npages--;
+    }
+
+  if (p->npages < p->nalloc)
+    {
+      i_log_info ("File pager: %" PRpgno " preallocated pages past the last page in use\n", p->nalloc - p->npages);
+    }
+
+  return SUCCESS;
+}
+
+static void
+fpgr_close_files (struct file_pager *p, error *e)
+{
+  if (p->pool)
+    {
+      fpool_close (p->pool, e);
+      i_free (p->pool);
+      p->pool = NULL;
+    }
+  else
+    {
+      i_close (&p->f, e);
+    }
+}
+
+/**
+ * Everything after the files are open
+ */
+static err_t
+fpgr_open_common (struct file_pager *dest, error *e)
+{
+  if (fpgr_find_logical_end (dest, e))
+    {
+      fpgr_close_files (dest, e);
+      return e->cause_code;
+    }
+
+  if (i_aio_open (&dest->aio, AIO_QUEUE_DEPTH, e))
+    {
+      fpgr_close_files (dest, e);
+      return e->cause_code;
+    }
+
+  if (i_timer_create (&dest->timer, e))
+    {
+      i_aio_close (&dest->aio);
+      fpgr_close_files (dest, e);
+      return e->cause_code;
+    }
+  dest->stats = (struct fpgr_stats){ 0 };
+
+  DBG_ASSERT (file_pager, dest);
+
   return SUCCESS;
 }
 
 err_t
 fpgr_open (struct file_pager *dest, const char *fname, error *e)
 {
+  dest->npages = 0;
+  dest->nalloc = 0;
+  dest->pool = NULL;
+  dest->compress = false;
+
   if (i_open_rw (&dest->f, fname, e))
     {
       return e->cause_code;
@@ -70,9 +472,34 @@ fpgr_open (struct file_pager *dest, const char *fname, error *e)
       return e->cause_code;
     }
 
-  DBG_ASSERT (file_pager, dest);
+  return fpgr_open_common (dest, e);
+}
 
-  return SUCCESS;
+err_t
+fpgr_open_segmented (struct file_pager *dest, const char *const *dirs, u32 ndirs, error *e)
+{
+  dest->npages = 0;
+  dest->nalloc = 0;
+  dest->compress = false;
+
+  dest->pool = i_malloc (1, sizeof *dest->pool, e);
+  if (dest->pool == NULL)
+    {
+      return e->cause_code;
+    }
+  if (fpool_init (dest->pool, dirs, ndirs, e))
+    {
+      i_free (dest->pool);
+      dest->pool = NULL;
+      return e->cause_code;
+    }
+  if (fpgr_set_len_segmented (dest, e))
+    {
+      fpgr_close_files (dest, e);
+      return e->cause_code;
+    }
+
+  return fpgr_open_common (dest, e);
 }
 
 #ifndef NTEST
@@ -100,10 +527,20 @@ TEST (TT_UNIT, fpgr_open)
   test_fail_if (fpgr_close (&pager, &e));
 
   /* happy path: file exactly header size, more pages */
+  u8 one = 1;
   test_fail_if (i_truncate (&fp, 3 * PAGE_SIZE, &e));
+  test_fail_if (i_pwrite_all (&fp, &one, 1, 2 * PAGE_SIZE, &e));
+  test_err_t_check (fpgr_open (&pager, "test.db", &e), SUCCESS, &e);
+  test_assert_equal (pager.npages, 3);
+  test_fail_if (fpgr_close (&pager, &e));
+
+  /* preallocated (zero) tail left by a crash isn't part of the database */
+  test_fail_if (i_truncate (&fp, 8 * PAGE_SIZE, &e));
   test_err_t_check (fpgr_open (&pager, "test.db", &e), SUCCESS, &e);
   test_assert_equal (pager.npages, 3);
+  test_assert_equal (pager.nalloc, 8);
   test_fail_if (fpgr_close (&pager, &e));
+  test_assert_int_equal (i_file_size (&fp, &e), 3 * PAGE_SIZE);
 
   /* There were 2 references to file - close it here too */
   test_fail_if (i_close (&fp, &e));
@@ -115,7 +552,16 @@ err_t
 fpgr_close (struct file_pager *f, error *e)
 {
   DBG_ASSERT (file_pager, f);
-  i_close (&f->f, e);
+
+  // Give back the unused tail
+  if (f->nalloc > f->npages)
+    {
+      fpgr_resize (f, f->npages, e);
+    }
+
+  i_timer_free (&f->timer);
+  i_aio_close (&f->aio);
+  fpgr_close_files (f, e);
   return e->cause_code;
 }
 
@@ -123,8 +569,9 @@ err_t
 fpgr_reset (struct file_pager *f, error *e)
 {
   DBG_ASSERT (file_pager, f);
-  err_t_wrap (i_truncate (&f->f, 0, e), e);
+  err_t_wrap (fpgr_resize (f, 0, e), e);
   f->npages = 0;
+  f->nalloc = 0;
   return e->cause_code;
 }
 
@@ -135,6 +582,92 @@ fpgr_get_npages (const struct file_pager *fp)
   return fp->npages;
 }
 
+static err_t
+fpgr_grow (struct file_pager *p, pgno atleast, error *e)
+{
+  // Double up to the cap so small databases stay small
+  pgno step = MIN (MAX (p->nalloc, (pgno)FPGR_EXTENT_MIN), (pgno)FPGR_EXTENT_MAX);
+  pgno nalloc = MAX (p->nalloc + step, atleast);
+
+  if (p->pool)
+    {
+      // Segments are preallocated whole anyway
+      nalloc = fpgr_nsegments (nalloc) * FPGR_SEGMENT_PAGES;
+    }
+
+  i_log_trace ("File pager growing from %" PRpgno " to %" PRpgno " pages\n", p->nalloc, nalloc);
+
+  err_t_wrap (fpgr_resize (p, nalloc, e), e);
+
+  p->nalloc = nalloc;
+  return SUCCESS;
+}
+
+err_t
+fpgr_ensure (struct file_pager *p, pgno npages, error *e)
+{
+  DBG_ASSERT (file_pager, p);
+
+  if (npages > p->nalloc)
+    {
+      err_t_wrap (fpgr_grow (p, npages, e), e);
+    }
+  p->npages = MAX (p->npages, npages);
+
+  return SUCCESS;
+}
+
+/**
+ * The preallocated extent goes with it - a vacuumed database
+ * shouldn't keep the space around on disk
+ */
+err_t
+fpgr_truncate (struct file_pager *p, pgno npages, error *e)
+{
+  DBG_ASSERT (file_pager, p);
+  ASSERT (npages > 0 && npages <= p->npages);
+
+  i_log_trace ("File pager truncating from %" PRpgno " to %" PRpgno " pages\n", p->npages, npages);
+
+  err_t_wrap (fpgr_resize (p, npages, e), e);
+  p->npages = npages;
+  p->nalloc = npages;
+
+  return SUCCESS;
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, fpgr_truncate)
+{
+  i_file fp;
+  error e = error_create ();
+  test_fail_if (i_open_rw (&fp, "test.db", &e));
+  test_fail_if (i_truncate (&fp, 0, &e));
+
+  struct file_pager pager;
+  test_err_t_check (fpgr_open (&pager, "test.db", &e), SUCCESS, &e);
+
+  test_fail_if (fpgr_ensure (&pager, 3 * FPGR_EXTENT_MIN, &e));
+  test_assert (pager.nalloc >= 3 * FPGR_EXTENT_MIN);
+
+  /* Logical and physical size both drop */
+  test_fail_if (fpgr_truncate (&pager, 5, &e));
+  test_assert_int_equal (pager.npages, 5);
+  test_assert_int_equal (pager.nalloc, 5);
+  test_assert_int_equal (i_file_size (&fp, &e), 5 * PAGE_SIZE);
+
+  /* And it grows back from there */
+  pgno pg;
+  test_fail_if (fpgr_new (&pager, &pg, &e));
+  test_assert_int_equal (pg, 5);
+  test_assert (pager.nalloc > pager.npages);
+
+  test_fail_if (fpgr_close (&pager, &e));
+  test_fail_if (i_close (&fp, &e));
+  test_fail_if (i_unlink ("test.db", &e));
+}
+#endif
+
 err_t
 fpgr_new (struct file_pager *p, pgno *dest, error *e)
 {
@@ -143,9 +676,10 @@ fpgr_new (struct file_pager *p, pgno *dest, error *e)
 
   i_log_trace ("File pager creating a new page\n");
 
-  /* Extend the file by 1 page */
-  err_t_wrap (i_truncate (&p->f, PAGE_SIZE * (1 + p->npages), e), e);
-
+  if (p->npages == p->nalloc)
+    {
+      err_t_wrap (fpgr_grow (p, p->npages + 1, e), e);
+    }
   *dest = p->npages++;
 
   i_log_trace ("File pager new total pages: %" PRpgno "\n", p->npages);
@@ -173,24 +707,38 @@ TEST (TT_UNIT, fpgr_new)
   /* Page should be at position 0 */
   test_assert_int_equal (pg, 0);
 
-  /* There should be 1 page */
+  /* There should be 1 page, backed by a whole extent */
   test_assert_int_equal (pager.npages, 1);
+  test_assert_int_equal (pager.nalloc, FPGR_EXTENT_MIN);
+  test_assert_int_equal (i_file_size (&fp, &e), PAGE_SIZE * pager.nalloc);
 
-  /* Size should be PAGE_SIZE */
-  test_assert_int_equal (i_file_size (&fp, &e), PAGE_SIZE * pager.npages);
+  /* The rest of the extent doesn't touch the file */
+  for (u32 i = 1; i < FPGR_EXTENT_MIN; ++i)
+    {
+      test_fail_if (fpgr_new (&pager, &pg, &e));
+      test_assert_int_equal (pg, i);
+    }
+  test_assert_int_equal (pager.npages, FPGR_EXTENT_MIN);
+  test_assert_int_equal (i_file_size (&fp, &e), PAGE_SIZE * FPGR_EXTENT_MIN);
 
-  /* Add two more pages and do the same thing */
+  /* Then it doubles */
   test_fail_if (fpgr_new (&pager, &pg, &e));
-  test_assert_int_equal (pg, 1);
-  test_assert_int_equal (pager.npages, 2);
-  test_assert_int_equal (i_file_size (&fp, &e), PAGE_SIZE * pager.npages);
+  test_assert_int_equal (pg, FPGR_EXTENT_MIN);
+  test_assert_int_equal (pager.nalloc, 2 * FPGR_EXTENT_MIN);
+  test_assert_int_equal (i_file_size (&fp, &e), PAGE_SIZE * pager.nalloc);
 
-  test_fail_if (fpgr_new (&pager, &pg, &e));
-  test_assert_int_equal (pg, 2);
-  test_assert_int_equal (pager.npages, 3);
-  test_assert_int_equal (i_file_size (&fp, &e), PAGE_SIZE * pager.npages);
+  /* Ensure only ever grows */
+  test_fail_if (fpgr_ensure (&pager, 3, &e));
+  test_assert_int_equal (pager.npages, FPGR_EXTENT_MIN + 1);
+  test_fail_if (fpgr_ensure (&pager, 5 * FPGR_EXTENT_MIN, &e));
+  test_assert_int_equal (pager.npages, 5 * FPGR_EXTENT_MIN);
+  test_assert (pager.nalloc >= pager.npages);
 
+  /* Close trims the file to what's in use */
+  test_fail_if (i_pwrite_all (&fp, &pg, sizeof (pg), (pager.npages - 1) * PAGE_SIZE, &e));
+  pgno npages = pager.npages;
   test_fail_if (fpgr_close (&pager, &e));
+  test_assert_int_equal (i_file_size (&fp, &e), PAGE_SIZE * npages);
 
   /* There were 2 references to file - close it here too */
   test_fail_if (i_close (&fp, &e));
@@ -198,6 +746,24 @@ TEST (TT_UNIT, fpgr_new)
 }
 #endif
 
+err_t
+fpgr_set_compress (struct file_pager *p, bool compress, error *e)
+{
+  DBG_ASSERT (file_pager, p);
+
+  // A compressed page has to free a whole block to save anything
+  if (compress && FPGR_CMP_CAP == 0)
+    {
+      return error_causef (e, ERR_INVALID_ARGUMENT,
+                           "Compression needs pages bigger than a %d byte block, "
+                           "this build has %d byte pages - raise PAGE_POW to use it",
+                           FPGR_CMP_BLOCK, PAGE_SIZE);
+    }
+
+  p->compress = compress;
+  return SUCCESS;
+}
+
 err_t
 fpgr_read (struct file_pager *p, u8 *dest, pgno pg, error *e)
 {
@@ -213,17 +779,9 @@ fpgr_read (struct file_pager *p, u8 *dest, pgno pg, error *e)
     }
 
   /* Read all from file */
-  i64 nread = i_pread_all (&p->f, dest, PAGE_SIZE, pg * PAGE_SIZE, e);
-
-  if (nread == 0)
-    {
-      return error_causef (e, ERR_CORRUPT, "File pager: empty read");
-    }
-
-  if (nread < 0)
-    {
-      return e->cause_code;
-    }
+  u64 start = i_timer_now_ns (&p->timer);
+  err_t_wrap (fpgr_read_page (p, dest, pg, e), e);
+  fpgr_stat_add (p, &p->stats.reads, &p->stats.read_ns, 1, start);
 
   return SUCCESS;
 }
@@ -244,11 +802,255 @@ fpgr_write (struct file_pager *p, const u8 *src, pgno pg, error *e)
   ASSERT (src);
   ASSERT (pg < p->npages);
 
-  err_t_wrap (i_pwrite_all (&p->f, src, PAGE_SIZE, pg * PAGE_SIZE, e), e);
+  u64 start = i_timer_now_ns (&p->timer);
+  err_t_wrap (fpgr_write_page (p, src, pg, e), e);
+  fpgr_stat_add (p, &p->stats.writes, &p->stats.write_ns, 1, start);
+
+  return SUCCESS;
+}
+
+static err_t
+fpgr_submit_pinned (struct file_pager *p, struct i_aio_req *reqs, struct ifframe **frames, u32 n, error *e)
+{
+  if (n == 0)
+    {
+      return SUCCESS;
+    }
+
+  err_t ret = i_aio_submit (&p->aio, reqs, n, e);
+  for (u32 i = 0; i < n; ++i)
+    {
+      fpool_putf (p->pool, frames[i], reqs[i].op == I_AIO_WRITE);
+    }
+
+  return ret;
+}
+
+/**
+ * Each request pins the segment file it goes to. If every open file
+ * is pinned, what's queued so far goes out first to free them up
+ */
+static err_t
+fpgr_submit_segmented (struct file_pager *p, struct i_aio_req *reqs, const pgno *pgs, u32 n, u32 from, error *e)
+{
+  struct ifframe *frames[AIO_QUEUE_DEPTH];
+  u32 sent = 0;   // Submitted and put back
+  u32 pinned = 0; // Have their file pinned
+  err_t ret = SUCCESS;
+
+  while (pinned < n)
+    {
+      u64 addr = page_to_addr (pgs[pinned]);
+      struct ifframe *fr = fpool_trygetf (p->pool, addr, e);
+
+      if (fr == NULL && e->cause_code == SUCCESS)
+        {
+          ret = fpgr_submit_pinned (p, reqs + sent, frames + sent, pinned - sent, e);
+          sent = pinned;
+          if (ret == SUCCESS)
+            {
+              fr = fpool_getf (p->pool, addr, e);
+            }
+        }
+
+      if (fr == NULL)
+        {
+          ret = e->cause_code;
+          break;
+        }
+
+      frames[pinned] = fr;
+      reqs[pinned].fp = &fr->fp;
+      reqs[pinned].offset = (pgs[pinned] % FPGR_SEGMENT_PAGES) * PAGE_SIZE + from;
+      pinned++;
+    }
+
+  if (ret)
+    {
+      for (u32 i = sent; i < pinned; ++i)
+        {
+          fpool_putf (p->pool, frames[i], false);
+        }
+      return ret;
+    }
+
+  return fpgr_submit_pinned (p, reqs + sent, frames + sent, pinned - sent, e);
+}
+
+// [lens] bytes (PAGE_SIZE if NULL) of each page's slot from [from] on
+static err_t
+fpgr_batch (struct file_pager *p, enum i_aio_op op, u8 *const *bufs, const u32 *lens, const pgno *pgs, u32 n, u32 from, error *e)
+{
+  DBG_ASSERT (file_pager, p);
+  ASSERT (n <= AIO_QUEUE_DEPTH);
+
+  struct i_aio_req reqs[AIO_QUEUE_DEPTH];
+  for (u32 i = 0; i < n; ++i)
+    {
+      if (pgs[i] >= p->npages)
+        {
+          return error_causef (e, ERR_PG_OUT_OF_RANGE,
+                               "File Pager: Invalid page index. "
+                               "Got page: %" PRpgno " but total "
+                               "amount of pages is %" PRpgno,
+                               pgs[i], p->npages);
+        }
+
+      reqs[i] = (struct i_aio_req){
+        .op = op,
+        .fp = &p->f,
+        .buf = bufs[i],
+        .n = lens ? lens[i] : PAGE_SIZE,
+        .offset = pgs[i] * PAGE_SIZE + from,
+      };
+    }
+
+  if (p->pool)
+    {
+      return fpgr_submit_segmented (p, reqs, pgs, n, from, e);
+    }
+
+  return i_aio_submit (&p->aio, reqs, n, e);
+}
+
+/**
+ * Like fpgr_read_page - the first blocks go out in one batch, and the
+ * slots that run past them in a second
+ */
+err_t
+fpgr_read_batch (struct file_pager *p, u8 *const *dests, const pgno *pgs, u32 n, error *e)
+{
+  u32 head = fpgr_read_head (p);
+  u32 heads[AIO_QUEUE_DEPTH];
+  for (u32 i = 0; i < n; ++i)
+    {
+      heads[i] = head;
+    }
+
+  u64 start = i_timer_now_ns (&p->timer);
+  err_t_wrap (fpgr_batch (p, I_AIO_READ, dests, heads, pgs, n, 0, e), e);
+
+  u8 *tails[AIO_QUEUE_DEPTH];
+  u32 tlens[AIO_QUEUE_DEPTH];
+  pgno tpgs[AIO_QUEUE_DEPTH];
+  u32 lens[AIO_QUEUE_DEPTH];
+  u32 ntails = 0;
+  u64 nbytes = 0;
+
+  for (u32 i = 0; i < n; ++i)
+    {
+      lens[i] = MAX (fpgr_slot_len (dests[i]), head);
+      if (lens[i] > head)
+        {
+          tails[ntails] = dests[i] + head;
+          tlens[ntails] = lens[i] - head;
+          tpgs[ntails++] = pgs[i];
+        }
+      nbytes += lens[i];
+    }
+
+  if (ntails > 0)
+    {
+      err_t_wrap (fpgr_batch (p, I_AIO_READ, tails, tlens, tpgs, ntails, head, e), e);
+    }
+  fpgr_stat_add (p, &p->stats.reads, &p->stats.read_ns, n, start);
+  __atomic_fetch_add (&p->stats.read_bytes, nbytes, __ATOMIC_RELAXED);
+
+  for (u32 i = 0; i < n; ++i)
+    {
+      fpgr_decompress_slot (dests[i], lens[i], pgs[i]);
+    }
 
   return SUCCESS;
 }
 
+err_t
+fpgr_write_batch (struct file_pager *p, const u8 *const *srcs, const pgno *pgs, u32 n, error *e)
+{
+  u64 start = i_timer_now_ns (&p->timer);
+
+  if (!p->compress)
+    {
+      // Requests carry a mutable buffer for reads - writes never touch it
+      err_t_wrap (fpgr_batch (p, I_AIO_WRITE, (u8 *const *)srcs, NULL, pgs, n, 0, e), e);
+      fpgr_stat_add (p, &p->stats.writes, &p->stats.write_ns, n, start);
+      return SUCCESS;
+    }
+
+  u8 *slots = i_malloc (n, PAGE_SIZE, e);
+  if (slots == NULL)
+    {
+      return e->cause_code;
+    }
+
+  u8 *bufs[AIO_QUEUE_DEPTH];
+  u32 lens[AIO_QUEUE_DEPTH];
+  for (u32 i = 0; i < n; ++i)
+    {
+      bufs[i] = slots + (u64)i * PAGE_SIZE;
+      lens[i] = fpgr_compress_slot (p, bufs[i], srcs[i]);
+      if (lens[i] == 0)
+        {
+          bufs[i] = (u8 *)srcs[i];
+          lens[i] = PAGE_SIZE;
+        }
+    }
+
+  err_t ret = fpgr_batch (p, I_AIO_WRITE, bufs, lens, pgs, n, 0, e);
+  if (ret == SUCCESS)
+    {
+      fpgr_stat_add (p, &p->stats.writes, &p->stats.write_ns, n, start);
+    }
+
+  for (u32 i = 0; ret == SUCCESS && i < n; ++i)
+    {
+      if (lens[i] < PAGE_SIZE)
+        {
+          ret = fpgr_punch (p, pgs[i], lens[i], e);
+          __atomic_fetch_add (&p->stats.cmp_writes, 1, __ATOMIC_RELAXED);
+          __atomic_fetch_add (&p->stats.cmp_bytes, lens[i], __ATOMIC_RELAXED);
+        }
+    }
+
+  i_free (slots);
+  return ret;
+}
+
+err_t
+fpgr_sync (struct file_pager *p, error *e)
+{
+  DBG_ASSERT (file_pager, p);
+
+  u64 start = i_timer_now_ns (&p->timer);
+  if (p->pool)
+    {
+      err_t_wrap (fpool_sync (p->pool, e), e);
+    }
+  else
+    {
+      err_t_wrap (i_fsync (&p->f, e), e);
+    }
+  fpgr_stat_add (p, &p->stats.syncs, &p->stats.sync_ns, 1, start);
+
+  return SUCCESS;
+}
+
+void
+fpgr_get_stats (struct file_pager *p, struct fpgr_stats *dest)
+{
+  DBG_ASSERT (file_pager, p);
+
+  dest->reads = __atomic_load_n (&p->stats.reads, __ATOMIC_RELAXED);
+  dest->writes = __atomic_load_n (&p->stats.writes, __ATOMIC_RELAXED);
+  dest->read_ns = __atomic_load_n (&p->stats.read_ns, __ATOMIC_RELAXED);
+  dest->write_ns = __atomic_load_n (&p->stats.write_ns, __ATOMIC_RELAXED);
+  dest->syncs = __atomic_load_n (&p->stats.syncs, __ATOMIC_RELAXED);
+  dest->sync_ns = __atomic_load_n (&p->stats.sync_ns, __ATOMIC_RELAXED);
+  dest->cmp_writes = __atomic_load_n (&p->stats.cmp_writes, __ATOMIC_RELAXED);
+  dest->cmp_bytes = __atomic_load_n (&p->stats.cmp_bytes, __ATOMIC_RELAXED);
+  dest->read_bytes = __atomic_load_n (&p->stats.read_bytes, __ATOMIC_RELAXED);
+}
+
 #ifndef NTEST
 TEST (TT_UNIT, fpgr_read_write)
 {
@@ -298,12 +1100,220 @@ TEST (TT_UNIT, fpgr_read_write)
 }
 #endif
 
+#ifndef NTEST
+TEST (TT_UNIT, fpgr_read_write_batch)
+{
+  static u8 pages[8][PAGE_SIZE];
+  u8 *bufs[8];
+  pgno pgs[8];
+
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+
+  struct file_pager pager;
+  test_err_t_wrap (fpgr_open (&pager, "test.db", &e), &e);
+
+  for (u32 i = 0; i < 8; ++i)
+    {
+      test_err_t_wrap (fpgr_new (&pager, &pgs[i], &e), &e);
+      i_memset (pages[i], (int)i + 1, PAGE_SIZE);
+      bufs[i] = pages[i];
+    }
+
+  /* Write them all in one go, out of order */
+  pgno tmp = pgs[0];
+  pgs[0] = pgs[7];
+  pgs[7] = tmp;
+  test_err_t_wrap (fpgr_write_batch (&pager, (const u8 *const *)bufs, pgs, 8, &e), &e);
+
+  /* Singles agree with the batch */
+  u8 _page[PAGE_SIZE];
+  test_err_t_wrap (fpgr_read (&pager, _page, 7, &e), &e);
+  test_assert_int_equal (_page[0], 1);
+  test_err_t_wrap (fpgr_read (&pager, _page, 0, &e), &e);
+  test_assert_int_equal (_page[0], 8);
+
+  i_memset (pages, 0, sizeof (pages));
+  test_err_t_wrap (fpgr_read_batch (&pager, bufs, pgs, 8, &e), &e);
+  for (u32 i = 0; i < 8; ++i)
+    {
+      test_assert_int_equal (pages[i][PAGE_SIZE - 1], (u8)(i + 1));
+    }
+
+  /* Out of range page fails the whole batch up front */
+  pgs[3] = pager.npages;
+  test_err_t_check (fpgr_read_batch (&pager, bufs, pgs, 8, &e), ERR_PG_OUT_OF_RANGE, &e);
+
+  test_fail_if (fpgr_close (&pager, &e));
+  test_fail_if (i_unlink ("test.db", &e));
+}
+#endif
+
+#ifndef NTEST
+TEST (TT_UNIT, fpgr_compressed)
+{
+  static page pages[3];
+  u8 *bufs[3];
+  pgno pgs[3];
+  u8 _page[PAGE_SIZE];
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+
+  struct file_pager pager;
+  test_err_t_wrap (fpgr_open (&pager, "test.db", &e), &e);
+
+  /* Refused outright if a compressed page can't free a block */
+  if (FPGR_CMP_CAP == 0)
+    {
+      test_assert_int_equal (fpgr_set_compress (&pager, true, &e), ERR_INVALID_ARGUMENT);
+      test_assert_int_equal (pager.compress, false);
+      e.cause_code = SUCCESS;
+    }
+  else
+    {
+      test_err_t_wrap (fpgr_set_compress (&pager, true, &e), &e);
+    }
+
+  /* A smooth data_list page, a noisy one and a smooth page of another type */
+  for (u32 i = 0; i < 3; ++i)
+    {
+      page_init_empty (&pages[i], i == 2 ? PG_INNER_NODE : PG_DATA_LIST);
+      for (u32 j = PG_COMMN_END; j + sizeof (i64) <= PAGE_SIZE; j += sizeof (i64))
+        {
+          i64 v = i == 1 ? (i64)randu64 () : 5000 + 7 * (i64)j;
+          i_memcpy (&pages[i].raw[j], &v, sizeof (v));
+        }
+      test_err_t_wrap (fpgr_new (&pager, &pgs[i], &e), &e);
+      bufs[i] = pages[i].raw;
+    }
+
+  test_err_t_wrap (fpgr_write (&pager, pages[0].raw, pgs[0], &e), &e);
+  test_err_t_wrap (fpgr_write_batch (&pager, (const u8 *const *)&bufs[1], &pgs[1], 2, &e), &e);
+
+  /* Only the smooth data_list page is worth it - and only if a page is more than a block */
+  struct fpgr_stats st;
+  fpgr_get_stats (&pager, &st);
+  test_assert_int_equal (st.cmp_writes, (PAGE_SIZE > FPGR_CMP_BLOCK ? 1 : 0));
+
+  /* Singles and batches read them back the same */
+  for (u32 i = 0; i < 3; ++i)
+    {
+      test_err_t_wrap (fpgr_read (&pager, _page, pgs[i], &e), &e);
+      test_assert_memequal (_page, pages[i].raw, PAGE_SIZE);
+    }
+
+  /* ... fetching only what the compressed page takes on disk */
+  fpgr_get_stats (&pager, &st);
+  test_assert_int_equal (st.read_bytes, 2 * PAGE_SIZE + (PAGE_SIZE > FPGR_CMP_BLOCK ? st.cmp_bytes : PAGE_SIZE));
+
+  static u8 back[3][PAGE_SIZE];
+  for (u32 i = 0; i < 3; ++i)
+    {
+      bufs[i] = back[i];
+    }
+  test_err_t_wrap (fpgr_read_batch (&pager, bufs, pgs, 3, &e), &e);
+  for (u32 i = 0; i < 3; ++i)
+    {
+      test_assert_memequal (back[i], pages[i].raw, PAGE_SIZE);
+    }
+
+  u64 before = st.read_bytes;
+  fpgr_get_stats (&pager, &st);
+  test_assert_int_equal (st.read_bytes - before, before);
+
+  /* Turning it off doesn't strand compressed pages */
+  test_err_t_wrap (fpgr_set_compress (&pager, false, &e), &e);
+  test_err_t_wrap (fpgr_read (&pager, _page, pgs[0], &e), &e);
+  test_assert_memequal (_page, pages[0].raw, PAGE_SIZE);
+
+  /* A torn slot comes back as is - it won't pass its checksum */
+  if (PAGE_SIZE > FPGR_CMP_BLOCK)
+    {
+      u8 junk[16];
+      i_memset (junk, 0xEE, sizeof (junk));
+      test_err_t_wrap (i_pwrite_all (&pager.f, junk, sizeof (junk), pgs[0] * PAGE_SIZE + 16, &e), &e);
+      test_err_t_wrap (fpgr_read (&pager, _page, pgs[0], &e), &e);
+      test_assert_int_equal (_page[PG_HEDR_OFST], 0);
+    }
+
+  test_fail_if (fpgr_close (&pager, &e));
+  test_fail_if (i_unlink ("test.db", &e));
+}
+#endif
+
+#ifndef NTEST
+TEST (TT_UNIT, fpgr_segmented)
+{
+  static u8 pages[4][PAGE_SIZE];
+  u8 *bufs[4];
+  u8 _page[PAGE_SIZE];
+  error e = error_create ();
+
+  const char *dirs[] = { ".", "." };
+  struct file_pager pager;
+  test_err_t_wrap (fpgr_open_segmented (&pager, dirs, 2, &e), &e);
+  test_err_t_wrap (fpgr_reset (&pager, &e), &e);
+
+  /* Grows a whole segment at a time */
+  pgno pg;
+  test_err_t_wrap (fpgr_new (&pager, &pg, &e), &e);
+  test_assert_int_equal (pg, 0);
+  test_assert_int_equal (pager.nalloc, FPGR_SEGMENT_PAGES);
+
+  /* Pages on both sides of a segment boundary */
+  test_err_t_wrap (fpgr_ensure (&pager, FPGR_SEGMENT_PAGES + 2, &e), &e);
+  test_assert_int_equal (pager.nalloc, 2 * FPGR_SEGMENT_PAGES);
+
+  pgno pgs[] = { 0, FPGR_SEGMENT_PAGES - 1, FPGR_SEGMENT_PAGES, FPGR_SEGMENT_PAGES + 1 };
+  for (u32 i = 0; i < 4; ++i)
+    {
+      i_memset (pages[i], (int)i + 1, PAGE_SIZE);
+      bufs[i] = pages[i];
+    }
+  test_err_t_wrap (fpgr_write_batch (&pager, (const u8 *const *)bufs, pgs, 4, &e), &e);
+  test_err_t_wrap (fpgr_sync (&pager, &e), &e);
+
+  for (u32 i = 0; i < 4; ++i)
+    {
+      test_err_t_wrap (fpgr_read (&pager, _page, pgs[i], &e), &e);
+      test_assert_int_equal (_page[PAGE_SIZE - 1], (u8)(i + 1));
+    }
+
+  /* Close trims the last segment and a reopen finds the same pages */
+  test_fail_if (fpgr_close (&pager, &e));
+  test_err_t_wrap (fpgr_open_segmented (&pager, dirs, 2, &e), &e);
+  test_assert_int_equal (pager.npages, FPGR_SEGMENT_PAGES + 2);
+  test_assert_int_equal (pager.nalloc, FPGR_SEGMENT_PAGES + 2);
+
+  i_memset (pages, 0, sizeof (pages));
+  test_err_t_wrap (fpgr_read_batch (&pager, bufs, pgs, 4, &e), &e);
+  for (u32 i = 0; i < 4; ++i)
+    {
+      test_assert_int_equal (pages[i][0], (u8)(i + 1));
+    }
+
+  /* Truncating drops the second segment file */
+  bool exists;
+  u64 size;
+  test_err_t_wrap (fpgr_truncate (&pager, 5, &e), &e);
+  test_err_t_wrap (fpool_stat (pager.pool, page_to_addr (FPGR_SEGMENT_PAGES), &exists, &size, &e), &e);
+  test_assert (!exists);
+  test_err_t_wrap (fpool_stat (pager.pool, page_to_addr (0), &exists, &size, &e), &e);
+  test_assert (exists);
+  test_assert_int_equal (size, 5 * PAGE_SIZE);
+
+  test_err_t_wrap (fpgr_reset (&pager, &e), &e);
+  test_fail_if (fpgr_close (&pager, &e));
+}
+#endif
+
 #ifndef NTEST
 err_t
 fpgr_crash (struct file_pager *p, error *e)
 {
   DBG_ASSERT (file_pager, p);
-  i_close (&p->f, e);
+  i_aio_close (&p->aio);
+  fpgr_close_files (p, e);
   return e->cause_code;
 }
 #endif
@@ -21,23 +21,67 @@
 
 // core
 #include <numstore/core/error.h>
+#include <numstore/core/file_pool.h>
 #include <numstore/intf/os.h>
 
+struct fpgr_stats
+{
+  u64 reads;    // Pages read
+  u64 writes;   // Pages written
+  u64 read_ns;  // Time spent in reads
+  u64 write_ns; // Time spent in writes
+  u64 syncs;
+  u64 sync_ns;
+  u64 cmp_writes; // Pages written compressed
+  u64 cmp_bytes;  // ... and the bytes they took on disk
+  u64 read_bytes; // Bytes reads fetched - short for compressed slots
+};
+
+// Pages in one segment file of a segmented database
+#define FPGR_SEGMENT_PAGES (FPOOL_SEGMENT_SIZE / PAGE_SIZE)
+
+/**
+ * The file grows in preallocated extents. [npages] is the logical
+ * size - pages handed out by fpgr_new. [nalloc] is what's on disk,
+ * and the unused tail past npages is always zeros
+ *
+ * A segmented database is a run of FPGR_SEGMENT_PAGES page files in
+ * [pool] instead of the single file [f]. Page n lives in segment
+ * n / FPGR_SEGMENT_PAGES, and extents are whole segments
+ */
 struct file_pager
 {
   pgno npages;
+  pgno nalloc;
   i_file f;
+  struct file_pool *pool; // NULL unless segmented
+  i_aio aio;              // Batched page I/O
+  bool compress;          // Write data_list pages compressed - reads handle both either way
+
+  // Updated atomically - partitions read and write concurrently
+  i_timer timer;
+  struct fpgr_stats stats;
 };
 
 err_t fpgr_open (struct file_pager *dest, const char *fname, error *e);
+err_t fpgr_open_segmented (struct file_pager *dest, const char *const *dirs, u32 ndirs, error *e);
 err_t fpgr_close (struct file_pager *f, error *e);
 err_t fpgr_reset (struct file_pager *f, error *e);
+err_t fpgr_set_compress (struct file_pager *p, bool compress, error *e); // ERR_INVALID_ARGUMENT if pages are too small to gain
 
 p_size fpgr_get_npages (const struct file_pager *fp);
 err_t fpgr_new (struct file_pager *p, pgno *pgno_dest, error *e);
+err_t fpgr_ensure (struct file_pager *p, pgno npages, error *e);   // Grow the logical size to at least [npages]
+err_t fpgr_truncate (struct file_pager *p, pgno npages, error *e); // Shrink the file to exactly [npages]
 err_t fpgr_read (struct file_pager *p, u8 *dest, pgno pgno, error *e);
 err_t fpgr_write (struct file_pager *p, const u8 *src, pgno pgno, error *e);
+
+// Batches of up to AIO_QUEUE_DEPTH pages in one submission
+err_t fpgr_read_batch (struct file_pager *p, u8 *const *dests, const pgno *pgs, u32 n, error *e);
+err_t fpgr_write_batch (struct file_pager *p, const u8 *const *srcs, const pgno *pgs, u32 n, error *e);
 err_t fpgr_delete (struct file_pager *p, pgno pgno, error *e);
+err_t fpgr_sync (struct file_pager *p, error *e);
+void fpgr_get_stats (struct file_pager *p, struct fpgr_stats *dest);
 
 #ifndef NTEST
 err_t fpgr_crash (struct file_pager *p, error *e);
@@ -0,0 +1,254 @@
+/*
+ * Copyright 2025 Theo Lincke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *   Implements free_list.h. Bitmap search over the free space map pages.
+ */
+
+#include <numstore/pager/free_list.h>
+
+#include <numstore/core/random.h>
+#include <numstore/intf/logging.h>
+#include <numstore/pager/page.h>
+#include <numstore/test/testing.h>
+
+DEFINE_DBG_ASSERT (
+    page, frlst_page, d,
+    {
+      ASSERT (d);
+    })
+
+/////////////////////////////////
+///////// INITIALIZATION
+
+#ifndef NTEST
+TEST (TT_UNIT, frlst_init_empty)
+{
+  page p;
+
+  rand_bytes (p.raw, PAGE_SIZE);
+  page_init_empty (&p, PG_FREE_LIST);
+  p.pg = 3 * FL_SPAN;
+
+  test_assert_int_equal (page_get_type (&p), PG_FREE_LIST);
+  test_assert_equal (frlst_count_free (&p), 0);
+}
+#endif
+
+/////////////////////////////////
+///////// SEARCH
+
+pgno
+frlst_find_free (const page *map, pgno from, pgno to)
+{
+  DBG_ASSERT (frlst_page, map);
+  ASSERT (from <= to && to <= FL_SPAN);
+
+  const u8 *bits = &map->raw[frlst_free_ofst (map)];
+  pgno i = from;
+
+  // Up to a byte boundary
+  for (; i < to && i % 8; ++i)
+    {
+      if ((bits[i / 8] >> (i % 8)) & 1)
+        {
+          return i;
+        }
+    }
+
+  // Runs of used pages are the common case - skip them a word at a time
+  for (; i + 64 <= to; i += 64)
+    {
+      u64 word;
+      i_memcpy (&word, &bits[i / 8], sizeof (word));
+      if (word)
+        {
+          break;
+        }
+    }
+
+  for (; i < to; ++i)
+    {
+      if ((bits[i / 8] >> (i % 8)) & 1)
+        {
+          return i;
+        }
+    }
+
+  return to;
+}
+
+pgno
+frlst_used_end (const page *map, pgno to)
+{
+  DBG_ASSERT (frlst_page, map);
+  ASSERT (0 < to && to <= FL_SPAN);
+
+  const u8 *bits = &map->raw[frlst_free_ofst (map)];
+  pgno i = to;
+
+  // Back down to a byte boundary
+  for (; i > 0 && i % 8; --i)
+    {
+      if (!((bits[(i - 1) / 8] >> ((i - 1) % 8)) & 1))
+        {
+          return i;
+        }
+    }
+
+  // A free tail is usually a long run - whole bytes at a time
+  for (; i > 0 && bits[(i - 1) / 8] == 0xFF; i -= 8)
+    {
+    }
+
+  for (; i > 0; --i)
+    {
+      if (!((bits[(i - 1) / 8] >> ((i - 1) % 8)) & 1))
+        {
+          return i;
+        }
+    }
+
+  return 0;
+}
+
+pgno
+frlst_count_free (const page *map)
+{
+  DBG_ASSERT (frlst_page, map);
+
+  const u8 *bits = &map->raw[frlst_free_ofst (map)];
+  pgno ret = 0;
+
+  for (pgno i = 0; i < FL_SPAN / 8; ++i)
+    {
+      ret += (pgno)__builtin_popcount (bits[i]);
+    }
+
+  return ret;
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, frlst_find_free)
+{
+  page p;
+  rand_bytes (p.raw, PAGE_SIZE);
+  page_init_empty (&p, PG_FREE_LIST);
+  p.pg = FL_SPAN;
+
+  TEST_CASE ("Empty map")
+  {
+    test_assert_equal (frlst_find_free (&p, 0, FL_SPAN), FL_SPAN);
+  }
+
+  TEST_CASE ("Bits are relative to the span")
+  {
+    frlst_set_free (&p, FL_SPAN + 5, true);
+    test_assert_equal (frlst_is_free (&p, FL_SPAN + 5), true);
+    test_assert_equal (frlst_is_free (&p, FL_SPAN + 4), false);
+    test_assert_equal (frlst_find_free (&p, 0, FL_SPAN), 5);
+    test_assert_equal (frlst_find_free (&p, 5, FL_SPAN), 5);
+    test_assert_equal (frlst_find_free (&p, 6, FL_SPAN), FL_SPAN);
+    test_assert_equal (frlst_find_free (&p, 0, 5), 5);
+  }
+
+  TEST_CASE ("Across words")
+  {
+    frlst_set_free (&p, FL_SPAN + 5, false);
+    frlst_set_free (&p, FL_SPAN + 1000, true);
+    frlst_set_free (&p, FL_SPAN + FL_SPAN - 1, true);
+    test_assert_equal (frlst_find_free (&p, 1, FL_SPAN), 1000);
+    test_assert_equal (frlst_find_free (&p, 1001, FL_SPAN), FL_SPAN - 1);
+    test_assert_equal (frlst_count_free (&p), 2);
+  }
+
+  TEST_CASE ("Used end skips the free tail")
+  {
+    test_assert_equal (frlst_used_end (&p, FL_SPAN), FL_SPAN - 1);
+    test_assert_equal (frlst_used_end (&p, 1001), 1000);
+
+    for (pgno i = 900; i < FL_SPAN; ++i)
+      {
+        frlst_set_free (&p, FL_SPAN + i, true);
+      }
+    test_assert_equal (frlst_used_end (&p, FL_SPAN), 900);
+    test_assert_equal (frlst_used_end (&p, 899), 899);
+  }
+
+  TEST_CASE ("Root node holds span 0")
+  {
+    page r;
+    rand_bytes (r.raw, PAGE_SIZE);
+    page_init_empty (&r, PG_ROOT_NODE);
+    r.pg = 0;
+
+    test_assert_equal (frlst_find_free (&r, 0, FL_SPAN), FL_SPAN);
+    frlst_set_free (&r, FL_SPAN - 1, true);
+    test_assert_equal (frlst_find_free (&r, 0, FL_SPAN), FL_SPAN - 1);
+    test_assert_equal (rn_get_next_pg (&r), 1);
+  }
+}
+#endif
+
+/////////////////////////////////
+///////// VALIDATION
+
+err_t
+frlst_validate_for_db (const page *p, error *e)
+{
+  if (page_get_type (p) != PG_FREE_LIST)
+    {
+      return error_causef (e, ERR_CORRUPT, "Invalid page header for free list");
+    }
+  return SUCCESS;
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, frlst_validate_for_db)
+{
+  error e = error_create ();
+  page p;
+
+  TEST_CASE ("Invalid header -> ERR_CORRUPT")
+  {
+    rand_bytes (p.raw, PAGE_SIZE);
+    page_set_type (&p, PG_TOMBSTONE);
+    test_assert_int_equal (frlst_validate_for_db (&p, &e), ERR_CORRUPT);
+    e.cause_code = SUCCESS;
+  }
+
+  TEST_CASE ("Valid header -> SUCCESS")
+  {
+    rand_bytes (p.raw, PAGE_SIZE);
+    page_init_empty (&p, PG_FREE_LIST);
+    test_assert_int_equal (frlst_validate_for_db (&p, &e), SUCCESS);
+  }
+}
+#endif
+
+/////////////////////////////////
+///////// UTILS
+
+void
+i_log_frlst (int level, const page *t)
+{
+  i_log (level, "=== FREE LIST PAGE START ===\n");
+
+  i_printf (level, "PGNO: %" PRpgno "\n", t->pg);
+  i_printf (level, "SPAN: [%" PRpgno ", %" PRpgno ")\n", t->pg, t->pg + FL_SPAN);
+  i_printf (level, "FREE: %" PRpgno "\n", frlst_count_free (t));
+
+  i_log (level, "=== FREE LIST PAGE END ===\n");
+}
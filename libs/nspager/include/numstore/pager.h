@@ -25,28 +25,126 @@
 #include <numstore/pager/page_h.h>
 #include <numstore/pager/txn.h>
 
+#include <stdio.h>
+
 // Special Page Numbers
 #define ROOT_PGNO ((pgno)0)  // Root page
 #define VHASH_PGNO ((pgno)1) // Variable hash table page
 
+// Buffer pool replacement policies
+enum pgr_policy
+{
+  PGR_POLICY_2Q = 0, // Default - scan resistant, once touched pages are evicted first
+  PGR_POLICY_CLOCK,  // Plain second chance CLOCK
+};
+
+// Open time tunables - zeroed fields take the defaults from config.h
+struct pgr_params
+{
+  u64 memory_budget; // Bytes of buffer pool (frames + page table). 0 = MEMORY_PAGE_LEN frames
+  u64 meta_budget;   // Bytes of it only root, catalog and inner node pages can hold on to. 0 = META_TIER_PCT percent
+  u32 npartitions;   // Independent buffer pool partitions. 0 = sized from the budget
+  enum pgr_policy policy;
+  bool huge_pages;   // Back the buffer pool with huge pages if the OS allows it
+  bool compress;     // Store data_list pages compressed on disk (needs PAGE_SIZE > FPGR_CMP_BLOCK - the open fails otherwise)
+
+  // Spread the database over segment files in these directories instead of fname
+  const char *const *data_dirs;
+  u32 ndata_dirs;
+
+  // Keep clean pages evicted from the pool in a scratch file here (e.g. a local SSD
+  // in front of network storage). Created on open, removed on close. NULL = off
+  const char *l2_path;
+  u64 l2_budget; // Bytes of it
+
+  // Group commit - how long the WAL flusher waits for more transactions to
+  // commit along with the first, and how many it waits for. 0 = WAL_COMMIT_*
+  u32 commit_delay_us;
+  u32 commit_batch;
+
+  // Size of the WAL's segment files - a log that already exists keeps its own.
+  // 0 = WAL_SEGMENT_SIZE
+  u64 wal_segment_bytes;
+};
+
+/**
+ * Buffer pool and I/O counters since open. Counts are cumulative,
+ * frame counts are what they were when the snapshot was taken
+ */
+struct pgr_stats
+{
+  // Buffer pool
+  u32 nframes;
+  u32 npinned;         // Frames someone holds a page_h on
+  u32 ndirty;          // Frames not yet written back
+  u32 nmeta;           // Frames in the root / catalog / inner node tier
+  u32 maxmeta;         // ... and how many it can hold
+  u64 hits;            // Lookups that found the page resident
+  u64 misses;          // Lookups that had to load it
+  u64 readahead;       // Pages loaded by read-ahead
+  u64 readahead_hits;  // ... that were used before they were evicted
+  u64 evictions;       // Frames reused for another page
+  u64 dirty_evictions; // ... that had to be written out first
+  u64 near_full;       // Frames found with 7/8 of the partition pinned - ERR_PAGER_FULL near misses
+  u64 pager_full;      // Frames not found because everything was pinned (ERR_PAGER_FULL)
+
+  // Second level cache - all 0 if it's off
+  u32 l2_pages;     // Slots in the cache file
+  u64 l2_hits;      // Misses above served from it
+  u64 l2_misses;    // ... that went to the database file
+  u64 l2_writes;    // Clean evictions written to it
+  u64 l2_evictions; // Pages it dropped to make room
+
+  // Database file
+  u64 page_reads;
+  u64 page_writes;
+  u64 read_ns;
+  u64 write_ns;
+  u64 file_syncs;
+  u64 file_sync_ns;
+  u64 compressed_writes; // Page writes stored compressed
+  u64 compressed_bytes;  // ... and what they took on disk
+
+  // WAL - every flush is a write and an fsync
+  u64 wal_fsyncs;
+  u64 wal_bytes;
+  u64 wal_fsync_ns;
+  u64 wal_fsync_max_ns;
+  u64 wal_grouped;    // Commits and page flushes that shared another one's fsync
+  u64 wal_full_pages; // Whole page images logged for the first change after a checkpoint
+  u64 wal_recycled;   // Segments a checkpoint truncated and renamed for reuse
+  u64 wal_removed;    // ... and removed, with enough spares already
+};
+
 // Lifecycle
 struct pager *pgr_open (const char *fname, const char *walname, struct lockt *lt, struct thread_pool *tp, error *e);
+struct pager *pgr_open_with (const char *fname, const char *walname, struct lockt *lt, struct thread_pool *tp, struct pgr_params params, error *e);
 bool pgr_isnew (struct pager *p);
 err_t pgr_close (struct pager *p, error *e);
 
 // Utils
 p_size pgr_get_npages (const struct pager *p);
+u32 pgr_get_nframes (const struct pager *p);
 void i_log_page_table (int log_level, struct pager *p);
 
+// Stats
+void pgr_get_stats (struct pager *p, struct pgr_stats *dest);
+f64 pgr_stats_hit_ratio (const struct pgr_stats *s);
+void pgr_stats_fprint (FILE *out, const struct pgr_stats *s);
+void i_log_pgr_stats (int log_level, const struct pgr_stats *s);
+
 // Transaction control
 err_t pgr_begin_txn (struct txn *tx, struct pager *p, error *e);
+err_t pgr_begin_unlogged_txn (struct txn *tx, struct pager *p, error *e); // Bulk load - pages it allocates skip the WAL and are forced at commit
 err_t pgr_commit (struct pager *p, struct txn *tx, error *e);
-err_t pgr_checkpoint (struct pager *p, error *e); // Blocking - should be called in a sepearte thread
+err_t pgr_checkpoint (struct pager *p, error *e); // Fuzzy - doesn't stop writers but does the I/O, call from a separate thread
 
 // Page fetching
 err_t pgr_get (page_h *dest, int flags, pgno pgno, struct pager *p, error *e);
 err_t pgr_get_unverified (page_h *dest, pgno pgno, struct pager *p, error *e);
 err_t pgr_new (page_h *dest, struct pager *p, struct txn *tx, enum page_type ptype, error *e);
+err_t pgr_new_near (page_h *dest, struct pager *p, struct txn *tx, enum page_type ptype, pgno near, error *e); // Prefers the free page right after [near]
+void pgr_prefetch (struct pager *p, int flags, const pgno *pgs, u32 npgs); // Hint - loads [pgs] in the background if it can
 
 // Make writable
 err_t pgr_make_writable (struct pager *p, struct txn *tx, page_h *h, error *e);
@@ -61,6 +159,10 @@ err_t pgr_get_writable_no_tx (page_h *dest, int flags, pgno pg, struct pager *p,
 err_t pgr_save (struct pager *p, page_h *h, int flags, error *e);
 err_t pgr_delete_and_release (struct pager *p, struct txn *tx, page_h *h, error *e);
 
+// Compaction
+err_t pgr_relocate (page_h *dest, struct pager *p, struct txn *tx, page_h *h, error *e); // Moves [h] to the lowest free page below it - [dest] stays empty if there isn't one
+err_t pgr_shrink (struct pager *p, error *e);                                            // Cuts the free pages off the end of the file - its own transaction
+
 // Release
 err_t pgr_release_if_exists (struct pager *p, page_h *h, int flags, error *e);
 err_t pgr_release (struct pager *p, page_h *h, int flags, error *e);
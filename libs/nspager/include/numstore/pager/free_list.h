@@ -20,31 +20,74 @@
  */
 
 #include <numstore/pager/page.h>
+#include <numstore/pager/root_node.h>
+
+/**
+ * The file is cut into spans of FL_SPAN pages. The first page of each
+ * span holds the bitmap for it - the root node for span 0, a free list
+ * page after that. A set bit is a free page
+ *
+ * ============ PAGE START
+ * HEADER
+ * FREE     [bits]  - One bit per page in the span
+ * ============ PAGE END
+ */
 
 // OFFSETS and _Static_asserts
-#define FL_NEXT_OFST PG_COMMN_END
+#define FL_FREE_OFST PG_COMMN_END
 
-HEADER_FUNC void
-frlst_set_next (page *p, pgno pg)
-{
-  PAGE_SIMPLE_SET_IMPL (p, pg, TS_NEXT_OFST);
-}
+// Sized to what's left in the root node - free list pages waste a few bytes
+#define FL_SPAN ((pgno)(PAGE_SIZE - RN_FREE_OFST) * 8)
+
+_Static_assert (RN_FREE_OFST >= FL_FREE_OFST, "Root node bitmap must be the smaller one");
 
 HEADER_FUNC void
 frlst_init_empty (page *frlst)
 {
-  ASSERT (page_get_type (frlst) == PG_TOMBSTONE);
-  frlst_set_next (frlst, PGNO_NULL);
+  ASSERT (page_get_type (frlst) == PG_FREE_LIST);
+  i_memset (&frlst->raw[FL_FREE_OFST], 0, PAGE_SIZE - FL_FREE_OFST);
 }
 
+// The page holding [pg]'s bit
 HEADER_FUNC pgno
-frlst_get_next (const page *p)
+frlst_map_pgno (pgno pg)
+{
+  return pg - pg % FL_SPAN;
+}
+
+HEADER_FUNC p_size
+frlst_free_ofst (const page *map)
 {
-  PAGE_SIMPLE_GET_IMPL (p, pgno, TS_NEXT_OFST);
+  ASSERT (page_get_type (map) & (PG_FREE_LIST | PG_ROOT_NODE));
+  return page_get_type (map) == PG_ROOT_NODE ? RN_FREE_OFST : FL_FREE_OFST;
 }
 
+HEADER_FUNC bool
+frlst_is_free (const page *map, pgno pg)
+{
+  ASSERT (frlst_map_pgno (pg) == map->pg);
+  pgno i = pg % FL_SPAN;
+  return (map->raw[frlst_free_ofst (map) + i / 8] >> (i % 8)) & 1;
+}
+
+HEADER_FUNC void
+frlst_set_free (page *map, pgno pg, bool free)
+{
+  ASSERT (frlst_map_pgno (pg) == map->pg);
+  pgno i = pg % FL_SPAN;
+  u8 *byte = &map->raw[frlst_free_ofst (map) + i / 8];
+  *byte = free ? (u8)(*byte | (1u << (i % 8))) : (u8)(*byte & ~(1u << (i % 8)));
+}
+
+// First free bit in [from, to) of [map]'s span, or [to] if there isn't one
+pgno frlst_find_free (const page *map, pgno from, pgno to);
+
+// One past the last used page in [0, to) of [map]'s span - the map page itself always is
+pgno frlst_used_end (const page *map, pgno to);
+pgno frlst_count_free (const page *map);
+
 // Validation
-err_t frlst_validate_for_db (const page *hl, error *e);
+err_t frlst_validate_for_db (const page *p, error *e);
 
 // Utils
 void i_log_frlst (int level, const page *t);
@@ -40,6 +40,9 @@ enum page_type
   PG_VAR_HASH_PAGE = (1 << 4), // A Hash Table for variable names - links to a linked list
   PG_VAR_PAGE = (1 << 5),      // A Single link in the hash table linked list
   PG_VAR_TAIL = (1 << 6),      // Overflow to a VAR_PAGE
+
+  // Free space map page types
+  PG_FREE_LIST = (1 << 7), // Free page bitmap for one span of the file
 };
 
 #define PG_ANY (PG_TOMBSTONE       \
@@ -48,7 +51,8 @@ enum page_type
                 | PG_INNER_NODE    \
                 | PG_VAR_HASH_PAGE \
                 | PG_VAR_PAGE      \
-                | PG_VAR_TAIL)
+                | PG_VAR_TAIL      \
+                | PG_FREE_LIST)
 
 // COMMON PAGE HEADER
 #define PG_CKSM_OFST ((p_size)0)
@@ -74,6 +78,11 @@ void page_init_empty (page *p, enum page_type t);
 // Validate
 err_t page_validate_for_db (const page *p, int page_types, error *e);
 
+// Checksums - over the page number and everything after the checksum field
+u32 page_compute_checksum (const page *p);
+void page_update_checksum (page *p);
+err_t page_verify_checksum (const page *p, error *e);
+
 ////////////////////////////////////////////////////////////
 /////// Utility Macros
 
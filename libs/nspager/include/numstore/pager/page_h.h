@@ -23,13 +23,17 @@
 #include <numstore/pager/page.h>
 #include <numstore/pager/page_delegate.h>
 
+/**
+ * pin keeps the frame resident. nreaders counts the S handles on it,
+ * an X handle is marked in flags. Both are guarded by the owning
+ * pager partition's latch
+ */
 struct page_frame
 {
   page page;
   u32 pin;
   u32 flags;
-  i32 wsibling;
-  struct latch latch;
+  u32 nreaders;
 };
 
 typedef struct
@@ -47,10 +51,10 @@ typedef struct
     struct page_frame *pgr;
   };
 
-  // Write context stuff
+  // Write context stuff - X writes go straight into pgr
   struct
   {
-    struct page_frame *pgw;
+    page *undo; // Before image, logged and dropped on save
     struct txn *tx;
   };
 } page_h;
@@ -63,21 +67,19 @@ DEFINE_DBG_ASSERT (page_h, page_h, h, {
     case PHM_S:
       {
         ASSERT (h->pgr);
-        ASSERT (h->pgw == NULL);
-        ASSERT (h->pgr->wsibling == -1);
+        ASSERT (h->undo == NULL);
         break;
       }
     case PHM_X:
       {
         ASSERT (h->pgr);
-        ASSERT (h->pgw);
-        ASSERT (h->pgr->wsibling >= 0);
+        ASSERT (h->undo);
         break;
       }
     case PHM_NONE:
       {
         ASSERT (h->pgr == NULL);
-        ASSERT (h->pgw == NULL);
+        ASSERT (h->undo == NULL);
         break;
       }
     }
@@ -88,7 +90,7 @@ DEFINE_DBG_ASSERT (page_h, page_h, h, {
   {                     \
     .mode = PHM_NONE,   \
     .pgr = NULL,        \
-    .pgw = NULL,        \
+    .undo = NULL,       \
   }
 
 HEADER_FUNC void
@@ -104,7 +106,7 @@ page_h_xfer_ownership_ptr (page_h *dest, page_h *src)
   *dest = *src;
   src->mode = PHM_NONE;
   src->pgr = NULL;
-  src->pgw = NULL;
+  src->undo = NULL;
 }
 
 HEADER_FUNC page_h
@@ -114,7 +116,7 @@ page_h_xfer_ownership (page_h *h)
   page_h ret = *h;
   h->mode = PHM_NONE;
   h->pgr = NULL;
-  h->pgw = NULL;
+  h->undo = NULL;
   return ret;
 }
 
@@ -139,7 +141,7 @@ page_h_w (const page_h *h)
       ASSERT (h->mode == PHM_X);
       UNREACHABLE ();
     }
-  return &h->pgw->page;
+  return &h->pgr->page;
 }
 
 HEADER_FUNC page *
@@ -155,24 +157,15 @@ page_h_w_or_null (const page_h *h)
       ASSERT (h->mode == PHM_X);
       UNREACHABLE ();
     }
-  return &h->pgw->page;
+  return &h->pgr->page;
 }
 
 HEADER_FUNC const page *
 page_h_ro (const page_h *h)
 {
   DBG_ASSERT (page_h, h);
-  if (h->mode == PHM_X)
-    {
-      return &h->pgw->page;
-    }
-  else if (h->mode == PHM_S)
-    {
-      return &h->pgr->page;
-    }
-
   ASSERT (h->mode != PHM_NONE);
-  UNREACHABLE ();
+  return &h->pgr->page;
 }
 
 HEADER_FUNC const page *
@@ -190,21 +183,8 @@ HEADER_FUNC pgno
 page_h_pgno (const page_h *h)
 {
   DBG_ASSERT (page_h, h);
-  const page *p = NULL;
-  if (h->mode == PHM_X)
-    {
-      p = &h->pgw->page;
-    }
-  else if (h->mode == PHM_S)
-    {
-      p = &h->pgr->page;
-    }
-  else
-    {
-      ASSERT (h->mode != PHM_NONE);
-      UNREACHABLE ();
-    }
-  return p->pg;
+  ASSERT (h->mode != PHM_NONE);
+  return h->pgr->page.pg;
 }
 
 HEADER_FUNC pgno
@@ -221,21 +201,8 @@ HEADER_FUNC enum page_type
 page_h_type (const page_h *h)
 {
   DBG_ASSERT (page_h, h);
-  const page *p = NULL;
-  if (h->mode == PHM_X)
-    {
-      p = &h->pgw->page;
-    }
-  else if (h->mode == PHM_S)
-    {
-      p = &h->pgr->page;
-    }
-  else
-    {
-      ASSERT (h->mode != PHM_NONE);
-      UNREACHABLE ();
-    }
-  return page_get_type (p);
+  ASSERT (h->mode != PHM_NONE);
+  return page_get_type (&h->pgr->page);
 }
 
 HEADER_FUNC struct in_pair
@@ -25,22 +25,36 @@
 /**
  * ============ PAGE START
  * HEADER
- * FSTS     [pgno]  - First tombstone
+ * MAGC     [u32]   - RN_MAGIC
+ * VERS     [u32]   - On-disk format version
+ * NXPG     [pgno]  - First page number never handed out
  * MLSN     [lsn]   - Master lsn
+ * PGSZ     [p_size]- Page size the database was created with
+ * FREE     [bits]  - Free space map for pages [0, FL_SPAN) (see free_list.h)
  * ============ PAGE END
+ *
+ * Files from before the format was versioned have their first
+ * tombstone where MAGC / VERS are now, which never reads as RN_MAGIC
  */
 
+#define RN_MAGIC 0x4E554D53u   // "NUMS"
+#define RN_FORMAT_VERSION 1u // Bump on any change to what's on disk
+
 // OFFSETS and _Static_asserts
-#define RN_FSTS_OFST PG_COMMN_END                              // First tombstone
-#define RN_MLSN_OFST ((p_size) (RN_FSTS_OFST + sizeof (pgno))) // Master LSN
+#define RN_MAGC_OFST PG_COMMN_END                                // Magic
+#define RN_VERS_OFST ((p_size) (RN_MAGC_OFST + sizeof (u32)))    // Format version
+#define RN_NXPG_OFST ((p_size) (RN_VERS_OFST + sizeof (u32)))    // Next page
+#define RN_MLSN_OFST ((p_size) (RN_NXPG_OFST + sizeof (pgno)))   // Master LSN
+#define RN_PGSZ_OFST ((p_size) (RN_MLSN_OFST + sizeof (lsn)))    // Page size
+#define RN_FREE_OFST ((p_size) (RN_PGSZ_OFST + sizeof (p_size))) // Free bits
 
 // Initialization
 
 // Setters
 HEADER_FUNC void
-rn_set_first_tmbst (page *p, pgno pg)
+rn_set_next_pg (page *p, pgno pg)
 {
-  PAGE_SIMPLE_SET_IMPL (p, pg, RN_FSTS_OFST);
+  PAGE_SIMPLE_SET_IMPL (p, pg, RN_NXPG_OFST);
 }
 
 HEADER_FUNC void
@@ -49,19 +63,35 @@ rn_set_master_lsn (page *p, lsn pg)
   PAGE_SIMPLE_SET_IMPL (p, pg, RN_MLSN_OFST);
 }
 
+HEADER_FUNC void
+rn_set_page_size (page *p, p_size size)
+{
+  PAGE_SIMPLE_SET_IMPL (p, size, RN_PGSZ_OFST);
+}
+
+HEADER_FUNC void
+rn_set_format (page *p, u32 magic, u32 version)
+{
+  PAGE_SIMPLE_SET_IMPL (p, magic, RN_MAGC_OFST);
+  PAGE_SIMPLE_SET_IMPL (p, version, RN_VERS_OFST);
+}
+
 HEADER_FUNC void
 rn_init_empty (page *rn)
 {
   ASSERT (page_get_type (rn) == PG_ROOT_NODE);
-  rn_set_first_tmbst (rn, 1);
+  rn_set_format (rn, RN_MAGIC, RN_FORMAT_VERSION);
+  rn_set_next_pg (rn, 1);
   rn_set_master_lsn (rn, 0);
+  rn_set_page_size (rn, PAGE_SIZE);
+  i_memset (&rn->raw[RN_FREE_OFST], 0, PAGE_SIZE - RN_FREE_OFST);
 }
 
 // Getters
 HEADER_FUNC pgno
-rn_get_first_tmbst (const page *p)
+rn_get_next_pg (const page *p)
 {
-  PAGE_SIMPLE_GET_IMPL (p, pgno, RN_FSTS_OFST);
+  PAGE_SIMPLE_GET_IMPL (p, pgno, RN_NXPG_OFST);
 }
 
 HEADER_FUNC lsn
@@ -70,8 +100,28 @@ rn_get_master_lsn (const page *p)
   PAGE_SIMPLE_GET_IMPL (p, pgno, RN_MLSN_OFST);
 }
 
+HEADER_FUNC p_size
+rn_get_page_size (const page *p)
+{
+  PAGE_SIMPLE_GET_IMPL (p, p_size, RN_PGSZ_OFST);
+}
+
+HEADER_FUNC u32
+rn_get_magic (const page *p)
+{
+  PAGE_SIMPLE_GET_IMPL (p, u32, RN_MAGC_OFST);
+}
+
+HEADER_FUNC u32
+rn_get_version (const page *p)
+{
+  PAGE_SIMPLE_GET_IMPL (p, u32, RN_VERS_OFST);
+}
+
 // Validation
 err_t rn_validate_for_db (const page *p, error *e);
+err_t rn_check_format (const page *p, error *e); // Written by a build that lays pages out like this one
+
 
 // Utils
 void i_log_rn (int level, const page *rn);
@@ -84,6 +84,10 @@ struct txn
   struct hnode node;      // The node that indicates where this txn is in the att
   struct txn_lock *locks; // All held locks for this transaction
   struct latch l;         // Thread safety
+  bool unlogged;          // Pages it allocates aren't logged - see pgr_begin_unlogged_txn
+  lsn first_lsn;          // Its begin record - the log is kept from here on. 0 = not known
+  pgno extent_next;       // Unlogged: pages [extent_next, extent_end) are taken off the end but not handed out yet
+  pgno extent_end;
 };
 
 void txn_init (struct txn *dest, txid tid, struct txn_data data);
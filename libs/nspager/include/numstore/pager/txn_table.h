@@ -49,6 +49,7 @@ err_t txnt_merge_into (
     struct slab_alloc *alloc,
     error *e);
 slsn txnt_max_u_undo_lsn (struct txn_table *t);
+lsn txnt_min_first_lsn (struct txn_table *t, lsn upper); // Oldest first_lsn, at most [upper]
 void txnt_foreach (struct txn_table *t, void (*action) (struct txn *, void *ctx), void *ctx);
 u32 txnt_get_size (struct txn_table *dest);
 
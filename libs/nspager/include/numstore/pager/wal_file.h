@@ -29,12 +29,38 @@
 
 struct wal_file
 {
-  // Swap ostreams so we can flush in a seperate thread
+  // Opened on the first write - it flushes on its own thread
   struct wal_ostream *current_ostream;
   struct wal_istream istream;
   bool istream_open;
   const char *fname;
 
+  // Stats of ostreams that have since been closed
+  struct wal_stats retired;
+
+  // Group commit tunables handed to each ostream
+  u64 commit_delay_ns;
+  u32 commit_batch;
+
+  /**
+   * Full page writes. A page whose lsn is older than [fpw_lsn] (the
+   * last checkpoint begin, or the end of the log when it was opened)
+   * logs whole images on its next change - after that only deltas
+   */
+  lsn fpw_lsn;
+  u64 full_pages;
+
+  /**
+   * Segments. [ctl] is loaded (or made) with the first stream. Appends
+   * start where the log ends - a sequential read that runs into the end
+   * records it, otherwise opening the ostream looks for it
+   */
+  struct wal_ctl ctl;
+  bool ctl_open;
+  u64 seg_size; // For a new log - an existing one keeps its own
+  lsn end_lsn;
+  bool end_known;
+
   struct latch l;
 };
 
@@ -42,6 +68,9 @@ err_t walf_open (struct wal_file *dest, const char *fname, error *e);
 err_t walf_reset (struct wal_file *dest, error *e);
 err_t walf_close (struct wal_file *w, error *e);
 err_t walf_write_mode (struct wal_file *w, error *e);
+void walf_set_group_commit (struct wal_file *w, u64 delay_ns, u32 batch);
+void walf_set_segment_size (struct wal_file *w, u64 bytes);
+err_t walf_truncate (struct wal_file *w, lsn keep, error *e); // Nothing before [keep] is read again
 
 lsn walf_get_next_lsn (struct wal_file *w);
 
@@ -56,6 +85,8 @@ err_t walf_read (struct wal_rec_hdr_read *dest, lsn *rlsn, struct wal_file *w, e
 err_t walf_flush_to (struct wal_file *w, lsn l, error *e);
 err_t walf_flush_all (struct wal_file *w, error *e);
 
+void walf_get_stats (struct wal_file *w, struct wal_stats *dest);
+
 #ifndef NTEST
 err_t walf_crash (struct wal_file *w, error *e);
 #endif
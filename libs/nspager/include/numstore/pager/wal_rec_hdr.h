@@ -30,6 +30,8 @@ struct wal_update_read
   txid tid;
   lsn prev;
   pgno pg;
+  bool delta; // [undo] and [redo] are dlen byte deltas (see wal_delta_encode), not page images
+  u32 dlen;
   u8 undo[PAGE_SIZE];
   u8 redo[PAGE_SIZE];
 };
@@ -41,6 +43,8 @@ struct wal_update_write
   pgno pg;
   u8 *redo;
   u8 *undo;
+  lsn page_lsn; // Page lsn before the update - see walf_write_update
+  bool full;    // Log both images even if they barely differ
 };
 
 struct wal_begin
@@ -66,6 +70,8 @@ struct wal_clr_read
   lsn prev;
   pgno pg;
   lsn undo_next;
+  bool delta; // [redo] is a dlen byte delta
+  u32 dlen;
   u8 redo[PAGE_SIZE];
 };
 
@@ -76,6 +82,10 @@ struct wal_clr_write
   pgno pg;
   lsn undo_next;
   u8 *redo;
+  bool delta; // [redo] is a dlen byte delta - undoing a delta update
+  u32 dlen;
+  lsn page_lsn;    // Page lsn before the undo
+  const u8 *image; // Page after the undo - logged in place of a delta (see walf_write_clr). NULL keeps the delta
   u8 read_redo[PAGE_SIZE];
 };
 
@@ -104,6 +114,10 @@ enum wal_rec_hdr_type
   WL_EOF = 8,
 };
 
+// On disk tags of the delta forms - read back as WL_UPDATE / WL_CLR with .delta set
+#define WLH_UPDATE_DELTA ((wlh)9)
+#define WLH_CLR_DELTA ((wlh)10)
+
 struct wal_rec_hdr_read
 {
   enum wal_rec_hdr_type type;
@@ -171,6 +185,16 @@ struct wal_rec_hdr_write wrhw_from_wrhr (struct wal_rec_hdr_read *src);
                     + PAGE_SIZE     /* Data */            \
                     + sizeof (u32)) /* Checksum */
 
+// Update with byte deltas instead of images - at most WL_DELTA_MAX each
+#define WL_UPDATE_DELTA_MAX_LEN (sizeof (wlh)    /* header */         \
+                                 + sizeof (txid) /* transaction id */ \
+                                 + sizeof (lsn)  /* prev lsn */       \
+                                 + sizeof (pgno) /* ref page */       \
+                                 + sizeof (u32)  /* delta length */   \
+                                 + WL_DELTA_MAX  /* Undo */           \
+                                 + WL_DELTA_MAX  /* Redo */           \
+                                 + sizeof (u32)) /* Checksum */
+
 #define WL_CKPT_BEGIN_LEN (sizeof (wlh)    /* Header */ \
                            + sizeof (u32)) /* Checksum */
 
@@ -179,6 +203,34 @@ struct wal_rec_hdr_write wrhw_from_wrhr (struct wal_rec_hdr_read *src);
                              + MAX_DPGT_SRL_SIZE /* dptgt */  \
                              + sizeof (u32))     /* Checksum */
 
+/**
+ * Byte deltas. A delta is a run of entries
+ *
+ *   [ u16 ofst ][ u16 len ][ len bytes ]
+ *
+ * An update logs two over the same ranges - the bytes before (undo) and
+ * after (redo). Applying one copies the bytes back in, so it only works
+ * on the page state it was taken against. ARIES only redoes onto a page
+ * older than the record, and only undoes after every later update to
+ * the page by the same transaction was undone - that's the page state.
+ *
+ * Past WL_DELTA_MAX bytes the update logs whole images instead. So
+ * does the first change to a page after a checkpoint begins - a delta
+ * can't repair a page the crash tore in half, but redo puts a whole
+ * image over a page that fails its checksum
+ */
+#define WL_DELTA_MAX (PAGE_SIZE / 2)
+#define WL_DELTA_GAP 4 // Equal bytes a range runs over rather than start a new one
+
+bool wal_delta_encode (u8 *undo_dest, u8 *redo_dest, u32 *dlen, const u8 *undo, const u8 *redo); // false - too big
+err_t wal_delta_validate (const u8 *delta, u32 dlen, error *e);
+void wal_delta_apply (u8 *raw, const u8 *delta, u32 dlen);
+
+// Undo / redo a record onto [raw] - whichever form it was logged in
+void wal_update_undo (u8 *raw, const struct wal_update_read *r);
+void wal_update_redo (u8 *raw, const struct wal_update_read *r);
+void wal_clr_redo (u8 *raw, const struct wal_clr_read *r);
+
 stxid wrh_get_tid (struct wal_rec_hdr_read *h);
 slsn wrh_get_prev_lsn (struct wal_rec_hdr_read *h);
 void i_log_wal_rec_hdr_read (int log_level, struct wal_rec_hdr_read *r);
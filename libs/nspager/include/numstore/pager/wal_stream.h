@@ -25,47 +25,146 @@
 
 #include "config.h"
 
+struct wal_stats
+{
+  u64 fsyncs;       // One per segment file a flush writes to
+  u64 bytes;        // Bytes written out
+  u64 fsync_ns;     // Time spent in fsyncs - with the writes linked ahead of them
+  u64 fsync_max_ns; // Slowest single fsync
+  u64 grouped;      // Flush requests that rode on another thread's fsync
+  u64 full_pages;   // Update / CLR records with whole page images after a checkpoint
+  u64 recycled;     // Truncated segments renamed to be written again
+  u64 removed;      // ... and removed, past WAL_SEGMENT_SPARES
+};
+
+/**
+ * Segments. The log is cut into [seg_size] byte files <fname>.<n> -
+ * segment n holds lsns [n * seg_size, (n + 1) * seg_size). lsns are still
+ * offsets into one long log and records run across segment ends.
+ *
+ * <fname> itself is a small control file: which log this is and where it
+ * starts now that the front has been truncated. Records checksum the log
+ * id and their own lsn, so whatever a reused segment (or a log from before
+ * a reset) still holds past the end never reads back as a record
+ */
+struct wal_ctl
+{
+  u64 log_id;
+  u64 seg_size;
+  lsn start_lsn; // First record still in the log
+};
+
+err_t walctl_read (struct wal_ctl *dest, bool *exists, const char *fname, error *e); // ERR_CORRUPT if it doesn't check out
+err_t walctl_write (const char *fname, const struct wal_ctl *src, error *e);         // Synced before it returns
+
+void walseg_name (char dest[MAX_FILE_NAME], const char *fname, u64 seg);
+err_t walseg_open (i_file *dest, bool *exists, const char *fname, u64 seg, error *e);
+err_t walseg_create (i_file *dest, const char *fname, u64 seg, u64 seg_size, error *e); // Preallocated to [seg_size]
+err_t walseg_remove_from (const char *fname, u64 seg, error *e);                       // [seg] and every one after it
+
+/**
+ * Appenders copy records into [buffer] and never write it themselves.
+ * A flusher thread writes and fsyncs what's buffered while appends keep
+ * going into the free space behind it - the bytes in flight aren't
+ * consumed until it's done. The buffer is WAL_BUFFERS slices: the
+ * flusher starts as soon as one fills, so an appender only waits on
+ * the disk when every slice is full.
+ *
+ * Group commit - a flush request that isn't durable yet queues up,
+ * wakes the flusher and waits on [flushed] for [durable_lsn] to pass
+ * it. Everyone queued when a flush starts goes out in its one write +
+ * fsync. The flusher can hold off for [commit_delay_ns] until
+ * [commit_batch] requests have queued. Off by default - the fsync in
+ * flight is usually a long enough window on its own
+ */
 struct wal_ostream
 {
-  i_file fd;
-  struct latch l;
+  i_aio aio;      // Linked writes + fsync per segment flushed
+  struct latch l; // The buffer, flushed_lsn and rec_end
   lsn flushed_lsn;
+  lsn rec_end; // End of the last whole record appended
+
+  // Group commit - lock gl before l
+  i_mutex gl;
+  i_cond flushed;  // Appenders and flush requests wait on the flusher
+  i_cond work;     // ... and it waits on them
+  bool flushing;   // A flush is being written
+  lsn durable_lsn; // Every record that starts below this is on disk
+  lsn requested;   // Buffer end the latest flush request wants out
+  u32 nwaiting;    // Flush requests queued for the next flush
+  u64 nflushes;    // Flushes started
+  u64 commit_delay_ns;
+  u32 commit_batch;
+
+  i_thread flusher;
+  bool closing;
+  bool failed; // A write or fsync failed - nothing more goes out, [ferr] says why
+  error ferr;
+
+  // Written by the flusher, read atomically by walos_get_stats
+  i_timer timer;
+  struct wal_stats stats;
+
+  /**
+   * Segment files. The flusher writes through [fd] - segment [seg] - and
+   * opens the next one when a flush runs past it. Segments [first_seg,
+   * seg) are what the log still needs behind it, (seg, last_seg] are
+   * spares renamed out of the way by walos_recycle. Lock sl after gl.
+   */
+  const char *fname;
+  u64 seg_size;
+  i_mutex sl; // Creating, renaming and removing segments
+  i_file fd;
+  u64 seg;
+  u64 first_seg;
+  u64 last_seg;
 
   struct cbuffer buffer;
   u8 _buffer[WAL_BUFFER_CAP];
 };
 
 // Lifecycle
-struct wal_ostream *walos_open (const char *fname, error *e);
+struct wal_ostream *walos_open (const char *fname, u64 seg_size, lsn end, u64 first_seg, error *e); // Appends at [end]
 err_t walos_close (struct wal_ostream *w, error *e);
 
+void walos_set_group_commit (struct wal_ostream *w, u64 delay_ns, u32 batch);
+
 // Flush
-err_t walos_flush_to (struct wal_ostream *w, lsn l, error *e);
+err_t walos_flush_to (struct wal_ostream *w, lsn l, error *e); // Durable through the record at [l]
 err_t walos_flush_all (struct wal_ostream *w, error *e);
 
 // Write
 err_t walos_write_all (struct wal_ostream *w, u32 *checksum, const void *data, u32 len, error *e);
+void walos_mark_end_log (struct wal_ostream *w);
 lsn walos_get_next_lsn (struct wal_ostream *w);
-err_t walos_truncate (struct wal_ostream *w, u64 howmuch, error *e);
+void walos_get_stats (struct wal_ostream *w, struct wal_stats *dest);
+err_t walos_recycle (struct wal_ostream *w, lsn keep, error *e); // Give back the segments wholly below [keep]
 
+/**
+ * Reads go to whichever segment holds the lsn - one stays open. A
+ * segment that isn't there or runs out is the end of the log
+ */
 struct wal_istream
 {
   struct latch latch;
+  const char *fname;
+  u64 seg_size;
   i_file fd;
+  u64 seg;
+  bool fd_open;
   lsn curlsn;
   lsn lsnidx;
 };
 
 // Lifecycle
-err_t walis_open (struct wal_istream *dest, const char *fname, error *e);
+err_t walis_open (struct wal_istream *dest, const char *fname, u64 seg_size, lsn start, error *e);
 err_t walis_close (struct wal_istream *w, error *e);
 
-// Writing
+// Reading
 err_t walis_seek (struct wal_istream *w, u64 pos, error *e);
 void walis_mark_start_log (struct wal_istream *w);
 err_t walis_read_all (struct wal_istream *w, bool *iseof, lsn *rlsn, u32 *checksum, void *data, u32 len, error *e);
 void walis_mark_end_log (struct wal_istream *w);
-err_t walis_truncate (struct wal_istream *w, u64 howmuch, error *e);
 
 #ifndef NTEST
 err_t walos_crash (struct wal_ostream *w, error *e);
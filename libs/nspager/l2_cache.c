@@ -0,0 +1,356 @@
+/*
+ * Copyright 2025 Theo Lincke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *   Implements l2_cache.h. Scratch file of page slots behind the buffer pool.
+ */
+
+#include <l2_cache.h>
+
+#include <numstore/core/assert.h>
+#include <numstore/core/error.h>
+#include <numstore/intf/logging.h>
+#include <numstore/intf/stdlib.h>
+#include <numstore/test/testing.h>
+
+#include <config.h>
+
+enum
+{
+  L2C_USED = 1u << 0,
+  L2C_REF = 1u << 1, // Came back from the cache before - second chance
+};
+
+DEFINE_DBG_ASSERT (
+    struct l2_cache, l2_cache, c,
+    {
+      ASSERT (c);
+      ASSERT (c->nslots > 0);
+      ASSERT (c->nused <= c->nslots);
+      ASSERT (c->clock < c->nslots);
+    })
+
+/**
+ * Carve the bookkeeping out of one arena:
+ *
+ *   [ pgno x nslots ][ hentry_l2c x 2 * nslots ][ u8 x nslots ][ fname ]
+ */
+err_t
+l2c_open (struct l2_cache *dest, const char *fname, u64 bytes, error *e)
+{
+  ASSERT (dest);
+  ASSERT (fname);
+
+  u64 nslots = MIN (bytes / PAGE_SIZE, (u64)I32_MAX / 2);
+  if (nslots == 0)
+    {
+      return error_causef (e, ERR_INVALID_ARGUMENT, "Second level cache of %" PRIu64 " bytes can't hold a page", bytes);
+    }
+
+  const u64 pg_bytes = nslots * sizeof (pgno);
+  const u64 ht_bytes = 2 * nslots * sizeof (hentry_l2c);
+  const u64 flag_bytes = nslots;
+  const u64 name_bytes = i_strlen (fname) + 1;
+
+  err_t_wrap (i_arena_alloc (&dest->mem, pg_bytes + ht_bytes + flag_bytes + name_bytes, false, e), e);
+
+  dest->slot_pg = dest->mem.data;
+  hentry_l2c *hdata = (hentry_l2c *)((u8 *)dest->slot_pg + pg_bytes);
+  dest->slot_flags = (u8 *)hdata + ht_bytes;
+  dest->fname = (char *)dest->slot_flags + flag_bytes;
+  i_memcpy (dest->fname, fname, name_bytes);
+
+  dest->nslots = (u32)nslots;
+  dest->nused = 0;
+  dest->clock = 0;
+  dest->failed = false;
+  dest->stats = (struct l2c_stats){ 0 };
+  ht_init_l2c (&dest->index, hdata, 2 * dest->nslots);
+
+  err_t_wrap_goto (i_mutex_create (&dest->l, e), failed, e);
+
+  // Whatever a previous run left in there is stale
+  err_t_wrap_goto (i_open_rw (&dest->f, fname, e), failed_mutex, e);
+  err_t_wrap_goto (i_truncate (&dest->f, 0, e), failed_file, e);
+  err_t_wrap_goto (i_truncate (&dest->f, nslots * PAGE_SIZE, e), failed_file, e);
+
+  i_log_info ("Second level cache: %u pages in %s\n", dest->nslots, fname);
+
+  return SUCCESS;
+
+failed_file:
+  i_close (&dest->f, e);
+  i_remove_quiet (fname, e);
+failed_mutex:
+  i_mutex_free (&dest->l);
+failed:
+  i_arena_free (&dest->mem);
+  return e->cause_code;
+}
+
+err_t
+l2c_close (struct l2_cache *c, error *e)
+{
+  DBG_ASSERT (l2_cache, c);
+
+  i_close (&c->f, e);
+  i_remove_quiet (c->fname, e);
+  i_mutex_free (&c->l);
+  i_arena_free (&c->mem);
+
+  return e->cause_code;
+}
+
+static void
+l2c_fail (struct l2_cache *c, error *e)
+{
+  i_log_warn ("Second level cache turned off after an I/O error: %s\n", e->cause_msg);
+  c->failed = true;
+}
+
+// Caller holds c->l
+static void
+l2c_forget (struct l2_cache *c, u32 slot)
+{
+  ASSERT (c->slot_flags[slot] & L2C_USED);
+  ht_delete_expect_l2c (&c->index, NULL, c->slot_pg[slot]);
+  c->slot_flags[slot] = 0;
+  c->nused--;
+}
+
+/**
+ * Move the clock hand onto a free slot, pushing out the first entry
+ * without a second chance. Caller holds c->l
+ */
+static u32
+l2c_reserve (struct l2_cache *c)
+{
+  // Twice round at most - the first lap can only clear reference bits
+  for (u32 i = 0; i < 2 * c->nslots; ++i)
+    {
+      u32 slot = c->clock;
+      c->clock = (c->clock + 1) % c->nslots;
+
+      if (!(c->slot_flags[slot] & L2C_USED))
+        {
+          return slot;
+        }
+
+      if (c->slot_flags[slot] & L2C_REF)
+        {
+          c->slot_flags[slot] &= (u8)~L2C_REF;
+          continue;
+        }
+
+      l2c_forget (c, slot);
+      c->stats.evictions++;
+      return slot;
+    }
+
+  UNREACHABLE ();
+}
+
+bool
+l2c_read (struct l2_cache *c, u8 *dest, pgno pg)
+{
+  DBG_ASSERT (l2_cache, c);
+
+  bool hit = false;
+  hdata_l2c data;
+  error e = error_create ();
+
+  i_mutex_lock (&c->l);
+
+  if (c->failed || ht_get_l2c (&c->index, &data, pg) != HTAR_SUCCESS)
+    {
+      c->stats.misses++;
+      goto theend;
+    }
+
+  if (i_pread_all_expect (&c->f, dest, PAGE_SIZE, (u64)data.value * PAGE_SIZE, &e))
+    {
+      l2c_fail (c, &e);
+      c->stats.misses++;
+      goto theend;
+    }
+
+  // The pool has it now
+  l2c_forget (c, data.value);
+  c->stats.hits++;
+  hit = true;
+
+theend:
+  i_mutex_unlock (&c->l);
+  return hit;
+}
+
+bool
+l2c_contains (struct l2_cache *c, pgno pg)
+{
+  DBG_ASSERT (l2_cache, c);
+
+  hdata_l2c data;
+
+  i_mutex_lock (&c->l);
+  bool ret = !c->failed && ht_get_l2c (&c->index, &data, pg) == HTAR_SUCCESS;
+  i_mutex_unlock (&c->l);
+
+  return ret;
+}
+
+void
+l2c_write (struct l2_cache *c, const u8 *src, pgno pg, bool reused)
+{
+  DBG_ASSERT (l2_cache, c);
+
+  hdata_l2c data;
+  error e = error_create ();
+
+  i_mutex_lock (&c->l);
+
+  if (c->failed)
+    {
+      goto theend;
+    }
+
+  // Exclusive with the pool, but don't count on it - overwrite in place
+  u32 slot;
+  if (ht_get_l2c (&c->index, &data, pg) == HTAR_SUCCESS)
+    {
+      slot = data.value;
+      l2c_forget (c, slot);
+    }
+  else
+    {
+      slot = l2c_reserve (c);
+    }
+
+  if (i_pwrite_all (&c->f, src, PAGE_SIZE, (u64)slot * PAGE_SIZE, &e))
+    {
+      l2c_fail (c, &e);
+      goto theend;
+    }
+
+  c->slot_pg[slot] = pg;
+  c->slot_flags[slot] = L2C_USED | (reused ? L2C_REF : 0);
+  c->nused++;
+  ht_insert_expect_l2c (&c->index, (hdata_l2c){ .key = pg, .value = slot });
+  c->stats.writes++;
+
+theend:
+  i_mutex_unlock (&c->l);
+}
+
+void
+l2c_drop (struct l2_cache *c, pgno pg)
+{
+  DBG_ASSERT (l2_cache, c);
+
+  hdata_l2c data;
+
+  i_mutex_lock (&c->l);
+  if (ht_get_l2c (&c->index, &data, pg) == HTAR_SUCCESS)
+    {
+      l2c_forget (c, data.value);
+    }
+  i_mutex_unlock (&c->l);
+}
+
+void
+l2c_drop_from (struct l2_cache *c, pgno end)
+{
+  DBG_ASSERT (l2_cache, c);
+
+  i_mutex_lock (&c->l);
+  for (u32 slot = 0; slot < c->nslots && c->nused > 0; ++slot)
+    {
+      if ((c->slot_flags[slot] & L2C_USED) && c->slot_pg[slot] >= end)
+        {
+          l2c_forget (c, slot);
+        }
+    }
+  i_mutex_unlock (&c->l);
+}
+
+void
+l2c_get_stats (struct l2_cache *c, struct l2c_stats *dest)
+{
+  DBG_ASSERT (l2_cache, c);
+
+  i_mutex_lock (&c->l);
+  *dest = c->stats;
+  i_mutex_unlock (&c->l);
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, l2c_read_write)
+{
+  error e = error_create ();
+  struct l2_cache c;
+  u8 src[PAGE_SIZE];
+  u8 dest[PAGE_SIZE];
+
+  test_err_t_wrap (l2c_open (&c, "test.l2", 4 * PAGE_SIZE, &e), &e);
+
+  TEST_CASE ("A hit returns the page and forgets it")
+  {
+    i_memset (src, 7, PAGE_SIZE);
+    l2c_write (&c, src, 10, false);
+    test_assert (l2c_contains (&c, 10));
+
+    test_assert (l2c_read (&c, dest, 10));
+    test_assert_memequal (dest, src, PAGE_SIZE);
+    test_assert (!l2c_contains (&c, 10));
+    test_assert (!l2c_read (&c, dest, 10));
+  }
+
+  TEST_CASE ("Full cache pushes out entries without a second chance")
+  {
+    for (pgno pg = 0; pg < 4; ++pg)
+      {
+        i_memset (src, (int)pg, PAGE_SIZE);
+        l2c_write (&c, src, pg, pg == 0);
+      }
+
+    // Page 0 was reused, so page 1 goes first
+    l2c_write (&c, src, 4, false);
+    test_assert (l2c_contains (&c, 0));
+    test_assert (!l2c_contains (&c, 1));
+    test_assert (l2c_contains (&c, 4));
+
+    test_assert (l2c_read (&c, dest, 2));
+    i_memset (src, 2, PAGE_SIZE);
+    test_assert_memequal (dest, src, PAGE_SIZE);
+  }
+
+  TEST_CASE ("Dropping the tail")
+  {
+    l2c_drop_from (&c, 3);
+    test_assert (l2c_contains (&c, 0));
+    test_assert (!l2c_contains (&c, 3));
+    test_assert (!l2c_contains (&c, 4));
+    test_assert_int_equal (c.nused, 1);
+  }
+
+  struct l2c_stats s;
+  l2c_get_stats (&c, &s);
+  test_assert_int_equal (s.hits, 2);
+  test_assert_int_equal (s.misses, 1);
+  test_assert_int_equal (s.writes, 6);
+  test_assert_int_equal (s.evictions, 1);
+
+  test_err_t_wrap (l2c_close (&c, &e), &e);
+}
+#endif
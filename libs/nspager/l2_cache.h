@@ -0,0 +1,85 @@
+#pragma once
+
+/*
+ * Copyright 2025 Theo Lincke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *   Second level page cache. Clean pages the buffer pool evicts are kept
+ *   in a scratch file on fast local storage so a later miss doesn't have
+ *   to go back to the (slower) database file.
+ */
+
+// core
+#include <numstore/core/error.h>
+#include <numstore/intf/os.h>
+#include <numstore/intf/types.h>
+
+#define VTYPE u32
+#define KTYPE pgno
+#define SUFFIX l2c
+#include <numstore/core/robin_hood_ht.h>
+#undef VTYPE
+#undef KTYPE
+#undef SUFFIX
+
+struct l2c_stats
+{
+  u64 hits;      // Buffer pool misses served from the cache file
+  u64 misses;    // ... that had to go to the database file
+  u64 writes;    // Evicted pages written to the cache file
+  u64 evictions; // Pages pushed out of it to make room
+};
+
+/**
+ * The file is [nslots] page slots. Slots are handed out by their own
+ * CLOCK - an entry gets a second chance if the page already came back
+ * from the cache once (it's being reused, not scanned).
+ *
+ * The cache is exclusive with the buffer pool: a hit hands the page
+ * back and forgets it, and anything else that loads a page drops its
+ * entry first. So an entry is always what the database file holds and
+ * dirty pages never need invalidating. The file is scratch - it starts
+ * empty and is removed on close.
+ *
+ * An I/O error on the cache file turns the cache off; the database
+ * file still has every page
+ */
+struct l2_cache
+{
+  i_file f;
+  i_mutex l; // Held across the I/O - a slot can't be reused mid read
+  bool failed;
+
+  u32 nslots;
+  u32 nused;
+  u32 clock;
+  pgno *slot_pg;   // pgno in each slot
+  u8 *slot_flags;  // L2C_USED | L2C_REF
+  hash_table_l2c index; // pgno -> slot
+  char *fname;
+
+  struct i_arena mem;
+  struct l2c_stats stats;
+};
+
+err_t l2c_open (struct l2_cache *dest, const char *fname, u64 bytes, error *e);
+err_t l2c_close (struct l2_cache *c, error *e);
+
+bool l2c_read (struct l2_cache *c, u8 *dest, pgno pg);           // Hit - [dest] has the page and the entry is gone
+bool l2c_contains (struct l2_cache *c, pgno pg);
+void l2c_write (struct l2_cache *c, const u8 *src, pgno pg, bool reused); // Best effort
+void l2c_drop (struct l2_cache *c, pgno pg);
+void l2c_drop_from (struct l2_cache *c, pgno end); // Every page >= [end] - the file shrank
+void l2c_get_stats (struct l2_cache *c, struct l2c_stats *dest);
@@ -22,8 +22,10 @@
 #include <numstore/pager/var_hash_page.h>
 #include <numstore/pager/var_page.h>
 
+#include <numstore/core/checksums.h>
 #include <numstore/core/random.h>
 #include <numstore/pager/data_list.h>
+#include <numstore/pager/free_list.h>
 #include <numstore/pager/inner_node.h>
 #include <numstore/pager/root_node.h>
 #include <numstore/pager/tombstone.h>
@@ -80,6 +82,11 @@ page_init_empty (page *p, enum page_type type)
         vh_init_empty (p);
         return;
       }
+    case PG_FREE_LIST:
+      {
+        frlst_init_empty (p);
+        return;
+      }
     }
   UNREACHABLE ();
 }
@@ -129,11 +136,112 @@ page_validate_for_db (const page *p, int flags, error *e)
       {
         return vh_validate_for_db (p, e);
       }
+    case PG_FREE_LIST:
+      {
+        return frlst_validate_for_db (p, e);
+      }
     }
 
   UNREACHABLE ();
 }
 
+/////////////////////////////////
+///////// CHECKSUMS
+
+u32
+page_compute_checksum (const page *p)
+{
+  DBG_ASSERT (page_base, p);
+
+  // The page number goes in too so a page written to the wrong spot doesn't pass
+  u32 ret = checksum_init ();
+  checksum_execute (&ret, (const u8 *)&p->pg, sizeof (p->pg));
+  checksum_execute (&ret, p->raw + PG_HEDR_OFST, PAGE_SIZE - PG_HEDR_OFST);
+  return ret;
+}
+
+void
+page_update_checksum (page *p)
+{
+  page_set_checksum (p, page_compute_checksum (p));
+}
+
+static bool
+page_is_zero (const page *p)
+{
+  for (u32 i = 0; i < PAGE_SIZE; ++i)
+    {
+      if (p->raw[i])
+        {
+          return false;
+        }
+    }
+  return true;
+}
+
+err_t
+page_verify_checksum (const page *p, error *e)
+{
+  DBG_ASSERT (page_base, p);
+
+  u32 expect = page_get_checksum (p);
+  u32 actual = page_compute_checksum (p);
+
+  if (expect == actual)
+    {
+      return SUCCESS;
+    }
+
+  // Handed out but never written - type validation has the final say on those
+  if (expect == 0 && page_is_zero (p))
+    {
+      return SUCCESS;
+    }
+
+  return error_causef (e, ERR_CORRUPT,
+                       "Page: %" PRpgno " failed its checksum. "
+                       "Expected: %" PRIu32 " got: %" PRIu32,
+                       p->pg, expect, actual);
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, page_verify_checksum)
+{
+  page p;
+  error e = error_create ();
+
+  page_init_empty (&p, PG_DATA_LIST);
+  p.pg = 7;
+  dl_set_used (&p, 10);
+  page_update_checksum (&p);
+
+  TEST_CASE ("Freshly updated page passes")
+  {
+    test_err_t_wrap (page_verify_checksum (&p, &e), &e);
+  }
+
+  TEST_CASE ("A flipped bit fails")
+  {
+    p.raw[PAGE_SIZE - 1] ^= 1;
+    test_err_t_check (page_verify_checksum (&p, &e), ERR_CORRUPT, &e);
+    p.raw[PAGE_SIZE - 1] ^= 1;
+  }
+
+  TEST_CASE ("The same bytes at another page number fail")
+  {
+    p.pg = 8;
+    test_err_t_check (page_verify_checksum (&p, &e), ERR_CORRUPT, &e);
+    p.pg = 7;
+  }
+
+  TEST_CASE ("A never written page passes")
+  {
+    i_memset (p.raw, 0, PAGE_SIZE);
+    test_err_t_wrap (page_verify_checksum (&p, &e), &e);
+  }
+}
+#endif
+
 /////////////////////////////////
 ///////// SETTERS
 
@@ -222,6 +330,11 @@ i_log_page (int log_level, const page *p)
         i_log_vh (log_level, p);
         return;
       }
+    case PG_FREE_LIST:
+      {
+        i_log_frlst (log_level, p);
+        return;
+      }
     }
   UNREACHABLE ();
 }
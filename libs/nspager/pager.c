@@ -24,6 +24,7 @@
 #include <numstore/core/dbl_buffer.h>
 #include <numstore/core/error.h>
 #include <numstore/core/latch.h>
+#include <numstore/core/macros.h>
 #include <numstore/core/max_capture.h>
 #include <numstore/core/random.h>
 #include <numstore/core/string.h>
@@ -33,6 +34,8 @@
 #include <numstore/pager.h>
 #include <numstore/pager/data_list.h>
 #include <numstore/pager/dirty_page_table.h>
+#include <numstore/pager/free_list.h>
+#include <numstore/pager/inner_node.h>
 #include <numstore/pager/lock_table.h>
 #include <numstore/pager/lt_lock.h>
 #include <numstore/pager/page.h>
@@ -83,9 +86,11 @@ pgr_flush (struct pager *p, struct page_frame *mp, error *e)
         }
 
       i_log_trace ("Page: %" PRpgno " flushed to wal, writing to file now\n", mp->page.pg);
+      page_update_checksum (&mp->page);
       err_t_wrap (fpgr_write (&p->fp, mp->page.raw, mp->page.pg, e), e);
 
       pf_clr (mp, PW_DIRTY);
+      pgr_part_of (p, mp->page.pg)->ndirty--;
 
       err_t_wrap (dpgt_remove_expect (&p->dpt, mp->page.pg, e), e);
     }
@@ -94,16 +99,23 @@ pgr_flush (struct pager *p, struct page_frame *mp, error *e)
 }
 
 static inline err_t
-pgr_evict (struct pager *p, struct page_frame *mp, error *e)
+pgr_evict (struct pager *p, struct pgr_part *pt, struct page_frame *mp, error *e)
 {
   DBG_ASSERT (pager, p);
   ASSERT (pf_check (mp, PW_PRESENT));
   ASSERT (!pf_check (mp, PW_X));
   ASSERT (mp->pin == 0);
 
+  pt->evictions++;
+  if (pf_check (mp, PW_DIRTY))
+    {
+      pt->dirty_evictions++;
+    }
+
   err_t_wrap (pgr_flush (p, mp, e), e);
 
-  ht_delete_expect_idx (&p->pgno_to_value, NULL, mp->page.pg);
+  ht_delete_expect_idx (&pt->pgno_to_value, NULL, mp->page.pg);
+  pgr_policy_on_evict (pt, mp);
   mp->flags = 0;
   pf_clr (mp, PW_PRESENT);
 
@@ -116,16 +128,23 @@ pgr_evict_all (struct pager *pg, error *e)
   // Should be called when there are no PW_X in the db
   DBG_ASSERT (pager, pg);
 
-  for (u32 i = 0; i < MEMORY_PAGE_LEN; ++i)
+  for (u32 j = 0; j < pg->nparts; ++j)
     {
-      struct page_frame *mp = &pg->pages[pg->clock];
+      struct pgr_part *pt = &pg->parts[j];
 
-      if (pf_check (mp, PW_PRESENT))
+      i_mutex_lock (&pt->l);
+      for (u32 i = 0; i < pt->nframes; ++i)
         {
-          pgr_evict (pg, mp, e);
-        }
+          struct page_frame *mp = pgr_part_clock_frame (pg, pt);
+
+          if (pf_check (mp, PW_PRESENT))
+            {
+              pgr_evict (pg, pt, mp, e);
+            }
 
-      pg->clock = (pg->clock + 1) % MEMORY_PAGE_LEN;
+          pgr_part_tick (pt);
+        }
+      i_mutex_unlock (&pt->l);
     }
 
   return e->cause_code;
@@ -136,1390 +155,4580 @@ pgr_flush_all (struct pager *pg, error *e)
 {
   DBG_ASSERT (pager, pg);
 
-  for (u32 i = 0; i < MEMORY_PAGE_LEN; ++i)
+  for (u32 j = 0; j < pg->nparts; ++j)
     {
-      struct page_frame *mp = &pg->pages[pg->clock];
+      struct pgr_part *pt = &pg->parts[j];
 
-      if (pf_check (mp, PW_PRESENT) && !pf_check (mp, PW_X))
+      i_mutex_lock (&pt->l);
+      for (u32 i = 0; i < pt->nframes; ++i)
         {
-          pgr_flush (pg, mp, e);
-        }
+          struct page_frame *mp = pgr_part_clock_frame (pg, pt);
 
-      pg->clock = (pg->clock + 1) % MEMORY_PAGE_LEN;
+          if (pf_check (mp, PW_PRESENT) && !pf_check (mp, PW_X))
+            {
+              pgr_flush (pg, mp, e);
+            }
+
+          pgr_part_tick (pt);
+        }
+      i_mutex_unlock (&pt->l);
     }
 
   return e->cause_code;
 }
 
-static inline err_t
-pgr_reserve_at_clock_thread_unsafe (struct pager *p, error *e)
+/**
+ * A clean victim goes to the second level cache on its way out. Dirty
+ * ones are written to the database file by the eviction and skipped.
+ * A clean frame is what a read of the database file would return, but
+ * the cleaner and checkpoints checksum the copy they write and not the
+ * frame, so the checksum is set here. The frame is claimed - nobody
+ * else is looking at it
+ */
+static inline void
+pgr_l2_admit (struct pager *p, struct page_frame *mp)
+{
+  if (!p->l2_enabled || pf_check (mp, PW_DIRTY))
+    {
+      return;
+    }
+
+  page_update_checksum (&mp->page);
+  l2c_write (&p->l2, mp->page.raw, mp->page.pg, pf_check (mp, PW_L2));
+}
+
+/**
+ * Load [pg] into [mp] from the second level cache. False if it's
+ * not there (or came back damaged) and the database file has to be read
+ */
+static inline bool
+pgr_l2_load (struct pager *p, struct page_frame *mp, pgno pg)
+{
+  if (!p->l2_enabled || !l2c_read (&p->l2, mp->page.raw, pg))
+    {
+      return false;
+    }
+
+  // The checksum covers the pgno - a slot read back for the wrong page fails it
+  mp->page.pg = pg;
+  if (page_verify_checksum (&mp->page, NULL))
+    {
+      i_log_warn ("Page %" PRpgno " is damaged in the second level cache, reading the database file\n", pg);
+      return false;
+    }
+
+  return true;
+}
+
+/**
+ * What a victim needs on its way out - written back if [dirty],
+ * otherwise copied to the second level cache. Runs without pt->l, the
+ * frame is claimed (pinned, PW_IO) so nothing reads or changes it
+ */
+static err_t
+pgr_victim_io (struct pager *p, struct page_frame *mp, bool dirty, error *e)
+{
+  if (!dirty)
+    {
+      pgr_l2_admit (p, mp);
+      return SUCCESS;
+    }
+
+  // WAL Invariant: Flush to wal before flushing to disk
+  if (!p->restarting)
+    {
+      err_t_wrap (wal_flush_to (&p->ww, page_get_page_lsn (&mp->page), e), e);
+    }
+
+  page_update_checksum (&mp->page);
+  return fpgr_write (&p->fp, mp->page.raw, mp->page.pg, e);
+}
+
+/**
+ * Claim a free frame of [pt] for a new page, evicting if needed. It
+ * comes back in [*dest] pinned and not present.
+ *
+ * A victim that needs I/O is marked PW_IO and written with pt->l
+ * dropped - lookups of it wait on the partition until it's gone. So
+ * the table may have changed by the time this returns and callers look
+ * their page up again. Caller holds pt->l
+ */
+static err_t
+pgr_reserve (struct pager *p, struct pgr_part *pt, struct page_frame **dest, error *e)
 {
   DBG_ASSERT (pager, p);
 
-  i_log_trace ("Pager reserving a spot in buffer pool\n");
+  i_log_trace ("Pager reserving a spot in buffer pool partition: %u\n", (u32)(pt - p->parts));
 
-  // 2 times so that we might clear an access bit
+  // 3 times so that the policy might clear an access bit and demote a hot page
   struct page_frame *mp;
-  for (u32 i = 0; i < 2 * MEMORY_PAGE_LEN; ++i)
+  for (u32 i = 0; i < 3 * pt->nframes; ++i)
     {
-      i_log_trace ("Reserve: checking page: %u\n", p->clock);
+      i_log_trace ("Reserve: checking page: %u\n", pt->start + pt->clock);
 
-      mp = &p->pages[p->clock];
+      mp = pgr_part_clock_frame (p, pt);
 
       // Found an empty spot
       if (!pf_check (mp, PW_PRESENT))
         {
-          i_log_trace ("Page: %u is not present, using this spot\n", p->clock);
+          i_log_trace ("Page: %u is not present, using this spot\n", pt->start + pt->clock);
           goto found_spot;
         }
 
       // Pinned, skip it
       if (mp->pin > 0)
         {
-          i_log_trace ("Page: %u is pinned with pin: %u, using this spot\n", p->clock, mp->pin);
-          p->clock = (p->clock + 1) % MEMORY_PAGE_LEN;
+          i_log_trace ("Page: %u is pinned with pin: %u, using this spot\n", pt->start + pt->clock, mp->pin);
+          pgr_part_tick (pt);
+          continue;
+        }
+
+      // Root, catalog and inner nodes have their own budget
+      if (pgr_tier_spare (pt, mp))
+        {
+          i_log_trace ("Page: %u held by the meta tier, skipping\n", pt->start + pt->clock);
+          pgr_part_tick (pt);
           continue;
         }
 
-      // Access bit is on - set off and continue
-      if (pf_check (mp, PW_ACCESS))
+      // Replacement policy gives it another chance
+      if (pgr_policy_spare (p, pt, mp))
         {
-          i_log_trace ("Page: %u has access bit: 1, clearing then skipping\n", p->clock);
-          pf_clr (mp, PW_ACCESS);
-          p->clock = (p->clock + 1) % MEMORY_PAGE_LEN;
+          i_log_trace ("Page: %u spared by replacement policy, skipping\n", pt->start + pt->clock);
+          pgr_part_tick (pt);
           continue;
         }
 
       // EVICT
-      i_log_trace ("Page: %u is present but doesn't have access bit, evicting\n", p->clock);
-      err_t_wrap (pgr_evict (p, mp, e), e);
-      goto found_spot;
+      i_log_trace ("Page: %u is present but not spared, evicting\n", pt->start + pt->clock);
+      goto evict;
     }
 
+  pt->pager_full++;
   return error_causef (e, ERR_PAGER_FULL, "Memory buffer pool is full");
 
-found_spot:
-  ASSERT (!pf_check (&p->pages[p->clock], PW_PRESENT));
-  return SUCCESS;
-}
-
-static err_t
-pgr_new_extend (page_h *dest, struct pager *p, struct txn *tx, error *e)
-{
-  DBG_ASSERT (pager, p);
-  DBG_ASSERT (page_h, dest);
-  ASSERT (dest->mode == PHM_NONE);
-
-  i_log_trace ("Creating new page by extending file\n");
-
-  pgno pg;
-  struct page_frame *pgr = NULL, *pgw = NULL;
-  u32 pgrloc;
-
-  err_t ret = SUCCESS;
+evict:
+  pt->evictions++;
+  pgr_part_pin (pt, mp);
+  pgr_part_tick (pt);
 
-  // Reserve the read page spot
-  latch_lock (&p->l);
-  {
-    ret = pgr_reserve_at_clock_thread_unsafe (p, e);
-    if (ret)
-      {
-        latch_unlock (&p->l);
-        goto theend;
-      }
-    pgrloc = p->clock;
-
-    pgr = &p->pages[pgrloc];
-    pgr->pin = 1;
-    pgr->flags = 0;
-    pgr->wsibling = -1;
-    pf_set (pgr, PW_ACCESS);
-    pf_set (pgr, PW_PRESENT);
-  }
-  latch_unlock (&p->l);
+  bool dirty = pf_check (mp, PW_DIRTY);
+  if (dirty || p->l2_enabled)
+    {
+      if (dirty)
+        {
+          pt->dirty_evictions++;
+        }
 
-  page_init_empty (&pgr->page, PG_TOMBSTONE);
-  tmbst_set_next (&pgr->page, fpgr_get_npages (&p->fp) + 1);
+      pf_set (mp, PW_IO);
+      i_mutex_unlock (&pt->l);
+      err_t ret = pgr_victim_io (p, mp, dirty, e);
+      i_mutex_lock (&pt->l);
+      pf_clr (mp, PW_IO);
+      pgr_part_wake (pt);
 
-  i_printf_trace ("Read buffer pool location: %d\n", pgrloc);
+      if (ret == SUCCESS && dirty)
+        {
+          pf_clr (mp, PW_DIRTY);
+          pt->ndirty--;
+          ret = dpgt_remove_expect (&p->dpt, mp->page.pg, e);
+        }
 
-  // Reserve the write page spot
-  latch_lock (&p->l);
-  {
-    ret = pgr_reserve_at_clock_thread_unsafe (p, e);
-    if (ret)
-      {
-        pgr->pin = 0;
-        pgr->flags = 0;
-        latch_unlock (&p->l);
-        goto theend;
-      }
+      if (ret)
+        {
+          pgr_part_unpin (pt, mp);
+          return ret;
+        }
+    }
 
-    pgr->wsibling = p->clock;
+  ht_delete_expect_idx (&pt->pgno_to_value, NULL, mp->page.pg);
+  pgr_policy_on_evict (pt, mp);
+  mp->flags = 0;
+  goto claimed;
 
-    pgw = &p->pages[p->clock];
-    pgw->pin = 1;
-    pgw->flags = 0;
-    pgw->wsibling = -1;
-    pf_set (pgw, PW_PRESENT);
-    pf_set (pgw, PW_X);
-  }
-  latch_unlock (&p->l);
+found_spot:
+  pgr_part_pin (pt, mp);
+  pgr_part_tick (pt);
 
-  i_printf_trace ("Write buffer pool location: %d\n", pgr->wsibling);
+claimed:
+  ASSERT (!pf_check (mp, PW_PRESENT));
 
-  /**
-   * Now we can actually extend the file
-   * TODO - You don't need to do this and we
-   * could reduce system calls by lazily extending the
-   * file and truncating it once on large pages
-   */
-  ret = fpgr_new (&p->fp, &pg, e);
-  if (ret)
+  // Counting the pin we just took
+  if (pt->npinned > pt->nframes - pt->nframes / 8)
     {
-      latch_lock (&p->l);
-      pgr->pin = 0;
-      pgr->flags = 0;
-      pgw->pin = 0;
-      pgw->flags = 0;
-      latch_unlock (&p->l);
-      goto theend;
+      pt->near_full++;
     }
+  *dest = mp;
+  return SUCCESS;
+}
 
-  i_printf_trace ("New page number: %" PRpgno "\n", pg);
-  i_memcpy (pgw->page.raw, pgr->page.raw, PAGE_SIZE);
-  pgr->page.pg = pg;
-  pgw->page.pg = pg;
-
-  // Mark page as dirty (will be added to DPT in pgr_save with proper LSN)
-  pf_set (pgr, PW_DIRTY);
-
-  // Insert page into the hash table
-  hdata_idx hd = (hdata_idx){ .key = pg, .value = pgrloc };
-  ht_insert_expect_idx (&p->pgno_to_value, hd);
+///////////////////////////////////////////////////////////
+////// BACKGROUND CLEANER
 
-  // Initialize page_h
-  dest->pgr = pgr;
-  dest->pgw = pgw;
-  dest->mode = PHM_X;
-  dest->tx = tx;
+/**
+ * The cleaner writes dirty, unpinned frames just ahead of each
+ * partition's clock hand (the next victims) so foreground eviction
+ * finds clean frames and rarely has to do I/O. It runs as a task on
+ * the thread pool handed to pgr_open, and only if that pool is spinning.
+ * Otherwise victims are written inline like before
+ */
 
-theend:
-  i_log_trace ("Done trying to extend new page. Exit code: %d\n", ret);
-  return ret;
+static inline bool
+pgr_part_needs_cleaning (const struct pgr_part *pt)
+{
+  u32 target = MAX (pt->nframes * CLEANER_TARGET_PCT / 100, 1u);
+  return pt->nframes - pt->ndirty < target;
 }
 
-///////////////////////////////////////////////////////////
-////// LIFECYCLE
-
-static struct pager *
-pgr_open_new (const char *fname, const char *walname, struct pager *p, error *e)
+/**
+ * Write [n] (at most CLEANER_BATCH) page copies taken out of their
+ * frames under the partition latch. No latch is held here
+ */
+static err_t
+pgr_write_copies (struct pager *p, page *copies, u32 n, error *e)
 {
-  i_log_info ("Creating new database: %s\n", fname);
-  if (fpgr_reset (&p->fp, e))
-    {
-      return NULL;
-    }
-  if (wal_reset (&p->ww, e))
+  // WAL Invariant: Flush to wal before flushing to disk - once for the whole batch
+  if (!p->restarting)
     {
-      return NULL;
+      lsn maxlsn = 0;
+      for (u32 i = 0; i < n; ++i)
+        {
+          maxlsn = MAX (maxlsn, page_get_page_lsn (&copies[i]));
+        }
+      err_t_wrap (wal_flush_to (&p->ww, maxlsn, e), e);
     }
 
-  if (txnt_open (&p->tnxt, e))
+  // One submission for the whole batch
+  const u8 *srcs[CLEANER_BATCH];
+  pgno pgs[CLEANER_BATCH];
+  for (u32 i = 0; i < n; ++i)
     {
-      return NULL;
+      page_update_checksum (&copies[i]);
+      srcs[i] = copies[i].raw;
+      pgs[i] = copies[i].pg;
     }
+  return fpgr_write_batch (&p->fp, srcs, pgs, n, e);
+}
 
-  p->next_tid = 1;
-
-  // The first transaction - create the root page
-  {
-    struct txn tx;
-
-    if (pgr_begin_txn (&tx, p, e))
-      {
-        return NULL;
-      }
+/**
+ * Write up to CLEANER_BATCH dirty frames of [pt]. Frames are
+ * snapshotted under the partition latch and pinned so they can't be
+ * evicted, then written without holding it. Sets [*progress] if
+ * anything was written.
+ *
+ * With [before] == NULL this is the background cleaner. Otherwise it's a
+ * checkpoint asking for every frame whose rec lsn is below *[before] -
+ * the partition's clean target doesn't matter, readers don't get in the
+ * way, and frames it had to skip because they're being modified are
+ * counted in [*busy]. If those are all that's left, it waits for one
+ * of them before returning
+ */
+static err_t
+pgr_clean_part (struct pager *p, struct pgr_part *pt, const lsn *before, bool *progress, u32 *busy, error *e)
+{
+  struct page_frame *batch[CLEANER_BATCH];
+  page *copies = p->cleaner_buf;
+  u32 n = 0;
 
-    page_h root = page_h_create ();
-    pgr_new_extend (&root, p, &tx, e);
-    page_init_empty (page_h_w (&root), PG_ROOT_NODE);
+  *progress = false;
+  *busy = 0;
 
-    // Save the root page to WAL before releasing
-    err_t_wrap_null_goto (pgr_save (p, &root, PG_ROOT_NODE, e) == SUCCESS ? p : NULL, failed, e);
-    pgr_release (p, &root, PG_ROOT_NODE, e);
+  i_mutex_lock (&pt->l);
+  if (before == NULL && !pgr_part_needs_cleaning (pt))
+    {
+      i_mutex_unlock (&pt->l);
+      return SUCCESS;
+    }
 
-    err_t ret = pgr_commit (p, &tx, e);
-    if (ret)
-      {
-        goto failed;
-      }
-  }
+  for (u32 i = 0; i < pt->nframes && n < CLEANER_BATCH; ++i)
+    {
+      struct page_frame *mp = &p->pages[pt->start + (pt->clock + i) % pt->nframes];
 
-  return p;
+      if (!pf_check (mp, PW_PRESENT) || !pf_check (mp, PW_DIRTY))
+        {
+          continue;
+        }
 
-failed:
-  txnt_close (&p->tnxt);
-  return NULL;
-}
+      if (before != NULL)
+        {
+          // Dirtied after the checkpoint began - not ours to write
+          lsn rec_lsn;
+          if (!dpgt_get (&rec_lsn, &p->dpt, mp->page.pg) || rec_lsn >= *before)
+            {
+              continue;
+            }
 
-static struct pager *
-pgr_open_existing (const char *fname, const char *walname, struct pager *ret, error *e)
-{
-  i_log_info ("Opening existing database: %s\n", fname);
+          // Being changed, or written out by an eviction
+          if (pf_check (mp, PW_X | PW_IO))
+            {
+              (*busy)++;
+              continue;
+            }
+        }
 
-  // Open the transaction table
-  if (txnt_open (&ret->tnxt, e))
-    {
-      return NULL;
-    }
+      // Skip anything in use or currently being modified
+      else if (pf_check (mp, PW_X) || mp->pin > 0)
+        {
+          continue;
+        }
 
-  // Run ARIES recovery if WAL is enabled
-  i_log_info ("Running ARIES recovery (analysis/redo/undo)...\n");
+      pgr_part_pin (pt, mp);
+      i_memcpy (&copies[n], &mp->page, sizeof (page));
 
-  i_log_info ("Read master LSN: %" PRlsn "\n", ret->master_lsn);
+      // A writer re-dirties the frame if it changes under us
+      pf_clr (mp, PW_DIRTY);
+      pt->ndirty--;
 
-  if (ret->master_lsn == 0)
-    {
-      i_log_info ("No checkpoint found, starting recovery from beginning\n");
+      batch[n++] = mp;
     }
-  else
+
+  /**
+   * Only busy frames left - sleep until one is let go. The scan and
+   * the wait are under one latch hold, so the wake can't slip between
+   */
+  if (n == 0 && *busy > 0)
     {
-      i_log_info ("Starting recovery from checkpoint at LSN %" PRlsn "\n", ret->master_lsn);
+      pgr_part_wait (pt);
     }
+  i_mutex_unlock (&pt->l);
 
-  struct aries_ctx ctx;
-  if (aries_ctx_create (&ctx, ret->master_lsn, e))
+  if (n == 0)
     {
-      goto failed;
+      return SUCCESS;
     }
-  err_t result = pgr_restart (ret, &ctx, e);
-  // Go back to write mode
-  if (result != SUCCESS)
+
+  err_t ret = pgr_write_copies (p, copies, n, e);
+
+  i_mutex_lock (&pt->l);
+  for (u32 i = 0; i < n; ++i)
     {
-      i_log_error ("ARIES recovery failed with error code %d: %s\n", e->cause_code, e->cause_msg);
-      goto failed;
-    }
+      struct page_frame *mp = batch[i];
 
-  i_log_info ("ARIES recovery completed successfully\n");
+      if (ret)
+        {
+          // Never made it to disk
+          if (!pf_check (mp, PW_DIRTY))
+            {
+              pf_set (mp, PW_DIRTY);
+              pt->ndirty++;
+            }
+        }
+      else if (!pf_check (mp, PW_DIRTY))
+        {
+          // Still clean - the disk copy is current, so it leaves the DPT
+          if (ret == SUCCESS)
+            {
+              ret = dpgt_remove_expect (&p->dpt, copies[i].pg, e);
+            }
+        }
 
-  // Enter optimized write mode
-  err_t_wrap_goto (wal_write_mode (&ret->ww, e), failed, e);
-  ret->next_tid = ctx.max_tid + 1;
+      pgr_part_unpin (pt, mp);
+    }
+  i_mutex_unlock (&pt->l);
 
-  i_log_info ("Opened existing database, starting with next_tid: %" PRtxid "\n", ret->next_tid);
+  *progress = ret == SUCCESS;
 
   return ret;
-
-failed:
-  txnt_close (&ret->tnxt);
-  return NULL;
 }
 
-static inline err_t
-pgr_is_new_guard (struct pager *p, error *e)
+/**
+ * cleaner_buf has a single owner - either the scheduled cleaner task
+ * or a checkpoint. These hand it back and forth
+ */
+static void
+pgr_cleaner_claim (struct pager *p)
 {
-  p->flags = p->flags & ~PF_ISNEW;
-
-  if (fpgr_get_npages (&p->fp) == 0)
+  i_mutex_lock (&p->cleaner_lock);
+  while (p->cleaner_scheduled)
     {
-      p->flags = p->flags | PF_ISNEW;
-      return SUCCESS;
+      i_cond_wait (&p->cleaner_idle, &p->cleaner_lock);
     }
-
-  page root;
-
-  err_t_wrap (fpgr_read (&p->fp, root.raw, ROOT_PGNO, e), e);
-  root.pg = ROOT_PGNO;
-
-  p->master_lsn = rn_get_master_lsn (&root);
-  p->first_tombstone = rn_get_first_tmbst (&root);
-
-  return SUCCESS;
+  p->cleaner_scheduled = true;
+  i_mutex_unlock (&p->cleaner_lock);
 }
 
-struct pager *
-pgr_open (const char *fname, const char *walname, struct lockt *lt, struct thread_pool *tp, error *e)
+static void
+pgr_cleaner_release (struct pager *p)
 {
-  struct pager *ret = NULL;
-  bool fpgr_opened = false;
-  bool dpt_opened = false;
-  bool wal_opened = false;
+  i_mutex_lock (&p->cleaner_lock);
+  p->cleaner_scheduled = false;
+  i_cond_broadcast (&p->cleaner_idle);
+  i_mutex_unlock (&p->cleaner_lock);
+}
 
-  // Allocate the pager
-  if ((ret = i_calloc (1, sizeof *ret, e)) == NULL)
+static void
+pgr_cleaner_task (void *ctx)
+{
+  struct pager *p = ctx;
+  error e = error_create ();
+
+  for (u32 i = 0; i < p->nparts; ++i)
     {
-      return NULL;
+      bool progress = true;
+      u32 busy;
+      while (progress)
+        {
+          if (pgr_clean_part (p, &p->parts[i], NULL, &progress, &busy, &e))
+            {
+              i_log_warn ("Page cleaner failed on partition %u: %s\n", i, e.cause_msg);
+              e.cause_code = SUCCESS;
+              break;
+            }
+        }
     }
 
-  // Initialize the file pager
-  err_t_wrap_goto (fpgr_open (&ret->fp, fname, e), failed, e);
-  fpgr_opened = true;
-
-  // Pull in the root node data values
-  err_t_wrap_goto (pgr_is_new_guard (ret, e), failed, e);
+  pgr_cleaner_release (p);
+}
 
-  // Open the dirty page table
-  err_t_wrap_goto (dpgt_open (&ret->dpt, e), failed, e);
-  dpt_opened = true;
+static void
+pgr_cleaner_maybe_wake (struct pager *p, struct pgr_part *pt)
+{
+  // Racy peek - worst case we wake a little early or late
+  if (!pgr_part_needs_cleaning (pt) || p->tp == NULL || !tp_is_spinning (p->tp))
+    {
+      return;
+    }
 
-  // Initialize the WAL
-  if (walname)
+  i_mutex_lock (&p->cleaner_lock);
+  if (!p->cleaner_scheduled)
     {
-      err_t_wrap_goto (wal_open (&ret->ww, walname, e), failed, e);
-      wal_opened = true;
+      error e = error_create ();
+      if (tp_add_task (p->tp, pgr_cleaner_task, p, &e) == SUCCESS)
+        {
+          p->cleaner_scheduled = true;
+        }
     }
-  else
+  i_mutex_unlock (&p->cleaner_lock);
+}
+
+// Waits out the cleaner and any queued read-ahead
+static void
+pgr_cleaner_wait (struct pager *p)
+{
+  i_mutex_lock (&p->cleaner_lock);
+  while (p->cleaner_scheduled || p->readahead_scheduled)
     {
-      panic ("TODO - optional WAL");
+      i_cond_wait (&p->cleaner_idle, &p->cleaner_lock);
     }
+  i_mutex_unlock (&p->cleaner_lock);
+}
 
-  // Initialize the hash table from pgno -> table index
-  ht_init_idx (&ret->pgno_to_value, ret->_hdata, MEMORY_PAGE_LEN);
+///////////////////////////////////////////////////////////
+////// READ-AHEAD
 
-  // Initialize internal latch
-  latch_init (&ret->l);
+/**
+ * Cursors that notice they're walking a data_list chain hand the pager
+ * the pgnos they're about to need. A task on the thread pool loads them
+ * into their partitions unpinned and without a reference, so an unused
+ * prefetch is the first thing the clock evicts and a scan can't push
+ * out the hot set. The first pgr_get of a prefetched frame counts as its
+ * load. Without a spinning pool there's nothing to overlap the reads
+ * with, so the hint is dropped
+ */
+/**
+ * Loads the read-ahead pages that hash to [pt] as one batch. Frames
+ * are claimed and published in the page table as PW_IO under the
+ * latch, read without it, and finished under it again. A lookup that
+ * gets to one first waits for the batch rather than reading it twice,
+ * and the rest of the partition keeps going meanwhile
+ */
+static err_t
+pgr_prefetch_part (struct pager *p, struct pgr_part *pt, int flags, const pgno *pgs, u32 npgs, error *e)
+{
+  struct page_frame *frames[READ_AHEAD_PAGES];
+  u8 *dests[READ_AHEAD_PAGES];
+  pgno loads[READ_AHEAD_PAGES];
+  bool valid[READ_AHEAD_PAGES];
+  u32 n = 0;
+  err_t ret = SUCCESS;
+
+  i_mutex_lock (&pt->l);
+
+  for (u32 i = 0; i < npgs; ++i)
+    {
+      hdata_idx data;
+      if (pgs[i] >= fpgr_get_npages (&p->fp) || ht_get_idx (&pt->pgno_to_value, &data, pgs[i]) == HTAR_SUCCESS)
+        {
+          continue;
+        }
+
+      // A miss on it is cheap already - and loading it from the database file would leave two copies
+      if (p->l2_enabled && l2c_contains (&p->l2, pgs[i]))
+        {
+          continue;
+        }
+
+      // Everything else is pinned - read what we've got
+      struct page_frame *mp;
+      if (pgr_reserve (p, pt, &mp, e))
+        {
+          e->cause_code = SUCCESS;
+          break;
+        }
 
-  // Initialize page frame latches
-  for (u32 i = 0; i < MEMORY_PAGE_LEN; ++i)
+      // Loaded while a victim was being written out
+      if (ht_get_idx (&pt->pgno_to_value, &data, pgs[i]) == HTAR_SUCCESS)
+        {
+          pgr_part_unpin (pt, mp);
+          continue;
+        }
+
+      mp->nreaders = 0;
+      mp->page.pg = pgs[i];
+      pf_set (mp, PW_PRESENT | PW_IO);
+      hdata_idx hd = (hdata_idx){ .key = pgs[i], .value = (u32)(mp - p->pages) };
+      ht_insert_expect_idx (&pt->pgno_to_value, hd);
+
+      frames[n] = mp;
+      dests[n] = mp->page.raw;
+      loads[n] = pgs[i];
+      n++;
+    }
+
+  i_mutex_unlock (&pt->l);
+
+  if (n == 0)
     {
-      latch_init (&ret->pages[i].latch);
+      return SUCCESS;
     }
 
-  // Simple variables
-  ret->clock = 0;
-  ret->next_tid = 1;
-  ret->lt = lt;
-  ret->tp = tp;
+  ret = fpgr_read_batch (&p->fp, dests, loads, n, e);
 
-  // More work
-  if (pgr_isnew (ret))
+  // Changed type since the cursor looked, or it's damaged - a real fetch reports it
+  for (u32 i = 0; i < n; ++i)
     {
-      err_t_wrap_null_goto (pgr_open_new (fname, walname, ret, e), failed, e);
+      struct page_frame *mp = frames[i];
+      mp->page.pg = loads[i];
+      valid[i] = ret == SUCCESS
+                 && page_verify_checksum (&mp->page, NULL) == SUCCESS
+                 && page_validate_for_db (&mp->page, flags, NULL) == SUCCESS;
     }
-  else
+
+  i_mutex_lock (&pt->l);
+  for (u32 i = 0; i < n; ++i)
     {
-      err_t_wrap_null_goto (pgr_open_existing (fname, walname, ret, e), failed, e);
+      struct page_frame *mp = frames[i];
+      pf_clr (mp, PW_IO);
+      pgr_part_unpin (pt, mp);
+
+      if (!valid[i])
+        {
+          ht_delete_expect_idx (&pt->pgno_to_value, NULL, loads[i]);
+          mp->flags = 0;
+          continue;
+        }
+
+      pf_set (mp, PW_PREFETCH);
+      pt->readahead++;
     }
+  pgr_part_wake (pt);
+  i_mutex_unlock (&pt->l);
 
-  DBG_ASSERT (pager, ret);
   return ret;
+}
 
-failed:
-  ASSERT (e->cause_code);
-  // latch doesn't need cleanup
-  if (ret && dpt_opened)
+static void
+pgr_readahead_task (void *ctx)
+{
+  struct pager *p = ctx;
+  error e = error_create ();
+
+  // Split by partition, keeping the order within each
+  bool taken[READ_AHEAD_PAGES] = { 0 };
+  for (u32 i = 0; i < p->readahead_npgs; ++i)
     {
-      dpgt_close (&ret->dpt);
+      if (taken[i])
+        {
+          continue;
+        }
+
+      struct pgr_part *pt = pgr_part_of (p, p->readahead_pgs[i]);
+      pgno pgs[READ_AHEAD_PAGES];
+      u32 n = 0;
+      for (u32 j = i; j < p->readahead_npgs; ++j)
+        {
+          if (!taken[j] && pgr_part_of (p, p->readahead_pgs[j]) == pt)
+            {
+              taken[j] = true;
+              pgs[n++] = p->readahead_pgs[j];
+            }
+        }
+
+      if (pgr_prefetch_part (p, pt, p->readahead_flags, pgs, n, &e))
+        {
+          // Pool full of pinned pages or an I/O error - the foreground will see it too
+          i_log_debug ("Read-ahead stopped at page %" PRpgno ": %s\n", p->readahead_pgs[i], e.cause_msg);
+          break;
+        }
     }
-  if (ret && wal_opened)
+
+  i_mutex_lock (&p->cleaner_lock);
+  p->readahead_scheduled = false;
+  i_cond_broadcast (&p->cleaner_idle);
+  i_mutex_unlock (&p->cleaner_lock);
+}
+
+void
+pgr_prefetch (struct pager *p, int flags, const pgno *pgs, u32 npgs)
+{
+  DBG_ASSERT (pager, p);
+
+  if (npgs == 0 || p->restarting || p->tp == NULL || !tp_is_spinning (p->tp))
     {
-      wal_close (&ret->ww, e);
+      return;
     }
-  if (ret && fpgr_opened)
+
+  i_mutex_lock (&p->cleaner_lock);
+  if (!p->readahead_scheduled)
     {
-      fpgr_close (&ret->fp, e);
+      p->readahead_flags = flags;
+      // Never more than a quarter of the pool - read-ahead shouldn't churn what it feeds
+      p->readahead_npgs = MIN (MIN (npgs, (u32)READ_AHEAD_PAGES), MAX (p->nframes / 4, 1u));
+      i_memcpy (p->readahead_pgs, pgs, p->readahead_npgs * sizeof (pgno));
+
+      error e = error_create ();
+      if (tp_add_task (p->tp, pgr_readahead_task, p, &e) == SUCCESS)
+        {
+          p->readahead_scheduled = true;
+        }
     }
-  if (pgr_isnew (ret))
+  i_mutex_unlock (&p->cleaner_lock);
+}
+
+// Defined with the free space map below
+static err_t pgr_get_free_writable (page_h *dest, struct txn *tx, pgno pg, struct pager *p, error *e);
+
+// Defined with checkpoints below
+static err_t pgr_checkpoint_flush (struct pager *p, lsn ckpt_lsn, error *e);
+
+///////////////////////////////////////////////////////////
+////// LIFECYCLE
+
+static struct pager *
+pgr_open_new (const char *fname, const char *walname, struct pager *p, error *e)
+{
+  i_log_info ("Creating new database: %s\n", fname);
+  if (fpgr_reset (&p->fp, e))
     {
-      i_remove_quiet (fname, e);
-      i_remove_quiet (walname, e);
+      return NULL;
     }
-  if (ret)
+  if (wal_reset (&p->ww, e))
     {
-      i_free (ret);
+      return NULL;
     }
-  return NULL;
-}
 
-bool
-pgr_isnew (struct pager *p)
-{
-  return p->flags && PF_ISNEW;
-}
+  if (txnt_open (&p->tnxt, e))
+    {
+      return NULL;
+    }
 
-#ifndef NTEST
-TEST (TT_UNIT, pager_open)
-{
-  error e = error_create ();
+  p->next_tid = 1;
 
-  /* Green path */
+  // The first transaction - create the root page
   {
-    test_fail_if (i_remove_quiet ("test.db", &e));
-    test_fail_if (i_remove_quiet ("test.wal", &e));
-
-    struct lockt lt;
-    test_err_t_wrap (lockt_init (&lt, &e), &e);
+    struct txn tx;
 
-    struct thread_pool *tp = tp_open (&e);
-    test_fail_if_null (tp);
+    if (pgr_begin_txn (&tx, p, e))
+      {
+        return NULL;
+      }
 
-    struct pager *p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+    page_h root = page_h_create ();
+    if (pgr_get_free_writable (&root, &tx, ROOT_PGNO, p, e))
+      {
+        goto failed;
+      }
+    page_init_empty (page_h_w (&root), PG_ROOT_NODE);
 
-    test_fail_if_null (p);
-    test_err_t_wrap (pgr_close (p, &e), &e);
+    // Save the root page to WAL before releasing
+    err_t_wrap_null_goto (pgr_save (p, &root, PG_ROOT_NODE, e) == SUCCESS ? p : NULL, failed, e);
+    pgr_release (p, &root, PG_ROOT_NODE, e);
 
-    test_err_t_wrap (tp_free (tp, &e), &e);
-    lockt_destroy (&lt);
+    err_t ret = pgr_commit (p, &tx, e);
+    if (ret)
+      {
+        goto failed;
+      }
   }
+
+  return p;
+
+failed:
+  txnt_close (&p->tnxt);
+  return NULL;
 }
-#endif
 
-#ifndef NTEST
-TEST (TT_UNIT, pgr_open_basic)
+static struct pager *
+pgr_open_existing (const char *fname, const char *walname, struct pager *ret, error *e)
 {
-  error e = error_create ();
-  test_fail_if (i_remove_quiet ("test.db", &e));
-  test_fail_if (i_remove_quiet ("test.wal", &e));
+  i_log_info ("Opening existing database: %s\n", fname);
 
-  struct lockt lt;
-  test_err_t_wrap (lockt_init (&lt, &e), &e);
+  // Open the transaction table
+  if (txnt_open (&ret->tnxt, e))
+    {
+      return NULL;
+    }
 
-  struct thread_pool *tp = tp_open (&e);
-  test_fail_if_null (tp);
+  // Run ARIES recovery if WAL is enabled
+  i_log_info ("Running ARIES recovery (analysis/redo/undo)...\n");
 
-  i_file fp;
-  test_err_t_wrap (i_open_rw (&fp, "test.db", &e), &e);
+  i_log_info ("Read master LSN: %" PRlsn "\n", ret->master_lsn);
 
-  struct pager *p;
+  if (ret->master_lsn == 0)
+    {
+      i_log_info ("No checkpoint found, starting recovery from beginning\n");
+    }
+  else
+    {
+      i_log_info ("Starting recovery from checkpoint at LSN %" PRlsn "\n", ret->master_lsn);
+    }
 
-  /* File is shorter than page size */
-  test_fail_if (i_truncate (&fp, PAGE_SIZE - 1, &e));
-  p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
-  test_assert_int_equal (e.cause_code, ERR_CORRUPT);
-  test_assert_equal (p, NULL);
-  e.cause_code = SUCCESS;
+  struct aries_ctx ctx;
+  if (aries_ctx_create (&ctx, ret->master_lsn, e))
+    {
+      goto failed;
+    }
+  err_t result = pgr_restart (ret, &ctx, e);
+  // Go back to write mode
+  if (result != SUCCESS)
+    {
+      i_log_error ("ARIES recovery failed with error code %d: %s\n", e->cause_code, e->cause_msg);
+      goto failed;
+    }
+
+  i_log_info ("ARIES recovery completed successfully\n");
+
+  // Enter optimized write mode
+  err_t_wrap_goto (wal_write_mode (&ret->ww, e), failed, e);
+  ret->next_tid = ctx.max_tid + 1;
+
+  i_log_info ("Opened existing database, starting with next_tid: %" PRtxid "\n", ret->next_tid);
+
+  return ret;
+
+failed:
+  txnt_close (&ret->tnxt);
+  return NULL;
+}
+
+static inline err_t
+pgr_is_new_guard (struct pager *p, error *e)
+{
+  p->flags = p->flags & ~PF_ISNEW;
+
+  if (fpgr_get_npages (&p->fp) == 0)
+    {
+      p->flags = p->flags | PF_ISNEW;
+      return SUCCESS;
+    }
+
+  page root;
+
+  err_t_wrap (fpgr_read (&p->fp, root.raw, ROOT_PGNO, e), e);
+  root.pg = ROOT_PGNO;
+
+  // Another format or page size can't be read at all - refuse it before
+  // anything checksums a page. A root that never made it to disk before
+  // a crash is zeros - redo rebuilds it
+  if (page_get_type (&root) != 0)
+    {
+      err_t_wrap (rn_check_format (&root, e), e);
+    }
+
+  p->master_lsn = rn_get_master_lsn (&root);
+  p->trunc_lsn = 0;
+  p->fsm_hint = 0;
+
+  return SUCCESS;
+}
+
+static void
+pgr_pool_free (struct pager *p)
+{
+  for (u32 i = 0; i < p->nparts; ++i)
+    {
+      i_cond_free (&p->parts[i].wait);
+      i_mutex_free (&p->parts[i].l);
+    }
+  i_arena_free (&p->pool);
+}
+
+/**
+ * Carve the buffer pool out of a single arena:
+ *
+ *   [ page_frame x nframes ][ pgr_part x nparts ][ hentry_idx x 2 * nframes ][ page x CLEANER_BATCH ]
+ *
+ * Each partition's page table gets twice the slots of its frames so
+ * robin hood probe lengths stay short at a full pool
+ */
+static err_t
+pgr_pool_alloc (struct pager *p, struct pgr_params params, error *e)
+{
+  const u64 per_frame = sizeof (struct page_frame) + 2 * sizeof (hentry_idx);
+
+  u64 nframes = params.memory_budget / per_frame;
+  nframes = MAX (nframes, (u64)MEMORY_PAGE_LEN);
+
+  // Page table values are u32 and it holds 2 * nframes slots
+  nframes = MIN (nframes, (u64)I32_MAX / 2);
+
+  u64 nparts = params.npartitions;
+  if (nparts == 0)
+    {
+      nparts = MIN (nframes / MIN_PARTITION_FRAMES, (u64)MAX_POOL_PARTITIONS);
+    }
+  nparts = MIN (nparts, nframes / MEMORY_PAGE_LEN);
+  nparts = MAX (nparts, (u64)1);
+
+  // Leaves always get at least half
+  u64 nmeta = params.meta_budget / per_frame;
+  if (params.meta_budget == 0)
+    {
+      nmeta = nframes * META_TIER_PCT / 100;
+    }
+  nmeta = MIN (nmeta, nframes / 2);
+
+  const u64 frame_bytes = nframes * sizeof (struct page_frame);
+  const u64 part_bytes = nparts * sizeof (struct pgr_part);
+  const u64 ht_bytes = 2 * nframes * sizeof (hentry_idx);
+  const u64 cleaner_bytes = CLEANER_BATCH * sizeof (page);
+
+  err_t_wrap (i_arena_alloc (&p->pool, frame_bytes + part_bytes + ht_bytes + cleaner_bytes, params.huge_pages, e), e);
+
+  p->nframes = (u32)nframes;
+  p->nparts = (u32)nparts;
+  p->policy = params.policy;
+  p->pages = p->pool.data;
+  p->parts = (struct pgr_part *)((u8 *)p->pool.data + frame_bytes);
+  p->_hdata = (hentry_idx *)((u8 *)p->parts + part_bytes);
+  p->cleaner_buf = (page *)((u8 *)p->_hdata + ht_bytes);
+
+  // Split frames (and table slots) evenly, remainder to the front
+  u32 start = 0;
+  for (u32 i = 0; i < p->nparts; ++i)
+    {
+      struct pgr_part *pt = &p->parts[i];
+      pt->start = start;
+      pt->nframes = p->nframes / p->nparts + (i < p->nframes % p->nparts ? 1 : 0);
+      pt->clock = 0;
+      pt->nhot = 0;
+      pt->ndirty = 0;
+      pt->npinned = 0;
+      pt->nmeta = 0;
+      pt->maxmeta = (u32)(nmeta * pt->nframes / nframes);
+      pt->meta_waiting = false;
+      pt->hits = 0;
+      pt->misses = 0;
+      pt->evictions = 0;
+      pt->dirty_evictions = 0;
+      pt->near_full = 0;
+      pt->pager_full = 0;
+      pt->readahead = 0;
+      pt->readahead_hits = 0;
+      pt->nwaiting = 0;
+
+      if (i_mutex_create (&pt->l, e))
+        {
+          p->nparts = i;
+          pgr_pool_free (p);
+          return e->cause_code;
+        }
+      if (i_cond_create (&pt->wait, e))
+        {
+          i_mutex_free (&pt->l);
+          p->nparts = i;
+          pgr_pool_free (p);
+          return e->cause_code;
+        }
+
+      // Initialize the hash table from pgno -> table index
+      ht_init_idx (&pt->pgno_to_value, &p->_hdata[2 * (u64)start], 2 * pt->nframes);
+
+      start += pt->nframes;
+    }
+  ASSERT (start == p->nframes);
+
+  i_log_info ("Buffer pool: %u frames in %u partitions, %" PRIu64 " for the meta tier (%" PRIu64 " bytes%s)\n",
+              p->nframes, p->nparts, nmeta, p->pool.len, p->pool.huge ? ", huge pages" : "");
+
+  return SUCCESS;
+}
+
+struct pager *
+pgr_open (const char *fname, const char *walname, struct lockt *lt, struct thread_pool *tp, error *e)
+{
+  return pgr_open_with (fname, walname, lt, tp, (struct pgr_params){ 0 }, e);
+}
+
+struct pager *
+pgr_open_with (const char *fname, const char *walname, struct lockt *lt, struct thread_pool *tp, struct pgr_params params, error *e)
+{
+  struct pager *ret = NULL;
+  bool fpgr_opened = false;
+  bool dpt_opened = false;
+  bool wal_opened = false;
+
+  // Allocate the pager
+  if ((ret = i_calloc (1, sizeof *ret, e)) == NULL)
+    {
+      return NULL;
+    }
+
+  // Allocate the buffer pool
+  if (pgr_pool_alloc (ret, params, e))
+    {
+      i_free (ret);
+      return NULL;
+    }
+
+  // Background cleaner synchronization
+  if (i_mutex_create (&ret->cleaner_lock, e))
+    {
+      pgr_pool_free (ret);
+      i_free (ret);
+      return NULL;
+    }
+  if (i_cond_create (&ret->cleaner_idle, e))
+    {
+      i_mutex_free (&ret->cleaner_lock);
+      pgr_pool_free (ret);
+      i_free (ret);
+      return NULL;
+    }
+  ret->cleaner_scheduled = false;
+  ret->readahead_scheduled = false;
+
+  // Before images of pages held in X
+  slab_alloc_init (&ret->undo_alloc, sizeof (page), UNDO_SLAB_PAGES);
+
+  // Initialize the file pager
+  if (params.ndata_dirs > 0)
+    {
+      err_t_wrap_goto (fpgr_open_segmented (&ret->fp, params.data_dirs, params.ndata_dirs, e), failed, e);
+    }
+  else
+    {
+      err_t_wrap_goto (fpgr_open (&ret->fp, fname, e), failed, e);
+    }
+  fpgr_opened = true;
+  err_t_wrap_goto (fpgr_set_compress (&ret->fp, params.compress, e), failed, e);
+
+  // Second level cache
+  if (params.l2_path != NULL && params.l2_budget > 0)
+    {
+      err_t_wrap_goto (l2c_open (&ret->l2, params.l2_path, params.l2_budget, e), failed, e);
+      ret->l2_enabled = true;
+    }
+
+  // Pull in the root node data values
+  err_t_wrap_goto (pgr_is_new_guard (ret, e), failed, e);
+
+  // Open the dirty page table
+  err_t_wrap_goto (dpgt_open (&ret->dpt, e), failed, e);
+  dpt_opened = true;
+
+  // Initialize the WAL
+  if (walname)
+    {
+      err_t_wrap_goto (wal_open (&ret->ww, walname, e), failed, e);
+      wal_opened = true;
+
+      if (params.wal_segment_bytes > 0)
+        {
+          wal_set_segment_size (&ret->ww, params.wal_segment_bytes);
+        }
+
+      if (params.commit_delay_us > 0 || params.commit_batch > 0)
+        {
+          wal_set_group_commit (
+              &ret->ww,
+              (u64)(params.commit_delay_us > 0 ? params.commit_delay_us : WAL_COMMIT_DELAY_US) * 1000,
+              params.commit_batch > 0 ? params.commit_batch : WAL_COMMIT_BATCH);
+        }
+    }
+  else
+    {
+      panic ("TODO - optional WAL");
+    }
+
+  // Initialize internal latch
+  latch_init (&ret->l);
+
+  // Simple variables
+  ret->next_tid = 1;
+  ret->lt = lt;
+  ret->tp = tp;
+
+  // More work
+  if (pgr_isnew (ret))
+    {
+      err_t_wrap_null_goto (pgr_open_new (fname, walname, ret, e), failed, e);
+    }
+  else
+    {
+      err_t_wrap_null_goto (pgr_open_existing (fname, walname, ret, e), failed, e);
+    }
+
+  DBG_ASSERT (pager, ret);
+  return ret;
+
+failed:
+  ASSERT (e->cause_code);
+  // latch doesn't need cleanup
+  pgr_cleaner_wait (ret);
+  if (ret && dpt_opened)
+    {
+      dpgt_close (&ret->dpt);
+    }
+  if (ret && wal_opened)
+    {
+      wal_close (&ret->ww, e);
+    }
+  if (ret && ret->l2_enabled)
+    {
+      l2c_close (&ret->l2, e);
+    }
+  if (ret && fpgr_opened)
+    {
+      if (pgr_isnew (ret) && params.ndata_dirs > 0)
+        {
+          fpgr_reset (&ret->fp, e);
+        }
+      fpgr_close (&ret->fp, e);
+    }
+  if (pgr_isnew (ret))
+    {
+      if (params.ndata_dirs == 0)
+        {
+          i_remove_quiet (fname, e);
+        }
+      i_remove_quiet (walname, e);
+    }
+  if (ret)
+    {
+      slab_alloc_destroy (&ret->undo_alloc);
+      i_cond_free (&ret->cleaner_idle);
+      i_mutex_free (&ret->cleaner_lock);
+      pgr_pool_free (ret);
+      i_free (ret);
+    }
+  return NULL;
+}
+
+bool
+pgr_isnew (struct pager *p)
+{
+  return p->flags && PF_ISNEW;
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, pager_open)
+{
+  error e = error_create ();
+
+  /* Green path */
+  {
+    test_fail_if (i_remove_quiet ("test.db", &e));
+    test_fail_if (i_remove_quiet ("test.wal", &e));
+
+    struct lockt lt;
+    test_err_t_wrap (lockt_init (&lt, &e), &e);
+
+    struct thread_pool *tp = tp_open (&e);
+    test_fail_if_null (tp);
+
+    struct pager *p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+
+    test_fail_if_null (p);
+    test_err_t_wrap (pgr_close (p, &e), &e);
+
+    test_err_t_wrap (tp_free (tp, &e), &e);
+    lockt_destroy (&lt);
+  }
+}
+#endif
+
+#ifndef NTEST
+TEST (TT_UNIT, pager_open_segmented)
+{
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.wal", &e));
+
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
+
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
+
+  const char *dirs[] = { "." };
+  struct pgr_params params = { .data_dirs = dirs, .ndata_dirs = 1 };
+
+  /* New database - the root page goes to segment 0 */
+  struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp, params, &e);
+  test_fail_if_null (p);
+  test_assert (pgr_isnew (p));
+  test_assert_int_equal ((int)pgr_get_npages (p), 1);
+  test_err_t_wrap (pgr_close (p, &e), &e);
+
+  /* And it's found there again */
+  p = pgr_open_with ("test.db", "test.wal", &lt, tp, params, &e);
+  test_fail_if_null (p);
+  test_assert (!pgr_isnew (p));
+  test_assert_int_equal ((int)pgr_get_npages (p), 1);
+  test_err_t_wrap (pgr_close (p, &e), &e);
+
+  /* Clean up the segments */
+  struct file_pager fp;
+  test_err_t_wrap (fpgr_open_segmented (&fp, dirs, 1, &e), &e);
+  test_err_t_wrap (fpgr_reset (&fp, &e), &e);
+  test_err_t_wrap (fpgr_close (&fp, &e), &e);
+  test_fail_if (i_remove_quiet ("test.wal", &e));
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
+}
+#endif
+
+#ifndef NTEST
+TEST (TT_UNIT, pgr_open_basic)
+{
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
+
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
+
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
+
+  i_file fp;
+  test_err_t_wrap (i_open_rw (&fp, "test.db", &e), &e);
+
+  struct pager *p;
+
+  /* File is shorter than page size */
+  test_fail_if (i_truncate (&fp, PAGE_SIZE - 1, &e));
+  p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+  test_assert_int_equal (e.cause_code, ERR_CORRUPT);
+  test_assert_equal (p, NULL);
+  e.cause_code = SUCCESS;
+
+  /* Half a page */
+  test_fail_if (i_truncate (&fp, PAGE_SIZE / 2, &e));
+  p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+  test_assert_int_equal (e.cause_code, ERR_CORRUPT);
+  test_assert_equal (p, NULL);
+  e.cause_code = SUCCESS;
+
+  /* 0 pages */
+  test_fail_if (i_truncate (&fp, 0, &e));
+  p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+  test_assert_int_equal (e.cause_code, SUCCESS);
+  test_fail_if_null (p);
+  test_assert_int_equal ((int)pgr_get_npages (p), 1);
+  test_fail_if (pgr_close (p, &e));
+
+  /* Created by a build with another page size */
+  p_size other = PAGE_SIZE * 2;
+  test_fail_if (i_pwrite_all (&fp, &other, sizeof (other), RN_PGSZ_OFST, &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
+  p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+  test_assert_int_equal (e.cause_code, ERR_INVALID_ARGUMENT);
+  test_assert_equal (p, NULL);
+  e.cause_code = SUCCESS;
+
+  /* Written before the format was versioned - no checksums and the first tombstone after the header */
+  page old;
+  i_memset (old.raw, 0, PAGE_SIZE);
+  page_set_type (&old, PG_ROOT_NODE);
+  pgno first_tmbst = 1;
+  i_memcpy (&old.raw[PG_COMMN_END], &first_tmbst, sizeof (first_tmbst));
+  test_fail_if (i_pwrite_all (&fp, old.raw, PAGE_SIZE, 0, &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
+  p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+  test_assert_int_equal (e.cause_code, ERR_INVALID_ARGUMENT);
+  test_assert_equal (p, NULL);
+  e.cause_code = SUCCESS;
+
+  /* Tear down */
+  test_fail_if (i_close (&fp, &e));
+  test_fail_if (i_unlink ("test.db", &e));
+
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
+}
+#endif
+
+#ifndef NTEST
+TEST (TT_UNIT, pgr_open_compress)
+{
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
+
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
+
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
+
+  /* Asking for compression where it can't save a block fails the open */
+  struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp, (struct pgr_params){ .compress = true }, &e);
+  if (PAGE_SIZE > FPGR_CMP_BLOCK)
+    {
+      test_fail_if_null (p);
+      test_err_t_wrap (pgr_close (p, &e), &e);
+    }
+  else
+    {
+      test_assert_equal (p, NULL);
+      test_assert_int_equal (e.cause_code, ERR_INVALID_ARGUMENT);
+      e.cause_code = SUCCESS;
+    }
+
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
+}
+#endif
+
+err_t
+pgr_close (struct pager *p, error *e)
+{
+  DBG_ASSERT (pager, p);
+
+  // Nothing may touch the pool behind our back from here on
+  pgr_cleaner_wait (p);
+
+  /**
+   * Write the dirty frames out a batch at a time first - evicting them
+   * one by one is a write per page. Whatever that leaves (frames not in
+   * the DPT) the evictions still catch
+   */
+  if (pgr_checkpoint_flush (p, (lsn)-1, e))
+    {
+      i_log_warn ("Pager close: batched write back failed, evicting page by page: %s\n", e->cause_msg);
+      e->cause_code = SUCCESS;
+    }
+
+  // Save all in memory pages
+  pgr_evict_all (p, e);
+
+  wal_close (&p->ww, e);
+  fpgr_close (&p->fp, e);
+  if (p->l2_enabled)
+    {
+      l2c_close (&p->l2, e);
+    }
+
+  txnt_close (&p->tnxt);
+  dpgt_close (&p->dpt);
+
+  slab_alloc_destroy (&p->undo_alloc);
+  i_cond_free (&p->cleaner_idle);
+  i_mutex_free (&p->cleaner_lock);
+  pgr_pool_free (p);
+  i_free (p);
+
+  return e->cause_code;
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, pgr_close_success)
+{
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
+
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
+
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
+
+  struct pager *p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+  test_fail_if_null (p);
+
+  /* Delete file i_close should fail */
+  test_assert_equal (pgr_close (p, &e), SUCCESS);
+  test_fail_if (i_remove_quiet ("foo.db", &e));
+
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
+}
+#endif
+
+///////////////////////////////////////////////////////////
+////// COMMON
+
+p_size
+pgr_get_npages (const struct pager *p)
+{
+  DBG_ASSERT (pager, p);
+  return fpgr_get_npages (&p->fp);
+}
+
+u32
+pgr_get_nframes (const struct pager *p)
+{
+  DBG_ASSERT (pager, p);
+  return p->nframes;
+}
+
+void
+pgr_get_stats (struct pager *p, struct pgr_stats *dest)
+{
+  DBG_ASSERT (pager, p);
+
+  *dest = (struct pgr_stats){ .nframes = p->nframes };
+
+  // One partition at a time - each is consistent, the sum is close
+  for (u32 i = 0; i < p->nparts; ++i)
+    {
+      struct pgr_part *pt = &p->parts[i];
+
+      i_mutex_lock (&pt->l);
+      dest->npinned += pt->npinned;
+      dest->ndirty += pt->ndirty;
+      dest->nmeta += pt->nmeta;
+      dest->maxmeta += pt->maxmeta;
+      dest->hits += pt->hits;
+      dest->misses += pt->misses;
+      dest->readahead += pt->readahead;
+      dest->readahead_hits += pt->readahead_hits;
+      dest->evictions += pt->evictions;
+      dest->dirty_evictions += pt->dirty_evictions;
+      dest->near_full += pt->near_full;
+      dest->pager_full += pt->pager_full;
+      i_mutex_unlock (&pt->l);
+    }
+
+  struct fpgr_stats fs;
+  fpgr_get_stats (&p->fp, &fs);
+  dest->page_reads = fs.reads;
+  dest->page_writes = fs.writes;
+  dest->read_ns = fs.read_ns;
+  dest->write_ns = fs.write_ns;
+  dest->file_syncs = fs.syncs;
+  dest->file_sync_ns = fs.sync_ns;
+  dest->compressed_writes = fs.cmp_writes;
+  dest->compressed_bytes = fs.cmp_bytes;
+
+  if (p->l2_enabled)
+    {
+      struct l2c_stats ls;
+      l2c_get_stats (&p->l2, &ls);
+      dest->l2_pages = p->l2.nslots;
+      dest->l2_hits = ls.hits;
+      dest->l2_misses = ls.misses;
+      dest->l2_writes = ls.writes;
+      dest->l2_evictions = ls.evictions;
+    }
+
+  struct wal_stats ws;
+  wal_get_stats (&p->ww, &ws);
+  dest->wal_fsyncs = ws.fsyncs;
+  dest->wal_bytes = ws.bytes;
+  dest->wal_fsync_ns = ws.fsync_ns;
+  dest->wal_fsync_max_ns = ws.fsync_max_ns;
+  dest->wal_grouped = ws.grouped;
+  dest->wal_full_pages = ws.full_pages;
+  dest->wal_recycled = ws.recycled;
+  dest->wal_removed = ws.removed;
+}
+
+f64
+pgr_stats_hit_ratio (const struct pgr_stats *s)
+{
+  u64 lookups = s->hits + s->misses;
+  return lookups == 0 ? 1.0 : (f64)s->hits / (f64)lookups;
+}
+
+void
+pgr_stats_fprint (FILE *out, const struct pgr_stats *s)
+{
+  fprintf (out, "Buffer pool: %" PRIu32 " frames, %" PRIu32 " pinned, %" PRIu32 " dirty\n",
+           s->nframes, s->npinned, s->ndirty);
+  fprintf (out, "  meta tier: %" PRIu32 " of %" PRIu32 " frames\n", s->nmeta, s->maxmeta);
+  fprintf (out, "  hits: %" PRIu64 " misses: %" PRIu64 " (hit ratio %.2f%%)\n",
+           s->hits, s->misses, 100.0 * pgr_stats_hit_ratio (s));
+  fprintf (out, "  read-ahead: %" PRIu64 " loaded, %" PRIu64 " used\n",
+           s->readahead, s->readahead_hits);
+  fprintf (out, "  evictions: %" PRIu64 " (%" PRIu64 " dirty)\n",
+           s->evictions, s->dirty_evictions);
+  fprintf (out, "  near full: %" PRIu64 " pager full: %" PRIu64 "\n",
+           s->near_full, s->pager_full);
+  if (s->l2_pages > 0)
+    {
+      fprintf (out, "Second level cache: %" PRIu32 " pages\n", s->l2_pages);
+      fprintf (out, "  hits: %" PRIu64 " misses: %" PRIu64 " writes: %" PRIu64 " evictions: %" PRIu64 "\n",
+               s->l2_hits, s->l2_misses, s->l2_writes, s->l2_evictions);
+    }
+  fprintf (out, "Database file:\n");
+  fprintf (out, "  page reads: %" PRIu64 " (%" PRIu64 " us) page writes: %" PRIu64 " (%" PRIu64 " us)\n",
+           s->page_reads, s->read_ns / 1000, s->page_writes, s->write_ns / 1000);
+  fprintf (out, "  fsyncs: %" PRIu64 " (%" PRIu64 " us)\n",
+           s->file_syncs, s->file_sync_ns / 1000);
+  if (s->compressed_writes > 0)
+    {
+      fprintf (out, "  compressed writes: %" PRIu64 " in %" PRIu64 " bytes (%.2fx)\n",
+               s->compressed_writes, s->compressed_bytes,
+               (f64)(s->compressed_writes * PAGE_SIZE) / (f64)s->compressed_bytes);
+    }
+  fprintf (out, "WAL:\n");
+  fprintf (out, "  fsyncs: %" PRIu64 " bytes: %" PRIu64 "\n",
+           s->wal_fsyncs, s->wal_bytes);
+  fprintf (out, "  fsync latency: %" PRIu64 " us avg, %" PRIu64 " us max\n",
+           s->wal_fsyncs == 0 ? 0 : s->wal_fsync_ns / s->wal_fsyncs / 1000, s->wal_fsync_max_ns / 1000);
+  fprintf (out, "  group commit: %" PRIu64 " flushes rode on another's fsync\n", s->wal_grouped);
+  fprintf (out, "  full page writes: %" PRIu64 "\n", s->wal_full_pages);
+  fprintf (out, "  segments: %" PRIu64 " recycled, %" PRIu64 " removed\n", s->wal_recycled, s->wal_removed);
+}
+
+void
+i_log_pgr_stats (int log_level, const struct pgr_stats *s)
+{
+  if (SHOULD_LOG_AT (log_level))
+    {
+      pgr_stats_fprint (stderr, s);
+    }
+}
+
+///////////////////////////////////////////////////////////
+////// TRANSACTION CONTROL
+
+err_t
+pgr_begin_txn (struct txn *tx, struct pager *p, error *e)
+{
+  DBG_ASSERT (pager, p);
+
+  // Generate a new transaction ID
+  latch_lock (&p->l);
+  txid tid = p->next_tid++;
+  latch_unlock (&p->l);
+
+  // Append begin record
+  slsn l = wal_append_begin_log (&p->ww, tid, e);
+  if (l < 0)
+    {
+      return e->cause_code;
+    }
+
+  txn_init (tx, tid, (struct txn_data){
+                         .last_lsn = l,
+                         .undo_next_lsn = 0,
+                         .state = TX_RUNNING,
+                     });
+  tx->first_lsn = l;
+
+  // Create a new transaction entry
+  err_t_wrap (txnt_insert_txn (&p->tnxt, tx, e), e);
+
+  return SUCCESS;
+}
+
+/**
+ * Unlogged transactions are for bulk loads. The pages they allocate
+ * (pgr_new) are never logged - pgr_save only stamps them with the
+ * transaction's last lsn, which is past anything logged about the page
+ * before it was handed out, so redo leaves them alone. Everything else
+ * they touch (root, free space map, catalog, pages that already existed)
+ * is logged as usual, and pages off the end of the file are taken
+ * UNLOGGED_EXTENT at a time so the root isn't logged for each one.
+ * pgr_commit writes the new pages and syncs the data file before the
+ * commit record goes out.
+ *
+ * If it never commits, undo puts the logged pages back and the new pages
+ * are free again - whatever they hold on disk doesn't matter
+ */
+err_t
+pgr_begin_unlogged_txn (struct txn *tx, struct pager *p, error *e)
+{
+  err_t_wrap (pgr_begin_txn (tx, p, e), e);
+  tx->unlogged = true;
+  return SUCCESS;
+}
+
+/**
+ * Give the unused end of [tx]'s last extent back. It still holds
+ * X(root), so nothing was taken off the end of the file since
+ */
+static err_t
+pgr_return_extent (struct pager *p, struct txn *tx, error *e)
+{
+  if (tx->extent_next == tx->extent_end)
+    {
+      return SUCCESS;
+    }
+
+  page_h root = page_h_create ();
+  err_t_wrap (pgr_get_writable (&root, tx, PG_ROOT_NODE, ROOT_PGNO, p, e), e);
+
+  if (rn_get_next_pg (page_h_ro (&root)) == tx->extent_end)
+    {
+      rn_set_next_pg (page_h_w (&root), tx->extent_next);
+    }
+  tx->extent_next = tx->extent_end = 0;
+
+  return pgr_release (p, &root, PG_ROOT_NODE, e);
+}
+
+/**
+ * Write every frame an unlogged transaction allocated and sync the
+ * data file. Frames other unlogged transactions still hold in X keep
+ * their mark - the rest are written too, their owners' later changes
+ * just get logged. Like the cleaner, each batch is copied into
+ * cleaner_buf under the partition latch and written without it. A frame
+ * re-dirtied while its copy was on the way keeps its mark so its owner's
+ * commit forces it again. The cleaner is held off so nothing it copied
+ * out lands after the sync
+ */
+static err_t
+pgr_force_unlogged (struct pager *p, error *e)
+{
+  struct page_frame *batch[CLEANER_BATCH];
+  page *copies = p->cleaner_buf;
+  err_t ret = SUCCESS;
+
+  pgr_cleaner_claim (p);
+
+  for (u32 i = 0; i < p->nparts && ret == SUCCESS; ++i)
+    {
+      struct pgr_part *pt = &p->parts[i];
+      u32 j = 0;
+
+      while (ret == SUCCESS && j < pt->nframes)
+        {
+          u32 n = 0;
+
+          i_mutex_lock (&pt->l);
+          for (; j < pt->nframes && n < CLEANER_BATCH; ++j)
+            {
+              struct page_frame *mp = &p->pages[pt->start + j];
+
+              // An eviction is writing it out - the sync has to come after
+              while (pf_check (mp, PW_UNLOGGED) && pf_check (mp, PW_IO))
+                {
+                  pgr_part_wait (pt);
+                }
+
+              if (!pf_check (mp, PW_PRESENT) || !pf_check (mp, PW_UNLOGGED) || pf_check (mp, PW_X))
+                {
+                  continue;
+                }
+
+              // Already on disk
+              if (!pf_check (mp, PW_DIRTY))
+                {
+                  pf_clr (mp, PW_UNLOGGED);
+                  continue;
+                }
+
+              pgr_part_pin (pt, mp);
+              i_memcpy (&copies[n], &mp->page, sizeof (page));
+
+              // A writer re-dirties the frame if it changes under us
+              pf_clr (mp, PW_DIRTY);
+              pt->ndirty--;
+
+              batch[n++] = mp;
+            }
+          i_mutex_unlock (&pt->l);
+
+          if (n == 0)
+            {
+              continue;
+            }
+
+          ret = pgr_write_copies (p, copies, n, e);
+
+          i_mutex_lock (&pt->l);
+          for (u32 k = 0; k < n; ++k)
+            {
+              struct page_frame *mp = batch[k];
+
+              if (ret)
+                {
+                  // Never made it to disk
+                  if (!pf_check (mp, PW_DIRTY))
+                    {
+                      pf_set (mp, PW_DIRTY);
+                      pt->ndirty++;
+                    }
+                }
+              else if (!pf_check (mp, PW_DIRTY))
+                {
+                  pf_clr (mp, PW_UNLOGGED);
+                  ret = dpgt_remove_expect (&p->dpt, copies[k].pg, e);
+                }
+
+              pgr_part_unpin (pt, mp);
+            }
+          i_mutex_unlock (&pt->l);
+        }
+    }
+
+  pgr_cleaner_release (p);
+
+  err_t_wrap (ret, e);
+
+  return fpgr_sync (&p->fp, e);
+}
+
+err_t
+pgr_commit (struct pager *p, struct txn *tx, error *e)
+{
+  DBG_ASSERT (pager, p);
+
+  // Recovery can't redo an unlogged page - it has to be on disk first
+  if (tx->unlogged)
+    {
+      err_t_wrap (pgr_return_extent (p, tx, e), e);
+      err_t_wrap (pgr_force_unlogged (p, e), e);
+    }
+
+  latch_lock (&tx->l);
+
+  if (tx->data.state != TX_RUNNING)
+    {
+      latch_unlock (&tx->l);
+      return error_causef (e, ERR_DUPLICATE_COMMIT, "Committing a transaction that is already committed\n");
+    }
+
+  // Append a commit log for this transaction
+  slsn l = wal_append_commit_log (&p->ww, tx->tid, tx->data.last_lsn, e);
+  if (l < 0)
+    {
+      latch_unlock (&tx->l);
+      return e->cause_code;
+    }
+
+  // Flush the wal to the expected lsn
+  err_t_wrap (wal_flush_to (&p->ww, l, e), e);
+
+  // Append an end log to the wal
+  l = wal_append_end_log (&p->ww, tx->tid, l, e);
+  if (l < 0)
+    {
+      latch_unlock (&tx->l);
+      return e->cause_code;
+    }
+
+  err_t_wrap (txnt_remove_txn_expect (&p->tnxt, tx, e), e);
+
+  tx->data.state = TX_DONE;
+
+  err_t_wrap (lockt_unlock_tx (p->lt, tx, e), e);
+
+  latch_unlock (&tx->l);
+
+  return SUCCESS;
+}
+
+/**
+ * Write back the frame behind [h], which the caller holds in S. Nobody
+ * can change it meanwhile, so only the flags need the partition latch
+ * and the write goes out without it. Same dance as pgr_clean_part -
+ * other readers may be looking at the frame, so the checksum goes on
+ * a copy
+ */
+static err_t
+pgr_flush_held (struct pager *p, page_h *h, error *e)
+{
+  ASSERT (h->mode == PHM_S);
+  struct pgr_part *pt = pgr_part_of (p, page_h_pgno (h));
+  struct page_frame *mp = h->pgr;
+
+  i_mutex_lock (&pt->l);
+  bool dirty = pf_check (mp, PW_DIRTY);
+  if (dirty)
+    {
+      pf_clr (mp, PW_DIRTY);
+      pt->ndirty--;
+    }
+  i_mutex_unlock (&pt->l);
+
+  if (!dirty)
+    {
+      return SUCCESS;
+    }
+
+  // WAL Invariant: Flush to wal before flushing to disk
+  err_t ret = SUCCESS;
+  if (!p->restarting)
+    {
+      ret = wal_flush_to (&p->ww, page_get_page_lsn (&mp->page), e);
+    }
+  if (ret == SUCCESS)
+    {
+      page copy;
+      i_memcpy (&copy, &mp->page, sizeof (copy));
+      page_update_checksum (&copy);
+      ret = fpgr_write (&p->fp, copy.raw, copy.pg, e);
+    }
+
+  i_mutex_lock (&pt->l);
+  if (ret)
+    {
+      // Never made it to disk
+      if (!pf_check (mp, PW_DIRTY))
+        {
+          pf_set (mp, PW_DIRTY);
+          pt->ndirty++;
+        }
+    }
+  else if (!pf_check (mp, PW_DIRTY))
+    {
+      ret = dpgt_remove_expect (&p->dpt, mp->page.pg, e);
+    }
+  i_mutex_unlock (&pt->l);
+
+  return ret;
+}
+
+static err_t
+pgr_update_master_lsn (struct pager *p, lsn mlsn, error *e)
+{
+  // BEGIN TXN
+  struct txn tx;
+  err_t_wrap (pgr_begin_txn (&tx, p, e), e);
+
+  // X(root)
+  if (lockt_lock (p->lt, (struct lt_lock){ .type = LOCK_ROOT, .data = { 0 } }, LM_X, &tx, e))
+    {
+      goto theend;
+    }
+
+  // GET ROOT
+  page_h root = page_h_create ();
+  if (pgr_get_writable (&root, &tx, PG_ROOT_NODE, 0, p, e))
+    {
+      return e->cause_code;
+    }
+
+  // UPDATE MLSN
+  rn_set_master_lsn (page_h_w (&root), mlsn);
+
+  // SAVE (don't release yet, we'll evict it)
+  if (pgr_save (p, &root, PG_ROOT_NODE, e))
+    {
+      goto theend;
+    }
+
+  // COMMIT
+  if (pgr_commit (p, &tx, e))
+    {
+      goto theend;
+    }
+
+  /**
+   * Flush root node to disk. It doesn't hurt. Technically we don't need to
+   * but if we want checkpoint to be "done" after this call, root page should be persisted (forced)
+   * to disk
+   */
+  if (pgr_flush_held (p, &root, e))
+    {
+      goto theend;
+    }
+
+theend:
+  pgr_release (p, &root, PG_ROOT_NODE, e);
+  return e->cause_code;
+}
+
+/**
+ * Write every frame that was dirty before [ckpt_lsn] and force the
+ * data file. Nothing is evicted and partition latches are only held
+ * while picking each batch, so transactions keep running against a
+ * warm cache. The force also makes the previous checkpoint's master
+ * durable, which is what lets pgr_checkpoint cut the log up to it
+ */
+static err_t
+pgr_checkpoint_flush (struct pager *p, lsn ckpt_lsn, error *e)
+{
+  err_t ret = SUCCESS;
+
+  pgr_cleaner_claim (p);
+
+  for (u32 i = 0; i < p->nparts && ret == SUCCESS; ++i)
+    {
+      bool progress = true;
+      u32 busy = 0;
+
+      while (ret == SUCCESS && (progress || busy > 0))
+        {
+          ret = pgr_clean_part (p, &p->parts[i], &ckpt_lsn, &progress, &busy, e);
+        }
+    }
+
+  pgr_cleaner_release (p);
+
+  err_t_wrap (ret, e);
+
+  return fpgr_sync (&p->fp, e);
+}
+
+err_t
+pgr_checkpoint (struct pager *p, error *e)
+{
+  // BEGIN CHECKPOINT
+  slsn mlsn = wal_append_ckpt_begin (&p->ww, e);
+  err_t_wrap (mlsn, e);
+
+  // END CHECKPOINT - fuzzy, the ATT / DPT are a snapshot of right now
+  slsn end_lsn = wal_append_ckpt_end (&p->ww, &p->tnxt, &p->dpt, e);
+  if (end_lsn < 0)
+    {
+      return e->cause_code;
+    }
+
+  // Flush the wal so that master lsn is accurate
+  err_t_wrap (wal_flush_to (&p->ww, end_lsn, e), e);
+
+  // FLUSH PAGES that were dirty before the checkpoint began
+  err_t_wrap (pgr_checkpoint_flush (p, mlsn, e), e);
+
+  // Update master lsn - restart can now skip everything before mlsn
+  err_t_wrap (pgr_update_master_lsn (p, mlsn, e), e);
+
+  /**
+   * Restart starts reading at the master, redo at the oldest dirty page
+   * and undo goes back as far as the oldest transaction's begin. The
+   * log before all three can go once the new master is on disk - it
+   * isn't forced until the next checkpoint's flush, so cut the log where
+   * the previous checkpoint left off rather than paying a second sync
+   */
+  lsn keep = txnt_min_first_lsn (&p->tnxt, mlsn);
+  lsn dirty = dpgt_min_rec_lsn (&p->dpt);
+  if (dirty > 0)
+    {
+      keep = MIN (keep, dirty);
+    }
+  if (p->trunc_lsn > 0)
+    {
+      err_t_wrap (wal_truncate (&p->ww, MIN (p->trunc_lsn, keep), e), e);
+    }
+  p->trunc_lsn = keep;
+
+  i_log_info ("Checkpoint written at LSN %" PRlsn "\n", mlsn);
+
+  return SUCCESS;
+}
+
+/////////////////////////////////////////
+//// READ / WRITE PAGES
+
+/**
+ * Frame S / X latching. Handles hold the frame for as long as they
+ * live, so waiters sleep on the partition (pgr_part_wait) until
+ * pgr_drop_w or pgr_unpin changes the frame. Callers hold pt->l and
+ * a pin on [mp] so it can't be evicted in between
+ */
+static inline void
+pgr_latch_shared (struct pgr_part *pt, struct page_frame *mp)
+{
+  // Writers (and writers waiting to get in) go first
+  while (pf_check (mp, PW_X | PW_XWAIT))
+    {
+      pgr_part_wait (pt);
+    }
+  mp->nreaders++;
+}
+
+/**
+ * Upgrade the caller's S on [mp] to X once every other reader is gone
+ */
+static inline void
+pgr_latch_upgrade (struct pgr_part *pt, struct page_frame *mp)
+{
+  ASSERT (mp->nreaders > 0);
+  ASSERTF (!pf_check (mp, PW_X | PW_XWAIT),
+           "Two writers upgrading page: %" PRpgno " at once - the lock table should have serialized them",
+           mp->page.pg);
+
+  pf_set (mp, PW_XWAIT);
+  while (mp->nreaders > 1)
+    {
+      pgr_part_wait (pt);
+    }
+  pf_clr (mp, PW_XWAIT);
+
+  mp->nreaders--;
+  pf_set (mp, PW_X);
+}
+
+/**
+ * Leave X mode on [h] - the frame keeps whatever was written into it
+ */
+static inline void
+pgr_drop_w (struct pager *p, page_h *h)
+{
+  ASSERT (h->mode == PHM_X);
+  struct pgr_part *pt = pgr_part_of (p, page_h_pgno (h));
+
+  i_mutex_lock (&pt->l);
+  pf_clr (h->pgr, PW_X);
+  h->pgr->nreaders++;
+  pgr_part_wake (pt);
+  i_mutex_unlock (&pt->l);
+
+  slab_alloc_free (&p->undo_alloc, h->undo);
+  h->undo = NULL;
+  h->mode = PHM_S;
+}
+
+static inline void
+pgr_unpin (struct pager *p, page_h *h)
+{
+  ASSERT (h->mode == PHM_S);
+  struct pgr_part *pt = pgr_part_of (p, page_h_pgno (h));
+
+  i_mutex_lock (&pt->l);
+  ASSERT (h->pgr->nreaders > 0);
+  h->pgr->nreaders--;
+  pgr_part_unpin (pt, h->pgr);
+  pgr_part_wake (pt);
+  i_mutex_unlock (&pt->l);
+
+  h->pgr = NULL;
+  h->mode = PHM_NONE;
+}
+
+enum pgr_get_mode
+{
+  PGM_VERIFY,     // pgr_get
+  PGM_UNVERIFIED, // ARIES reads pages that may be invalid
+  PGM_FREE,       // A free page about to be reused - a miss doesn't read it
+};
+
+/**
+ * Fill [mp] with [pg] - from the second level cache if it's there,
+ * otherwise the database file. Runs without pt->l: [mp] is already in
+ * the page table as PW_IO, so lookups of [pg] wait for it
+ */
+static err_t
+pgr_load (struct pager *p, struct page_frame *mp, int flags, pgno pg, enum pgr_get_mode mode, bool *from_l2, error *e)
+{
+  *from_l2 = false;
+
+  if (mode == PGM_FREE)
+    {
+      // Whatever is on disk gets overwritten - start from a blank tombstone
+      page_init_empty (&mp->page, PG_TOMBSTONE);
+      if (p->l2_enabled)
+        {
+          l2c_drop (&p->l2, pg);
+        }
+    }
+  else if (pgr_l2_load (p, mp, pg))
+    {
+      *from_l2 = true;
+    }
+  else
+    {
+      err_t_wrap (fpgr_read (&p->fp, mp->page.raw, pg, e), e);
+    }
+  mp->page.pg = pg;
+
+  // ARIES reads torn pages on purpose - redo overwrites them whole
+  if (mode == PGM_VERIFY)
+    {
+      err_t ret = page_verify_checksum (&mp->page, e);
+      if (ret == SUCCESS)
+        {
+          ret = page_validate_for_db (&mp->page, flags, e);
+        }
+      if (ret)
+        {
+          /**
+           * Maybe here we could try to recover the page
+           */
+          i_log_error ("Cannot get page %" PRpgno " because it is invalid in the database file: %s\n", pg, e->cause_msg);
+          return ret;
+        }
+    }
+
+  return SUCCESS;
+}
+
+static err_t
+pgr_get_impl (page_h *dest, int flags, pgno pg, struct pager *p, enum pgr_get_mode mode, error *e)
+{
+  DBG_ASSERT (page_h, dest);
+  ASSERT (dest->mode == PHM_NONE);
+
+  struct page_frame *pgr = NULL;
+  struct pgr_part *pt = pgr_part_of (p, pg);
+
+  err_t ret = SUCCESS;
+
+  i_mutex_lock (&pt->l);
+
+  // Try to fetch from memory first
+  hdata_idx data;
+lookup:
+  switch (ht_get_idx (&pt->pgno_to_value, &data, pg))
+    {
+    case HTAR_SUCCESS:
+      {
+        pgr = &p->pages[data.value];
+
+        // Still being read in or written out - it may not be here once that's done
+        if (pf_check (pgr, PW_IO))
+          {
+            pgr_part_wait (pt);
+            goto lookup;
+          }
+
+        pgr_part_pin (pt, pgr);
+        pgr_latch_shared (pt, pgr);
+
+        // No operation would have let a pgr into an invalid state
+        ASSERT (mode != PGM_VERIFY || page_validate_for_db (&pgr->page, flags, NULL) == SUCCESS);
+
+        // First reference to a read-ahead page is its load as far as the policy cares
+        if (pf_check (pgr, PW_PREFETCH))
+          {
+            pf_clr (pgr, PW_PREFETCH);
+            pgr_policy_on_load (p, pgr);
+            pt->readahead_hits++;
+          }
+        else
+          {
+            pgr_policy_on_hit (p, pgr);
+          }
+        pt->hits++;
+        break;
+      }
+    case HTAR_DOESNT_EXIST:
+      {
+        // Then load into a new spot
+        ret = pgr_reserve (p, pt, &pgr, e);
+        if (ret)
+          {
+            goto theend;
+          }
+
+        // Someone else loaded it while a victim was being written out
+        if (ht_get_idx (&pt->pgno_to_value, &data, pg) == HTAR_SUCCESS)
+          {
+            pgr_part_unpin (pt, pgr);
+            goto lookup;
+          }
+
+        pt->misses++;
+
+        /**
+         * Publish the frame before reading so a second miss on [pg]
+         * waits for this read instead of starting its own, then read
+         * without the partition latch
+         */
+        pgr->nreaders = 0;
+        pgr->page.pg = pg;
+        pf_set (pgr, PW_PRESENT | PW_IO);
+        hdata_idx hd = (hdata_idx){ .key = pg, .value = (u32)(pgr - p->pages) };
+        ht_insert_expect_idx (&pt->pgno_to_value, hd);
+        i_mutex_unlock (&pt->l);
+
+        bool from_l2;
+        ret = pgr_load (p, pgr, flags, pg, mode, &from_l2, e);
+
+        i_mutex_lock (&pt->l);
+        pf_clr (pgr, PW_IO);
+        pgr_part_wake (pt);
+
+        if (ret)
+          {
+            ht_delete_expect_idx (&pt->pgno_to_value, NULL, pg);
+            pgr->flags = 0;
+            pgr_part_unpin (pt, pgr);
+            goto theend;
+          }
+
+        // pgr is now loaded
+        pgr->nreaders = 1;
+        pgr_policy_on_load (p, pgr);
+        if (from_l2)
+          {
+            pf_set (pgr, PW_L2);
+          }
+        break;
+      }
+    }
+
+  // Initialize page_h
+  dest->pgr = pgr;
+  dest->undo = NULL;
+  dest->mode = PHM_S;
+
+theend:
+  i_mutex_unlock (&pt->l);
+  return ret;
+}
+
+err_t
+pgr_get (page_h *dest, int flags, pgno pg, struct pager *p, error *e)
+{
+  return pgr_get_impl (dest, flags, pg, p, PGM_VERIFY, e);
+}
+
+err_t
+pgr_get_unverified (page_h *dest, pgno pg, struct pager *p, error *e)
+{
+  return pgr_get_impl (dest, 0, pg, p, PGM_UNVERIFIED, e);
+}
+
+err_t
+pgr_make_writable_no_tx (struct pager *p, page_h *h, error *e)
+{
+  DBG_ASSERT (pager, p);
+  ASSERT (h->mode == PHM_S);
+
+  i_log_trace ("Pager making page: %" PRpgno " writable\n", page_h_pgno (h));
+
+  struct pgr_part *pt = pgr_part_of (p, page_h_pgno (h));
+
+  /**
+   * Writes go straight into the frame. All we keep on
+   * the side is the before image pgr_save logs as undo
+   */
+  page *undo = slab_alloc_alloc (&p->undo_alloc, e);
+  if (undo == NULL)
+    {
+      return e->cause_code;
+    }
+
+  i_mutex_lock (&pt->l);
+
+  pgr_latch_upgrade (pt, h->pgr);
+  i_memcpy (undo, &h->pgr->page, sizeof (page));
+
+  // Mark page as dirty (will be added to DPT in pgr_save with proper LSN)
+  bool was_dirty = pf_check (h->pgr, PW_DIRTY);
+  if (!was_dirty)
+    {
+      pf_set (h->pgr, PW_DIRTY);
+      pt->ndirty++;
+    }
+
+  i_mutex_unlock (&pt->l);
+
+  // Set page_h
+  h->undo = undo;
+  h->mode = PHM_X;
+
+  if (!was_dirty)
+    {
+      pgr_cleaner_maybe_wake (p, pt);
+    }
+
+  return SUCCESS;
+}
+
+err_t
+pgr_make_writable (struct pager *p, struct txn *tx, page_h *h, error *e)
+{
+  ASSERT (tx);
+  err_t_wrap (pgr_make_writable_no_tx (p, h, e), e);
+  h->tx = tx;
+  return SUCCESS;
+}
+
+err_t
+pgr_maybe_make_writable (struct pager *p, struct txn *tx, page_h *cur, error *e)
+{
+  ASSERT (tx);
+  if (cur->mode == PHM_S)
+    {
+      return pgr_make_writable (p, tx, cur, e);
+    }
+  return SUCCESS;
+}
+
+// No transaction version for recovery - no WAL logging
+err_t
+pgr_release_no_tx (struct pager *p, page_h *h, int flags, error *e)
+{
+  DBG_ASSERT (pager, p);
+  ASSERT (h->mode == PHM_X || h->mode == PHM_S);
+
+  i_log_trace ("Releasing (no tx) %" PRpgno "\n", page_h_pgno (h));
+
+  if (h->mode == PHM_X)
+    {
+      // TODO - I think this is wrong
+      // Add page to DPT if this is the first update (RecLSN = LSN of first update)
+      if (!dpgt_exists (&p->dpt, page_h_pgno (h)))
+        {
+          if (dpgt_add (&p->dpt, page_h_pgno (h), (lsn)page_get_page_lsn (page_h_ro (h)), e))
+            {
+              return e->cause_code;
+            }
+        }
+
+      // Save without WAL logging (recovery doesn't need WAL)
+      ASSERTF (page_validate_for_db (page_h_w (h), flags, NULL) == SUCCESS,
+               "%.*s\n", e->cmlen, e->cause_msg);
+
+      pgr_drop_w (p, h);
+    }
+
+  err_t_wrap (page_validate_for_db (&h->pgr->page, flags, e), e);
+
+  DBG_ASSERT (pager, p);
+
+  pgr_unpin (p, h);
+
+  return SUCCESS;
+}
+
+// No transaction version for recovery
+err_t
+pgr_get_writable_no_tx (page_h *dest, int flags, pgno pg, struct pager *p, error *e)
+{
+  err_t_wrap (pgr_get (dest, flags, pg, p, e), e);
+  err_t ret = pgr_make_writable_no_tx (p, dest, e);
+
+  // Couldn't allocate writable page - release dest
+  if (ret != SUCCESS)
+    {
+      pgr_release_no_tx (p, dest, flags, e);
+    }
+
+  return ret;
+}
+
+err_t
+pgr_get_writable (page_h *dest, struct txn *tx, int flags, pgno pg, struct pager *p, error *e)
+{
+  err_t_wrap (pgr_get (dest, flags, pg, p, e), e);
+  err_t ret = pgr_make_writable (p, tx, dest, e);
+
+  // Couldn't allocate writable page - release dest
+  if (ret != SUCCESS)
+    {
+      pgr_release_no_tx (p, dest, flags, e);
+    }
+
+  return ret;
+}
+
+static inline bool
+pgr_is_unlogged (struct pager *p, page_h *h)
+{
+  struct pgr_part *pt = pgr_part_of (p, page_h_pgno (h));
+
+  i_mutex_lock (&pt->l);
+  bool ret = pf_check (h->pgr, PW_UNLOGGED);
+  i_mutex_unlock (&pt->l);
+
+  return ret;
+}
+
+/**
+ * pgr_save for a page an unlogged transaction allocated. Nothing goes
+ * to the WAL - see pgr_begin_unlogged_txn
+ */
+static err_t
+pgr_save_unlogged (struct pager *p, page_h *h, error *e)
+{
+  ASSERT (h->tx->unlogged);
+
+  latch_lock (&h->tx->l);
+
+  // Its allocation is logged, so this is past every record about the page
+  lsn page_lsn = h->tx->data.last_lsn;
+  page_set_page_lsn (page_h_w (h), page_lsn);
+
+  // Still has to be tracked so checkpoints and flushes see it
+  if (!dpgt_exists (&p->dpt, page_h_pgno (h)))
+    {
+      if (dpgt_add (&p->dpt, page_h_pgno (h), page_lsn, e))
+        {
+          latch_unlock (&h->tx->l);
+          return e->cause_code;
+        }
+    }
+
+  latch_unlock (&h->tx->l);
+
+  pgr_drop_w (p, h);
+
+  return SUCCESS;
+}
+
+err_t
+pgr_save (struct pager *p, page_h *h, int flags, error *e)
+{
+  DBG_ASSERT (pager, p);
+  ASSERT (h->mode == PHM_X);
+  ASSERTF (page_validate_for_db (page_h_w (h), flags, NULL) == SUCCESS, "%.*s\n", e->cmlen, e->cause_msg);
+
+  if (pgr_is_unlogged (p, h))
+    {
+      return pgr_save_unlogged (p, h, e);
+    }
+
+  // Save log
+  latch_lock (&h->tx->l);
+
+  /**
+   * Construct an update log record. The WAL logs just the bytes that
+   * changed - unless the page was allocated or freed. Then its old
+   * bytes may not be what redo finds (a vacuum can cut a free page off
+   * the file) so the whole page goes in. The WAL also logs the whole
+   * page if [page_lsn] is from before the last checkpoint
+   */
+  struct wal_update_write update = {
+    .tid = h->tx->tid,
+    .pg = page_h_pgno (h),
+    .prev = h->tx->data.last_lsn,
+    .undo = h->undo->raw,
+    .redo = h->pgr->page.raw,
+    .page_lsn = page_get_page_lsn (h->undo),
+    .full = page_get_type (h->undo) != page_get_type (page_h_ro (h)),
+  };
+
+  // Append that update to the wal and get it's lsn
+  slsn page_lsn = wal_append_update_log (&p->ww, update, e);
+  if (page_lsn < 0)
+    {
+      latch_unlock (&h->tx->l);
+      return e->cause_code;
+    }
+
+  // Update the page lsn
+  page_set_page_lsn (page_h_w (h), (lsn)page_lsn);
+
+  h->tx->data.last_lsn = page_lsn;
+  h->tx->data.undo_next_lsn = page_lsn;
+
+  // Add page to DPT if this is the first update (RecLSN = LSN of first update)
+  if (!dpgt_exists (&p->dpt, page_h_pgno (h)))
+    {
+      if (dpgt_add (&p->dpt, page_h_pgno (h), (lsn)page_lsn, e))
+        {
+          latch_unlock (&h->tx->l);
+          return e->cause_code;
+        }
+    }
+
+  latch_unlock (&h->tx->l);
+
+  pgr_drop_w (p, h);
+
+  return SUCCESS;
+}
+
+static void
+pgr_cancel_w (struct pager *p, page_h *h)
+{
+  DBG_ASSERT (pager, p);
+  ASSERT (h->mode == PHM_X);
+
+  // Nothing was logged - put the before image back
+  i_memcpy (&h->pgr->page, h->undo, sizeof (page));
+  pgr_drop_w (p, h);
+}
+
+///////////////////////////////////////////////////////////
+////// FREE SPACE MAP
+
+/**
+ * X on free page [pg] without reading it - whatever it held is about
+ * to be overwritten. Pages past the end of the file are allocated here
+ */
+static err_t
+pgr_get_free_writable (page_h *dest, struct txn *tx, pgno pg, struct pager *p, error *e)
+{
+  if (pg >= fpgr_get_npages (&p->fp))
+    {
+      // Usually just a counter bump - the file grows in extents
+      err_t_wrap (fpgr_ensure (&p->fp, pg + 1, e), e);
+    }
+
+  err_t_wrap (pgr_get_impl (dest, PG_ANY, pg, p, PGM_FREE, e), e);
+  err_t ret = pgr_make_writable (p, tx, dest, e);
+
+  if (ret != SUCCESS)
+    {
+      pgr_release_no_tx (p, dest, PG_ANY, e);
+    }
+
+  return ret;
+}
+
+/**
+ * First free page in [from, to) - PGNO_NULL if there isn't one. Span 0's
+ * bits live in [root], the rest in the free list page heading each span
+ */
+static err_t
+pgr_fsm_scan (struct pager *p, page_h *root, pgno from, pgno to, pgno *dest, error *e)
+{
+  *dest = PGNO_NULL;
+
+  for (pgno span = frlst_map_pgno (from); span < to; span += FL_SPAN)
+    {
+      page_h map = page_h_create ();
+      const page *bits = page_h_ro (root);
+
+      if (span != ROOT_PGNO)
+        {
+          err_t_wrap (pgr_get (&map, PG_FREE_LIST, span, p, e), e);
+          bits = page_h_ro (&map);
+        }
+
+      pgno hi = MIN (to - span, FL_SPAN);
+      pgno i = frlst_find_free (bits, MAX (from, span) - span, hi);
+
+      if (span != ROOT_PGNO)
+        {
+          err_t_wrap (pgr_release (p, &map, PG_FREE_LIST, e), e);
+        }
+
+      if (i < hi)
+        {
+          *dest = span + i;
+          return SUCCESS;
+        }
+    }
+
+  return SUCCESS;
+}
+
+/**
+ * Pick the page pgr_new hands out. The rest of [near]'s span comes first so
+ * a chain of new pages (consecutive leaves) stays in file order, then the
+ * lowest free page in the file
+ */
+static err_t
+pgr_fsm_find (struct pager *p, page_h *root, pgno near, pgno *dest, error *e)
+{
+  pgno end = rn_get_next_pg (page_h_ro (root));
+
+  if (near != PGNO_NULL && near + 1 < end)
+    {
+      pgno span_end = MIN (frlst_map_pgno (near + 1) + FL_SPAN, end);
+      err_t_wrap (pgr_fsm_scan (p, root, near + 1, span_end, dest, e), e);
+      if (*dest != PGNO_NULL)
+        {
+          return SUCCESS;
+        }
+    }
+
+  err_t_wrap (pgr_fsm_scan (p, root, MIN (p->fsm_hint, end), end, dest, e), e);
+  p->fsm_hint = *dest == PGNO_NULL ? end : *dest;
+
+  return SUCCESS;
+}
+
+/**
+ * Flip [pg]'s bit. Root changes are left for the caller to save since
+ * it usually has more to write there
+ */
+static err_t
+pgr_fsm_mark (struct pager *p, struct txn *tx, page_h *root, pgno pg, bool free, error *e)
+{
+  pgno mpg = frlst_map_pgno (pg);
+
+  if (mpg == ROOT_PGNO)
+    {
+      err_t_wrap (pgr_maybe_make_writable (p, tx, root, e), e);
+      frlst_set_free (page_h_w (root), pg, free);
+      return SUCCESS;
+    }
+
+  page_h map = page_h_create ();
+  err_t_wrap (pgr_get_writable (&map, tx, PG_FREE_LIST, mpg, p, e), e);
+  frlst_set_free (page_h_w (&map), pg, free);
+
+  err_t ret = pgr_save (p, &map, PG_FREE_LIST, e);
+  if (ret)
+    {
+      pgr_cancel_w (p, &map);
+    }
+  pgr_release_no_tx (p, &map, PG_FREE_LIST, e);
+
+  return ret;
+}
+
+// [pg] heads a new span - it becomes that span's (empty) map
+static err_t
+pgr_fsm_new_map (struct pager *p, struct txn *tx, pgno pg, error *e)
+{
+  ASSERT (pg == frlst_map_pgno (pg) && pg != ROOT_PGNO);
+
+  page_h map = page_h_create ();
+  err_t_wrap (pgr_get_free_writable (&map, tx, pg, p, e), e);
+  page_init_empty (page_h_w (&map), PG_FREE_LIST);
+
+  err_t ret = pgr_save (p, &map, PG_FREE_LIST, e);
+  if (ret)
+    {
+      pgr_cancel_w (p, &map);
+    }
+  pgr_release_no_tx (p, &map, PG_ANY, e);
+
+  return ret;
+}
+
+err_t
+pgr_new (page_h *dest, struct pager *p, struct txn *tx, enum page_type type, error *e)
+{
+  return pgr_new_near (dest, p, tx, type, PGNO_NULL, e);
+}
+
+err_t
+pgr_new_near (page_h *dest, struct pager *p, struct txn *tx, enum page_type type, pgno near, error *e)
+{
+  DBG_ASSERT (pager, p);
+  DBG_ASSERT (page_h, dest);
+  ASSERT (dest->mode == PHM_NONE);
+
+  // X(root) - covers the whole free space map
+  if (lockt_lock (p->lt, (struct lt_lock){ .type = LOCK_ROOT, .data = { 0 } }, LM_X, tx, e))
+    {
+      return e->cause_code;
+    }
+
+  page_h root = page_h_create ();
+  pgno pg;
+  err_t ret;
+
+  // Left over from this unlogged transaction's last extent - the root already accounts for it
+  if (tx->extent_next < tx->extent_end)
+    {
+      pg = tx->extent_next++;
+      err_t_wrap (pgr_get_free_writable (dest, tx, pg, p, e), e);
+      goto theend;
+    }
+
+  err_t_wrap (pgr_get (&root, PG_ROOT_NODE, ROOT_PGNO, p, e), e);
+
+  ret = pgr_fsm_find (p, &root, near, &pg, e);
+  if (ret)
+    {
+      goto failed;
+    }
+
+  if (pg != PGNO_NULL)
+    {
+      // Reuse a free page
+      if ((ret = pgr_fsm_mark (p, tx, &root, pg, false, e)))
+        {
+          goto failed;
+        }
+    }
+  else
+    {
+      // Nothing free - take the next page off the end
+      if ((ret = pgr_maybe_make_writable (p, tx, &root, e)))
+        {
+          goto failed;
+        }
+
+      pg = rn_get_next_pg (page_h_ro (&root));
+      if (pg == frlst_map_pgno (pg))
+        {
+          if ((ret = pgr_fsm_new_map (p, tx, pg, e)))
+            {
+              goto failed;
+            }
+          pg++;
+        }
+
+      // Unlogged transactions take a whole extent (up to the next map page) for one root update
+      pgno end = pg + 1;
+      if (tx->unlogged)
+        {
+          while (end - pg < UNLOGGED_EXTENT && frlst_map_pgno (end) != end)
+            {
+              end++;
+            }
+          tx->extent_next = pg + 1;
+          tx->extent_end = end;
+        }
+
+      rn_set_next_pg (page_h_w (&root), end);
+    }
+
+  if ((ret = pgr_get_free_writable (dest, tx, pg, p, e)))
+    {
+      goto failed;
+    }
+
+  if (root.mode == PHM_X && (ret = pgr_save (p, &root, PG_ROOT_NODE, e)))
+    {
+      pgr_cancel_w (p, dest);
+      pgr_release_no_tx (p, dest, PG_ANY, e);
+      goto failed;
+    }
+
+  pgr_release (p, &root, PG_ROOT_NODE, e);
+
+theend:
+  page_init_empty (page_h_w (dest), type);
+
+  // Brand new to this transaction - an unlogged one doesn't log it
+  if (tx->unlogged)
+    {
+      struct pgr_part *pt = pgr_part_of (p, pg);
+      i_mutex_lock (&pt->l);
+      pf_set (dest->pgr, PW_UNLOGGED);
+      i_mutex_unlock (&pt->l);
+    }
+
+  return SUCCESS;
+
+failed:
+  if (root.mode == PHM_X)
+    {
+      pgr_cancel_w (p, &root);
+    }
+  pgr_release_no_tx (p, &root, PG_ROOT_NODE, e);
+  tx->extent_next = tx->extent_end = 0;
+  return ret;
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, pgr_new_get_save)
+{
+  struct pgr_fixture f;
+  page_h h = page_h_create ();
+  test_err_t_wrap (pgr_fixture_create (&f), &f.e);
+
+  struct txn tx;
+  test_err_t_wrap (pgr_begin_txn (&tx, f.p, &f.e), &f.e);
+
+  pgr_new (&h, f.p, &tx, PG_DATA_LIST, &f.e);
+  test_assert_int_equal ((int)pgr_get_npages (f.p), 2);
+
+  // Make it valid
+  dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+
+  test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
+
+  test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, &f.e), &f.e);
+
+  test_err_t_wrap (pgr_fixture_teardown (&f), &f.e);
+}
+
+TEST (TT_UNIT, pgr_get_checksum)
+{
+  struct pgr_fixture f;
+  error *e = &f.e;
+  page_h h = page_h_create ();
+  test_err_t_wrap (pgr_fixture_create (&f), e);
+
+  struct txn tx;
+  test_err_t_wrap (pgr_begin_txn (&tx, f.p, e), e);
+  test_err_t_wrap (pgr_new (&h, f.p, &tx, PG_DATA_LIST, e), e);
+  pgno pg = page_h_pgno (&h);
+  dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+  test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, e), e);
+  test_err_t_wrap (pgr_commit (f.p, &tx, e), e);
+
+  // Closing flushes it with its checksum
+  pgr_close (f.p, e);
+
+  TEST_CASE ("Clean page reads back")
+  {
+    f.p = pgr_open ("test.db", "test.wal", &f.lt, f.tp, e);
+    test_fail_if_null (f.p);
+    test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, pg, f.p, e), e);
+    test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, e), e);
+    pgr_close (f.p, e);
+  }
+
+  TEST_CASE ("A flipped data byte - still a valid data list - is caught")
+  {
+    i_file fp;
+    u8 byte;
+    test_err_t_wrap (i_open_rw (&fp, "test.db", e), e);
+    test_fail_if (i_pread_all (&fp, &byte, 1, (pg + 1) * PAGE_SIZE - 1, e) < 0);
+    byte ^= 0x10;
+    test_err_t_wrap (i_pwrite_all (&fp, &byte, 1, (pg + 1) * PAGE_SIZE - 1, e), e);
+    test_err_t_wrap (i_close (&fp, e), e);
+
+    // Nothing to recover - otherwise redo pulls the page into the pool first
+    test_err_t_wrap (i_remove_quiet ("test.wal", e), e);
+
+    f.p = pgr_open ("test.db", "test.wal", &f.lt, f.tp, e);
+    test_fail_if_null (f.p);
+    test_err_t_check (pgr_get (&h, PG_DATA_LIST, pg, f.p, e), ERR_CORRUPT, e);
+  }
+
+  test_err_t_wrap (pgr_fixture_teardown (&f), e);
+}
+#endif
+
+err_t
+pgr_delete_and_release (struct pager *p, struct txn *tx, page_h *h, error *e)
+{
+  DBG_ASSERT (pager, p);
+
+  pgno pg = page_h_pgno (h);
+  ASSERT (pg != ROOT_PGNO && pg != frlst_map_pgno (pg));
+
+  // X(root) - covers the whole free space map
+  if (lockt_lock (p->lt, (struct lt_lock){ .type = LOCK_ROOT, .data = { 0 } }, LM_X, tx, e))
+    {
+      return e->cause_code;
+    }
+
+  err_t_wrap (pgr_maybe_make_writable (p, tx, h, e), e);
+  page_init_empty (page_h_w (h), PG_TOMBSTONE);
+  err_t_wrap (pgr_release (p, h, PG_TOMBSTONE, e), e);
+
+  page_h root = page_h_create ();
+  err_t_wrap (pgr_get (&root, PG_ROOT_NODE, ROOT_PGNO, p, e), e);
+
+  err_t ret = pgr_fsm_mark (p, tx, &root, pg, true, e);
+  if (ret == SUCCESS && root.mode == PHM_X)
+    {
+      ret = pgr_save (p, &root, PG_ROOT_NODE, e);
+    }
+  if (ret && root.mode == PHM_X)
+    {
+      pgr_cancel_w (p, &root);
+    }
+  pgr_release_no_tx (p, &root, PG_ROOT_NODE, e);
+
+  if (ret == SUCCESS)
+    {
+      p->fsm_hint = MIN (p->fsm_hint, pg);
+    }
+
+  return ret;
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, pgr_delete)
+{
+  struct pgr_fixture f;
+  error *e = &f.e;
+  test_err_t_wrap (pgr_fixture_create (&f), &f.e);
+
+  struct txn tx;
+  test_err_t_wrap (pgr_begin_txn (&tx, f.p, e), e);
+
+  page_h a = page_h_create ();
+  page_h b = page_h_create ();
+  page_h c = page_h_create ();
+  page_h d = page_h_create ();
+
+  test_err_t_wrap (pgr_new (&a, f.p, &tx, PG_DATA_LIST, e), e);
+  test_err_t_wrap (pgr_new (&b, f.p, &tx, PG_DATA_LIST, e), e);
+  test_err_t_wrap (pgr_new (&c, f.p, &tx, PG_DATA_LIST, e), e);
+  test_err_t_wrap (pgr_new (&d, f.p, &tx, PG_DATA_LIST, e), e);
+
+  pgno apg = page_h_pgno (&a);
+  pgno bpg = page_h_pgno (&b);
+  pgno cpg = page_h_pgno (&c);
+  pgno dpg = page_h_pgno (&d);
+
+  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &a, e), e);
+  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &b, e), e);
+  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &c, e), e);
+  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &d, e), e);
+
+  test_err_t_wrap (pgr_new (&a, f.p, &tx, PG_DATA_LIST, e), e);
+  test_err_t_wrap (pgr_new (&b, f.p, &tx, PG_DATA_LIST, e), e);
+  test_err_t_wrap (pgr_new (&c, f.p, &tx, PG_DATA_LIST, e), e);
+  test_err_t_wrap (pgr_new (&d, f.p, &tx, PG_DATA_LIST, e), e);
+
+  // Lowest free page first
+  test_assert_equal (page_h_pgno (&a), apg);
+  test_assert_equal (page_h_pgno (&b), bpg);
+  test_assert_equal (page_h_pgno (&c), cpg);
+  test_assert_equal (page_h_pgno (&d), dpg);
+
+  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &a, e), e);
+  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &b, e), e);
+  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &c, e), e);
+  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &d, e), e);
+
+  test_err_t_wrap (pgr_new (&a, f.p, &tx, PG_DATA_LIST, e), e);
+  test_err_t_wrap (pgr_new (&b, f.p, &tx, PG_DATA_LIST, e), e);
+  test_err_t_wrap (pgr_new (&c, f.p, &tx, PG_DATA_LIST, e), e);
+  test_err_t_wrap (pgr_new (&d, f.p, &tx, PG_DATA_LIST, e), e);
+
+  test_assert_equal (page_h_pgno (&a), apg);
+  test_assert_equal (page_h_pgno (&b), bpg);
+  test_assert_equal (page_h_pgno (&c), cpg);
+  test_assert_equal (page_h_pgno (&d), dpg);
+
+  dl_set_used (page_h_w (&a), DL_DATA_SIZE);
+  dl_set_used (page_h_w (&b), DL_DATA_SIZE);
+  dl_set_used (page_h_w (&c), DL_DATA_SIZE);
+  dl_set_used (page_h_w (&d), DL_DATA_SIZE);
+
+  test_err_t_wrap (pgr_release (f.p, &a, PG_DATA_LIST, e), e);
+  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &b, e), e);
+  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &c, e), e);
+  test_err_t_wrap (pgr_release (f.p, &d, PG_DATA_LIST, e), e);
+
+  test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
+
+  test_err_t_wrap (pgr_fixture_teardown (&f), &f.e);
+}
+#endif
+
+#ifndef NTEST
+TEST (TT_UNIT, pgr_new_near)
+{
+  struct pgr_fixture f;
+  error *e = &f.e;
+  test_err_t_wrap (pgr_fixture_create (&f), &f.e);
+
+  struct txn tx;
+  test_err_t_wrap (pgr_begin_txn (&tx, f.p, e), e);
+
+  // Pages 1..10 - a freed page comes straight back
+  for (u32 i = 0; i < 10; ++i)
+    {
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_new (&h, f.p, &tx, PG_DATA_LIST, e), e);
+      test_assert_equal (page_h_pgno (&h), i + 1);
+      test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &h, e), e);
+      test_err_t_wrap (pgr_new (&h, f.p, &tx, PG_DATA_LIST, e), e);
+      test_assert_equal (page_h_pgno (&h), i + 1);
+      dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+      test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, e), e);
+    }
+
+  // Free 3, 4, 7, 8
+  pgno freed[] = { 3, 4, 7, 8 };
+  for (u32 i = 0; i < arrlen (freed); ++i)
+    {
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, freed[i], f.p, e), e);
+      test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &h, e), e);
+    }
+
+  struct
+  {
+    pgno near;
+    pgno expect;
+  } cases[] = {
+    { 6, 7 },          // Right after [near]
+    { 7, 8 },          // Keeps the chain going
+    { PGNO_NULL, 3 },  // Lowest free page
+    { 8, 4 },          // Nothing after [near] - lowest again
+    { 10, 11 },        // Full - extend
+    { PGNO_NULL, 12 }, // Still full
+  };
+
+  for (u32 i = 0; i < arrlen (cases); ++i)
+    {
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_new_near (&h, f.p, &tx, PG_DATA_LIST, cases[i].near, e), e);
+      test_assert_equal (page_h_pgno (&h), cases[i].expect);
+      dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+      test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, e), e);
+    }
+
+  test_assert_int_equal ((int)pgr_get_npages (f.p), 13);
+
+  test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
+  test_err_t_wrap (pgr_fixture_teardown (&f), &f.e);
+}
+#endif
+
+///////////////////////////////////////////////////////////
+////// COMPACTION
+
+err_t
+pgr_relocate (page_h *dest, struct pager *p, struct txn *tx, page_h *h, error *e)
+{
+  DBG_ASSERT (pager, p);
+  DBG_ASSERT (page_h, dest);
+  ASSERT (dest->mode == PHM_NONE);
+
+  pgno pg = page_h_pgno (h);
+  ASSERT (pg != ROOT_PGNO && pg != frlst_map_pgno (pg));
+
+  // X(root) - covers the whole free space map
+  if (lockt_lock (p->lt, (struct lt_lock){ .type = LOCK_ROOT, .data = { 0 } }, LM_X, tx, e))
+    {
+      return e->cause_code;
+    }
+
+  page_h root = page_h_create ();
+  err_t_wrap (pgr_get (&root, PG_ROOT_NODE, ROOT_PGNO, p, e), e);
+
+  // Nothing below the hint is free
+  pgno lower = PGNO_NULL;
+  err_t ret = SUCCESS;
+  if (p->fsm_hint < pg && (ret = pgr_fsm_scan (p, &root, p->fsm_hint, pg, &lower, e)))
+    {
+      goto failed;
+    }
+
+  if (lower == PGNO_NULL)
+    {
+      p->fsm_hint = MAX (p->fsm_hint, pg);
+      return pgr_release (p, &root, PG_ROOT_NODE, e);
+    }
+  p->fsm_hint = lower;
+
+  if ((ret = pgr_fsm_mark (p, tx, &root, lower, false, e)))
+    {
+      goto failed;
+    }
+
+  if ((ret = pgr_get_free_writable (dest, tx, lower, p, e)))
+    {
+      goto failed;
+    }
+
+  if (root.mode == PHM_X && (ret = pgr_save (p, &root, PG_ROOT_NODE, e)))
+    {
+      pgr_cancel_w (p, dest);
+      pgr_release_no_tx (p, dest, PG_ANY, e);
+      goto failed;
+    }
+
+  pgr_release (p, &root, PG_ROOT_NODE, e);
+
+  // Same bytes, new home. Whoever points at [pg] is the caller's to fix
+  i_memcpy (page_h_w (dest)->raw, page_h_ro (h)->raw, PAGE_SIZE);
+
+  return pgr_delete_and_release (p, tx, h, e);
+
+failed:
+  if (root.mode == PHM_X)
+    {
+      pgr_cancel_w (p, &root);
+    }
+  pgr_release_no_tx (p, &root, PG_ROOT_NODE, e);
+  return ret;
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, pgr_relocate)
+{
+  struct pgr_fixture f;
+  error *e = &f.e;
+  test_err_t_wrap (pgr_fixture_create (&f), &f.e);
+
+  struct txn tx;
+  test_err_t_wrap (pgr_begin_txn (&tx, f.p, e), e);
+
+  // Pages 1..6
+  for (u32 i = 0; i < 6; ++i)
+    {
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_new (&h, f.p, &tx, PG_DATA_LIST, e), e);
+      dl_set_used (page_h_w (&h), (p_size)(i + 1));
+      test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, e), e);
+    }
+
+  page_h h = page_h_create ();
+  page_h dest = page_h_create ();
+
+  TEST_CASE ("Nothing free below - stays put")
+  {
+    test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, 6, f.p, e), e);
+    test_err_t_wrap (pgr_relocate (&dest, f.p, &tx, &h, e), e);
+    test_assert_int_equal (dest.mode, PHM_NONE);
+    test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, e), e);
+  }
+
+  TEST_CASE ("Moves to the lowest free page")
+  {
+    pgno freed[] = { 4, 2 };
+    for (u32 i = 0; i < arrlen (freed); ++i)
+      {
+        test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, freed[i], f.p, e), e);
+        test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &h, e), e);
+      }
+
+    test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, 6, f.p, e), e);
+    test_err_t_wrap (pgr_relocate (&dest, f.p, &tx, &h, e), e);
+    test_assert_int_equal (h.mode, PHM_NONE);
+    test_assert_equal (page_h_pgno (&dest), 2);
+    test_assert_equal (dl_used (page_h_ro (&dest)), 6);
+    test_err_t_wrap (pgr_release (f.p, &dest, PG_DATA_LIST, e), e);
+
+    // The old page is free again
+    test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, 5, f.p, e), e);
+    test_err_t_wrap (pgr_relocate (&dest, f.p, &tx, &h, e), e);
+    test_assert_equal (page_h_pgno (&dest), 4);
+    test_err_t_wrap (pgr_release (f.p, &dest, PG_DATA_LIST, e), e);
+
+    test_err_t_wrap (pgr_new (&h, f.p, &tx, PG_DATA_LIST, e), e);
+    test_assert_equal (page_h_pgno (&h), 5);
+    test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &h, e), e);
+  }
+
+  test_err_t_wrap (pgr_commit (f.p, &tx, e), e);
+  test_err_t_wrap (pgr_fixture_teardown (&f), &f.e);
+}
+#endif
+
+/**
+ * Forget every cached frame at or past [end] - they're free pages about
+ * to be cut off, so dirty ones never need to reach the disk. Caller holds
+ * the cleaner. [*keep] is one past the last one still pinned (read-ahead
+ * can hold one) so the file isn't cut out from under it
+ */
+static err_t
+pgr_drop_tail (struct pager *p, pgno end, pgno *keep, error *e)
+{
+  *keep = end;
+
+  for (u32 j = 0; j < p->nparts; ++j)
+    {
+      struct pgr_part *pt = &p->parts[j];
+
+      i_mutex_lock (&pt->l);
+      for (u32 i = 0; i < pt->nframes; ++i)
+        {
+          struct page_frame *mp = &p->pages[pt->start + i];
+
+          if (!pf_check (mp, PW_PRESENT) || mp->page.pg < end)
+            {
+              continue;
+            }
+
+          if (mp->pin > 0)
+            {
+              *keep = MAX (*keep, mp->page.pg + 1);
+              continue;
+            }
+
+          if (pf_check (mp, PW_DIRTY))
+            {
+              pt->ndirty--;
+
+              bool exists;
+              if (dpgt_remove (&exists, &p->dpt, mp->page.pg, e))
+                {
+                  i_mutex_unlock (&pt->l);
+                  return e->cause_code;
+                }
+            }
+
+          ht_delete_expect_idx (&pt->pgno_to_value, NULL, mp->page.pg);
+          pgr_policy_on_evict (pt, mp);
+          mp->flags = 0;
+        }
+      i_mutex_unlock (&pt->l);
+    }
+
+  if (p->l2_enabled)
+    {
+      l2c_drop_from (&p->l2, end);
+    }
+
+  return SUCCESS;
+}
+
+/**
+ * Move next_pg back over the free pages at the end. The bits past it
+ * are cleared since pgr_new hands those pages out from the end, and map
+ * pages whose whole span is free go with them
+ */
+static err_t
+pgr_shrink_fsm (struct pager *p, struct txn *tx, pgno *dest, error *e)
+{
+  // X(root) - covers the whole free space map
+  if (lockt_lock (p->lt, (struct lt_lock){ .type = LOCK_ROOT, .data = { 0 } }, LM_X, tx, e))
+    {
+      return e->cause_code;
+    }
+
+  page_h root = page_h_create ();
+  page_h map = page_h_create ();
+  err_t_wrap (pgr_get (&root, PG_ROOT_NODE, ROOT_PGNO, p, e), e);
+
+  pgno end = rn_get_next_pg (page_h_ro (&root));
+  pgno k = end;
+
+  while (k > 1)
+    {
+      pgno span = frlst_map_pgno (k - 1);
+      const page *bits = page_h_ro (&root);
+
+      if (span != ROOT_PGNO)
+        {
+          if (pgr_get (&map, PG_FREE_LIST, span, p, e))
+            {
+              goto failed;
+            }
+          bits = page_h_ro (&map);
+        }
+
+      pgno used = frlst_used_end (bits, k - span);
+
+      if (span != ROOT_PGNO && pgr_release (p, &map, PG_FREE_LIST, e))
+        {
+          goto failed;
+        }
+
+      // Only the map page is left in use
+      if (used == 1 && span != ROOT_PGNO)
+        {
+          k = span;
+          continue;
+        }
+
+      k = span + used;
+      break;
+    }
+
+  *dest = k;
+
+  if (k == end)
+    {
+      return pgr_release (p, &root, PG_ROOT_NODE, e);
+    }
+
+  if (pgr_make_writable (p, tx, &root, e))
+    {
+      goto failed;
+    }
+
+  pgno span = frlst_map_pgno (k);
+  if (span != k)
+    {
+      page *bits = page_h_w (&root);
+      if (span != ROOT_PGNO)
+        {
+          if (pgr_get_writable (&map, tx, PG_FREE_LIST, span, p, e))
+            {
+              goto failed;
+            }
+          bits = page_h_w (&map);
+        }
+
+      for (pgno pg = k; pg < MIN (end, span + FL_SPAN); ++pg)
+        {
+          frlst_set_free (bits, pg, false);
+        }
+
+      if (span != ROOT_PGNO && pgr_release (p, &map, PG_FREE_LIST, e))
+        {
+          goto failed;
+        }
+    }
+
+  rn_set_next_pg (page_h_w (&root), k);
+
+  return pgr_release (p, &root, PG_ROOT_NODE, e);
+
+failed:
+  if (map.mode == PHM_X)
+    {
+      pgr_cancel_w (p, &map);
+    }
+  pgr_release_if_exists (p, &map, PG_FREE_LIST, e);
+  if (root.mode == PHM_X)
+    {
+      pgr_cancel_w (p, &root);
+    }
+  pgr_release_no_tx (p, &root, PG_ROOT_NODE, e);
+  return e->cause_code;
+}
+
+/**
+ * Truncate the file to next_pg. Separate from the free space map update
+ * so that's durable first - a crash in between just leaves a long file,
+ * never a free space map pointing at pages that were cut off
+ */
+static err_t
+pgr_shrink_file (struct pager *p, struct txn *tx, error *e)
+{
+  // X(root) - next_pg can't move under us
+  if (lockt_lock (p->lt, (struct lt_lock){ .type = LOCK_ROOT, .data = { 0 } }, LM_X, tx, e))
+    {
+      return e->cause_code;
+    }
 
-  /* Half a page */
-  test_fail_if (i_truncate (&fp, PAGE_SIZE / 2, &e));
-  p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
-  test_assert_int_equal (e.cause_code, ERR_CORRUPT);
-  test_assert_equal (p, NULL);
-  e.cause_code = SUCCESS;
+  page_h root = page_h_create ();
+  err_t_wrap (pgr_get (&root, PG_ROOT_NODE, ROOT_PGNO, p, e), e);
+  pgno end = rn_get_next_pg (page_h_ro (&root));
+  err_t_wrap (pgr_release (p, &root, PG_ROOT_NODE, e), e);
 
-  /* 0 pages */
-  test_fail_if (i_truncate (&fp, 0, &e));
-  p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
-  test_assert_int_equal (e.cause_code, SUCCESS);
-  test_fail_if_null (p);
-  test_assert_int_equal ((int)pgr_get_npages (p), 1);
-  test_fail_if (pgr_close (p, &e));
+  pgno keep;
+  pgr_cleaner_claim (p);
+  err_t ret = pgr_drop_tail (p, end, &keep, e);
+  pgr_cleaner_release (p);
+  err_t_wrap (ret, e);
 
-  /* Tear down */
-  test_fail_if (i_close (&fp, &e));
-  test_fail_if (i_unlink ("test.db", &e));
+  if (keep < fpgr_get_npages (&p->fp))
+    {
+      i_log_info ("Pager shrinking file from %" PRp_size " to %" PRpgno " pages\n", fpgr_get_npages (&p->fp), keep);
+      err_t_wrap (fpgr_truncate (&p->fp, keep, e), e);
+    }
 
-  test_err_t_wrap (tp_free (tp, &e), &e);
-  lockt_destroy (&lt);
+  return SUCCESS;
 }
-#endif
 
 err_t
-pgr_close (struct pager *p, error *e)
+pgr_shrink (struct pager *p, error *e)
 {
   DBG_ASSERT (pager, p);
 
-  // Save all in memory pages
-  pgr_evict_all (p, e);
-
-  wal_close (&p->ww, e);
-  fpgr_close (&p->fp, e);
-
-  txnt_close (&p->tnxt);
-  dpgt_close (&p->dpt);
+  struct txn tx;
+  pgno end;
 
-  i_free (p);
+  err_t_wrap (pgr_begin_txn (&tx, p, e), e);
+  if (pgr_shrink_fsm (p, &tx, &end, e))
+    {
+      pgr_rollback (p, &tx, 0, e);
+      return e->cause_code;
+    }
+  err_t_wrap (pgr_commit (p, &tx, e), e);
 
-  return e->cause_code;
+  err_t_wrap (pgr_begin_txn (&tx, p, e), e);
+  if (pgr_shrink_file (p, &tx, e))
+    {
+      pgr_rollback (p, &tx, 0, e);
+      return e->cause_code;
+    }
+  return pgr_commit (p, &tx, e);
 }
 
 #ifndef NTEST
-TEST (TT_UNIT, pgr_close_success)
+TEST (TT_UNIT, pgr_shrink)
 {
-  error e = error_create ();
-  test_fail_if (i_remove_quiet ("test.db", &e));
-  test_fail_if (i_remove_quiet ("test.wal", &e));
+  struct pgr_fixture f;
+  error *e = &f.e;
+  test_err_t_wrap (pgr_fixture_create (&f), &f.e);
 
-  struct lockt lt;
-  test_err_t_wrap (lockt_init (&lt, &e), &e);
+  struct txn tx;
+  test_err_t_wrap (pgr_begin_txn (&tx, f.p, e), e);
 
-  struct thread_pool *tp = tp_open (&e);
-  test_fail_if_null (tp);
+  // Pages 1..20
+  for (u32 i = 0; i < 20; ++i)
+    {
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_new (&h, f.p, &tx, PG_DATA_LIST, e), e);
+      dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+      test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, e), e);
+    }
 
-  struct pager *p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
-  test_fail_if_null (p);
+  // Free 5 and 12..20
+  for (pgno pg = 5; pg <= 20; pg = pg == 5 ? 12 : pg + 1)
+    {
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, pg, f.p, e), e);
+      test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &h, e), e);
+    }
+  test_err_t_wrap (pgr_commit (f.p, &tx, e), e);
 
-  /* Delete file i_close should fail */
-  test_assert_equal (pgr_close (p, &e), SUCCESS);
-  test_fail_if (i_remove_quiet ("foo.db", &e));
+  TEST_CASE ("Cuts the free tail, keeps the hole")
+  {
+    test_err_t_wrap (pgr_shrink (f.p, e), e);
+    test_assert_int_equal ((int)pgr_get_npages (f.p), 12);
 
-  test_err_t_wrap (tp_free (tp, &e), &e);
-  lockt_destroy (&lt);
+    // Nothing left to cut
+    test_err_t_wrap (pgr_shrink (f.p, e), e);
+    test_assert_int_equal ((int)pgr_get_npages (f.p), 12);
+  }
+
+  TEST_CASE ("The hole then the end")
+  {
+    test_err_t_wrap (pgr_begin_txn (&tx, f.p, e), e);
+
+    page_h h = page_h_create ();
+    test_err_t_wrap (pgr_new (&h, f.p, &tx, PG_DATA_LIST, e), e);
+    test_assert_equal (page_h_pgno (&h), 5);
+    dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+    test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, e), e);
+
+    test_err_t_wrap (pgr_new (&h, f.p, &tx, PG_DATA_LIST, e), e);
+    test_assert_equal (page_h_pgno (&h), 12);
+    dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+    test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, e), e);
+
+    test_err_t_wrap (pgr_commit (f.p, &tx, e), e);
+    test_assert_int_equal ((int)pgr_get_npages (f.p), 13);
+  }
+
+  test_err_t_wrap (pgr_fixture_teardown (&f), &f.e);
 }
 #endif
 
-///////////////////////////////////////////////////////////
-////// COMMON
-
-p_size
-pgr_get_npages (const struct pager *p)
+err_t
+pgr_release_if_exists (struct pager *p, page_h *h, int flags, error *e)
 {
-  DBG_ASSERT (pager, p);
-  return fpgr_get_npages (&p->fp);
+  if (h->mode != PHM_NONE)
+    {
+      return pgr_release (p, h, flags, e);
+    }
+  return SUCCESS;
 }
 
-///////////////////////////////////////////////////////////
-////// TRANSACTION CONTROL
-
 err_t
-pgr_begin_txn (struct txn *tx, struct pager *p, error *e)
+pgr_release (struct pager *p, page_h *h, int flags, error *e)
 {
   DBG_ASSERT (pager, p);
+  ASSERT (h->mode == PHM_X || h->mode == PHM_S);
+  ASSERT (pf_check (h->pgr, PW_PRESENT));
 
-  // Generate a new transaction ID
-  latch_lock (&p->l);
-  txid tid = p->next_tid++;
-  latch_unlock (&p->l);
+  i_log_trace ("Releasing %" PRpgno "\n", page_h_pgno (h));
 
-  // Append begin record
-  slsn l = wal_append_begin_log (&p->ww, tid, e);
-  if (l < 0)
+  if (h->mode == PHM_X)
     {
-      return e->cause_code;
+      err_t_wrap (pgr_save (p, h, flags, e), e);
     }
 
-  txn_init (tx, tid, (struct txn_data){
-                         .last_lsn = l,
-                         .undo_next_lsn = 0,
-                         .state = TX_RUNNING,
-                     });
+  err_t_wrap (page_validate_for_db (&h->pgr->page, flags, e), e);
 
-  // Create a new transaction entry
-  err_t_wrap (txnt_insert_txn (&p->tnxt, tx, e), e);
+  DBG_ASSERT (pager, p);
+
+  pgr_unpin (p, h);
 
   return SUCCESS;
 }
 
 err_t
-pgr_commit (struct pager *p, struct txn *tx, error *e)
+pgr_flush_wall (struct pager *p, error *e)
 {
-  DBG_ASSERT (pager, p);
+  return wal_flush_all (&p->ww, e);
+}
 
-  latch_lock (&tx->l);
+#ifndef NTEST
 
-  if (tx->data.state != TX_RUNNING)
-    {
-      latch_unlock (&tx->l);
-      return error_causef (e, ERR_DUPLICATE_COMMIT, "Committing a transaction that is already committed\n");
-    }
+TEST (TT_UNIT, pager_fill_ht)
+{
+  struct pgr_fixture f;
+  test_err_t_wrap (pgr_fixture_create (&f), &f.e);
 
-  // Append a commit log for this transaction
-  slsn l = wal_append_commit_log (&p->ww, tx->tid, tx->data.last_lsn, e);
-  if (l < 0)
-    {
-      latch_unlock (&tx->l);
-      return e->cause_code;
-    }
+  struct txn tx;
+  pgr_begin_txn (&tx, f.p, &f.e);
 
-  // Flush the wal to the expected lsn
-  err_t_wrap (wal_flush_to (&p->ww, l, e), e);
+  page_h pgs[MEMORY_PAGE_LEN];
+  page_h bad = page_h_create ();
 
-  // Append an end log to the wal
-  l = wal_append_end_log (&p->ww, tx->tid, l, e);
-  if (l < 0)
-    {
-      latch_unlock (&tx->l);
-      return e->cause_code;
-    }
+  {
+    // Fill up - there is already one page in the pool, the root
+    u32 i = 0;
+    for (; i < MEMORY_PAGE_LEN - 1; ++i)
+      {
+        pgs[i] = page_h_create ();
+        test_err_t_wrap (pgr_new (&pgs[i], f.p, &tx, PG_DATA_LIST, &f.e), &f.e);
+        test_assert_equal (pgs[i].mode, PHM_X);
+      }
 
-  err_t_wrap (txnt_remove_txn_expect (&p->tnxt, tx, e), e);
+    // Next page will be full
+    test_err_t_check (pgr_new (&bad, f.p, &tx, PG_DATA_LIST, &f.e), ERR_PAGER_FULL, &f.e);
 
-  tx->data.state = TX_DONE;
+    // Release them all
+    for (i = 0; i < MEMORY_PAGE_LEN - 1; ++i)
+      {
+        dl_set_used (page_h_w (&pgs[i]), DL_DATA_SIZE);
+        test_err_t_wrap (pgr_release (f.p, &pgs[i], PG_DATA_LIST, &f.e), &f.e);
+      }
+  }
 
-  err_t_wrap (lockt_unlock_tx (p->lt, tx, e), e);
+  // Repeat above
+  {
+    // Fill up again - good
+    for (u32 i = 0; i < MEMORY_PAGE_LEN - 1; ++i)
+      {
+        test_err_t_wrap (pgr_new (&pgs[i], f.p, &tx, PG_DATA_LIST, &f.e), &f.e);
+        test_assert_equal (pgs[i].mode, PHM_X);
+      }
 
-  latch_unlock (&tx->l);
+    // Next page will be full
+    test_err_t_check (pgr_new (&bad, f.p, &tx, PG_DATA_LIST, &f.e), ERR_PAGER_FULL, &f.e);
 
-  return SUCCESS;
+    // Release them all
+    for (u32 i = 0; i < MEMORY_PAGE_LEN - 1; ++i)
+      {
+        dl_set_used (page_h_w (&pgs[i]), DL_DATA_SIZE);
+        test_err_t_wrap (pgr_release (f.p, &pgs[i], PG_DATA_LIST, &f.e), &f.e);
+      }
+  }
+
+  test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
+
+  test_err_t_wrap (pgr_fixture_teardown (&f), &f.e);
 }
+#endif
 
-static err_t
-pgr_update_master_lsn (struct pager *p, lsn mlsn, error *e)
+#ifndef NTEST
+TEST (TT_UNIT, pgr_stats)
 {
-  // BEGIN TXN
-  struct txn tx;
-  err_t_wrap (pgr_begin_txn (&tx, p, e), e);
+  struct pgr_fixture f;
+  test_err_t_wrap (pgr_fixture_create (&f), &f.e);
 
-  // X(root)
-  if (lockt_lock (p->lt, (struct lt_lock){ .type = LOCK_ROOT, .data = { 0 } }, LM_X, &tx, e))
-    {
-      goto theend;
-    }
+  struct pgr_stats s;
+  pgr_get_stats (f.p, &s);
+  test_assert_int_equal (s.nframes, pgr_get_nframes (f.p));
+  test_assert_int_equal (s.npinned, 0);
+  test_assert_int_equal (s.pager_full, 0);
 
-  // GET ROOT
-  page_h root = page_h_create ();
-  if (pgr_get_writable (&root, &tx, PG_ROOT_NODE, 0, p, e))
-    {
-      return e->cause_code;
-    }
+  struct txn tx;
+  page_h pgs[MEMORY_PAGE_LEN];
+  page_h bad = page_h_create ();
+  pgno pg0 = PGNO_NULL;
 
-  // UPDATE MLSN
-  rn_set_master_lsn (page_h_w (&root), mlsn);
+  TEST_CASE ("Pins, near misses and a full pool")
+  {
+    test_err_t_wrap (pgr_begin_txn (&tx, f.p, &f.e), &f.e);
+    for (u32 i = 0; i < MEMORY_PAGE_LEN - 1; ++i)
+      {
+        pgs[i] = page_h_create ();
+        test_err_t_wrap (pgr_new (&pgs[i], f.p, &tx, PG_DATA_LIST, &f.e), &f.e);
+      }
+    test_err_t_check (pgr_new (&bad, f.p, &tx, PG_DATA_LIST, &f.e), ERR_PAGER_FULL, &f.e);
 
-  // SAVE (don't release yet, we'll evict it)
-  if (pgr_save (p, &root, PG_ROOT_NODE, e))
-    {
-      goto theend;
-    }
+    pgr_get_stats (f.p, &s);
+    test_assert_int_equal (s.npinned, MEMORY_PAGE_LEN - 1);
+    test_assert_int_equal (s.pager_full, 1);
+    test_assert (s.near_full > 0);
 
-  // COMMIT
-  if (pgr_commit (p, &tx, e))
-    {
-      goto theend;
-    }
+    pg0 = page_h_pgno (&pgs[0]);
+    for (u32 i = 0; i < MEMORY_PAGE_LEN - 1; ++i)
+      {
+        dl_set_used (page_h_w (&pgs[i]), DL_DATA_SIZE);
+        test_err_t_wrap (pgr_release (f.p, &pgs[i], PG_DATA_LIST, &f.e), &f.e);
+      }
+    test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
+
+    pgr_get_stats (f.p, &s);
+    test_assert_int_equal (s.npinned, 0);
+    test_assert (s.ndirty > 0);
+    test_assert (s.wal_fsyncs > 0);
+    test_assert (s.wal_bytes > 0);
+    test_assert (s.wal_fsync_max_ns > 0);
+    test_assert (s.wal_fsync_ns >= s.wal_fsync_max_ns);
+  }
 
-  /**
-   * Flush root node to disk. It doesn't hurt. Technically we don't need to
-   * but if we want checkpoint to be "done" after this call, root page should be persisted (forced)
-   * to disk
-   */
-  if (pgr_flush (p, root.pgr, e))
-    {
-      goto theend;
-    }
+  TEST_CASE ("Hits")
+  {
+    u64 hits = s.hits;
+    for (u32 i = 0; i < 4; ++i)
+      {
+        page_h h = page_h_create ();
+        test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, pg0, f.p, &f.e), &f.e);
+        test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, &f.e), &f.e);
+      }
+    pgr_get_stats (f.p, &s);
+    test_assert_equal (s.hits, hits + 4);
+    test_assert (pgr_stats_hit_ratio (&s) > 0.0);
+  }
 
-theend:
-  pgr_release (p, &root, PG_ROOT_NODE, e);
-  return e->cause_code;
+  TEST_CASE ("Dirty evictions write pages")
+  {
+    test_err_t_wrap (pgr_begin_txn (&tx, f.p, &f.e), &f.e);
+    for (u32 i = 0; i < 2 * MEMORY_PAGE_LEN; ++i)
+      {
+        page_h h = page_h_create ();
+        test_err_t_wrap (pgr_new (&h, f.p, &tx, PG_DATA_LIST, &f.e), &f.e);
+        dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+        test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, &f.e), &f.e);
+      }
+    test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
+
+    pgr_get_stats (f.p, &s);
+    test_assert (s.evictions >= MEMORY_PAGE_LEN);
+    test_assert (s.dirty_evictions > 0);
+    test_assert (s.page_writes >= s.dirty_evictions);
+  }
+
+  test_err_t_wrap (pgr_fixture_teardown (&f), &f.e);
 }
+#endif
 
-err_t
-pgr_checkpoint (struct pager *p, error *e)
+#ifndef NTEST
+TEST (TT_UNIT, pager_wal_delta)
 {
-  // BEGIN CHECKPOINT
-  slsn mlsn = wal_append_ckpt_begin (&p->ww, e);
-  err_t_wrap (mlsn, e);
+  struct pgr_fixture f;
+  test_err_t_wrap (pgr_fixture_create (&f), &f.e);
 
-  // FLUSH PAGES
-  err_t_wrap (pgr_evict_all (p, e), e);
+  struct txn tx;
+  struct pgr_stats s0, s1;
+  page_h h = page_h_create ();
 
-  // END CHECKPOINT
-  slsn end_lsn = wal_append_ckpt_end (&p->ww, &p->tnxt, &p->dpt, e);
-  if (end_lsn < 0)
-    {
-      return e->cause_code;
-    }
+  // Allocating logs the whole page
+  test_err_t_wrap (pgr_begin_txn (&tx, f.p, &f.e), &f.e);
+  test_err_t_wrap (pgr_new (&h, f.p, &tx, PG_DATA_LIST, &f.e), &f.e);
+  pgno pg = page_h_pgno (&h);
+  dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+  test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, &f.e), &f.e);
+  test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
 
-  // Flush the wal so that master lsn is accurate
-  err_t_wrap (wal_flush_to (&p->ww, end_lsn, e), e);
+  TEST_CASE ("A small write logs a few bytes, not two pages")
+  {
+    pgr_get_stats (f.p, &s0);
 
-  // Update master lsn
-  err_t_wrap (pgr_update_master_lsn (p, mlsn, e), e);
+    test_err_t_wrap (pgr_begin_txn (&tx, f.p, &f.e), &f.e);
+    test_err_t_wrap (pgr_get_writable (&h, &tx, PG_DATA_LIST, pg, f.p, &f.e), &f.e);
+    for (p_size i = 0; i < 8; ++i)
+      {
+        dl_set_byte (page_h_w (&h), i, (u8)(i + 1));
+      }
+    test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, &f.e), &f.e);
+    test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
 
-  i_log_info ("Checkpoint written at LSN %" PRlsn "\n", mlsn);
+    pgr_get_stats (f.p, &s1);
+    test_assert (s1.wal_bytes - s0.wal_bytes < 256);
+  }
 
-  return SUCCESS;
-}
+  TEST_CASE ("Rolling back a delta")
+  {
+    test_err_t_wrap (pgr_begin_txn (&tx, f.p, &f.e), &f.e);
+    test_err_t_wrap (pgr_get_writable (&h, &tx, PG_DATA_LIST, pg, f.p, &f.e), &f.e);
+    for (p_size i = 0; i < 8; ++i)
+      {
+        dl_set_byte (page_h_w (&h), i, 0xFF);
+      }
+    test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, &f.e), &f.e);
+    test_err_t_wrap (pgr_flush_wall (f.p, &f.e), &f.e);
+    test_err_t_wrap (pgr_rollback (f.p, &tx, 0, &f.e), &f.e);
 
-/////////////////////////////////////////
-//// READ / WRITE PAGES
+    test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, pg, f.p, &f.e), &f.e);
+    for (p_size i = 0; i < 8; ++i)
+      {
+        test_assert_int_equal (dl_get_byte (page_h_ro (&h), i), i + 1);
+      }
+    test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, &f.e), &f.e);
+    test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
+  }
 
-err_t
-pgr_get (page_h *dest, int flags, pgno pg, struct pager *p, error *e)
+  test_err_t_wrap (pgr_fixture_teardown (&f), &f.e);
+}
+#endif
+
+#ifndef NTEST
+TEST (TT_UNIT, pager_memory_budget)
 {
-  DBG_ASSERT (page_h, dest);
-  ASSERT (dest->mode == PHM_NONE);
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
 
-  struct page_frame *pgr = NULL;
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
 
-  err_t ret = SUCCESS;
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
 
-  // Try to fetch from memory first
-  hdata_idx data;
-  switch (ht_get_idx (&p->pgno_to_value, &data, pg))
-    {
-    case HTAR_SUCCESS:
-      {
-        pgr = &p->pages[data.value];
+  TEST_CASE ("Default budget is the compile time minimum")
+  {
+    struct pager *p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+    test_fail_if_null (p);
+    test_assert_int_equal (pgr_get_nframes (p), MEMORY_PAGE_LEN);
+    test_err_t_wrap (pgr_close (p, &e), &e);
+  }
 
-        // TODO BLOCK ON X
-        if (pgr->wsibling >= 0)
-          {
-            ASSERT (0 && "WOULD BLOCK ON X!");
-          }
+  TEST_CASE ("A larger budget holds more pages than the default pool")
+  {
+    test_fail_if (i_remove_quiet ("test.db", &e));
+    test_fail_if (i_remove_quiet ("test.wal", &e));
 
-        // No operation would have let a pgr into an invalid state
-        ASSERT (page_validate_for_db (&pgr->page, flags, NULL) == SUCCESS);
-        pgr->pin++;
-        break;
+    struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp,
+                                     (struct pgr_params){ .memory_budget = 256 * (u64)PAGE_SIZE, .huge_pages = true }, &e);
+    test_fail_if_null (p);
+    test_assert (pgr_get_nframes (p) > 4 * MEMORY_PAGE_LEN);
+
+    struct txn tx;
+    test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+
+    page_h pgs[4 * MEMORY_PAGE_LEN];
+    for (u32 i = 0; i < arrlen (pgs); ++i)
+      {
+        pgs[i] = page_h_create ();
+        test_err_t_wrap (pgr_new (&pgs[i], p, &tx, PG_DATA_LIST, &e), &e);
       }
-    case HTAR_DOESNT_EXIST:
+    for (u32 i = 0; i < arrlen (pgs); ++i)
       {
-        // Then load into a new spot
-        ret = pgr_reserve_at_clock_thread_unsafe (p, e);
-        if (ret)
-          {
-            return ret;
-          }
-
-        // Read in data to the current page
-        pgr = &p->pages[p->clock];
+        dl_set_used (page_h_w (&pgs[i]), DL_DATA_SIZE);
+        test_err_t_wrap (pgr_release (p, &pgs[i], PG_DATA_LIST, &e), &e);
+      }
 
-        ret = fpgr_read (&p->fp, pgr->page.raw, pg, e);
-        if (ret)
-          {
-            return ret;
-          }
+    test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+    test_err_t_wrap (pgr_close (p, &e), &e);
+  }
 
-        ret = page_validate_for_db (&pgr->page, flags, e);
-        if (ret)
-          {
-            /**
-             * Maybe here we could try to recover the page
-             */
-            i_log_error ("Cannot get page %" PRpgno " because it is invalid in the database file: %s\n", pg, e->cause_msg);
-            return ret;
-          }
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
+}
+#endif
 
-        // pgr is now loaded
-        pgr->pin = 1;
-        pgr->flags = 0;
-        pgr->wsibling = -1;
-        pgr->page.pg = pg;
+#ifndef NTEST
+struct pgr_part_test_ctx
+{
+  struct pager *p;
+  u32 npages;
+  u32 seed;
+  err_t ret;
+};
 
-        // Start page at access_bit = 1
-        pf_set (pgr, PW_ACCESS);
-        pf_set (pgr, PW_PRESENT);
+static void *
+pgr_part_test_thread (void *arg)
+{
+  struct pgr_part_test_ctx *ctx = arg;
+  error e = error_create ();
 
-        hdata_idx hd = (hdata_idx){ .key = pg, .value = p->clock };
-        ht_insert_expect_idx (&p->pgno_to_value, hd);
+  for (u32 i = 0; i < 2000; ++i)
+    {
+      ctx->seed = ctx->seed * 1103515245 + 12345;
+      pgno pg = 1 + (ctx->seed >> 8) % ctx->npages;
 
-        // Be nice to the next caller and iterate clock
-        p->clock = (p->clock + 1) % MEMORY_PAGE_LEN;
-        break;
-      }
+      page_h h = page_h_create ();
+      if ((ctx->ret = pgr_get (&h, PG_DATA_LIST, pg, ctx->p, &e)))
+        {
+          return NULL;
+        }
+      if (page_h_pgno (&h) != pg)
+        {
+          ctx->ret = ERR_FAILED_TEST;
+          return NULL;
+        }
+      if ((ctx->ret = pgr_release (ctx->p, &h, PG_DATA_LIST, &e)))
+        {
+          return NULL;
+        }
     }
 
-  // Initialize page_h
-  dest->pgr = pgr;
-  dest->pgw = NULL;
-  dest->mode = PHM_S;
-
-  return SUCCESS;
+  return NULL;
 }
 
-err_t
-pgr_get_unverified (page_h *dest, pgno pg, struct pager *p, error *e)
+TEST (TT_UNIT, pager_partitions_concurrent_get)
 {
-  DBG_ASSERT (page_h, dest);
-  ASSERT (dest->mode == PHM_NONE);
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
 
-  struct page_frame *pgr = NULL;
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
 
-  err_t ret = SUCCESS;
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
 
-  // Try to fetch from memory first
-  hdata_idx data;
-  switch (ht_get_idx (&p->pgno_to_value, &data, pg))
-    {
-    case HTAR_SUCCESS:
+  // Smaller pool than the working set so threads also evict
+  struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp,
+                                   (struct pgr_params){ .memory_budget = 128 * PAGE_SIZE, .npartitions = 4 }, &e);
+  test_fail_if_null (p);
+  test_assert_int_equal (p->nparts, 4);
+
+  const u32 npages = 200;
+  {
+    struct txn tx;
+    test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+    for (u32 i = 0; i < npages; ++i)
       {
-        pgr = &p->pages[data.value];
+        page_h h = page_h_create ();
+        test_err_t_wrap (pgr_new (&h, p, &tx, PG_DATA_LIST, &e), &e);
+        dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+        test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+      }
+    test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+  }
 
-        // TODO BLOCK ON X
-        if (pgr->wsibling >= 0)
-          {
-            ASSERT (0 && "WOULD BLOCK ON X!");
-          }
+  struct pgr_part_test_ctx ctx[4];
+  i_thread threads[4];
+  for (u32 i = 0; i < 4; ++i)
+    {
+      ctx[i] = (struct pgr_part_test_ctx){ .p = p, .npages = npages, .seed = i + 1 };
+      test_err_t_wrap (i_thread_create (&threads[i], pgr_part_test_thread, &ctx[i], &e), &e);
+    }
+  for (u32 i = 0; i < 4; ++i)
+    {
+      test_err_t_wrap (i_thread_join (&threads[i], &e), &e);
+      test_assert_int_equal (ctx[i].ret, SUCCESS);
+    }
 
-        pgr->pin++;
-        break;
-      }
-    case HTAR_DOESNT_EXIST:
-      {
-        // Then load into a new spot
-        ret = pgr_reserve_at_clock_thread_unsafe (p, e);
-        if (ret)
-          {
-            return ret;
-          }
+  // Every page lives in the partition it hashes to and nothing is left pinned
+  for (u32 i = 0; i < p->nframes; ++i)
+    {
+      struct page_frame *mp = &p->pages[i];
+      if (pf_check (mp, PW_PRESENT) && !pf_check (mp, PW_X))
+        {
+          struct pgr_part *pt = pgr_part_of (p, mp->page.pg);
+          test_assert (i >= pt->start && i < pt->start + pt->nframes);
+          test_assert_int_equal (mp->pin, 0);
+        }
+    }
 
-        // Read in data to the current page
-        pgr = &p->pages[p->clock];
+  test_err_t_wrap (pgr_close (p, &e), &e);
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
+}
 
-        ret = fpgr_read (&p->fp, pgr->page.raw, pg, e);
-        if (ret)
-          {
-            return ret;
-          }
+#define PGR_SX_PAGES 4
 
-        // NOTE: Skip validation - this is the difference from pgr_get
-        // Used during ARIES recovery to read pages that may be invalid
+struct pgr_sx_test_ctx
+{
+  struct pager *p;
+  struct txn *tx; // NULL for readers
+  u32 seed;
+  err_t ret;
+};
 
-        // pgr is now loaded
-        pgr->pin = 1;
-        pgr->flags = 0;
-        pgr->wsibling = -1;
-        pgr->page.pg = pg;
+static void *
+pgr_sx_test_thread (void *arg)
+{
+  struct pgr_sx_test_ctx *ctx = arg;
+  error e = error_create ();
+  u8 buf[DL_DATA_SIZE];
 
-        // Start page at access_bit = 1
-        pf_set (pgr, PW_ACCESS);
-        pf_set (pgr, PW_PRESENT);
+  for (u32 i = 0; i < 1000; ++i)
+    {
+      ctx->seed = ctx->seed * 1103515245 + 12345;
+      pgno pg = 1 + (ctx->seed >> 8) % PGR_SX_PAGES;
 
-        hdata_idx hd = (hdata_idx){ .key = pg, .value = p->clock };
-        ht_insert_expect_idx (&p->pgno_to_value, hd);
+      page_h h = page_h_create ();
 
-        // Be nice to the next caller and iterate clock
-        p->clock = (p->clock + 1) % MEMORY_PAGE_LEN;
-        break;
-      }
-    }
+      if (ctx->tx)
+        {
+          // Every byte of the page gets the same value
+          i_memset (buf, (u8)i, sizeof (buf));
+          if ((ctx->ret = pgr_get_writable (&h, ctx->tx, PG_DATA_LIST, pg, ctx->p, &e)))
+            {
+              return NULL;
+            }
+          dl_set_data (page_h_w (&h), (struct dl_data){ .data = buf, .blen = DL_DATA_SIZE });
+        }
+      else
+        {
+          // So a reader must never see two different values
+          if ((ctx->ret = pgr_get (&h, PG_DATA_LIST, pg, ctx->p, &e)))
+            {
+              return NULL;
+            }
+          const u8 *data = dl_get_data (page_h_ro (&h));
+          for (u32 j = 1; j < DL_DATA_SIZE; ++j)
+            {
+              if (data[j] != data[0])
+                {
+                  ctx->ret = ERR_FAILED_TEST;
+                  return NULL;
+                }
+            }
+        }
 
-  // Initialize page_h
-  dest->pgr = pgr;
-  dest->pgw = NULL;
-  dest->mode = PHM_S;
+      if ((ctx->ret = pgr_release (ctx->p, &h, PG_DATA_LIST, &e)))
+        {
+          return NULL;
+        }
+    }
 
-  return SUCCESS;
+  return NULL;
 }
 
-err_t
-pgr_make_writable_no_tx (struct pager *p, page_h *h, error *e)
+TEST (TT_UNIT, pager_frame_sx_latch)
 {
-  DBG_ASSERT (pager, p);
-  ASSERT (h->mode == PHM_S);
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
 
-  i_log_trace ("Pager making page: %" PRpgno " writable\n", page_h_pgno (h));
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
 
-  err_t ret = SUCCESS;
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
 
-  // Reserve room for writable page
-  ret = pgr_reserve_at_clock_thread_unsafe (p, e);
-  if (ret)
+  struct pager *p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+  test_fail_if_null (p);
+
+  struct txn tx;
+  test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+  for (u32 i = 0; i < PGR_SX_PAGES; ++i)
+    {
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_new (&h, p, &tx, PG_DATA_LIST, &e), &e);
+      dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+      test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+    }
+
+  // One writer and three readers hammering the same few pages
+  struct pgr_sx_test_ctx ctx[4];
+  i_thread threads[4];
+  for (u32 i = 0; i < 4; ++i)
+    {
+      ctx[i] = (struct pgr_sx_test_ctx){ .p = p, .tx = i == 0 ? &tx : NULL, .seed = i + 1 };
+      test_err_t_wrap (i_thread_create (&threads[i], pgr_sx_test_thread, &ctx[i], &e), &e);
+    }
+  for (u32 i = 0; i < 4; ++i)
+    {
+      test_err_t_wrap (i_thread_join (&threads[i], &e), &e);
+      test_assert_int_equal (ctx[i].ret, SUCCESS);
+    }
+
+  test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+
+  // Nobody is left holding a frame
+  for (u32 i = 0; i < p->nframes; ++i)
     {
-      return ret;
+      struct page_frame *mp = &p->pages[i];
+      test_assert_int_equal (mp->nreaders, 0);
+      test_assert (!pf_check (mp, PW_X | PW_XWAIT));
     }
 
-  struct page_frame *pgw = &p->pages[p->clock];
+  test_err_t_wrap (pgr_close (p, &e), &e);
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
+}
+#endif
+
+#ifndef NTEST
+struct pgr_io_test_ctx
+{
+  struct pager *p;
+  err_t ret;
+};
+
+static void *
+pgr_io_test_thread (void *arg)
+{
+  struct pgr_io_test_ctx *ctx = arg;
+  error e = error_create ();
+  page_h h = page_h_create ();
 
-  // Mark page as dirty (will be added to DPT in pgr_save with proper LSN)
-  bool was_dirty = pf_check (h->pgr, PW_DIRTY);
-  if (!was_dirty)
+  if ((ctx->ret = pgr_get (&h, PG_DATA_LIST, 1, ctx->p, &e)) == SUCCESS)
     {
-      pf_set (h->pgr, PW_DIRTY);
+      ctx->ret = pgr_release (ctx->p, &h, PG_DATA_LIST, &e);
     }
 
-  // Initialize w page
-  pgw->pin = 1;
-  pgw->wsibling = -1;
-  pgw->flags = 0;
-  pf_set (pgw, PW_PRESENT);
-  pf_set (pgw, PW_X);
-  i_memcpy (pgw->page.raw, h->pgr->page.raw, PAGE_SIZE);
-  pgw->page.pg = h->pgr->page.pg;
-
-  // Set page_h
-  h->pgr->wsibling = p->clock;
-  h->pgw = pgw;
-  h->mode = PHM_X;
-  h->pgw->pin++;
-
-  // Increment clock to be nice to next consumers
-  p->clock = (p->clock + 1) % MEMORY_PAGE_LEN;
-
-  return SUCCESS;
+  return NULL;
 }
 
-err_t
-pgr_make_writable (struct pager *p, struct txn *tx, page_h *h, error *e)
+static void *
+pgr_ckpt_test_thread (void *arg)
 {
-  ASSERT (tx);
-  err_t_wrap (pgr_make_writable_no_tx (p, h, e), e);
-  h->tx = tx;
-  return SUCCESS;
+  struct pgr_io_test_ctx *ctx = arg;
+  error e = error_create ();
+
+  ctx->ret = pgr_checkpoint (ctx->p, &e);
+
+  return NULL;
 }
 
-err_t
-pgr_maybe_make_writable (struct pager *p, struct txn *tx, page_h *cur, error *e)
+// Spins until [n] threads sleep on [pt]
+static void
+pgr_test_wait_parked (struct pgr_part *pt, u32 n)
 {
-  ASSERT (tx);
-  if (cur->mode == PHM_S)
+  bool parked = false;
+  while (!parked)
     {
-      return pgr_make_writable (p, tx, cur, e);
+      i_thread_yield ();
+      i_mutex_lock (&pt->l);
+      parked = pt->nwaiting == n;
+      i_mutex_unlock (&pt->l);
     }
-  return SUCCESS;
 }
 
-// No transaction version for recovery - no WAL logging
-err_t
-pgr_release_no_tx (struct pager *p, page_h *h, int flags, error *e)
+TEST (TT_UNIT, pager_io_frame_waits)
 {
-  DBG_ASSERT (pager, p);
-  ASSERT (h->mode == PHM_X || h->mode == PHM_S);
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
 
-  i_log_trace ("Releasing (no tx) %" PRpgno "\n", page_h_pgno (h));
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
 
-  if (h->mode == PHM_X)
-    {
-      // TODO - I think this is wrong
-      // Add page to DPT if this is the first update (RecLSN = LSN of first update)
-      if (!dpgt_exists (&p->dpt, page_h_pgno (h)))
-        {
-          if (dpgt_add (&p->dpt, page_h_pgno (h), (lsn)page_get_page_lsn (page_h_ro (h)), e))
-            {
-              return e->cause_code;
-            }
-        }
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
 
-      // Save without WAL logging (recovery doesn't need WAL)
-      ASSERTF (page_validate_for_db (page_h_w (h), flags, NULL) == SUCCESS,
-               "%.*s\n", e->cmlen, e->cause_msg);
+  struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp, (struct pgr_params){ .npartitions = 1 }, &e);
+  test_fail_if_null (p);
 
-      i_memcpy (h->pgr->page.raw, h->pgw->page.raw, PAGE_SIZE);
-      h->pgw->flags = 0;
-      pf_clr (h->pgw, PW_PRESENT);
-      h->pgr->wsibling = -1;
-      h->pgw = NULL;
-      h->mode = PHM_S;
+  struct txn tx;
+  test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+  for (u32 i = 0; i < 2; ++i)
+    {
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_new (&h, p, &tx, PG_DATA_LIST, &e), &e);
+      dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+      test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
     }
+  test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
 
-  err_t_wrap (page_validate_for_db (&h->pgr->page, flags, e), e);
+  // Page 1 looks like it's mid read
+  struct pgr_part *pt = &p->parts[0];
+  hdata_idx data;
+  test_assert_int_equal (ht_get_idx (&pt->pgno_to_value, &data, 1), HTAR_SUCCESS);
+  struct page_frame *mp = &p->pages[data.value];
 
-  DBG_ASSERT (pager, p);
+  i_mutex_lock (&pt->l);
+  pf_set (mp, PW_IO);
+  i_mutex_unlock (&pt->l);
 
-  h->pgr->pin--;
-  h->pgr = NULL;
-  h->mode = PHM_NONE;
+  struct pgr_io_test_ctx ctx = { .p = p, .ret = ERR_FAILED_TEST };
+  i_thread t;
+  test_err_t_wrap (i_thread_create (&t, pgr_io_test_thread, &ctx, &e), &e);
 
-  return SUCCESS;
-}
+  TEST_CASE ("A lookup of a frame under I/O sleeps on the partition")
+  {
+    pgr_test_wait_parked (pt, 1);
+  }
 
-// No transaction version for recovery
-err_t
-pgr_get_writable_no_tx (page_h *dest, int flags, pgno pg, struct pager *p, error *e)
-{
-  err_t_wrap (pgr_get (dest, flags, pg, p, e), e);
-  err_t ret = pgr_make_writable_no_tx (p, dest, e);
+  TEST_CASE ("The rest of the partition doesn't wait for it")
+  {
+    page_h h = page_h_create ();
+    test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, 2, p, &e), &e);
+    test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+  }
 
-  // Couldn't allocate writable page - release dest
-  if (ret != SUCCESS)
-    {
-      pgr_release_no_tx (p, dest, flags, e);
-    }
+  TEST_CASE ("Finishing the I/O lets it through")
+  {
+    i_mutex_lock (&pt->l);
+    pf_clr (mp, PW_IO);
+    pgr_part_wake (pt);
+    i_mutex_unlock (&pt->l);
 
-  return ret;
-}
+    test_err_t_wrap (i_thread_join (&t, &e), &e);
+    test_assert_int_equal (ctx.ret, SUCCESS);
+  }
 
-err_t
-pgr_get_writable (page_h *dest, struct txn *tx, int flags, pgno pg, struct pager *p, error *e)
-{
-  err_t_wrap (pgr_get (dest, flags, pg, p, e), e);
-  err_t ret = pgr_make_writable (p, tx, dest, e);
+  TEST_CASE ("A checkpoint sleeps on a dirty frame it needs until the I/O is done")
+  {
+    test_assert (pf_check (mp, PW_DIRTY));
 
-  // Couldn't allocate writable page - release dest
-  if (ret != SUCCESS)
-    {
-      pgr_release_no_tx (p, dest, flags, e);
-    }
+    i_mutex_lock (&pt->l);
+    pf_set (mp, PW_IO);
+    i_mutex_unlock (&pt->l);
 
-  return ret;
+    ctx.ret = ERR_FAILED_TEST;
+    test_err_t_wrap (i_thread_create (&t, pgr_ckpt_test_thread, &ctx, &e), &e);
+    pgr_test_wait_parked (pt, 1);
+
+    i_mutex_lock (&pt->l);
+    pf_clr (mp, PW_IO);
+    pgr_part_wake (pt);
+    i_mutex_unlock (&pt->l);
+
+    test_err_t_wrap (i_thread_join (&t, &e), &e);
+    test_assert_int_equal (ctx.ret, SUCCESS);
+    test_assert (!pf_check (mp, PW_DIRTY));
+  }
+
+  test_err_t_wrap (pgr_close (p, &e), &e);
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
 }
+#endif
 
-err_t
-pgr_save (struct pager *p, page_h *h, int flags, error *e)
+#ifndef NTEST
+static u64
+pgr_test_get_release (struct pager *p, pgno pg, int flags, error *e)
 {
-  DBG_ASSERT (pager, p);
-  ASSERT (h->mode == PHM_X);
-  ASSERTF (page_validate_for_db (page_h_w (h), flags, NULL) == SUCCESS, "%.*s\n", e->cmlen, e->cause_msg);
+  // Returns 1 if the page wasn't resident
+  u64 misses = p->parts[0].misses;
+  page_h h = page_h_create ();
+  err_t_panic (pgr_get (&h, flags, pg, p, e), e);
+  err_t_panic (pgr_release (p, &h, flags, e), e);
+  return p->parts[0].misses - misses;
+}
 
-  // Save log
-  latch_lock (&h->tx->l);
+TEST (TT_UNIT, pager_2q_scan_resistant)
+{
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
 
-  // Construct an update log record
-  struct wal_update_write update = {
-    .tid = h->tx->tid,
-    .pg = page_h_pgno (h),
-    .prev = h->tx->data.last_lsn,
-    .undo = h->pgr->page.raw,
-    .redo = h->pgw->page.raw,
-  };
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
 
-  // Append that update to the wal and get it's lsn
-  slsn page_lsn = wal_append_update_log (&p->ww, update, e);
-  if (page_lsn < 0)
-    {
-      latch_unlock (&h->tx->l);
-      return e->cause_code;
-    }
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
 
-  // Update the page lsn
-  page_set_page_lsn (page_h_w (h), (lsn)page_lsn);
+  struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp,
+                                   (struct pgr_params){ .memory_budget = 64 * PAGE_SIZE, .npartitions = 1, .policy = PGR_POLICY_2Q }, &e);
+  test_fail_if_null (p);
+  test_assert (p->nframes < 100);
 
-  h->tx->data.last_lsn = page_lsn;
-  h->tx->data.undo_next_lsn = page_lsn;
+  // pages [1, 8] are hot, [9, 208] are scanned
+  {
+    struct txn tx;
+    test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+    for (u32 i = 0; i < 208; ++i)
+      {
+        page_h h = page_h_create ();
+        test_err_t_wrap (pgr_new (&h, p, &tx, PG_DATA_LIST, &e), &e);
+        dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+        test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+      }
+    test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+  }
 
-  // Add page to DPT if this is the first update (RecLSN = LSN of first update)
-  if (!dpgt_exists (&p->dpt, page_h_pgno (h)))
+  // Warm up the hot set
+  for (u32 r = 0; r < 3; ++r)
     {
-      if (dpgt_add (&p->dpt, page_h_pgno (h), (lsn)page_lsn, e))
+      for (pgno pg = 1; pg <= 8; ++pg)
         {
-          latch_unlock (&h->tx->l);
-          return e->cause_code;
+          pgr_test_get_release (p, pg, PG_DATA_LIST, &e);
         }
     }
 
-  latch_unlock (&h->tx->l);
-
-  i_memcpy (&h->pgr->page.raw, h->pgw->page.raw, PAGE_SIZE);
-  h->pgw->flags = 0;
-  pf_clr (h->pgw, PW_PRESENT);
-  h->pgr->wsibling = -1;
-  h->pgw = NULL;
-  h->mode = PHM_S;
+  // A long scan with point reads mixed in never pushes out the hot set
+  u64 hot_misses = 0;
+  for (pgno pg = 9; pg <= 208; ++pg)
+    {
+      pgr_test_get_release (p, pg, PG_DATA_LIST, &e);
+      if (pg % 40 == 0)
+        {
+          for (pgno hot = 1; hot <= 8; ++hot)
+            {
+              hot_misses += pgr_test_get_release (p, hot, PG_DATA_LIST, &e);
+            }
+        }
+    }
+  test_assert_int_equal ((int)hot_misses, 0);
+  test_assert (p->parts[0].nhot >= 8);
+  test_assert (p->parts[0].nhot <= pgr_2q_maxhot (&p->parts[0]));
 
-  return SUCCESS;
+  test_err_t_wrap (pgr_close (p, &e), &e);
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
 }
+#endif
 
-static void
-pgr_cancel_w (struct pager *p, page_h *h)
+#ifndef NTEST
+TEST (TT_UNIT, pager_l2_cache)
 {
-  DBG_ASSERT (pager, p);
-  ASSERT (h->mode == PHM_X);
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
 
-  h->pgw->flags = 0;
-  pf_clr (h->pgw, PW_PRESENT);
-  h->pgr->wsibling = -1;
-  h->pgw = NULL;
-  h->mode = PHM_S;
-}
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
 
-err_t
-pgr_new (page_h *dest, struct pager *p, struct txn *tx, enum page_type type, error *e)
-{
-  DBG_ASSERT (pager, p);
-  DBG_ASSERT (page_h, dest);
-  ASSERT (dest->mode == PHM_NONE);
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
 
-  err_t ret = SUCCESS;
-  page_h root_node = page_h_create ();
+  struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp,
+                                   (struct pgr_params){
+                                       .memory_budget = 64 * PAGE_SIZE,
+                                       .npartitions = 1,
+                                       .l2_path = "test.l2",
+                                       .l2_budget = 256 * PAGE_SIZE,
+                                   },
+                                   &e);
+  test_fail_if_null (p);
 
-  // S(root)
-  if (lockt_lock (p->lt, (struct lt_lock){ .type = LOCK_ROOT, .data = { 0 } }, LM_X, tx, e))
+  // Each page holds its own pgno
+  struct txn tx;
+  test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+  for (u32 i = 0; i < 200; ++i)
     {
-      return e->cause_code;
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_new (&h, p, &tx, PG_DATA_LIST, &e), &e);
+      pgno pg = page_h_pgno (&h);
+      dl_append (page_h_w (&h), (const u8 *)&pg, sizeof pg);
+      test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
     }
+  test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
 
-  /**
-   * First, we'll check the tombstone to see if we can
-   * dish out a new page that's already been deleted
-   */
-  err_t_wrap (pgr_get (&root_node, PG_ROOT_NODE, ROOT_PGNO, p, e), e);
-
-  pgno ftpg = rn_get_first_tmbst (page_h_ro (&root_node));
-  ret = pgr_make_writable (p, tx, &root_node, e);
-  if (ret)
-    {
-      pgr_release_no_tx (p, &root_node, PG_ROOT_NODE, e);
-      return ret;
-    }
+  struct pgr_stats s;
+  pgr_get_stats (p, &s);
+  test_assert_int_equal (s.l2_pages, 256);
+  test_assert_equal (s.l2_writes, 0); // Only dirty evictions so far
 
-  // X(tombstone)
-  if (lockt_lock (p->lt, (struct lt_lock){ .type = LOCK_TMBST, .data = { .tmbst_pg = ftpg } }, LM_X, tx, e))
+  pgno first = 0;
+  for (u32 pass = 0; pass < 2; ++pass)
     {
-      return e->cause_code;
-    }
+      struct pgr_stats before;
+      pgr_get_stats (p, &before);
 
-  if (ftpg < fpgr_get_npages (&p->fp))
-    {
-      // Pop the first tombstone - this is our result page
-      ret = pgr_get_writable (dest, tx, PG_TOMBSTONE, ftpg, p, e);
-      if (ret)
+      for (pgno pg = 2; pg < pgr_get_npages (p); ++pg)
         {
-          pgr_cancel_w (p, &root_node);
-          pgr_release_no_tx (p, &root_node, PG_ROOT_NODE, e);
-          return ret;
+          page_h h = page_h_create ();
+          test_err_t_wrap (pgr_get (&h, PG_ANY, pg, p, &e), &e);
+          if (page_get_type (page_h_ro (&h)) == PG_DATA_LIST)
+            {
+              pgno v = PGNO_NULL;
+              dl_read (page_h_ro (&h), (u8 *)&v, 0, sizeof v);
+              test_assert_equal (v, pg);
+              first = first == 0 ? pg : first;
+            }
+          test_err_t_wrap (pgr_release (p, &h, PG_ANY, &e), &e);
         }
-    }
-  else
-    {
-      if ((ret = pgr_new_extend (dest, p, tx, e)))
+
+      pgr_get_stats (p, &s);
+      if (pass == 1)
         {
-          pgr_cancel_w (p, &root_node);
-          pgr_release_no_tx (p, &root_node, PG_ROOT_NODE, e);
-          return ret;
+          // The second scan is served by the cache file, not the database file
+          test_assert (s.l2_hits - before.l2_hits > 100);
+          test_assert_equal (s.page_reads - before.page_reads, s.l2_misses - before.l2_misses);
         }
     }
+  test_assert (s.l2_writes > 0);
+  test_assert (first > 0);
 
-  // Update root node's first tombstone link
-  pgno ntbst = tmbst_get_next (page_h_ro (dest));
-  rn_set_first_tmbst (page_h_w (&root_node), ntbst);
-  ret = pgr_save (p, &root_node, PG_ROOT_NODE, e);
+  TEST_CASE ("Modified pages don't come back stale")
+  {
+    page_h h = page_h_create ();
+    test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+    test_err_t_wrap (pgr_get_writable (&h, &tx, PG_DATA_LIST, first, p, &e), &e);
+    pgno v = first + 1000;
+    dl_write (page_h_w (&h), (const u8 *)&v, 0, sizeof v);
+    test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+    test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+
+    // Push it out (dirty), then scan so everything cycles through the cache file
+    for (pgno pg = 2; pg < pgr_get_npages (p); ++pg)
+      {
+        pgr_test_get_release (p, pg, PG_ANY, &e);
+      }
 
-  if (ret)
-    {
-      pgr_cancel_w (p, dest);
-      pgr_cancel_w (p, &root_node);
-      pgr_release (p, &root_node, PG_ROOT_NODE, e);
-      pgr_release (p, dest, type, e);
-      return ret;
-    }
+    test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, first, p, &e), &e);
+    dl_read (page_h_ro (&h), (u8 *)&v, 0, sizeof v);
+    test_assert_equal (v, first + 1000);
+    test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+  }
 
-  pgr_release (p, &root_node, PG_ROOT_NODE, e);
-  page_init_empty (page_h_w (dest), type);
+  TEST_CASE ("Pages the cleaner wrote back go to the cache file when evicted")
+  {
+    page_h h = page_h_create ();
+    test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+    test_err_t_wrap (pgr_get_writable (&h, &tx, PG_DATA_LIST, first, p, &e), &e);
+    pgno v = first + 2000;
+    dl_write (page_h_w (&h), (const u8 *)&v, 0, sizeof v);
+    test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+    test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+
+    // Cleaned while resident - the frame is clean but its checksum is the old one
+    bool progress = true;
+    u32 busy;
+    lsn all = U64_MAX;
+    pgr_cleaner_claim (p);
+    while (progress)
+      {
+        test_err_t_wrap (pgr_clean_part (p, &p->parts[0], &all, &progress, &busy, &e), &e);
+      }
+    pgr_cleaner_release (p);
 
-  return ret;
+    // Clean evictions only, and [first] is one of them
+    for (pgno pg = 2; pg < pgr_get_npages (p); ++pg)
+      {
+        if (pg != first)
+          {
+            pgr_test_get_release (p, pg, PG_ANY, &e);
+          }
+      }
+    hdata_idx data;
+    test_assert_int_equal (ht_get_idx (&p->parts[0].pgno_to_value, &data, first), HTAR_DOESNT_EXIST);
+
+    struct pgr_stats before;
+    pgr_get_stats (p, &before);
+    test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, first, p, &e), &e);
+    dl_read (page_h_ro (&h), (u8 *)&v, 0, sizeof v);
+    test_assert_equal (v, first + 2000);
+    test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+
+    pgr_get_stats (p, &s);
+    test_assert_equal (s.l2_hits - before.l2_hits, 1);
+    test_assert_equal (s.page_reads, before.page_reads);
+  }
+
+  test_err_t_wrap (pgr_close (p, &e), &e);
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
 }
+#endif
 
 #ifndef NTEST
-TEST (TT_UNIT, pgr_new_get_save)
+static pgno
+pgr_test_load (struct pager *p, struct txn *tx, u32 npages, error *e)
 {
-  struct pgr_fixture f;
-  page_h h = page_h_create ();
-  test_err_t_wrap (pgr_fixture_create (&f), &f.e);
+  // Each page holds its own pgno - returns the first one
+  pgno first = PGNO_NULL;
+  for (u32 i = 0; i < npages; ++i)
+    {
+      page_h h = page_h_create ();
+      err_t_panic (pgr_new (&h, p, tx, PG_DATA_LIST, e), e);
+      pgno pg = page_h_pgno (&h);
+      dl_append (page_h_w (&h), (const u8 *)&pg, sizeof pg);
+      err_t_panic (pgr_release (p, &h, PG_DATA_LIST, e), e);
+      first = i == 0 ? pg : first;
+    }
+  return first;
+}
+
+TEST (TT_UNIT, pager_unlogged_txn)
+{
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
+
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
+
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
+
+  struct pgr_params params = { .memory_budget = 64 * PAGE_SIZE, .npartitions = 1 };
+  struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp, params, &e);
+  test_fail_if_null (p);
+
+  struct txn tx;
+  struct pgr_stats s0, s1;
+  pgno first = PGNO_NULL;
+
+  TEST_CASE ("Only the allocations are logged")
+  {
+    pgr_get_stats (p, &s0);
+    test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+    pgr_test_load (p, &tx, 100, &e);
+    test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+    pgr_get_stats (p, &s1);
+    u64 logged = s1.wal_bytes - s0.wal_bytes;
+
+    pgr_get_stats (p, &s0);
+    test_err_t_wrap (pgr_begin_unlogged_txn (&tx, p, &e), &e);
+    first = pgr_test_load (p, &tx, 200, &e);
+    test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+    pgr_get_stats (p, &s1);
+    u64 unlogged = s1.wal_bytes - s0.wal_bytes;
+
+    // Twice the pages - two page images each without it
+    test_assert (unlogged * 10 < logged);
+    test_assert (s1.file_syncs > s0.file_syncs);
+
+    // Every page it allocated went out with the commit
+    for (u32 i = 0; i < p->nframes; ++i)
+      {
+        test_assert (!pf_check (&p->pages[i], PW_UNLOGGED));
+        test_assert_int_equal (p->pages[i].pin, 0);
+      }
+
+    // The rest of the last extent went back
+    page_h root = page_h_create ();
+    test_err_t_wrap (pgr_get (&root, PG_ROOT_NODE, ROOT_PGNO, p, &e), &e);
+    test_assert_equal (rn_get_next_pg (page_h_ro (&root)), first + 200);
+    test_err_t_wrap (pgr_release (p, &root, PG_ROOT_NODE, &e), &e);
+  }
 
-  struct txn tx;
-  test_err_t_wrap (pgr_begin_txn (&tx, f.p, &f.e), &f.e);
+  TEST_CASE ("A committed load survives a crash")
+  {
+    test_fail_if (pgr_crash (p, &e));
+    p = pgr_open_with ("test.db", "test.wal", &lt, tp, params, &e);
+    test_fail_if_null (p);
 
-  pgr_new (&h, f.p, &tx, PG_DATA_LIST, &f.e);
-  test_assert_int_equal ((int)pgr_get_npages (f.p), 2);
+    for (pgno pg = first; pg < first + 200; ++pg)
+      {
+        page_h h = page_h_create ();
+        test_err_t_wrap (pgr_get (&h, PG_ANY, pg, p, &e), &e);
+        if (page_get_type (page_h_ro (&h)) == PG_DATA_LIST)
+          {
+            pgno v = PGNO_NULL;
+            dl_read (page_h_ro (&h), (u8 *)&v, 0, sizeof v);
+            test_assert_equal (v, pg);
+          }
+        test_err_t_wrap (pgr_release (p, &h, PG_ANY, &e), &e);
+      }
+  }
 
-  // Make it valid
-  dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+  TEST_CASE ("An uncommitted load is dropped")
+  {
+    page_h root = page_h_create ();
+    test_err_t_wrap (pgr_get (&root, PG_ROOT_NODE, ROOT_PGNO, p, &e), &e);
+    pgno next = rn_get_next_pg (page_h_ro (&root));
+    test_err_t_wrap (pgr_release (p, &root, PG_ROOT_NODE, &e), &e);
 
-  test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
+    test_err_t_wrap (pgr_begin_unlogged_txn (&tx, p, &e), &e);
+    pgr_test_load (p, &tx, 200, &e);
+    test_err_t_wrap (pgr_flush_wall (p, &e), &e);
 
-  test_err_t_wrap (pgr_release (f.p, &h, PG_DATA_LIST, &f.e), &f.e);
+    test_fail_if (pgr_crash (p, &e));
+    p = pgr_open_with ("test.db", "test.wal", &lt, tp, params, &e);
+    test_fail_if_null (p);
 
-  test_err_t_wrap (pgr_fixture_teardown (&f), &f.e);
+    test_err_t_wrap (pgr_get (&root, PG_ROOT_NODE, ROOT_PGNO, p, &e), &e);
+    test_assert_equal (rn_get_next_pg (page_h_ro (&root)), next);
+    test_err_t_wrap (pgr_release (p, &root, PG_ROOT_NODE, &e), &e);
+  }
+
+  test_err_t_wrap (pgr_close (p, &e), &e);
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
 }
 #endif
 
-err_t
-pgr_delete_and_release (struct pager *p, struct txn *tx, page_h *h, error *e)
+#ifndef NTEST
+TEST (TT_UNIT, pager_meta_tier)
 {
-  DBG_ASSERT (pager, p);
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
 
-  err_t ret = SUCCESS;
-  page_h root_node = page_h_create ();
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
 
-  // Upgrade nodes to X
-  err_t_wrap (pgr_get (&root_node, PG_ROOT_NODE, 0, p, e), e);
-  ret = pgr_make_writable (p, tx, &root_node, e);
-  if (ret)
-    {
-      return ret;
-    }
-  if (h->mode == PHM_S)
-    {
-      ret = pgr_make_writable (p, tx, h, e);
-      if (ret)
-        {
-          pgr_cancel_w (p, &root_node);
-          pgr_release (p, &root_node, PG_ROOT_NODE, e);
-          return ret;
-        }
-    }
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
 
-  pgno ftpg = rn_get_first_tmbst (page_h_ro (&root_node));
-  page_init_empty (&h->pgw->page, PG_TOMBSTONE);
-  tmbst_set_next (page_h_w (h), ftpg);
-  ftpg = page_h_pgno (h);
+  struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp,
+                                   (struct pgr_params){ .memory_budget = 64 * PAGE_SIZE, .meta_budget = 16 * PAGE_SIZE, .npartitions = 1 }, &e);
+  test_fail_if_null (p);
+  test_assert (p->parts[0].maxmeta >= 8);
+  test_assert (p->parts[0].maxmeta <= p->nframes / 2);
 
-  ret = pgr_release (p, h, PG_TOMBSTONE, e);
+  // A few inner nodes, then a lot more leaves than fit
+  pgno inner[4];
+  {
+    struct txn tx;
+    test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+    for (u32 i = 0; i < arrlen (inner); ++i)
+      {
+        page_h h = page_h_create ();
+        test_err_t_wrap (pgr_new (&h, p, &tx, PG_INNER_NODE, &e), &e);
+        in_set_len (page_h_w (&h), 1);
+        in_set_key_leaf (page_h_w (&h), 0, 1, 1);
+        inner[i] = page_h_pgno (&h);
+        test_err_t_wrap (pgr_release (p, &h, PG_INNER_NODE, &e), &e);
+      }
+    for (u32 i = 0; i < 200; ++i)
+      {
+        page_h h = page_h_create ();
+        test_err_t_wrap (pgr_new (&h, p, &tx, PG_DATA_LIST, &e), &e);
+        dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+        test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+      }
+    test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+  }
 
-  /**
-   * TODO - The following error handling logic doesn't look right
-   */
-  if (ret)
+  // Touched once each, so 2Q alone would leave them in probation for the scan to evict
+  u64 inner_misses = 0;
+  for (u32 i = 0; i < arrlen (inner); ++i)
     {
-      pgr_cancel_w (p, &root_node);
-      pgr_release (p, &root_node, PG_ROOT_NODE, e);
-      return ret;
+      inner_misses += pgr_test_get_release (p, inner[i], PG_INNER_NODE, &e);
     }
+  test_assert_int_equal ((int)inner_misses, 0);
 
-  rn_set_first_tmbst (page_h_w (&root_node), ftpg);
-  ret = pgr_save (p, &root_node, PG_ROOT_NODE, e);
-  if (ret)
+  for (u32 r = 0; r < 2; ++r)
     {
-      pgr_cancel_w (p, &root_node);
-      pgr_release (p, &root_node, PG_ROOT_NODE, e);
-      return ret;
+      for (pgno pg = inner[arrlen (inner) - 1] + 1; pg <= inner[arrlen (inner) - 1] + 200; ++pg)
+        {
+          pgr_test_get_release (p, pg, PG_DATA_LIST, &e);
+        }
+      for (u32 i = 0; i < arrlen (inner); ++i)
+        {
+          inner_misses += pgr_test_get_release (p, inner[i], PG_INNER_NODE, &e);
+        }
     }
+  test_assert_int_equal ((int)inner_misses, 0);
 
-  pgr_release (p, &root_node, PG_ROOT_NODE, e);
+  struct pgr_stats s;
+  pgr_get_stats (p, &s);
+  test_assert (s.nmeta >= arrlen (inner));
+  test_assert (s.nmeta <= s.maxmeta);
 
-  return ret;
+  test_err_t_wrap (pgr_close (p, &e), &e);
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
 }
+#endif
 
 #ifndef NTEST
-TEST (TT_UNIT, pgr_delete)
+TEST (TT_UNIT, pager_background_cleaner)
 {
-  struct pgr_fixture f;
-  error *e = &f.e;
-  test_err_t_wrap (pgr_fixture_create (&f), &f.e);
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
 
-  struct txn tx;
-  test_err_t_wrap (pgr_begin_txn (&tx, f.p, e), e);
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
 
-  page_h a = page_h_create ();
-  page_h b = page_h_create ();
-  page_h c = page_h_create ();
-  page_h d = page_h_create ();
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
+  test_err_t_wrap (tp_spin (tp, 1, &e), &e);
 
-  test_err_t_wrap (pgr_new (&a, f.p, &tx, PG_DATA_LIST, e), e);
-  test_err_t_wrap (pgr_new (&b, f.p, &tx, PG_DATA_LIST, e), e);
-  test_err_t_wrap (pgr_new (&c, f.p, &tx, PG_DATA_LIST, e), e);
-  test_err_t_wrap (pgr_new (&d, f.p, &tx, PG_DATA_LIST, e), e);
+  struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp,
+                                   (struct pgr_params){ .memory_budget = 128 * PAGE_SIZE, .npartitions = 1 }, &e);
+  test_fail_if_null (p);
+  struct pgr_part *pt = &p->parts[0];
 
-  pgno apg = page_h_pgno (&a);
-  pgno bpg = page_h_pgno (&b);
-  pgno cpg = page_h_pgno (&c);
-  pgno dpg = page_h_pgno (&d);
+  // Dirty a lot more pages than fit in the pool
+  struct txn tx;
+  test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+  for (u32 i = 0; i < 400; ++i)
+    {
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_new (&h, p, &tx, PG_DATA_LIST, &e), &e);
+      dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+      test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+    }
+  test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
 
-  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &a, e), e);
-  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &b, e), e);
-  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &c, e), e);
-  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &d, e), e);
+  // Once the cleaner settles the partition is back above its clean target
+  pgr_cleaner_wait (p);
+  test_assert (!pgr_part_needs_cleaning (pt));
 
-  test_err_t_wrap (pgr_new (&a, f.p, &tx, PG_DATA_LIST, e), e);
-  test_err_t_wrap (pgr_new (&b, f.p, &tx, PG_DATA_LIST, e), e);
-  test_err_t_wrap (pgr_new (&c, f.p, &tx, PG_DATA_LIST, e), e);
-  test_err_t_wrap (pgr_new (&d, f.p, &tx, PG_DATA_LIST, e), e);
+  // Dirty counter agrees with the frames
+  u32 ndirty = 0;
+  for (u32 i = 0; i < p->nframes; ++i)
+    {
+      if (pf_check (&p->pages[i], PW_PRESENT) && pf_check (&p->pages[i], PW_DIRTY))
+        {
+          ndirty++;
+        }
+    }
+  test_assert_int_equal (ndirty, pt->ndirty);
 
-  test_assert_equal (page_h_pgno (&a), dpg);
-  test_assert_equal (page_h_pgno (&b), cpg);
-  test_assert_equal (page_h_pgno (&c), bpg);
-  test_assert_equal (page_h_pgno (&d), apg);
+  test_err_t_wrap (pgr_close (p, &e), &e);
 
-  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &a, e), e);
-  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &b, e), e);
-  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &c, e), e);
-  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &d, e), e);
+  // Everything made it to disk
+  p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+  test_fail_if_null (p);
+  test_assert_int_equal ((int)pgr_get_npages (p), 401);
+  test_err_t_wrap (pgr_close (p, &e), &e);
 
-  test_err_t_wrap (pgr_new (&a, f.p, &tx, PG_DATA_LIST, e), e);
-  test_err_t_wrap (pgr_new (&b, f.p, &tx, PG_DATA_LIST, e), e);
-  test_err_t_wrap (pgr_new (&c, f.p, &tx, PG_DATA_LIST, e), e);
-  test_err_t_wrap (pgr_new (&d, f.p, &tx, PG_DATA_LIST, e), e);
+  test_err_t_wrap (tp_stop (tp, &e), &e);
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
+}
 
-  test_assert_equal (page_h_pgno (&a), apg);
-  test_assert_equal (page_h_pgno (&b), bpg);
-  test_assert_equal (page_h_pgno (&c), cpg);
-  test_assert_equal (page_h_pgno (&d), dpg);
+TEST (TT_UNIT, pager_readahead)
+{
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
 
-  dl_set_used (page_h_w (&a), DL_DATA_SIZE);
-  dl_set_used (page_h_w (&b), DL_DATA_SIZE);
-  dl_set_used (page_h_w (&c), DL_DATA_SIZE);
-  dl_set_used (page_h_w (&d), DL_DATA_SIZE);
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
 
-  test_err_t_wrap (pgr_release (f.p, &a, PG_DATA_LIST, e), e);
-  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &b, e), e);
-  test_err_t_wrap (pgr_delete_and_release (f.p, &tx, &c, e), e);
-  test_err_t_wrap (pgr_release (f.p, &d, PG_DATA_LIST, e), e);
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
 
-  test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
+  const struct pgr_params params = { .memory_budget = 128 * PAGE_SIZE, .npartitions = 1 };
+  struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp, params, &e);
+  test_fail_if_null (p);
 
-  test_err_t_wrap (pgr_fixture_teardown (&f), &f.e);
-}
-#endif
+  struct txn tx;
+  test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+  for (u32 i = 0; i < 400; ++i)
+    {
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_new (&h, p, &tx, PG_DATA_LIST, &e), &e);
+      dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+      test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+    }
+  test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+  test_err_t_wrap (pgr_close (p, &e), &e);
 
-err_t
-pgr_release_if_exists (struct pager *p, page_h *h, int flags, error *e)
-{
-  if (h->mode != PHM_NONE)
+  pgno pgs[READ_AHEAD_PAGES];
+  for (u32 i = 0; i < READ_AHEAD_PAGES; ++i)
     {
-      return pgr_release (p, h, flags, e);
+      pgs[i] = 10 + i;
     }
-  return SUCCESS;
-}
 
-err_t
-pgr_release (struct pager *p, page_h *h, int flags, error *e)
-{
-  DBG_ASSERT (pager, p);
-  ASSERT (h->mode == PHM_X || h->mode == PHM_S);
-  ASSERT (pf_check (h->pgr, PW_PRESENT));
+  // Nothing to overlap with - dropped
+  p = pgr_open_with ("test.db", "test.wal", &lt, tp, params, &e);
+  test_fail_if_null (p);
+  struct pgr_part *pt = &p->parts[0];
+  pgr_prefetch (p, PG_DATA_LIST, pgs, READ_AHEAD_PAGES);
+  pgr_cleaner_wait (p);
+  test_assert_int_equal ((int)pt->readahead, 0);
+  test_err_t_wrap (pgr_close (p, &e), &e);
 
-  i_log_trace ("Releasing %" PRpgno "\n", page_h_pgno (h));
+  test_err_t_wrap (tp_spin (tp, 1, &e), &e);
+  p = pgr_open_with ("test.db", "test.wal", &lt, tp, params, &e);
+  test_fail_if_null (p);
+  pt = &p->parts[0];
 
-  if (h->mode == PHM_X)
+  // What recovery leaves resident depends on when the cleaner ran - pick pages it didn't
+  pgno next = 1;
+  for (u32 i = 0; i < READ_AHEAD_PAGES; ++i, ++next)
     {
-      err_t_wrap (pgr_save (p, h, flags, e), e);
+      hdata_idx data;
+      while (ht_get_idx (&pt->pgno_to_value, &data, next) == HTAR_SUCCESS)
+        {
+          next++;
+        }
+      pgs[i] = next;
     }
 
-  err_t_wrap (page_validate_for_db (&h->pgr->page, flags, e), e);
+  pgr_prefetch (p, PG_DATA_LIST, pgs, READ_AHEAD_PAGES);
+  pgr_cleaner_wait (p);
+  test_assert_int_equal ((int)pt->readahead, READ_AHEAD_PAGES);
 
-  DBG_ASSERT (pager, p);
+  // Resident but not referenced yet
+  for (u32 i = 0; i < READ_AHEAD_PAGES; ++i)
+    {
+      hdata_idx data;
+      test_assert_int_equal (ht_get_idx (&pt->pgno_to_value, &data, pgs[i]), HTAR_SUCCESS);
+      test_assert (pf_check (&p->pages[data.value], PW_PREFETCH));
+      test_assert (!pf_check (&p->pages[data.value], PW_ACCESS));
+      test_assert_int_equal (p->pages[data.value].pin, 0);
+    }
 
-  h->pgr->pin--;
-  h->pgr = NULL;
-  h->mode = PHM_NONE;
+  // The scan that asked for them never blocks on I/O
+  for (u32 i = 0; i < READ_AHEAD_PAGES; ++i)
+    {
+      test_assert_int_equal (pgr_test_get_release (p, pgs[i], PG_DATA_LIST, &e), 0);
+    }
+  test_assert_int_equal ((int)pt->readahead_hits, READ_AHEAD_PAGES);
 
-  return SUCCESS;
+  test_err_t_wrap (pgr_close (p, &e), &e);
+  test_err_t_wrap (tp_stop (tp, &e), &e);
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
 }
 
-err_t
-pgr_flush_wall (struct pager *p, error *e)
+TEST (TT_UNIT, pager_fuzzy_checkpoint)
 {
-  return wal_flush_all (&p->ww, e);
-}
-
-#ifndef NTEST
+  error e = error_create ();
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
 
-TEST (TT_UNIT, pager_fill_ht)
-{
-  struct pgr_fixture f;
-  test_err_t_wrap (pgr_fixture_create (&f), &f.e);
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
 
-  struct txn tx;
-  pgr_begin_txn (&tx, f.p, &f.e);
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
 
-  page_h pgs[MEMORY_PAGE_LEN];
-  page_h bad = page_h_create ();
+  struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp,
+                                   (struct pgr_params){ .memory_budget = 128 * PAGE_SIZE, .npartitions = 1 }, &e);
+  test_fail_if_null (p);
+  struct pgr_part *pt = &p->parts[0];
 
-  {
-    // Fill up - there is already one page in the pool, the root
-    u32 i = 0;
-    for (; i < MEMORY_PAGE_LEN / 2 - 1; ++i)
-      {
-        pgs[i] = page_h_create ();
-        test_err_t_wrap (pgr_new (&pgs[i], f.p, &tx, PG_DATA_LIST, &f.e), &f.e);
-        test_assert_equal (pgs[i].mode, PHM_X);
-      }
+  struct txn tx;
+  test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+  for (u32 i = 0; i < 40; ++i)
+    {
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_new (&h, p, &tx, PG_DATA_LIST, &e), &e);
+      dl_set_used (page_h_w (&h), i + 1);
+      test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+    }
+  test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+  test_assert (pt->ndirty > 0);
 
-    // Next page will be full
-    test_err_t_check (pgr_new (&bad, f.p, &tx, PG_DATA_LIST, &f.e), ERR_PAGER_FULL, &f.e);
+  test_err_t_wrap (pgr_checkpoint (p, &e), &e);
 
-    // Release them all
-    for (i = 0; i < MEMORY_PAGE_LEN / 2 - 1; ++i)
-      {
-        dl_set_used (page_h_w (&pgs[i]), DL_DATA_SIZE);
-        test_err_t_wrap (pgr_release (f.p, &pgs[i], PG_DATA_LIST, &f.e), &f.e);
-      }
-  }
+  // Everything is durable but nothing left the pool
+  test_assert_int_equal (pt->ndirty, 0);
+  test_assert_int_equal (dpgt_get_size (&p->dpt), 0);
+  for (pgno pg = 1; pg <= 40; ++pg)
+    {
+      test_assert_int_equal (pgr_test_get_release (p, pg, PG_DATA_LIST, &e), 0);
+    }
 
-  // Repeat above
+  // Modify after the checkpoint, then lose the pool
+  test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
   {
-    // Fill half way up - good
-    for (u32 i = 0; i < MEMORY_PAGE_LEN / 2 - 1; ++i)
-      {
-        test_err_t_wrap (pgr_new (&pgs[i], f.p, &tx, PG_DATA_LIST, &f.e), &f.e);
-        test_assert_equal (pgs[i].mode, PHM_X);
-      }
-
-    // Next page will be full
-    test_err_t_check (pgr_new (&bad, f.p, &tx, PG_DATA_LIST, &f.e), ERR_PAGER_FULL, &f.e);
-
-    // Release them all
-    for (u32 i = 0; i < MEMORY_PAGE_LEN / 2 - 1; ++i)
-      {
-        dl_set_used (page_h_w (&pgs[i]), DL_DATA_SIZE);
-        test_err_t_wrap (pgr_release (f.p, &pgs[i], PG_DATA_LIST, &f.e), &f.e);
-      }
+    page_h h = page_h_create ();
+    test_err_t_wrap (pgr_get_writable (&h, &tx, PG_DATA_LIST, 3, p, &e), &e);
+    dl_set_used (page_h_w (&h), 100);
+    test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
   }
+  test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
 
-  test_err_t_wrap (pgr_commit (f.p, &tx, &f.e), &f.e);
+  test_fail_if (pgr_crash (p, &e));
+  p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+  test_fail_if_null (p);
 
-  test_err_t_wrap (pgr_fixture_teardown (&f), &f.e);
+  for (pgno pg = 1; pg <= 40; ++pg)
+    {
+      page_h h = page_h_create ();
+      test_err_t_wrap (pgr_get (&h, PG_DATA_LIST, pg, p, &e), &e);
+      test_assert_int_equal (dl_used (page_h_ro (&h)), pg == 3 ? 100 : pg);
+      test_err_t_wrap (pgr_release (p, &h, PG_DATA_LIST, &e), &e);
+    }
+
+  test_err_t_wrap (pgr_close (p, &e), &e);
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
 }
 #endif
 
@@ -1549,19 +4758,19 @@ i_log_page_table (int log_level, struct pager *p)
 {
   DBG_ASSERT (pager, p);
   i_log (log_level, "Page Table:\n");
-  for (u32 i = 0; i < MEMORY_PAGE_LEN; ++i)
+  for (u32 i = 0; i < p->nframes; ++i)
     {
       struct page_frame *mp = &p->pages[i];
       if (pf_check (mp, PW_PRESENT))
         {
-          i_printf (log_level, "%u |(PAGE)    pg: %" PRpgno " pin: %d ax: %d drt: %d prsn: %d sib: %d type: %d|\n",
+          i_printf (log_level, "%u |(PAGE)    pg: %" PRpgno " pin: %d ax: %d drt: %d prsn: %d x: %d type: %d|\n",
                     i,
                     mp->page.pg,
                     mp->pin,
                     pf_check (mp, PW_ACCESS),
                     pf_check (mp, PW_DIRTY),
                     pf_check (mp, PW_PRESENT),
-                    mp->wsibling,
+                    pf_check (mp, PW_X),
                     page_get_type (&mp->page));
         }
       else
@@ -1964,15 +5173,25 @@ TEST (TT_UNIT, pager_wal_entries_on_crash)
 err_t
 pgr_crash (struct pager *p, error *e)
 {
+  pgr_cleaner_wait (p);
+
   if (p->wal_enabled)
     {
       wal_crash (&p->ww, e);
     }
   fpgr_crash (&p->fp, e);
+  if (p->l2_enabled)
+    {
+      l2c_close (&p->l2, e);
+    }
 
   txnt_crash (&p->tnxt);
   dpgt_crash (&p->dpt);
 
+  slab_alloc_destroy (&p->undo_alloc);
+  i_cond_free (&p->cleaner_idle);
+  i_mutex_free (&p->cleaner_lock);
+  pgr_pool_free (p);
   i_free (p);
 
   return e->cause_code;
@@ -1153,7 +1153,7 @@ pgr_dlgt_new_next (page_h *cur, page_h *dest, page_h *c_next, struct txn *tx, st
   err_t_wrap (pgr_maybe_make_writable (p, tx, cur, e), e);
   err_t_wrap (pgr_maybe_make_writable (p, tx, c_next, e), e);
 
-  err_t_wrap (pgr_new (dest, p, tx, page_get_type (page_h_ro (cur)), e), e);
+  err_t_wrap (pgr_new_near (dest, p, tx, page_get_type (page_h_ro (cur)), page_h_pgno (cur), e), e);
   dlgt_link (page_h_w (cur), page_h_w (dest));
   dlgt_link (page_h_w (dest), page_h_w_or_null (c_next));
 
@@ -1410,7 +1410,7 @@ pgr_dlgt_new_next_no_link (page_h *cur, page_h *next, struct txn *tx, struct pag
 
   err_t_wrap (pgr_maybe_make_writable (p, tx, cur, e), e);
 
-  err_t_wrap (pgr_new (next, p, tx, page_get_type (page_h_ro (cur)), e), e);
+  err_t_wrap (pgr_new_near (next, p, tx, page_get_type (page_h_ro (cur)), page_h_pgno (cur), e), e);
   dlgt_link (page_h_w (cur), page_h_w (next));
 
   return SUCCESS;
@@ -1630,7 +1630,7 @@ pgr_dlgt_new_ovnext_no_link (page_h *cur, page_h *next, struct txn *tx, struct p
 
   err_t_wrap (pgr_maybe_make_writable (p, tx, cur, e), e);
 
-  err_t_wrap (pgr_new (next, p, tx, PG_VAR_TAIL, e), e);
+  err_t_wrap (pgr_new_near (next, p, tx, PG_VAR_TAIL, page_h_pgno (cur), e), e);
   dlgtovlink (page_h_w (cur), page_h_w (next));
 
   return SUCCESS;
@@ -1972,7 +1972,7 @@ pgr_dlgt_advance_new_next (page_h *cur, page_h *c_next, struct txn *tx, struct p
   err_t_wrap (pgr_maybe_make_writable (p, tx, c_next, e), e);
 
   page_h next = page_h_create ();
-  err_t_wrap (pgr_new (&next, p, tx, page_get_type (page_h_ro (cur)), e), e);
+  err_t_wrap (pgr_new_near (&next, p, tx, page_get_type (page_h_ro (cur)), page_h_pgno (cur), e), e);
   dlgt_link (page_h_w (cur), page_h_w (&next));
   dlgt_link (page_h_w (&next), page_h_w_or_null (c_next));
   err_t_wrap (pgr_release (p, cur, page_get_type (page_h_ro (cur)), e), e);
@@ -2254,7 +2254,7 @@ pgr_dlgt_advance_new_next_no_link (page_h *cur, struct txn *tx, struct pager *p,
   err_t_wrap (pgr_maybe_make_writable (p, tx, cur, e), e);
 
   page_h next = page_h_create ();
-  err_t_wrap (pgr_new (&next, p, tx, page_get_type (page_h_ro (cur)), e), e);
+  err_t_wrap (pgr_new_near (&next, p, tx, page_get_type (page_h_ro (cur)), page_h_pgno (cur), e), e);
   dlgt_link (page_h_w (cur), page_h_w (&next));
   err_t_wrap (pgr_release (p, cur, page_get_type (page_h_ro (cur)), e), e);
 
@@ -24,6 +24,7 @@
 #include <numstore/core/string.h>
 #include <numstore/intf/logging.h>
 #include <numstore/intf/types.h>
+#include <numstore/pager/free_list.h>
 #include <numstore/pager/page.h>
 #include <numstore/test/testing.h>
 
@@ -59,11 +60,40 @@ TEST (TT_UNIT, rn_init_empty)
   rand_bytes (p.raw, PAGE_SIZE);
   page_init_empty (&p, PG_ROOT_NODE);
 
-  test_assert_equal (rn_get_first_tmbst (&p), 1);
+  test_assert_equal (rn_get_next_pg (&p), 1);
   test_assert_equal (rn_get_master_lsn (&p), 0);
+  test_assert_equal (rn_get_page_size (&p), PAGE_SIZE);
+  test_assert_equal (rn_get_magic (&p), RN_MAGIC);
+  test_assert_equal (rn_get_version (&p), RN_FORMAT_VERSION);
 }
 #endif
 
+err_t
+rn_check_format (const page *p, error *e)
+{
+  if (rn_get_magic (p) != RN_MAGIC)
+    {
+      return error_causef (e, ERR_INVALID_ARGUMENT,
+                           "Root node: database is in the unversioned format "
+                           "from before page checksums and can't be opened by this build");
+    }
+  if (rn_get_version (p) != RN_FORMAT_VERSION)
+    {
+      return error_causef (e, ERR_INVALID_ARGUMENT,
+                           "Root node: database is format version %" PRIu32
+                           " but this build reads version %" PRIu32,
+                           rn_get_version (p), RN_FORMAT_VERSION);
+    }
+  if (rn_get_page_size (p) != PAGE_SIZE)
+    {
+      return error_causef (e, ERR_INVALID_ARGUMENT,
+                           "Root node: database was created with %" PRp_size
+                           " byte pages but this build uses %" PRp_size " byte pages (PAGE_POW)",
+                           rn_get_page_size (p), PAGE_SIZE);
+    }
+  return SUCCESS;
+}
+
 err_t
 rn_validate_for_db (const page *p, error *e)
 {
@@ -71,7 +101,7 @@ rn_validate_for_db (const page *p, error *e)
     {
       return error_causef (e, ERR_CORRUPT, "Invalid page header for root node");
     }
-  return SUCCESS;
+  return rn_check_format (p, e);
 }
 
 #ifndef NTEST
@@ -109,6 +139,32 @@ TEST (TT_UNIT, rn_validate_for_db)
     page_init_empty (&p, PG_ROOT_NODE);
     test_assert_int_equal (rn_validate_for_db (&p, &e), SUCCESS);
   }
+
+  TEST_CASE ("Created with another page size -> ERR_INVALID_ARGUMENT")
+  {
+    page_init_empty (&p, PG_ROOT_NODE);
+    rn_set_page_size (&p, PAGE_SIZE * 4);
+    test_assert_int_equal (rn_validate_for_db (&p, &e), ERR_INVALID_ARGUMENT);
+    e.cause_code = SUCCESS;
+  }
+
+  TEST_CASE ("Another format version -> ERR_INVALID_ARGUMENT")
+  {
+    page_init_empty (&p, PG_ROOT_NODE);
+    rn_set_format (&p, RN_MAGIC, RN_FORMAT_VERSION + 1);
+    test_assert_int_equal (rn_validate_for_db (&p, &e), ERR_INVALID_ARGUMENT);
+    e.cause_code = SUCCESS;
+  }
+
+  TEST_CASE ("Unversioned root (first tombstone where the magic is) -> ERR_INVALID_ARGUMENT")
+  {
+    i_memset (p.raw, 0, PAGE_SIZE);
+    page_set_type (&p, PG_ROOT_NODE);
+    pgno first_tmbst = 1;
+    i_memcpy (&p.raw[PG_COMMN_END], &first_tmbst, sizeof (first_tmbst));
+    test_assert_int_equal (rn_validate_for_db (&p, &e), ERR_INVALID_ARGUMENT);
+    e.cause_code = SUCCESS;
+  }
 }
 #endif
 
@@ -120,13 +176,13 @@ TEST (TT_UNIT, rn_set_get_simple)
   rand_bytes (p.raw, PAGE_SIZE);
   page_init_empty (&p, PG_ROOT_NODE);
 
-  test_assert_type_equal (rn_get_first_tmbst (&p), 1, pgno, PRpgno);
+  test_assert_type_equal (rn_get_next_pg (&p), 1, pgno, PRpgno);
   test_assert_type_equal (rn_get_master_lsn (&p), (lsn)0, lsn, PRlsn);
 
-  rn_set_first_tmbst (&p, 2);
+  rn_set_next_pg (&p, 2);
   rn_set_master_lsn (&p, 3);
 
-  test_assert_type_equal (rn_get_first_tmbst (&p), 2, pgno, PRpgno);
+  test_assert_type_equal (rn_get_next_pg (&p), 2, pgno, PRpgno);
   test_assert_type_equal (rn_get_master_lsn (&p), (lsn)3, lsn, PRlsn);
 }
 #endif
@@ -140,8 +196,11 @@ i_log_rn (int level, const page *rn)
   i_log (level, "=== ROOT NODE PAGE START ===\n");
 
   i_printf (level, "PGNO: %" PRpgno "\n", rn->pg);
-  i_printf (level, "FIRST TMBST: %" PRpgno "\n", rn_get_first_tmbst (rn));
+  i_printf (level, "VERSION:     %" PRIu32 "\n", rn_get_version (rn));
+  i_printf (level, "NEXT PGNO:   %" PRpgno "\n", rn_get_next_pg (rn));
   i_printf (level, "MASTER_LSN:  %" PRlsn "\n", rn_get_master_lsn (rn));
+  i_printf (level, "PAGE_SIZE:   %" PRp_size "\n", rn_get_page_size (rn));
+  i_printf (level, "FREE:        %" PRpgno "\n", frlst_count_free (rn));
 
   i_log (level, "=== ROOT NODE PAGE END ===\n");
 }
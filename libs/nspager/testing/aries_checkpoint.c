@@ -101,7 +101,7 @@ TEST (TT_UNIT, aries_checkpoint_basic_recovery)
     page_h pg = page_h_create ();
 
     test_err_t_wrap (pgr_get (&pg, PG_ROOT_NODE, 0, p, &e), &e);
-    test_assert_int_equal (rn_get_first_tmbst (page_h_ro (&pg)), 6);
+    test_assert_int_equal (rn_get_next_pg (page_h_ro (&pg)), 6);
     lsn master_lsn = rn_get_master_lsn (page_h_ro (&pg));
     test_assert (master_lsn > 0); // Checkpoint LSN should be persisted
     pgr_release (p, &pg, PG_ROOT_NODE, &e);
@@ -189,7 +189,7 @@ TEST_disabled (TT_UNIT, aries_checkpoint_with_active_transactions)
     page_h pg = page_h_create ();
 
     test_err_t_wrap (pgr_get (&pg, PG_ROOT_NODE, ROOT_PGNO, p, &e), &e);
-    // Note: first_tmbst may be stale after fuzzy checkpoint recovery
+    // Note: next_pg may be stale after fuzzy checkpoint recovery
     // because it's checkpointed with uncommitted allocations
     lsn master_lsn = rn_get_master_lsn (page_h_ro (&pg));
     test_assert (master_lsn > 0);
@@ -327,7 +327,7 @@ TEST (TT_UNIT, aries_checkpoint_multiple_checkpoints)
     page_h pg = page_h_create ();
 
     test_err_t_wrap (pgr_get (&pg, PG_ROOT_NODE, 0, p, &e), &e);
-    test_assert_int_equal (rn_get_first_tmbst (page_h_ro (&pg)), 7);
+    test_assert_int_equal (rn_get_next_pg (page_h_ro (&pg)), 7);
     lsn master_lsn = rn_get_master_lsn (page_h_ro (&pg));
     test_assert_int_equal (master_lsn, ckpt3_lsn); // Should use latest checkpoint
     pgr_release (p, &pg, PG_ROOT_NODE, &e);
@@ -430,7 +430,7 @@ TEST (TT_UNIT, aries_checkpoint_with_post_checkpoint_activity)
     page_h pg = page_h_create ();
 
     test_err_t_wrap (pgr_get (&pg, PG_ROOT_NODE, 0, p, &e), &e);
-    test_assert_int_equal (rn_get_first_tmbst (page_h_ro (&pg)), 7);
+    test_assert_int_equal (rn_get_next_pg (page_h_ro (&pg)), 7);
     pgr_release (p, &pg, PG_ROOT_NODE, &e);
 
     // Data before checkpoint
@@ -455,5 +455,208 @@ TEST (TT_UNIT, aries_checkpoint_with_post_checkpoint_activity)
   test_err_t_wrap (tp_free (tp, &e), &e);
   lockt_destroy (&lt);
 }
+
+// A page torn on disk comes back from the full image its first post-checkpoint change logged
+TEST (TT_UNIT, aries_checkpoint_torn_page)
+{
+  error e = error_create ();
+
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
+
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
+
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
+
+  struct pager *p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+  test_fail_if_null (p);
+
+  u8 data[DL_DATA_SIZE];
+  rand_bytes (data, DL_DATA_SIZE);
+
+  struct txn tx;
+  struct pgr_stats s;
+  page_h pg = page_h_create ();
+
+  test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+  test_fail_if (pgr_new (&pg, p, &tx, PG_DATA_LIST, &e));
+  dl_set_data (page_h_w (&pg), (struct dl_data){ .data = data, .blen = DL_DATA_SIZE });
+  test_fail_if (pgr_release (p, &pg, PG_DATA_LIST, &e));
+  test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+
+  // Page 1 is on disk now
+  test_fail_if (pgr_checkpoint (p, &e));
+
+  // Two small changes - the first logs the whole page, the second a delta
+  for (u32 i = 0; i < 2; ++i)
+    {
+      pgr_get_stats (p, &s);
+      u64 full_pages = s.wal_full_pages;
+
+      test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+      test_err_t_wrap (pgr_get_writable (&pg, &tx, PG_DATA_LIST, 1, p, &e), &e);
+      for (p_size j = 8 * i; j < 8 * (i + 1); ++j)
+        {
+          data[j] = (u8)~data[j];
+          dl_set_byte (page_h_w (&pg), j, data[j]);
+        }
+      test_fail_if (pgr_release (p, &pg, PG_DATA_LIST, &e));
+      test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+
+      pgr_get_stats (p, &s);
+      test_assert_int_equal (s.wal_full_pages, full_pages + (i == 0));
+    }
+
+  test_fail_if (pgr_crash (p, &e));
+
+  // The crash got half way through writing page 1 - even its page lsn is junk
+  {
+    u8 junk[PAGE_SIZE / 2];
+    rand_bytes (junk, sizeof (junk));
+
+    i_file f;
+    test_err_t_wrap (i_open_rw (&f, "test.db", &e), &e);
+    test_err_t_wrap (i_pwrite_all (&f, junk, sizeof (junk), PAGE_SIZE, &e), &e);
+    test_err_t_wrap (i_close (&f, &e), &e);
+  }
+
+  p = pgr_open ("test.db", "test.wal", &lt, tp, &e);
+  test_fail_if_null (p);
+
+  test_err_t_wrap (pgr_get (&pg, PG_DATA_LIST, 1, p, &e), &e);
+  test_assert_memequal (dl_get_data (page_h_ro (&pg)), data, DL_DATA_SIZE);
+  pgr_release (p, &pg, PG_DATA_LIST, &e);
+
+  test_err_t_wrap (pgr_close (p, &e), &e);
+
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
+}
+
+#define TRUNC_SEG_SIZE (8 * PAGE_SIZE)
+#define TRUNC_NPAGES 10
+
+static bool
+aries_wal_seg_exists (lsn l)
+{
+  error e = error_create ();
+  char name[MAX_FILE_NAME];
+  bool exists = false;
+  walseg_name (name, "test.wal", l / TRUNC_SEG_SIZE);
+  i_file_exists (name, &exists, &e);
+  return exists;
+}
+
+TEST (TT_UNIT, aries_checkpoint_truncate)
+{
+  error e = error_create ();
+
+  test_fail_if (i_remove_quiet ("test.db", &e));
+  test_fail_if (i_remove_quiet ("test.wal", &e));
+
+  struct lockt lt;
+  test_err_t_wrap (lockt_init (&lt, &e), &e);
+
+  struct thread_pool *tp = tp_open (&e);
+  test_fail_if_null (tp);
+
+  struct pgr_params params = { .wal_segment_bytes = TRUNC_SEG_SIZE };
+  struct pager *p = pgr_open_with ("test.db", "test.wal", &lt, tp, params, &e);
+  test_fail_if_null (p);
+
+  u8 data[TRUNC_NPAGES + 1][DL_DATA_SIZE];
+  struct txn tx;
+  struct pgr_stats s;
+  page_h pg = page_h_create ();
+
+  // A transaction per page - well over a segment of log
+  for (pgno i = 1; i <= TRUNC_NPAGES; ++i)
+    {
+      rand_bytes (data[i], DL_DATA_SIZE);
+      test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+      test_fail_if (pgr_new (&pg, p, &tx, PG_DATA_LIST, &e));
+      test_assert_int_equal (page_h_pgno (&pg), i);
+      dl_set_data (page_h_w (&pg), (struct dl_data){ .data = data[i], .blen = DL_DATA_SIZE });
+      test_fail_if (pgr_release (p, &pg, PG_DATA_LIST, &e));
+      test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+    }
+
+  TEST_CASE ("A checkpoint gives back the segments behind it")
+  {
+    test_assert (aries_wal_seg_exists (0));
+
+    // The first one's master isn't forced until the second
+    test_fail_if (pgr_checkpoint (p, &e));
+    pgr_get_stats (p, &s);
+    test_assert_int_equal (s.wal_recycled + s.wal_removed, 0);
+    test_fail_if (pgr_checkpoint (p, &e));
+
+    pgr_get_stats (p, &s);
+    test_assert (s.wal_recycled > 0);
+    test_assert_int_equal (s.wal_recycled, MIN (s.wal_recycled + s.wal_removed, WAL_SEGMENT_SPARES));
+    test_assert (!aries_wal_seg_exists (0));
+  }
+
+  TEST_CASE ("An open transaction holds the log back")
+  {
+    // Changes page 1 and never commits
+    struct txn loser;
+    test_err_t_wrap (pgr_begin_txn (&loser, p, &e), &e);
+    test_err_t_wrap (pgr_get_writable (&pg, &loser, PG_DATA_LIST, 1, p, &e), &e);
+    for (p_size j = 0; j < 8; ++j)
+      {
+        dl_set_byte (page_h_w (&pg), j, (u8)~data[1][j]);
+      }
+    test_fail_if (pgr_release (p, &pg, PG_DATA_LIST, &e));
+
+    for (pgno i = 2; i <= TRUNC_NPAGES; ++i)
+      {
+        rand_bytes (data[i], DL_DATA_SIZE);
+        test_err_t_wrap (pgr_begin_txn (&tx, p, &e), &e);
+        test_err_t_wrap (pgr_get_writable (&pg, &tx, PG_DATA_LIST, i, p, &e), &e);
+        dl_set_data (page_h_w (&pg), (struct dl_data){ .data = data[i], .blen = DL_DATA_SIZE });
+        test_fail_if (pgr_release (p, &pg, PG_DATA_LIST, &e));
+        test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
+      }
+
+    test_fail_if (pgr_checkpoint (p, &e));
+    test_fail_if (pgr_checkpoint (p, &e));
+    pgr_get_stats (p, &s);
+
+    // Only what's before the loser began
+    test_assert (aries_wal_seg_exists (loser.first_lsn));
+    test_assert_int_equal (s.wal_recycled + s.wal_removed, loser.first_lsn / TRUNC_SEG_SIZE);
+  }
+
+  TEST_CASE ("Recovery undoes the loser from what's left of the log")
+  {
+    test_fail_if (pgr_crash (p, &e));
+
+    p = pgr_open_with ("test.db", "test.wal", &lt, tp, params, &e);
+    test_fail_if_null (p);
+
+    for (pgno i = 1; i <= TRUNC_NPAGES; ++i)
+      {
+        test_err_t_wrap (pgr_get (&pg, PG_DATA_LIST, i, p, &e), &e);
+        test_assert_memequal (dl_get_data (page_h_ro (&pg)), data[i], DL_DATA_SIZE);
+        pgr_release (p, &pg, PG_DATA_LIST, &e);
+      }
+  }
+
+  test_err_t_wrap (pgr_close (p, &e), &e);
+
+  // The log doesn't start at segment 0 anymore - don't leave the rest for the next test
+  struct wal_ctl ctl;
+  bool exists;
+  test_err_t_wrap (walctl_read (&ctl, &exists, "test.wal", &e), &e);
+  test_assert (exists);
+  test_err_t_wrap (walseg_remove_from ("test.wal", ctl.start_lsn / ctl.seg_size, &e), &e);
+  test_fail_if (i_remove_quiet ("test.wal", &e));
+
+  test_err_t_wrap (tp_free (tp, &e), &e);
+  lockt_destroy (&lt);
+}
 #endif
 #endif
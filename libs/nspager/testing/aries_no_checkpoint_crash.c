@@ -85,7 +85,7 @@ TEST_disabled (TT_UNIT, aries_crash_before_commit)
 
     // Root node was committed
     test_err_t_wrap (pgr_get (&pg, PG_ROOT_NODE, 0, p, &e), &e);
-    test_assert_int_equal (rn_get_first_tmbst (page_h_ro (&pg)), 1);
+    test_assert_int_equal (rn_get_next_pg (page_h_ro (&pg)), 1);
     test_assert_int_equal (rn_get_master_lsn (page_h_ro (&pg)), 0);
     pgr_release (p, &pg, PG_ROOT_NODE, &e);
 
@@ -176,7 +176,7 @@ TEST_disabled (TT_UNIT, aries_crash_before_commit_multiple)
 
     // Root node was committed
     test_err_t_wrap (pgr_get (&pg, PG_ROOT_NODE, 0, p, &e), &e);
-    test_assert_int_equal (rn_get_first_tmbst (page_h_ro (&pg)), 1);
+    test_assert_int_equal (rn_get_next_pg (page_h_ro (&pg)), 1);
     test_assert_int_equal (rn_get_master_lsn (page_h_ro (&pg)), 0);
     pgr_release (p, &pg, PG_ROOT_NODE, &e);
 
@@ -248,7 +248,7 @@ TEST (TT_UNIT, aries_crash_after_commit_before_end)
 
     // Root node was committed
     test_err_t_wrap (pgr_get (&pg, PG_ROOT_NODE, 0, p, &e), &e);
-    test_assert_int_equal (rn_get_first_tmbst (page_h_ro (&pg)), 6);
+    test_assert_int_equal (rn_get_next_pg (page_h_ro (&pg)), 6);
     test_assert_int_equal (rn_get_master_lsn (page_h_ro (&pg)), 0);
     pgr_release (p, &pg, PG_ROOT_NODE, &e);
 
@@ -348,7 +348,7 @@ TEST (TT_UNIT, aries_crash_after_commit_before_end_multiple)
 
     // Root node was committed
     test_err_t_wrap (pgr_get (&pg, PG_ROOT_NODE, 0, p, &e), &e);
-    test_assert_int_equal (rn_get_first_tmbst (page_h_ro (&pg)), 11);
+    test_assert_int_equal (rn_get_next_pg (page_h_ro (&pg)), 11);
     test_assert_int_equal (rn_get_master_lsn (page_h_ro (&pg)), 0);
     pgr_release (p, &pg, PG_ROOT_NODE, &e);
 
@@ -458,7 +458,7 @@ TEST_disabled (TT_UNIT, aries_crash_after_commit_before_end_multiple_second_no_c
 
     // Root node was committed
     test_err_t_wrap (pgr_get (&pg, PG_ROOT_NODE, 0, p, &e), &e);
-    test_assert_int_equal (rn_get_first_tmbst (page_h_ro (&pg)), 6);
+    test_assert_int_equal (rn_get_next_pg (page_h_ro (&pg)), 6);
     test_assert_int_equal (rn_get_master_lsn (page_h_ro (&pg)), 0);
     pgr_release (p, &pg, PG_ROOT_NODE, &e);
 
@@ -78,10 +78,14 @@ TEST (TT_UNIT, aries_rollback_basic)
   for (int i = 1; i < 4; ++i)
     {
       test_err_t_wrap (pgr_get (&pg, PG_TOMBSTONE, i, p, &e), &e);
-      test_assert_int_equal (tmbst_get_next (page_h_ro (&pg)), i + 1);
       pgr_release (p, &pg, PG_TOMBSTONE, &e);
     }
 
+  // And handed out again from the start
+  test_err_t_wrap (pgr_get (&pg, PG_ROOT_NODE, ROOT_PGNO, p, &e), &e);
+  test_assert_int_equal (rn_get_next_pg (page_h_ro (&pg)), 1);
+  pgr_release (p, &pg, PG_ROOT_NODE, &e);
+
   test_err_t_wrap (pgr_commit (p, &tx, &e), &e);
 
   test_err_t_wrap (pgr_close (p, &e), &e);
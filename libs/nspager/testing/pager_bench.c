@@ -0,0 +1,424 @@
+/*
+ * Copyright 2025 Theo Lincke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *   Pager benchmarks (TT_PROFILE). Run with `./test PROFILE pgr_bench`.
+ */
+
+#include <numstore/core/assert.h>
+#include <numstore/core/error.h>
+#include <numstore/core/macros.h>
+#include <numstore/intf/logging.h>
+#include <numstore/intf/os.h>
+#include <numstore/pager.h>
+#include <numstore/pager/data_list.h>
+#include <numstore/pager/lock_table.h>
+#include <numstore/pager/page.h>
+#include <numstore/pager/page_h.h>
+#include <numstore/test/testing.h>
+#include <numstore/test/testing_test.h>
+
+#include <_pager.h>
+#include <config.h>
+
+#ifndef DUMB_PAGER
+
+#ifndef NTEST
+
+//////////////////////////////////
+/// SHARED
+
+struct pgr_bench
+{
+  error e;
+  struct pager *p;
+  struct lockt lt;
+  struct thread_pool *tp;
+};
+
+static err_t
+pgr_bench_open (struct pgr_bench *b, struct pgr_params params)
+{
+  b->e = error_create ();
+
+  err_t_wrap (i_remove_quiet ("bench.db", &b->e), &b->e);
+  err_t_wrap (i_remove_quiet ("bench.wal", &b->e), &b->e);
+  err_t_wrap (lockt_init (&b->lt, &b->e), &b->e);
+
+  b->tp = tp_open (&b->e);
+  if (b->tp == NULL)
+    {
+      lockt_destroy (&b->lt);
+      return b->e.cause_code;
+    }
+
+  b->p = pgr_open_with ("bench.db", "bench.wal", &b->lt, b->tp, params, &b->e);
+  if (b->p == NULL)
+    {
+      tp_free (b->tp, &b->e);
+      lockt_destroy (&b->lt);
+      return b->e.cause_code;
+    }
+
+  return SUCCESS;
+}
+
+static err_t
+pgr_bench_close (struct pgr_bench *b)
+{
+  pgr_close (b->p, &b->e);
+  tp_free (b->tp, &b->e);
+  lockt_destroy (&b->lt);
+  i_remove_quiet ("bench.db", &b->e);
+  i_remove_quiet ("bench.wal", &b->e);
+  return b->e.cause_code;
+}
+
+// Appends [npages] full data list pages - they land at pgno 1..npages
+static err_t
+pgr_bench_fill (struct pgr_bench *b, u32 npages)
+{
+  struct txn tx;
+  err_t_wrap (pgr_begin_txn (&tx, b->p, &b->e), &b->e);
+
+  for (u32 i = 0; i < npages; ++i)
+    {
+      page_h h = page_h_create ();
+      err_t_wrap (pgr_new (&h, b->p, &tx, PG_DATA_LIST, &b->e), &b->e);
+      dl_set_used (page_h_w (&h), DL_DATA_SIZE);
+      err_t_wrap (pgr_release (b->p, &h, PG_DATA_LIST, &b->e), &b->e);
+    }
+
+  return pgr_commit (b->p, &tx, &b->e);
+}
+
+static inline u32
+pgr_bench_rand (u32 *state)
+{
+  // xorshift32 - per thread, no shared state
+  u32 x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+//////////////////////////////////
+/// FETCH SCALING
+
+#define FETCH_PAGES 1024
+#define FETCH_OPS 200000
+
+struct fetch_ctx
+{
+  struct pager *p;
+  u32 seed;
+  err_t ret;
+};
+
+static void *
+fetch_thread (void *arg)
+{
+  struct fetch_ctx *ctx = arg;
+  error e = error_create ();
+
+  for (u32 i = 0; i < FETCH_OPS; ++i)
+    {
+      pgno pg = 1 + pgr_bench_rand (&ctx->seed) % FETCH_PAGES;
+      page_h h = page_h_create ();
+      if ((ctx->ret = pgr_get (&h, PG_DATA_LIST, pg, ctx->p, &e)))
+        {
+          return NULL;
+        }
+      if ((ctx->ret = pgr_release (ctx->p, &h, PG_DATA_LIST, &e)))
+        {
+          return NULL;
+        }
+    }
+
+  return NULL;
+}
+
+static void
+pgr_bench_fetch_run (struct pgr_bench *b, const char *label, u32 nthreads)
+{
+  struct fetch_ctx ctx[16];
+  i_thread threads[16];
+  ASSERT (nthreads <= arrlen (threads));
+
+  i_timer timer;
+  i_timer_create (&timer, &b->e);
+  u64 start = i_timer_now_ns (&timer);
+
+  for (u32 i = 0; i < nthreads; ++i)
+    {
+      ctx[i] = (struct fetch_ctx){ .p = b->p, .seed = 0x9E3779B9u * (i + 1), .ret = SUCCESS };
+      i_thread_create (&threads[i], fetch_thread, &ctx[i], &b->e);
+    }
+  for (u32 i = 0; i < nthreads; ++i)
+    {
+      i_thread_join (&threads[i], &b->e);
+      ASSERT (ctx[i].ret == SUCCESS);
+    }
+
+  u64 elapsed = MAX (i_timer_now_ns (&timer) - start, (u64)1);
+  i_timer_free (&timer);
+
+  i_log_info ("pgr_bench_fetch %-12s threads: %2u  %10.0f fetch/s\n",
+              label, nthreads, (f64)nthreads * FETCH_OPS * 1e9 / (f64)elapsed);
+}
+
+/**
+ * Whole working set fits in memory so this measures the cost of
+ * the buffer pool lookup itself. One partition serializes every
+ * fetch on a single latch, the default splits it up
+ */
+TEST (TT_PROFILE, pgr_bench_fetch_scaling)
+{
+  const u64 budget = 4 * FETCH_PAGES * (u64)PAGE_SIZE;
+
+  struct
+  {
+    const char *label;
+    u32 npartitions;
+  } configs[] = {
+    { "1 partition", 1 },
+    { "partitioned", 0 },
+  };
+
+  for (u32 c = 0; c < arrlen (configs); ++c)
+    {
+      struct pgr_bench b;
+      test_err_t_wrap (pgr_bench_open (&b, (struct pgr_params){ .memory_budget = budget, .npartitions = configs[c].npartitions }), &b.e);
+      test_err_t_wrap (pgr_bench_fill (&b, FETCH_PAGES), &b.e);
+
+      for (u32 nthreads = 1; nthreads <= 8; nthreads *= 2)
+        {
+          pgr_bench_fetch_run (&b, configs[c].label, nthreads);
+        }
+
+      test_err_t_wrap (pgr_bench_close (&b), &b.e);
+    }
+}
+
+//////////////////////////////////
+/// HIT RATIO
+
+#define HR_HOT_PAGES 64
+#define HR_SCAN_PAGES 4096
+#define HR_FRAMES 256
+#define HR_ROUNDS 5
+#define HR_SCAN_PER_POINT 4
+
+static u64
+pgr_bench_misses (struct pager *p)
+{
+  u64 ret = 0;
+  for (u32 i = 0; i < p->nparts; ++i)
+    {
+      ret += p->parts[i].misses;
+    }
+  return ret;
+}
+
+static err_t
+pgr_bench_touch (struct pgr_bench *b, pgno pg)
+{
+  page_h h = page_h_create ();
+  err_t_wrap (pgr_get (&h, PG_DATA_LIST, pg, b->p, &b->e), &b->e);
+  return pgr_release (b->p, &h, PG_DATA_LIST, &b->e);
+}
+
+/**
+ * Mixed workload: large sequential scans (think nsfslite_read walking a
+ * data_list chain) with point reads of a small hot set (inner nodes,
+ * var pages) sprinkled in. The hot set fits in the pool, the scan doesn't
+ */
+TEST (TT_PROFILE, pgr_bench_hit_ratio)
+{
+  struct
+  {
+    const char *label;
+    enum pgr_policy policy;
+  } configs[] = {
+    { "CLOCK", PGR_POLICY_CLOCK },
+    { "2Q", PGR_POLICY_2Q },
+  };
+
+  for (u32 c = 0; c < arrlen (configs); ++c)
+    {
+      struct pgr_bench b;
+      struct pgr_params params = {
+        .memory_budget = HR_FRAMES * (u64)PAGE_SIZE,
+        .npartitions = 1,
+        .policy = configs[c].policy,
+      };
+      test_err_t_wrap (pgr_bench_open (&b, params), &b.e);
+      test_err_t_wrap (pgr_bench_fill (&b, HR_HOT_PAGES + HR_SCAN_PAGES), &b.e);
+
+      u32 seed = 0x12345678;
+      u64 hot_reads = 0, hot_misses = 0;
+      u64 total_reads = 0;
+      u64 misses0 = pgr_bench_misses (b.p);
+
+      for (u32 r = 0; r < HR_ROUNDS; ++r)
+        {
+          for (u32 i = 0; i < HR_SCAN_PAGES; ++i)
+            {
+              test_err_t_wrap (pgr_bench_touch (&b, 1 + HR_HOT_PAGES + i), &b.e);
+              total_reads++;
+
+              if (i % HR_SCAN_PER_POINT == 0)
+                {
+                  u64 before = pgr_bench_misses (b.p);
+                  test_err_t_wrap (pgr_bench_touch (&b, 1 + pgr_bench_rand (&seed) % HR_HOT_PAGES), &b.e);
+                  hot_misses += pgr_bench_misses (b.p) - before;
+                  hot_reads++;
+                  total_reads++;
+                }
+            }
+        }
+
+      u64 total_misses = pgr_bench_misses (b.p) - misses0;
+      i_log_info ("pgr_bench_hit_ratio %-6s hot hit ratio: %6.2f%%  overall hit ratio: %6.2f%%\n",
+                  configs[c].label,
+                  100.0 * (f64)(hot_reads - hot_misses) / (f64)hot_reads,
+                  100.0 * (f64)(total_reads - total_misses) / (f64)total_reads);
+
+      test_err_t_wrap (pgr_bench_close (&b), &b.e);
+    }
+}
+
+//////////////////////////////////
+/// GROUP COMMIT
+
+#define COMMIT_TXNS 500
+
+struct commit_ctx
+{
+  struct pager *p;
+  pgno pg; // Each thread updates its own page - no lock waits
+  err_t ret;
+};
+
+static void *
+commit_thread (void *arg)
+{
+  struct commit_ctx *ctx = arg;
+  error e = error_create ();
+  u8 buf[64];
+
+  for (u32 i = 0; i < COMMIT_TXNS; ++i)
+    {
+      struct txn tx;
+      page_h h = page_h_create ();
+      i_memset (buf, (u8)i, sizeof (buf));
+
+      if ((ctx->ret = pgr_begin_txn (&tx, ctx->p, &e)))
+        {
+          return NULL;
+        }
+      if ((ctx->ret = pgr_get_writable (&h, &tx, PG_DATA_LIST, ctx->pg, ctx->p, &e)))
+        {
+          return NULL;
+        }
+      dl_set_data (page_h_w (&h), (struct dl_data){ .data = buf, .blen = sizeof (buf) });
+      if ((ctx->ret = pgr_release (ctx->p, &h, PG_DATA_LIST, &e)))
+        {
+          return NULL;
+        }
+      if ((ctx->ret = pgr_commit (ctx->p, &tx, &e)))
+        {
+          return NULL;
+        }
+    }
+
+  return NULL;
+}
+
+static void
+pgr_bench_commit_run (struct pgr_bench *b, const char *label, u32 nthreads)
+{
+  struct commit_ctx ctx[16];
+  i_thread threads[16];
+  ASSERT (nthreads <= arrlen (threads));
+
+  struct pgr_stats before, after;
+  pgr_get_stats (b->p, &before);
+
+  i_timer timer;
+  i_timer_create (&timer, &b->e);
+  u64 start = i_timer_now_ns (&timer);
+
+  for (u32 i = 0; i < nthreads; ++i)
+    {
+      ctx[i] = (struct commit_ctx){ .p = b->p, .pg = 1 + i, .ret = SUCCESS };
+      i_thread_create (&threads[i], commit_thread, &ctx[i], &b->e);
+    }
+  for (u32 i = 0; i < nthreads; ++i)
+    {
+      i_thread_join (&threads[i], &b->e);
+      ASSERT (ctx[i].ret == SUCCESS);
+    }
+
+  u64 elapsed = MAX (i_timer_now_ns (&timer) - start, (u64)1);
+  i_timer_free (&timer);
+
+  pgr_get_stats (b->p, &after);
+  u64 commits = (u64)nthreads * COMMIT_TXNS;
+  u64 fsyncs = MAX (after.wal_fsyncs - before.wal_fsyncs, (u64)1);
+
+  i_log_info ("pgr_bench_commit %-10s threads: %2u  %10.0f commit/s  %6.2f commit/fsync\n",
+              label, nthreads, (f64)commits * 1e9 / (f64)elapsed, (f64)commits / (f64)fsyncs);
+}
+
+/**
+ * Small update transactions committing as fast as they can. Without
+ * group commit every commit is its own WAL fsync, so commits/s is flat
+ * in the number of threads. With it, commits queued behind the fsync in
+ * flight all go out in the next one
+ */
+TEST (TT_PROFILE, pgr_bench_commit_scaling)
+{
+  struct
+  {
+    const char *label;
+    u32 commit_delay_us;
+  } configs[] = {
+    { "no delay", 0 },
+    { "200us", 200 },
+  };
+
+  for (u32 c = 0; c < arrlen (configs); ++c)
+    {
+      struct pgr_bench b;
+      struct pgr_params params = {
+        .commit_delay_us = configs[c].commit_delay_us,
+      };
+      test_err_t_wrap (pgr_bench_open (&b, params), &b.e);
+      test_err_t_wrap (pgr_bench_fill (&b, 16), &b.e);
+
+      for (u32 nthreads = 1; nthreads <= 16; nthreads *= 2)
+        {
+          pgr_bench_commit_run (&b, configs[c].label, nthreads);
+        }
+
+      test_err_t_wrap (pgr_bench_close (&b), &b.e);
+    }
+}
+
+#endif
+
+#endif
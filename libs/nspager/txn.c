@@ -32,6 +32,10 @@ txn_init (struct txn *dest, txid tid, struct txn_data data)
   dest->data = data;
   dest->tid = tid;
   dest->locks = NULL;
+  dest->unlogged = false;
+  dest->first_lsn = 0;
+  dest->extent_next = 0;
+  dest->extent_end = 0;
   hnode_init (&dest->node, tid);
   latch_init (&dest->l);
 }
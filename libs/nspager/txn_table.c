@@ -151,7 +151,7 @@ static void
 merge_txn (struct txn *tx, void *vctx)
 {
   struct merge_ctx *ctx = vctx;
-  ASSERT (ctx->txn_dest == NULL || ctx->txn_dest->size == sizeof (struct txn));
+  ASSERT (ctx->txn_dest == NULL || ctx->txn_dest->size == sizeof (struct txn *));
 
   if (ctx->e->cause_code)
     {
@@ -205,6 +205,7 @@ txnt_merge_into (
     .dest = dest,
     .e = e,
     .txn_dest = txn_dest,
+    .alloc = alloc,
   };
 
   latch_lock (&src->l);
@@ -346,7 +347,56 @@ txnt_max_u_undo_lsn (struct txn_table *t)
   return max;
 }
 
+static void
+find_min_first (struct txn *tx, void *vctx)
+{
+  lsn *min = vctx;
+
+  // Set before the transaction goes in the table and never again
+  if (tx->first_lsn < *min)
+    {
+      *min = tx->first_lsn;
+    }
+}
+
+lsn
+txnt_min_first_lsn (struct txn_table *t, lsn upper)
+{
+  lsn min = upper;
+
+  latch_lock (&t->l);
+  txnt_foreach (t, find_min_first, &min);
+  latch_unlock (&t->l);
+
+  return min;
+}
+
 #ifndef NTEST
+TEST (TT_UNIT, txnt_min_first_lsn)
+{
+  error e = error_create ();
+  struct txn_table t;
+  test_err_t_wrap (txnt_open (&t, &e), &e);
+
+  test_assert_int_equal (txnt_min_first_lsn (&t, 500), 500);
+
+  struct txn tx1, tx2;
+  txn_init (&tx1, 1, (struct txn_data){ .last_lsn = 300, .state = TX_RUNNING });
+  txn_init (&tx2, 2, (struct txn_data){ .last_lsn = 400, .state = TX_RUNNING });
+  tx1.first_lsn = 200;
+  tx2.first_lsn = 350;
+
+  test_err_t_wrap (txnt_insert_txn (&t, &tx1, &e), &e);
+  test_err_t_wrap (txnt_insert_txn (&t, &tx2, &e), &e);
+  test_assert_int_equal (txnt_min_first_lsn (&t, 500), 200);
+  test_assert_int_equal (txnt_min_first_lsn (&t, 100), 100);
+
+  test_err_t_wrap (txnt_remove_txn_expect (&t, &tx1, &e), &e);
+  test_assert_int_equal (txnt_min_first_lsn (&t, 500), 350);
+
+  txnt_close (&t);
+}
+
 TEST (TT_UNIT, txnt_max_u_undo_lsn_empty)
 {
   error e = error_create ();
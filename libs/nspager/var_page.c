@@ -248,7 +248,7 @@ TEST (TT_UNIT, vp_validate)
   TEST_CASE ("Overflow page requires next pointer")
   {
     page_init_empty (&sut, PG_VAR_PAGE);
-    vp_set_vlen (&sut, PAGE_SIZE);
+    vp_set_vlen (&sut, (u16)MIN (PAGE_SIZE, U16_MAX));
     vp_set_tlen (&sut, 5);
     vp_set_ovnext (&sut, PGNO_NULL);
     test_err_t_check (vp_validate_for_db (&sut, &e), ERR_CORRUPT, &e);
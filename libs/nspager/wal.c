@@ -70,6 +70,20 @@ wal_write_mode (struct wal *w, error *e)
   return walf_write_mode (&w->wf, e);
 }
 
+void
+wal_set_group_commit (struct wal *w, u64 delay_ns, u32 batch)
+{
+  DBG_ASSERT (wal, w);
+  walf_set_group_commit (&w->wf, delay_ns, batch);
+}
+
+void
+wal_set_segment_size (struct wal *w, u64 bytes)
+{
+  DBG_ASSERT (wal, w);
+  walf_set_segment_size (&w->wf, bytes);
+}
+
 //////////////////////////////////////////////////////////////
 //////// Append Primitives
 
@@ -262,6 +276,20 @@ wal_flush_all (struct wal *w, error *e)
   return walf_flush_all (&w->wf, e);
 }
 
+err_t
+wal_truncate (struct wal *w, lsn keep, error *e)
+{
+  DBG_ASSERT (wal, w);
+  return walf_truncate (&w->wf, keep, e);
+}
+
+void
+wal_get_stats (struct wal *w, struct wal_stats *dest)
+{
+  DBG_ASSERT (wal, w);
+  walf_get_stats (&w->wf, dest);
+}
+
 //////////////////////////////////////////////////////////////
 //////// Read Primitive
 
@@ -35,6 +35,8 @@ struct wal
 // Lifecycle
 err_t wal_open (struct wal *dest, const char *fname, error *e);
 void wal_set_thread_pool (struct wal *w, struct thread_pool *tp);
+void wal_set_group_commit (struct wal *w, u64 delay_ns, u32 batch); // Commit delay and group size - see wal_ostream
+void wal_set_segment_size (struct wal *w, u64 bytes);               // For a log that doesn't exist yet
 err_t wal_reset (struct wal *dest, error *e);
 err_t wal_close (struct wal *w, error *e);
 err_t wal_write_mode (struct wal *w, error *e);
@@ -43,6 +45,12 @@ err_t wal_write_mode (struct wal *w, error *e);
 err_t wal_flush_to (struct wal *w, lsn l, error *e);
 err_t wal_flush_all (struct wal *w, error *e);
 
+// TRUNCATE
+err_t wal_truncate (struct wal *w, lsn keep, error *e); // Segments wholly before [keep] are recycled
+
+// STATS
+void wal_get_stats (struct wal *w, struct wal_stats *dest);
+
 // READ
 struct wal_rec_hdr_read *wal_read_next (struct wal *w, lsn *read_lsn, error *e);
 struct wal_rec_hdr_read *wal_read_entry (struct wal *w, lsn id, error *e);
@@ -23,6 +23,8 @@
 #include <numstore/core/checksums.h>
 #include <numstore/core/error.h>
 #include <numstore/core/latch.h>
+#include <numstore/core/macros.h>
+#include <numstore/core/random.h>
 #include <numstore/intf/logging.h>
 #include <numstore/intf/os.h>
 #include <numstore/pager/dirty_page_table.h>
@@ -36,16 +38,77 @@ DEFINE_DBG_ASSERT (
       ASSERT (w);
     })
 
+/**
+ * Every log gets its own id - records checksum it along with their lsn
+ */
+static u64
+walf_new_log_id (void)
+{
+  struct timespec ts;
+  i_get_monotonic_time (&ts);
+  return ((u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec) ^ randu64 ();
+}
+
+static inline u32
+walf_checksum_init (const struct wal_file *w, lsn l)
+{
+  u32 checksum = checksum_init ();
+  checksum_execute (&checksum, (const u8 *)&w->ctl.log_id, sizeof (u64));
+  checksum_execute (&checksum, (const u8 *)&l, sizeof (lsn));
+  return checksum;
+}
+
+static inline err_t
+walf_lazy_ctl_init (struct wal_file *w, error *e)
+{
+  if (w->ctl_open)
+    {
+      return SUCCESS;
+    }
+
+  bool exists;
+  err_t_wrap (walctl_read (&w->ctl, &exists, w->fname, e), e);
+
+  if (!exists)
+    {
+      // A new log - segments without a control file belong to no log
+      err_t_wrap (walseg_remove_from (w->fname, 0, e), e);
+      w->ctl = (struct wal_ctl){
+        .log_id = walf_new_log_id (),
+        .seg_size = w->seg_size,
+        .start_lsn = 0,
+      };
+      err_t_wrap (walctl_write (w->fname, &w->ctl, e), e);
+      w->end_lsn = 0;
+      w->end_known = true;
+    }
+
+  w->ctl_open = true;
+  return SUCCESS;
+}
+
+static err_t walf_find_end (struct wal_file *w, error *e);
+
 static inline err_t
 walf_lazy_ostream_init (struct wal_file *w, error *e)
 {
   if (w->current_ostream == NULL)
     {
-      w->current_ostream = walos_open (w->fname, e);
+      err_t_wrap (walf_lazy_ctl_init (w, e), e);
+      if (!w->end_known)
+        {
+          err_t_wrap (walf_find_end (w, e), e);
+        }
+
+      w->current_ostream = walos_open (w->fname, w->ctl.seg_size, w->end_lsn, w->ctl.start_lsn / w->ctl.seg_size, e);
       if (w->current_ostream == NULL)
         {
           return e->cause_code;
         }
+      walos_set_group_commit (w->current_ostream, w->commit_delay_ns, w->commit_batch);
+
+      // Nothing says the pages are whole - first changes from here log full images
+      __atomic_store_n (&w->fpw_lsn, walos_get_next_lsn (w->current_ostream), __ATOMIC_RELEASE);
     }
   return SUCCESS;
 }
@@ -55,17 +118,35 @@ walf_lazy_istream_init (struct wal_file *w, error *e)
 {
   if (!w->istream_open)
     {
-      err_t_wrap (walis_open (&w->istream, w->fname, e), e);
+      err_t_wrap (walf_lazy_ctl_init (w, e), e);
+      err_t_wrap (walis_open (&w->istream, w->fname, w->ctl.seg_size, w->ctl.start_lsn, e), e);
       w->istream_open = true;
     }
   return SUCCESS;
 }
 
+static inline void
+walf_stats_add (struct wal_stats *dest, const struct wal_stats *src)
+{
+  dest->fsyncs += src->fsyncs;
+  dest->bytes += src->bytes;
+  dest->fsync_ns += src->fsync_ns;
+  dest->fsync_max_ns = MAX (dest->fsync_max_ns, src->fsync_max_ns);
+  dest->grouped += src->grouped;
+  dest->full_pages += src->full_pages;
+  dest->recycled += src->recycled;
+  dest->removed += src->removed;
+}
+
 static inline err_t
 walf_lazy_ostream_close (struct wal_file *w, error *e)
 {
   if (w->current_ostream != NULL)
     {
+      struct wal_stats s;
+      walos_get_stats (w->current_ostream, &s);
+      walf_stats_add (&w->retired, &s);
+
       err_t_wrap (walos_close (w->current_ostream, e), e);
       w->current_ostream = NULL;
     }
@@ -92,6 +173,15 @@ walf_open (struct wal_file *dest, const char *fname, error *e)
   dest->current_ostream = NULL;
   dest->istream_open = false;
   dest->fname = fname;
+  dest->retired = (struct wal_stats){ 0 };
+  dest->commit_delay_ns = (u64)WAL_COMMIT_DELAY_US * 1000;
+  dest->commit_batch = WAL_COMMIT_BATCH;
+  dest->fpw_lsn = 0;
+  dest->full_pages = 0;
+  dest->ctl_open = false;
+  dest->seg_size = WAL_SEGMENT_SIZE;
+  dest->end_lsn = 0;
+  dest->end_known = false;
 
   latch_init (&dest->l);
 
@@ -103,12 +193,59 @@ walf_open (struct wal_file *dest, const char *fname, error *e)
 err_t
 walf_reset (struct wal_file *dest, error *e)
 {
+  u64 delay_ns = dest->commit_delay_ns;
+  u32 batch = dest->commit_batch;
+  u64 seg_size = dest->seg_size;
+
   err_t_wrap (walf_close (dest, e), e);
+
+  // The old log's segments - from the start if the control file can't say where that is
+  struct wal_ctl ctl;
+  bool exists;
+  if (walctl_read (&ctl, &exists, dest->fname, e))
+    {
+      error_reset (e);
+      exists = false;
+    }
+  err_t_wrap (walseg_remove_from (dest->fname, exists ? ctl.start_lsn / ctl.seg_size : 0, e), e);
   err_t_wrap (i_remove_quiet (dest->fname, e), e);
+
   err_t_wrap (walf_open (dest, dest->fname, e), e);
+
+  walf_set_group_commit (dest, delay_ns, batch);
+  walf_set_segment_size (dest, seg_size);
   return SUCCESS;
 }
 
+void
+walf_set_group_commit (struct wal_file *w, u64 delay_ns, u32 batch)
+{
+  DBG_ASSERT (wal_file, w);
+
+  latch_lock (&w->l);
+  w->commit_delay_ns = delay_ns;
+  w->commit_batch = batch;
+  if (w->current_ostream != NULL)
+    {
+      walos_set_group_commit (w->current_ostream, delay_ns, batch);
+    }
+  latch_unlock (&w->l);
+}
+
+/**
+ * Only a log that doesn't exist yet takes it
+ */
+void
+walf_set_segment_size (struct wal_file *w, u64 bytes)
+{
+  DBG_ASSERT (wal_file, w);
+  ASSERT (bytes > 0);
+
+  latch_lock (&w->l);
+  w->seg_size = bytes;
+  latch_unlock (&w->l);
+}
+
 err_t
 walf_close (struct wal_file *w, error *e)
 {
@@ -136,18 +273,52 @@ walf_write_update (struct wal_file *w, const struct wal_rec_hdr_write *r, error
 {
   DBG_ASSERT (wal_file, w);
 
+  /**
+   * Only the bytes that changed if that's small enough - otherwise both
+   * images. Same for the first change to the page since a checkpoint
+   * began. [fpw_lsn] only moves forward, so a page that needs images
+   * here still does under the latch - the other way round is checked again
+   */
+  u8 undo[WL_DELTA_MAX];
+  u8 redo[WL_DELTA_MAX];
+  u32 dlen = 0;
+  bool delta = !r->update.full
+               && r->update.page_lsn >= __atomic_load_n (&w->fpw_lsn, __ATOMIC_ACQUIRE)
+               && wal_delta_encode (undo, redo, &dlen, r->update.undo, r->update.redo);
+
   latch_lock (&w->l);
 
   err_t_wrap_goto (walf_lazy_ostream_init (w, e), theend, e);
 
-  u32 checksum = checksum_init ();
-  wlh t = (wlh)r->type;
+  if (delta && r->update.page_lsn < w->fpw_lsn)
+    {
+      delta = false;
+    }
+  if (!delta && !r->update.full && r->update.page_lsn < w->fpw_lsn)
+    {
+      w->full_pages++;
+    }
+
+  u32 checksum = walf_checksum_init (w, walos_get_next_lsn (w->current_ostream));
+  wlh t = delta ? WLH_UPDATE_DELTA : (wlh)r->type;
   err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &t, sizeof (wlh), e), theend, e);
   err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &r->update.tid, sizeof (txid), e), theend, e);
   err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &r->update.prev, sizeof (lsn), e), theend, e);
   err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &r->update.pg, sizeof (pgno), e), theend, e);
-  err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, r->update.undo, PAGE_SIZE, e), theend, e);
-  err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, r->update.redo, PAGE_SIZE, e), theend, e);
+  if (delta)
+    {
+      err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &dlen, sizeof (u32), e), theend, e);
+      if (dlen > 0)
+        {
+          err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, undo, dlen, e), theend, e);
+          err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, redo, dlen, e), theend, e);
+        }
+    }
+  else
+    {
+      err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, r->update.undo, PAGE_SIZE, e), theend, e);
+      err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, r->update.redo, PAGE_SIZE, e), theend, e);
+    }
   err_t_wrap_goto (walos_write_all (w->current_ostream, NULL, &checksum, sizeof (u32), e), theend, e);
 
 theend:
@@ -166,14 +337,35 @@ walf_write_clr (struct wal_file *w, const struct wal_rec_hdr_write *r, error *e)
 
   err_t_wrap_goto (walf_lazy_ostream_init (w, e), theend, e);
 
-  u32 checksum = checksum_init ();
-  wlh t = r->type;
+  // Like updates - the first change since a checkpoint logs the whole page
+  bool delta = r->clr.delta;
+  const u8 *redo = r->clr.redo;
+  if (delta && r->clr.image != NULL && r->clr.page_lsn < w->fpw_lsn)
+    {
+      delta = false;
+      redo = r->clr.image;
+      w->full_pages++;
+    }
+
+  u32 checksum = walf_checksum_init (w, walos_get_next_lsn (w->current_ostream));
+  wlh t = delta ? WLH_CLR_DELTA : (wlh)r->type;
   err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &t, sizeof (wlh), e), theend, e);
   err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &r->clr.tid, sizeof (txid), e), theend, e);
   err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &r->clr.prev, sizeof (lsn), e), theend, e);
   err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &r->clr.pg, sizeof (pgno), e), theend, e);
   err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &r->clr.undo_next, sizeof (lsn), e), theend, e);
-  err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, r->clr.redo, PAGE_SIZE, e), theend, e);
+  if (delta)
+    {
+      err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &r->clr.dlen, sizeof (u32), e), theend, e);
+      if (r->clr.dlen > 0)
+        {
+          err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, redo, r->clr.dlen, e), theend, e);
+        }
+    }
+  else
+    {
+      err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, redo, PAGE_SIZE, e), theend, e);
+    }
   err_t_wrap_goto (walos_write_all (w->current_ostream, NULL, &checksum, sizeof (u32), e), theend, e);
 
 theend:
@@ -191,7 +383,7 @@ walf_write_begin (struct wal_file *w, const struct wal_rec_hdr_write *r, error *
 
   err_t_wrap_goto (walf_lazy_ostream_init (w, e), theend, e);
 
-  u32 checksum = checksum_init ();
+  u32 checksum = walf_checksum_init (w, walos_get_next_lsn (w->current_ostream));
   wlh t = r->type;
   err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &t, sizeof (wlh), e), theend, e);
   err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &r->begin.tid, sizeof (txid), e), theend, e);
@@ -212,7 +404,7 @@ walf_write_commit (struct wal_file *w, const struct wal_rec_hdr_write *r, error
 
   err_t_wrap_goto (walf_lazy_ostream_init (w, e), theend, e);
 
-  u32 checksum = checksum_init ();
+  u32 checksum = walf_checksum_init (w, walos_get_next_lsn (w->current_ostream));
   wlh t = r->type;
   txid tid = r->commit.tid;
   lsn prev = r->commit.prev;
@@ -237,7 +429,7 @@ walf_write_end (struct wal_file *w, const struct wal_rec_hdr_write *r, error *e)
 
   err_t_wrap_goto (walf_lazy_ostream_init (w, e), theend, e);
 
-  u32 checksum = checksum_init ();
+  u32 checksum = walf_checksum_init (w, walos_get_next_lsn (w->current_ostream));
   wlh t = r->type;
   txid tid = r->end.tid;
   lsn prev = r->end.prev;
@@ -262,7 +454,10 @@ walf_write_ckpt_begin (struct wal_file *w, const struct wal_rec_hdr_write *r, er
 
   err_t_wrap_goto (walf_lazy_ostream_init (w, e), theend, e);
 
-  u32 checksum = checksum_init ();
+  // Pages changed before here might be torn by the flush this checkpoint starts
+  __atomic_store_n (&w->fpw_lsn, walos_get_next_lsn (w->current_ostream), __ATOMIC_RELEASE);
+
+  u32 checksum = walf_checksum_init (w, walos_get_next_lsn (w->current_ostream));
   wlh t = r->type;
   err_t_wrap_goto (walos_write_all (w->current_ostream, &checksum, &t, sizeof (wlh), e), theend, e);
   err_t_wrap_goto (walos_write_all (w->current_ostream, NULL, &checksum, sizeof (u32), e), theend, e);
@@ -313,7 +508,7 @@ walf_write_ckpt_end (struct wal_file *w, const struct wal_rec_hdr_write *r, erro
             latch_unlock (&r->ckpt_end.att->l);
             goto theend;
           }
-        txnt_serialize (att_serialized, attsize, r->ckpt_end.att);
+        dpgt_serialize (dpgt_serialized, dptsize, r->ckpt_end.dpt);
       }
 
     latch_unlock (&r->ckpt_end.dpt->l);
@@ -328,7 +523,7 @@ walf_write_ckpt_end (struct wal_file *w, const struct wal_rec_hdr_write *r, erro
         goto theend;
       }
 
-    u32 checksum = checksum_init ();
+    u32 checksum = walf_checksum_init (w, walos_get_next_lsn (w->current_ostream));
     wlh t = r->type;
 
     if (walos_write_all (w->current_ostream, &checksum, &t, sizeof (wlh), e))
@@ -438,6 +633,8 @@ walf_write (struct wal_file *w, const struct wal_rec_hdr_write *r, error *e)
       }
     }
 
+  walos_mark_end_log (w->current_ostream);
+
   return ret;
 }
 
@@ -477,6 +674,12 @@ walf_read_ckpt_end_full (
     dptsize = sizes[1];
   }
 
+  // Sizes aren't covered by the checksum until the whole record is in
+  if ((u64)attsize + dptsize > U32_MAX / 2)
+    {
+      return error_causef (e, ERR_CORRUPT, "Checkpoint tables of %" PRIu32 " + %" PRIu32 " bytes", attsize, dptsize);
+    }
+
   u32 size = sizeof (type)       // Header
              + 2 * sizeof (u32)  // sizes
              + attsize + dptsize // data
@@ -645,6 +848,110 @@ walf_read_clr (struct wal_file *w, u32 *checksum, struct wal_rec_hdr_read *r, er
   return SUCCESS;
 }
 
+/**
+ * Next [len] bytes of a variable length record. WL_EOF if the log
+ * ends first
+ */
+static inline int
+walf_read_part (struct wal_file *w, u32 *checksum, void *dest, u32 len, error *e)
+{
+  if (len == 0)
+    {
+      return SUCCESS;
+    }
+
+  bool iseof;
+  err_t_wrap (walis_read_all (&w->istream, &iseof, NULL, checksum, dest, len, e), e);
+  return iseof ? WL_EOF : SUCCESS;
+}
+
+static inline int
+walf_read_checksum (struct wal_file *w, u32 checksum, error *e)
+{
+  u32 actual_crc;
+  int ret = walf_read_part (w, NULL, &actual_crc, sizeof (u32), e);
+  if (ret == SUCCESS && checksum != actual_crc)
+    {
+      return error_causef (e, ERR_CORRUPT, "Invalid CRC");
+    }
+  return ret;
+}
+
+static inline err_t
+walf_read_delta_len (u32 dlen, error *e)
+{
+  if (dlen > WL_DELTA_MAX)
+    {
+      return error_causef (e, ERR_CORRUPT, "Delta of %" PRIu32 " bytes is too long", dlen);
+    }
+  return SUCCESS;
+}
+
+/**
+ * [ tid ][ prev ][ pg ][ dlen ][ undo delta ][ redo delta ][ checksum ]
+ */
+static inline err_t
+walf_read_update_delta (struct wal_file *w, u32 *checksum, struct wal_rec_hdr_read *r, error *e)
+{
+  DBG_ASSERT (wal_file, w);
+  ASSERT (r->type == WL_UPDATE);
+
+  r->update.delta = true;
+
+  int ret = walf_read_part (w, checksum, &r->update.tid, sizeof (txid), e);
+  ret = ret ? ret : walf_read_part (w, checksum, &r->update.prev, sizeof (lsn), e);
+  ret = ret ? ret : walf_read_part (w, checksum, &r->update.pg, sizeof (pgno), e);
+  ret = ret ? ret : walf_read_part (w, checksum, &r->update.dlen, sizeof (u32), e);
+  ret = ret ? ret : walf_read_delta_len (r->update.dlen, e);
+  ret = ret ? ret : walf_read_part (w, checksum, r->update.undo, r->update.dlen, e);
+  ret = ret ? ret : walf_read_part (w, checksum, r->update.redo, r->update.dlen, e);
+  ret = ret ? ret : walf_read_checksum (w, *checksum, e);
+  err_t_wrap (ret, e);
+
+  if (ret == WL_EOF)
+    {
+      r->type = WL_EOF;
+      return SUCCESS;
+    }
+
+  err_t_wrap (wal_delta_validate (r->update.undo, r->update.dlen, e), e);
+  err_t_wrap (wal_delta_validate (r->update.redo, r->update.dlen, e), e);
+
+  return SUCCESS;
+}
+
+/**
+ * [ tid ][ prev ][ pg ][ undo_next ][ dlen ][ redo delta ][ checksum ]
+ */
+static inline err_t
+walf_read_clr_delta (struct wal_file *w, u32 *checksum, struct wal_rec_hdr_read *r, error *e)
+{
+  DBG_ASSERT (wal_file, w);
+  ASSERT (r->type == WL_CLR);
+
+  r->clr.delta = true;
+
+  int ret = walf_read_part (w, checksum, &r->clr.tid, sizeof (txid), e);
+  ret = ret ? ret : walf_read_part (w, checksum, &r->clr.prev, sizeof (lsn), e);
+  ret = ret ? ret : walf_read_part (w, checksum, &r->clr.pg, sizeof (pgno), e);
+  ret = ret ? ret : walf_read_part (w, checksum, &r->clr.undo_next, sizeof (lsn), e);
+  ret = ret ? ret : walf_read_part (w, checksum, &r->clr.dlen, sizeof (u32), e);
+  ret = ret ? ret : walf_read_delta_len (r->clr.dlen, e);
+  ret = ret ? ret : walf_read_part (w, checksum, r->clr.redo, r->clr.dlen, e);
+  ret = ret ? ret : walf_read_checksum (w, *checksum, e);
+  err_t_wrap (ret, e);
+
+  if (ret == WL_EOF)
+    {
+      r->type = WL_EOF;
+      return SUCCESS;
+    }
+
+  err_t_wrap (wal_delta_validate (r->clr.redo, r->clr.dlen, e), e);
+
+  return SUCCESS;
+}
+
 static inline err_t
 walf_read_begin (struct wal_file *w, u32 *checksum, struct wal_rec_hdr_read *r, error *e)
 {
@@ -774,101 +1081,80 @@ walf_read_ckpt_end (struct wal_file *w, u32 *checksum, struct wal_rec_hdr_read *
   return SUCCESS;
 }
 
-err_t
-walf_pread (struct wal_rec_hdr_read *dest, struct wal_file *w, lsn ofst, error *e)
+/**
+ * The rest of a record whose type [t] was just read
+ */
+static err_t
+walf_read_rec (struct wal_file *w, u32 *checksum, struct wal_rec_hdr_read *dest, wlh t, error *e)
 {
-  DBG_ASSERT (wal_file, w);
-  err_t_wrap (walf_lazy_istream_init (w, e), e);
-
-  wlh t;
-  u32 checksum = checksum_init ();
-  lsn rlsn;
-  err_t_wrap (walis_seek (&w->istream, ofst, e), e);
-
-  // Do read or terminate early
-  {
-    walis_mark_start_log (&w->istream);
-    bool iseof;
-    err_t_wrap (walis_read_all (&w->istream, &iseof, &rlsn, &checksum, &t, sizeof (t), e), e);
-    if (iseof)
-      {
-        dest->type = WL_EOF;
-        return SUCCESS;
-      }
-  }
-
   switch (t)
     {
     case WL_UPDATE:
       {
         dest->type = t;
-        err_t_wrap (walf_read_update (w, &checksum, dest, e), e);
-        break;
+        return walf_read_update (w, checksum, dest, e);
       }
     case WL_CLR:
       {
         dest->type = t;
-        err_t_wrap (walf_read_clr (w, &checksum, dest, e), e);
-        break;
+        return walf_read_clr (w, checksum, dest, e);
+      }
+    case WLH_UPDATE_DELTA:
+      {
+        dest->type = WL_UPDATE;
+        return walf_read_update_delta (w, checksum, dest, e);
+      }
+    case WLH_CLR_DELTA:
+      {
+        dest->type = WL_CLR;
+        return walf_read_clr_delta (w, checksum, dest, e);
       }
     case WL_BEGIN:
       {
         dest->type = t;
-        err_t_wrap (walf_read_begin (w, &checksum, dest, e), e);
-        break;
+        return walf_read_begin (w, checksum, dest, e);
       }
     case WL_COMMIT:
       {
         dest->type = t;
-        err_t_wrap (walf_read_commit (w, &checksum, dest, e), e);
-        break;
+        return walf_read_commit (w, checksum, dest, e);
       }
     case WL_END:
       {
         dest->type = t;
-        err_t_wrap (walf_read_end (w, &checksum, dest, e), e);
-        break;
+        return walf_read_end (w, checksum, dest, e);
       }
     case WL_CKPT_BEGIN:
       {
         dest->type = t;
-        err_t_wrap (walf_read_ckpt_begin (w, &checksum, dest, e), e);
-        break;
+        return walf_read_ckpt_begin (w, checksum, dest, e);
       }
     case WL_CKPT_END:
       {
         dest->type = t;
-        err_t_wrap (walf_read_ckpt_end (w, &checksum, dest, e), e);
-        break;
+        return walf_read_ckpt_end (w, checksum, dest, e);
       }
     default:
       {
         return error_causef (e, ERR_CORRUPT, "Invalid wal header type");
       }
     }
-
-  walis_mark_end_log (&w->istream);
-
-  i_log_trace ("PRead wal:\n");
-  i_log_wal_rec_hdr_read (LOG_TRACE, dest);
-
-  return SUCCESS;
 }
 
 err_t
-walf_read (struct wal_rec_hdr_read *dest, lsn *rlsn, struct wal_file *w, error *e)
+walf_pread (struct wal_rec_hdr_read *dest, struct wal_file *w, lsn ofst, error *e)
 {
   DBG_ASSERT (wal_file, w);
   err_t_wrap (walf_lazy_istream_init (w, e), e);
 
   wlh t;
-  u32 checksum = checksum_init ();
+  err_t_wrap (walis_seek (&w->istream, ofst, e), e);
 
   // Do read or terminate early
   {
     walis_mark_start_log (&w->istream);
     bool iseof;
-    err_t_wrap (walis_read_all (&w->istream, &iseof, rlsn, &checksum, &t, sizeof (t), e), e);
+    err_t_wrap (walis_read_all (&w->istream, &iseof, NULL, NULL, &t, sizeof (t), e), e);
     if (iseof)
       {
         dest->type = WL_EOF;
@@ -876,55 +1162,66 @@ walf_read (struct wal_rec_hdr_read *dest, lsn *rlsn, struct wal_file *w, error *
       }
   }
 
-  switch (t)
+  u32 checksum = walf_checksum_init (w, ofst);
+  checksum_execute (&checksum, &t, sizeof (t));
+  err_t_wrap (walf_read_rec (w, &checksum, dest, t, e), e);
+
+  walis_mark_end_log (&w->istream);
+
+  i_log_trace ("PRead wal:\n");
+  i_log_wal_rec_hdr_read (LOG_TRACE, dest);
+
+  return SUCCESS;
+}
+
+/**
+ * The log ends at the first record that doesn't check out - one a crash
+ * cut off, zeros past the last write, or whatever a reused segment held
+ */
+err_t
+walf_read (struct wal_rec_hdr_read *dest, lsn *rlsn, struct wal_file *w, error *e)
+{
+  DBG_ASSERT (wal_file, w);
+  err_t_wrap (walf_lazy_istream_init (w, e), e);
+
+  wlh t;
+  lsn at;
+  bool iseof;
+
+  walis_mark_start_log (&w->istream);
+  err_t_wrap (walis_read_all (&w->istream, &iseof, &at, NULL, &t, sizeof (t), e), e);
+  if (rlsn)
     {
-    case WL_UPDATE:
-      {
-        dest->type = t;
-        err_t_wrap (walf_read_update (w, &checksum, dest, e), e);
-        break;
-      }
-    case WL_CLR:
-      {
-        dest->type = t;
-        err_t_wrap (walf_read_clr (w, &checksum, dest, e), e);
-        break;
-      }
-    case WL_BEGIN:
-      {
-        dest->type = t;
-        err_t_wrap (walf_read_begin (w, &checksum, dest, e), e);
-        break;
-      }
-    case WL_COMMIT:
-      {
-        dest->type = t;
-        err_t_wrap (walf_read_commit (w, &checksum, dest, e), e);
-        break;
-      }
-    case WL_END:
-      {
-        dest->type = t;
-        err_t_wrap (walf_read_end (w, &checksum, dest, e), e);
-        break;
-      }
-    case WL_CKPT_BEGIN:
-      {
-        dest->type = t;
-        err_t_wrap (walf_read_ckpt_begin (w, &checksum, dest, e), e);
-        break;
-      }
-    case WL_CKPT_END:
-      {
-        dest->type = t;
-        err_t_wrap (walf_read_ckpt_end (w, &checksum, dest, e), e);
-        break;
-      }
-    default:
-      {
-        err_t_wrap (error_causef (e, ERR_CORRUPT, "Invalid wal header type"), e);
-        break;
-      }
+      *rlsn = at;
+    }
+
+  if (iseof)
+    {
+      dest->type = WL_EOF;
+    }
+  else
+    {
+      u32 checksum = walf_checksum_init (w, at);
+      checksum_execute (&checksum, &t, sizeof (t));
+
+      error_silence (e);
+      err_t ret = walf_read_rec (w, &checksum, dest, t, e);
+      error_silence_reset (e);
+
+      if (ret == ERR_CORRUPT)
+        {
+          i_log_debug ("Log ends at %" PRlsn ": %s\n", at, e->cause_msg);
+          error_reset (e);
+          dest->type = WL_EOF;
+        }
+      err_t_wrap (e->cause_code, e);
+    }
+
+  if (dest->type == WL_EOF)
+    {
+      w->end_lsn = at;
+      w->end_known = true;
+      return SUCCESS;
     }
 
   walis_mark_end_log (&w->istream);
@@ -934,6 +1231,42 @@ walf_read (struct wal_rec_hdr_read *dest, lsn *rlsn, struct wal_file *w, error *
   return SUCCESS;
 }
 
+/**
+ * Nothing has read the log to its end - do it now, from its start
+ */
+static err_t
+walf_find_end (struct wal_file *w, error *e)
+{
+  struct wal_rec_hdr_read *r = i_malloc (1, sizeof *r, e);
+  if (r == NULL)
+    {
+      return e->cause_code;
+    }
+
+  err_t_wrap_goto (walf_lazy_istream_init (w, e), theend, e);
+  err_t_wrap_goto (walis_seek (&w->istream, w->ctl.start_lsn, e), theend, e);
+
+  do
+    {
+      err_t_wrap_goto (walf_read (r, NULL, w, e), theend, e);
+
+      if (r->type == WL_CKPT_END)
+        {
+          txnt_close (&r->ckpt_end.att);
+          dpgt_close (&r->ckpt_end.dpt);
+          if (r->ckpt_end.txn_bank)
+            {
+              i_free (r->ckpt_end.txn_bank);
+            }
+        }
+    }
+  while (r->type != WL_EOF);
+
+theend:
+  i_free (r);
+  return e->cause_code;
+}
+
 err_t
 walf_flush_to (struct wal_file *w, lsn l, error *e)
 {
@@ -950,6 +1283,51 @@ walf_flush_all (struct wal_file *w, error *e)
   return walos_flush_all (w->current_ostream, e);
 }
 
+/**
+ * The control file moves first - once it says the log starts at [keep]
+ * nothing reads the segments below it
+ */
+err_t
+walf_truncate (struct wal_file *w, lsn keep, error *e)
+{
+  DBG_ASSERT (wal_file, w);
+
+  latch_lock (&w->l);
+
+  err_t_wrap_goto (walf_lazy_ostream_init (w, e), theend, e);
+
+  if (keep / w->ctl.seg_size > w->ctl.start_lsn / w->ctl.seg_size)
+    {
+      struct wal_ctl ctl = w->ctl;
+      ctl.start_lsn = keep;
+      err_t_wrap_goto (walctl_write (w->fname, &ctl, e), theend, e);
+      w->ctl = ctl;
+
+      err_t_wrap_goto (walos_recycle (w->current_ostream, keep, e), theend, e);
+    }
+
+theend:
+  latch_unlock (&w->l);
+  return e->cause_code;
+}
+
+void
+walf_get_stats (struct wal_file *w, struct wal_stats *dest)
+{
+  DBG_ASSERT (wal_file, w);
+
+  latch_lock (&w->l);
+  *dest = w->retired;
+  if (w->current_ostream != NULL)
+    {
+      struct wal_stats s;
+      walos_get_stats (w->current_ostream, &s);
+      walf_stats_add (dest, &s);
+    }
+  dest->full_pages = w->full_pages;
+  latch_unlock (&w->l);
+}
+
 #ifndef NTEST
 err_t
 walf_crash (struct wal_file *w, error *e)
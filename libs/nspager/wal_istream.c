@@ -14,7 +14,7 @@
  * limitations under the License.
  *
  * Description:
- *   Implements wal_stream.h. Input stream operations for reading WAL records sequentially with buffering.
+ *   Implements wal_stream.h. Input stream operations for reading WAL records out of the segment files.
  */
 
 #include <numstore/core/assert.h>
@@ -30,32 +30,22 @@ DEFINE_DBG_ASSERT (
     struct wal_istream, wal_istream, w,
     {
       ASSERT (w);
+      ASSERT (w->seg_size > 0);
     })
 
 ///////////////////////////////////////////////////////
 /// LOGR Mode
 
 err_t
-walis_open (struct wal_istream *dest, const char *fname, error *e)
+walis_open (struct wal_istream *dest, const char *fname, u64 seg_size, lsn start, error *e)
 {
   ASSERT (dest);
 
-  err_t_wrap (i_open_rw (&dest->fd, fname, e), e);
-
-  i64 len = i_file_size (&dest->fd, e);
-  if (len < 0)
-    {
-      i_close (&dest->fd, e);
-      return e->cause_code;
-    }
-
-  if (i_seek (&dest->fd, 0, I_SEEK_SET, e) < 0)
-    {
-      i_close (&dest->fd, e);
-      return e->cause_code;
-    }
-
-  dest->curlsn = 0;
+  dest->fname = fname;
+  dest->seg_size = seg_size;
+  dest->seg = 0;
+  dest->fd_open = false;
+  dest->curlsn = start;
   dest->lsnidx = 0;
   latch_init (&dest->latch);
 
@@ -64,11 +54,22 @@ walis_open (struct wal_istream *dest, const char *fname, error *e)
   return SUCCESS;
 }
 
+static err_t
+walis_close_seg (struct wal_istream *w, error *e)
+{
+  if (w->fd_open)
+    {
+      w->fd_open = false;
+      return i_close (&w->fd, e);
+    }
+  return SUCCESS;
+}
+
 err_t
 walis_close (struct wal_istream *w, error *e)
 {
   DBG_ASSERT (wal_istream, w);
-  return i_close (&w->fd, e);
+  return walis_close_seg (w, e);
 }
 
 ///////////////////////////////////////////////////////
@@ -81,19 +82,7 @@ walis_seek (struct wal_istream *w, u64 pos, error *e)
 
   DBG_ASSERT (wal_istream, w);
 
-  i64 res = i_seek (&w->fd, pos, I_SEEK_SET, e);
-  if (res < 0)
-    {
-      latch_unlock (&w->latch);
-      return e->cause_code;
-    }
-
-  if ((u64)res != pos)
-    {
-      latch_unlock (&w->latch);
-      return error_causef (e, ERR_CORRUPT, "Tried to seek to an invalid spot");
-    }
-
+  // Nothing to check - a missing segment reads as the end of the log
   w->curlsn = pos;
 
   latch_unlock (&w->latch);
@@ -109,6 +98,26 @@ walis_mark_start_log (struct wal_istream *w)
   latch_unlock (&w->latch);
 }
 
+/**
+ * Switch the open segment to [seg]. False if there isn't one
+ */
+static err_t
+walis_use_seg (struct wal_istream *w, bool *exists, u64 seg, error *e)
+{
+  if (w->fd_open && w->seg == seg)
+    {
+      *exists = true;
+      return SUCCESS;
+    }
+
+  err_t_wrap (walis_close_seg (w, e), e);
+  err_t_wrap (walseg_open (&w->fd, exists, w->fname, seg, e), e);
+  w->fd_open = *exists;
+  w->seg = seg;
+
+  return SUCCESS;
+}
+
 err_t
 walis_read_all (struct wal_istream *w, bool *iseof, lsn *rlsn, u32 *checksum, void *data, u32 len, error *e)
 {
@@ -122,33 +131,38 @@ walis_read_all (struct wal_istream *w, bool *iseof, lsn *rlsn, u32 *checksum, vo
       *rlsn = w->curlsn;
     }
 
-  i64 bread = i_read_all (&w->fd, data, len, e);
-  if (bread < 0)
+  // A record can run across segments
+  u8 *dest = data;
+  u64 pos = w->curlsn + w->lsnidx;
+  for (u32 done = 0; done < len;)
     {
-      latch_unlock (&w->latch);
-      return e->cause_code;
-    }
+      u64 seg = pos / w->seg_size;
+      u64 ofst = pos % w->seg_size;
+      u32 toread = (u32)MIN ((u64)(len - done), w->seg_size - ofst);
 
-  if (bread < len)
-    {
-      // Hit EOF - incomplete record
-      // Truncate to where this record started (before any bytes were copied)
-      if (bread > 0)
+      bool exists;
+      err_t_wrap_goto (walis_use_seg (w, &exists, seg, e), theend, e);
+      if (!exists)
         {
-          if (i_truncate (&w->fd, w->curlsn, e))
-            {
-              latch_unlock (&w->latch);
-              return e->cause_code;
-            }
-          if (i_fsync (&w->fd, e))
-            {
-              latch_unlock (&w->latch);
-              return e->cause_code;
-            }
+          *iseof = true;
+          goto theend;
         }
-      *iseof = true;
-      latch_unlock (&w->latch);
-      return SUCCESS;
+
+      i64 bread = i_pread_all (&w->fd, dest + done, toread, ofst, e);
+      if (bread < 0)
+        {
+          goto theend;
+        }
+
+      // Short - a crash before the segment was preallocated
+      if (bread < toread)
+        {
+          *iseof = true;
+          goto theend;
+        }
+
+      done += toread;
+      pos += toread;
     }
 
   if (checksum)
@@ -158,9 +172,9 @@ walis_read_all (struct wal_istream *w, bool *iseof, lsn *rlsn, u32 *checksum, vo
 
   w->lsnidx += len;
 
+theend:
   latch_unlock (&w->latch);
-
-  return SUCCESS;
+  return e->cause_code;
 }
 
 void
@@ -178,6 +192,6 @@ err_t
 walis_crash (struct wal_istream *w, error *e)
 {
   DBG_ASSERT (wal_istream, w);
-  return i_close (&w->fd, e);
+  return walis_close_seg (w, e);
 }
 #endif
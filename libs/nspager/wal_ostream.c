@@ -25,6 +25,7 @@
 #include <numstore/intf/os.h>
 #include <numstore/intf/stdlib.h>
 #include <numstore/pager/wal_stream.h>
+#include <numstore/test/testing.h>
 
 DEFINE_DBG_ASSERT (
     struct wal_ostream, wal_ostream, w,
@@ -32,41 +33,103 @@ DEFINE_DBG_ASSERT (
       ASSERT (w);
     })
 
+// The flusher starts on the buffer as soon as one of these fills
+#define WAL_SLICE (WAL_BUFFER_CAP / WAL_BUFFERS)
+
+static void *walos_flusher (void *arg);
+
 ///////////////////////////////////////////////////////
 /// LOGR Mode
 
 struct wal_ostream *
-walos_open (const char *fname, error *e)
+walos_open (const char *fname, u64 seg_size, lsn end, u64 first_seg, error *e)
 {
+  ASSERT (seg_size > 0);
+  ASSERT (first_seg <= end / seg_size);
+
   struct wal_ostream *ret = i_malloc (1, sizeof *ret, e);
   if (ret == NULL)
     {
       return NULL;
     }
 
-  if (i_open_w (&ret->fd, fname, e))
-    {
-      i_free (ret);
-      return NULL;
-    }
-
-  i64 len = i_seek (&ret->fd, 0, I_SEEK_END, e);
-
-  if (len < 0)
-    {
-      i_close (&ret->fd, e);
-      i_free (ret);
-      return NULL;
-    }
+  ret->fname = fname;
+  ret->seg_size = seg_size;
+  ret->seg = end / seg_size;
+  ret->first_seg = first_seg;
+  ret->last_seg = ret->seg;
+
+  /**
+   * Nothing past [end] is log. Zero the rest of its segment and drop the
+   * segments after it - records a crash left whole behind one it cut off
+   * mustn't turn up after the next records go in. Spares go with them
+   */
+  err_t_wrap_goto (walseg_create (&ret->fd, fname, ret->seg, seg_size, e), failed, e);
+  err_t_wrap_goto (i_truncate (&ret->fd, end % seg_size, e), failed_fd, e);
+  err_t_wrap_goto (i_fallocate (&ret->fd, seg_size, e), failed_fd, e);
+  err_t_wrap_goto (walseg_remove_from (fname, ret->seg + 1, e), failed_fd, e);
+
+  err_t_wrap_goto (i_aio_open (&ret->aio, 3, e), failed_fd, e);
+  err_t_wrap_goto (i_timer_create (&ret->timer, e), failed_aio, e);
+  ret->stats = (struct wal_stats){ 0 };
+
+  err_t_wrap_goto (i_mutex_create (&ret->gl, e), failed_timer, e);
+  err_t_wrap_goto (i_cond_create (&ret->flushed, e), failed_gl, e);
+  err_t_wrap_goto (i_cond_create (&ret->work, e), failed_flushed, e);
+  err_t_wrap_goto (i_mutex_create (&ret->sl, e), failed_work, e);
 
   latch_init (&ret->l);
 
   ret->buffer = cbuffer_create (ret->_buffer, sizeof (ret->_buffer));
-  ret->flushed_lsn = len;
+  ret->flushed_lsn = end;
+  ret->rec_end = end;
+
+  ret->flushing = false;
+  ret->durable_lsn = end;
+  ret->requested = end;
+  ret->nwaiting = 0;
+  ret->nflushes = 0;
+  ret->commit_delay_ns = (u64)WAL_COMMIT_DELAY_US * 1000;
+  ret->commit_batch = WAL_COMMIT_BATCH;
+
+  ret->closing = false;
+  ret->failed = false;
+  ret->ferr = error_create ();
+  err_t_wrap_goto (i_thread_create (&ret->flusher, walos_flusher, ret, e), failed_sl, e);
 
   DBG_ASSERT (wal_ostream, ret);
 
   return ret;
+
+failed_sl:
+  i_mutex_free (&ret->sl);
+failed_work:
+  i_cond_free (&ret->work);
+failed_flushed:
+  i_cond_free (&ret->flushed);
+failed_gl:
+  i_mutex_free (&ret->gl);
+failed_timer:
+  i_timer_free (&ret->timer);
+failed_aio:
+  i_aio_close (&ret->aio);
+failed_fd:
+  i_close (&ret->fd, e);
+failed:
+  i_free (ret);
+  return NULL;
+}
+
+// Waits out a flush in flight - whatever is still buffered stays there
+static void
+walos_stop_flusher (struct wal_ostream *w, error *e)
+{
+  i_mutex_lock (&w->gl);
+  w->closing = true;
+  i_cond_signal (&w->work);
+  i_mutex_unlock (&w->gl);
+
+  i_thread_join (&w->flusher, e);
 }
 
 err_t
@@ -74,68 +137,348 @@ walos_close (struct wal_ostream *w, error *e)
 {
   DBG_ASSERT (wal_ostream, w);
 
-  walos_flush_to (w, w->flushed_lsn + cbuffer_len (&w->buffer), e);
+  walos_flush_all (w, e);
+  walos_stop_flusher (w, e);
+  i_mutex_free (&w->sl);
+  i_cond_free (&w->work);
+  i_cond_free (&w->flushed);
+  i_mutex_free (&w->gl);
+  i_timer_free (&w->timer);
+  i_aio_close (&w->aio);
   i_close (&w->fd, e);
   i_free (w);
 
   return e->cause_code;
 }
 
+void
+walos_set_group_commit (struct wal_ostream *w, u64 delay_ns, u32 batch)
+{
+  DBG_ASSERT (wal_ostream, w);
+
+  i_mutex_lock (&w->gl);
+  w->commit_delay_ns = delay_ns;
+  w->commit_batch = MAX (batch, 1u);
+  i_mutex_unlock (&w->gl);
+}
+
 ///////////////////////////////////////////////////////
 /// LOGW Mode
 
+/**
+ * One fsync (and the writes linked in front of it) that took [elapsed].
+ * Stats readers race with it, so the max only ever moves up by CAS
+ */
+static inline void
+walos_stat_fsync (struct wal_ostream *w, u64 elapsed)
+{
+  __atomic_fetch_add (&w->stats.fsyncs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add (&w->stats.fsync_ns, elapsed, __ATOMIC_RELAXED);
+
+  u64 max = __atomic_load_n (&w->stats.fsync_max_ns, __ATOMIC_RELAXED);
+  while (elapsed > max)
+    {
+      if (__atomic_compare_exchange_n (&w->stats.fsync_max_ns, &max, elapsed, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+          break;
+        }
+    }
+}
+
+/**
+ * Flusher holds gl. With a commit delay set, give other committers
+ * a chance to join the flush - but only if someone is already queued
+ * behind the first, a lone committer shouldn't pay for it
+ */
+static void
+walos_gather (struct wal_ostream *w)
+{
+  if (w->commit_delay_ns == 0 || w->nwaiting < 2)
+    {
+      return;
+    }
+
+  u64 deadline = i_timer_now_ns (&w->timer) + w->commit_delay_ns;
+  while (w->nwaiting < w->commit_batch)
+    {
+      u64 now = i_timer_now_ns (&w->timer);
+      if (now >= deadline)
+        {
+          return;
+        }
+      i_cond_timedwait (&w->work, &w->gl, deadline - now);
+    }
+}
+
+/**
+ * Flusher. Move [fd] on to the next segment - a spare if one was renamed
+ * there. The last one was synced by the flush that filled it
+ */
 static err_t
-walos_flush_to_impl (struct wal_ostream *w, lsn l, bool lock, error *e)
+walos_next_seg (struct wal_ostream *w, error *e)
 {
-  DBG_ASSERT (wal_ostream, w);
+  i_file fd;
 
-  if (lock)
+  i_mutex_lock (&w->sl);
+
+  err_t ret = walseg_create (&fd, w->fname, w->seg + 1, w->seg_size, e);
+  if (ret == SUCCESS)
     {
-      latch_lock (&w->l);
+      i_close (&w->fd, e);
+      w->fd = fd;
+      w->seg++;
+      w->last_seg = MAX (w->last_seg, w->seg);
+      ret = e->cause_code;
     }
 
-  ASSERTF (l <= w->flushed_lsn + cbuffer_len (&w->buffer),
-           "Trying to flush past a written lsn. Attempt: %" PRlsn " actual last lsn: %" PRlsn "\n",
-           l, w->flushed_lsn + cbuffer_len (&w->buffer));
+  i_mutex_unlock (&w->sl);
 
-  // i_log_debug ("Flushing the WAL to lsn: %" PRlsn "\n", l);
+  return ret;
+}
+
+/**
+ * Flusher, without gl. Writes out everything buffered right now (it may
+ * wrap, so up to two writes) with the fsync linked behind it - one
+ * submission per segment it lands in. Appends keep going into the free
+ * space meanwhile, the bytes in flight aren't consumed until it's done
+ */
+static err_t
+walos_write_out (struct wal_ostream *w, u32 *towrite, lsn *rec_end, error *e)
+{
+  struct bytes segs[2];
+
+  latch_lock (&w->l);
+  *towrite = cbuffer_len (&w->buffer);
+  *rec_end = w->rec_end;
+  u64 ofst = w->flushed_lsn;
+  u32 nsegs = cbuffer_data_segments (segs, &w->buffer, *towrite);
+  latch_unlock (&w->l);
 
-  if (l > w->flushed_lsn)
+  u32 i = 0;
+  u32 done = 0; // Of segs[i]
+  while (i < nsegs)
     {
-      u32 towrite = cbuffer_len (&w->buffer);
+      if (ofst / w->seg_size > w->seg)
+        {
+          err_t_wrap (walos_next_seg (w, e), e);
+        }
+      ASSERT (ofst / w->seg_size == w->seg);
 
-      // Flush out the entire file to disk
-      if (cbuffer_write_to_file_1_expect (&w->fd, &w->buffer, towrite, e))
+      // At most one piece of each buffer segment fits before the file ends
+      u64 seg_end = (w->seg + 1) * w->seg_size;
+      struct i_aio_req reqs[3];
+      u32 n = 0;
+      while (i < nsegs && ofst < seg_end)
         {
-          goto theend;
+          ASSERT (segs[i].len > done);
+          u32 len = (u32)MIN ((u64)(segs[i].len - done), seg_end - ofst);
+          reqs[n++] = (struct i_aio_req){
+            .op = I_AIO_WRITE,
+            .fp = &w->fd,
+            .buf = (u8 *)segs[i].head + done,
+            .n = len,
+            .offset = ofst % w->seg_size,
+            .link = true,
+          };
+          ofst += len;
+          done += len;
+          if (done == segs[i].len)
+            {
+              i++;
+              done = 0;
+            }
         }
-      cbuffer_write_to_file_2 (&w->buffer, towrite);
+      reqs[n++] = (struct i_aio_req){ .op = I_AIO_FSYNC, .fp = &w->fd };
 
-      w->flushed_lsn += towrite;
+      u64 start = i_timer_now_ns (&w->timer);
+      err_t_wrap (i_aio_submit (&w->aio, reqs, n, e), e);
+      walos_stat_fsync (w, i_timer_now_ns (&w->timer) - start);
     }
 
-  // Need to fsync every flush due to interleaving
-  // fsync's
-  if (i_fsync (&w->fd, e))
+  __atomic_fetch_add (&w->stats.bytes, *towrite, __ATOMIC_RELAXED);
+
+  return SUCCESS;
+}
+
+/**
+ * Flusher holds gl. Someone's waiting on a flush, or a slice of the
+ * buffer filled up
+ */
+static bool
+walos_flush_due (struct wal_ostream *w)
+{
+  if (w->flushing)
     {
-      goto theend;
+      return false;
     }
 
-theend:
+  latch_lock (&w->l);
+  u32 len = cbuffer_len (&w->buffer);
+  bool ret = len > 0 && (w->requested > w->flushed_lsn || len >= WAL_SLICE);
   latch_unlock (&w->l);
-  return e->cause_code;
+
+  return ret;
+}
+
+static void *
+walos_flusher (void *arg)
+{
+  struct wal_ostream *w = arg;
+
+  i_mutex_lock (&w->gl);
+
+  while (true)
+    {
+      while (!w->closing && !walos_flush_due (w))
+        {
+          i_cond_wait (&w->work, &w->gl);
+        }
+
+      // Close flushed everything it wanted already
+      if (w->closing)
+        {
+          break;
+        }
+
+      walos_gather (w);
+
+      // Everyone queued so far is covered by what's buffered now
+      u32 batch = w->nwaiting;
+      w->nwaiting = 0;
+      w->nflushes++;
+      w->flushing = true;
+      i_mutex_unlock (&w->gl);
+
+      u32 towrite;
+      lsn rec_end;
+      err_t ret = walos_write_out (w, &towrite, &rec_end, &w->ferr);
+
+      i_mutex_lock (&w->gl);
+      if (ret == SUCCESS)
+        {
+          latch_lock (&w->l);
+          cbuffer_write_to_file_2 (&w->buffer, towrite);
+          w->flushed_lsn += towrite;
+          latch_unlock (&w->l);
+          w->durable_lsn = rec_end;
+
+          if (batch > 1)
+            {
+              __atomic_fetch_add (&w->stats.grouped, batch - 1, __ATOMIC_RELAXED);
+            }
+        }
+      w->flushing = false;
+
+      /**
+       * A failed fsync may have dropped the pages it was writing - trying
+       * again could report durable what never got there. Everyone waiting
+       * now and after gets the error
+       */
+      if (ret)
+        {
+          i_log_error ("WAL flush failed at lsn %" PRlsn ": %s\n", w->flushed_lsn, w->ferr.cause_msg);
+          w->failed = true;
+        }
+
+      i_cond_broadcast (&w->flushed);
+
+      if (ret)
+        {
+          break;
+        }
+    }
+
+  i_mutex_unlock (&w->gl);
+
+  return NULL;
+}
+
+// Caller holds gl
+static err_t
+walos_failed (struct wal_ostream *w, error *e)
+{
+  return error_causef (e, w->ferr.cause_code, "WAL flush failed earlier: %.*s", (int)w->ferr.cmlen, w->ferr.cause_msg);
 }
 
 err_t
 walos_flush_to (struct wal_ostream *w, lsn l, error *e)
 {
-  return walos_flush_to_impl (w, l, true, e);
+  DBG_ASSERT (wal_ostream, w);
+
+  // Whatever is buffered now has to go - that covers the record at l
+  latch_lock (&w->l);
+  lsn want = w->flushed_lsn + cbuffer_len (&w->buffer);
+  latch_unlock (&w->l);
+
+  ASSERTF (l <= want,
+           "Trying to flush past a written lsn. Attempt: %" PRlsn " actual last lsn: %" PRlsn "\n",
+           l, want);
+
+  i_mutex_lock (&w->gl);
+
+  if (l >= w->durable_lsn && want > w->flushed_lsn)
+    {
+      // Queue up for the next flush
+      w->requested = MAX (w->requested, want);
+      w->nwaiting++;
+      u64 nflushes = w->nflushes;
+      i_cond_signal (&w->work);
+
+      while (l >= w->durable_lsn && want > w->flushed_lsn && !w->failed)
+        {
+          i_cond_wait (&w->flushed, &w->gl);
+        }
+
+      // The flush in flight got it - the next one doesn't count us
+      if (w->nflushes == nflushes)
+        {
+          w->nwaiting--;
+        }
+
+      if (l >= w->durable_lsn && want > w->flushed_lsn)
+        {
+          walos_failed (w, e);
+        }
+    }
+
+  i_mutex_unlock (&w->gl);
+
+  return e->cause_code;
 }
 
 err_t
 walos_flush_all (struct wal_ostream *w, error *e)
 {
-  return walos_flush_to_impl (w, w->flushed_lsn + cbuffer_len (&w->buffer), true, e);
+  return walos_flush_to (w, walos_get_next_lsn (w), e);
+}
+
+static err_t
+walos_wait_room (struct wal_ostream *w, error *e)
+{
+  i_mutex_lock (&w->gl);
+  i_cond_signal (&w->work);
+
+  while (!w->failed)
+    {
+      latch_lock (&w->l);
+      bool full = cbuffer_avail (&w->buffer) == 0;
+      latch_unlock (&w->l);
+
+      if (!full)
+        {
+          break;
+        }
+      i_cond_wait (&w->flushed, &w->gl);
+    }
+
+  if (w->failed)
+    {
+      walos_failed (w, e);
+    }
+
+  i_mutex_unlock (&w->gl);
+
+  return e->cause_code;
 }
 
 err_t
@@ -150,37 +493,117 @@ walos_write_all (struct wal_ostream *w, u32 *checksum, const void *data, u32 len
 
   u32 written = 0;
   const u8 *src = data;
+  bool wake = false;
 
   latch_lock (&w->l);
 
   while (written < len)
     {
-      if (cbuffer_avail (&w->buffer) < (len - written))
+      if (cbuffer_avail (&w->buffer) == 0)
         {
-          if (walos_flush_to_impl (w, w->flushed_lsn + cbuffer_len (&w->buffer), false, e))
-            {
-              latch_unlock (&w->l);
-              return e->cause_code;
-            }
+          // Every slice is full - the flusher is on it already, wait for room
+          latch_unlock (&w->l);
+          err_t_wrap (walos_wait_room (w, e), e);
+          latch_lock (&w->l);
+          continue;
         }
 
+      u32 before = cbuffer_len (&w->buffer);
       u32 towrite = MIN (len - written, cbuffer_avail (&w->buffer));
-      ASSERT (towrite > 0); // Loop termination condition
-
       cbuffer_write_expect (src + written, 1, towrite, &w->buffer);
-
       written += towrite;
+
+      // Filled a slice
+      wake = wake || before / WAL_SLICE != (before + towrite) / WAL_SLICE;
     }
 
   latch_unlock (&w->l);
 
+  // gl comes before l
+  if (wake)
+    {
+      i_mutex_lock (&w->gl);
+      i_cond_signal (&w->work);
+      i_mutex_unlock (&w->gl);
+    }
+
   return SUCCESS;
 }
 
+void
+walos_mark_end_log (struct wal_ostream *w)
+{
+  DBG_ASSERT (wal_ostream, w);
+
+  latch_lock (&w->l);
+  w->rec_end = w->flushed_lsn + cbuffer_len (&w->buffer);
+  latch_unlock (&w->l);
+}
+
 lsn
 walos_get_next_lsn (struct wal_ostream *w)
 {
-  return w->flushed_lsn + cbuffer_len (&w->buffer);
+  // The flusher may be consuming the buffer
+  latch_lock (&w->l);
+  lsn ret = w->flushed_lsn + cbuffer_len (&w->buffer);
+  latch_unlock (&w->l);
+  return ret;
+}
+
+void
+walos_get_stats (struct wal_ostream *w, struct wal_stats *dest)
+{
+  DBG_ASSERT (wal_ostream, w);
+
+  dest->fsyncs = __atomic_load_n (&w->stats.fsyncs, __ATOMIC_RELAXED);
+  dest->bytes = __atomic_load_n (&w->stats.bytes, __ATOMIC_RELAXED);
+  dest->fsync_ns = __atomic_load_n (&w->stats.fsync_ns, __ATOMIC_RELAXED);
+  dest->fsync_max_ns = __atomic_load_n (&w->stats.fsync_max_ns, __ATOMIC_RELAXED);
+  dest->grouped = __atomic_load_n (&w->stats.grouped, __ATOMIC_RELAXED);
+  dest->recycled = __atomic_load_n (&w->stats.recycled, __ATOMIC_RELAXED);
+  dest->removed = __atomic_load_n (&w->stats.removed, __ATOMIC_RELAXED);
+}
+
+/**
+ * Segments wholly below [keep] aren't log anymore. Up to
+ * WAL_SEGMENT_SPARES of them are renamed past the last segment so the
+ * log grows into files that are already allocated - the rest are removed.
+ * Whatever they held stays behind, records don't check out at another lsn
+ */
+err_t
+walos_recycle (struct wal_ostream *w, lsn keep, error *e)
+{
+  DBG_ASSERT (wal_ostream, w);
+
+  char from[MAX_FILE_NAME];
+  char to[MAX_FILE_NAME];
+
+  i_mutex_lock (&w->sl);
+
+  // A flush that ended right on a segment end hasn't moved off the segment yet
+  u64 keep_seg = MIN (keep / w->seg_size, w->seg);
+
+  for (; w->first_seg < keep_seg; w->first_seg++)
+    {
+      walseg_name (from, w->fname, w->first_seg);
+
+      if (w->last_seg - w->seg < WAL_SEGMENT_SPARES)
+        {
+          walseg_name (to, w->fname, w->last_seg + 1);
+          err_t_wrap_goto (i_rename (from, to, e), theend, e);
+          w->last_seg++;
+          __atomic_fetch_add (&w->stats.recycled, 1, __ATOMIC_RELAXED);
+        }
+      else
+        {
+          err_t_wrap_goto (i_remove_quiet (from, e), theend, e);
+          __atomic_fetch_add (&w->stats.removed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+theend:
+  i_mutex_unlock (&w->sl);
+  return e->cause_code;
 }
 
 #ifndef NTEST
@@ -188,8 +611,326 @@ err_t
 walos_crash (struct wal_ostream *w, error *e)
 {
   DBG_ASSERT (wal_ostream, w);
+  walos_stop_flusher (w, e);
+  i_mutex_free (&w->sl);
+  i_cond_free (&w->work);
+  i_cond_free (&w->flushed);
+  i_mutex_free (&w->gl);
+  i_timer_free (&w->timer);
+  i_aio_close (&w->aio);
   i_close (&w->fd, e);
   i_free (w);
   return e->cause_code;
 }
 #endif
+
+#ifndef NTEST
+#define WALOS_TEST_THREADS 4
+#define WALOS_TEST_FLUSHES 200
+
+struct walos_test_ctx
+{
+  struct wal_ostream *w;
+  i_mutex *append; // Stands in for the wal latch - one record at a time
+  u8 id;
+  u32 nflushes;
+  err_t ret;
+};
+
+static void *
+walos_test_thread (void *arg)
+{
+  struct walos_test_ctx *ctx = arg;
+  error e = error_create ();
+  u8 rec[16];
+  i_memset (rec, ctx->id, sizeof (rec));
+
+  for (u32 i = 0; i < ctx->nflushes; ++i)
+    {
+      i_mutex_lock (ctx->append);
+      lsn l = walos_get_next_lsn (ctx->w);
+      ctx->ret = walos_write_all (ctx->w, NULL, rec, sizeof (rec), &e);
+      walos_mark_end_log (ctx->w);
+      i_mutex_unlock (ctx->append);
+
+      if (ctx->ret || (ctx->ret = walos_flush_to (ctx->w, l, &e)))
+        {
+          return NULL;
+        }
+
+      // The whole record is on disk once flush_to returns
+      i_mutex_lock (&ctx->w->gl);
+      bool durable = l < ctx->w->durable_lsn && l + sizeof (rec) <= ctx->w->flushed_lsn;
+      i_mutex_unlock (&ctx->w->gl);
+      if (!durable)
+        {
+          ctx->ret = ERR_FAILED_TEST;
+          return NULL;
+        }
+    }
+
+  return NULL;
+}
+
+TEST (TT_UNIT, walos_group_commit)
+{
+  error e = error_create ();
+  struct wal_stats s;
+  u8 rec[16] = { 0 };
+
+  test_err_t_wrap (walseg_remove_from ("test.wal", 0, &e), &e);
+  struct wal_ostream *w = walos_open ("test.wal", WAL_SEGMENT_SIZE, 0, 0, &e);
+  test_fail_if_null (w);
+
+  TEST_CASE ("Flushing a record that's already durable doesn't fsync")
+  {
+    test_err_t_wrap (walos_write_all (w, NULL, rec, sizeof (rec), &e), &e);
+    walos_mark_end_log (w);
+    test_err_t_wrap (walos_flush_to (w, 0, &e), &e);
+
+    walos_get_stats (w, &s);
+    test_assert_int_equal (s.fsyncs, 1);
+    test_assert_int_equal (s.bytes, sizeof (rec));
+
+    test_err_t_wrap (walos_flush_to (w, 0, &e), &e);
+    test_err_t_wrap (walos_flush_all (w, &e), &e);
+    walos_get_stats (w, &s);
+    test_assert_int_equal (s.fsyncs, 1);
+  }
+
+  i_mutex append;
+  test_err_t_wrap (i_mutex_create (&append, &e), &e);
+
+  struct walos_test_ctx ctx[WALOS_TEST_THREADS];
+  i_thread threads[WALOS_TEST_THREADS];
+
+  TEST_CASE ("Committers queued behind a flush go out in one fsync")
+  {
+    // Pretend the flusher is mid flush
+    i_mutex_lock (&w->gl);
+    w->flushing = true;
+    i_mutex_unlock (&w->gl);
+
+    for (u32 i = 0; i < WALOS_TEST_THREADS; ++i)
+      {
+        ctx[i] = (struct walos_test_ctx){ .w = w, .append = &append, .id = (u8)(i + 1), .nflushes = 1 };
+        test_err_t_wrap (i_thread_create (&threads[i], walos_test_thread, &ctx[i], &e), &e);
+      }
+
+    // Everyone appended and queued up
+    for (bool queued = false; !queued; i_thread_yield ())
+      {
+        i_mutex_lock (&w->gl);
+        queued = w->nwaiting == WALOS_TEST_THREADS;
+        i_mutex_unlock (&w->gl);
+      }
+
+    i_mutex_lock (&w->gl);
+    w->flushing = false;
+    i_cond_signal (&w->work);
+    i_mutex_unlock (&w->gl);
+
+    for (u32 i = 0; i < WALOS_TEST_THREADS; ++i)
+      {
+        test_err_t_wrap (i_thread_join (&threads[i], &e), &e);
+        test_assert_int_equal (ctx[i].ret, SUCCESS);
+      }
+
+    walos_get_stats (w, &s);
+    test_assert_int_equal (s.fsyncs, 2);
+    test_assert_int_equal (s.grouped, WALOS_TEST_THREADS - 1);
+    test_assert_int_equal (s.bytes, (1 + WALOS_TEST_THREADS) * sizeof (rec));
+  }
+
+  TEST_CASE ("Concurrent committers with a commit delay")
+  {
+    walos_set_group_commit (w, 1000000, WALOS_TEST_THREADS);
+
+    for (u32 i = 0; i < WALOS_TEST_THREADS; ++i)
+      {
+        ctx[i] = (struct walos_test_ctx){ .w = w, .append = &append, .id = (u8)(i + 1), .nflushes = WALOS_TEST_FLUSHES };
+        test_err_t_wrap (i_thread_create (&threads[i], walos_test_thread, &ctx[i], &e), &e);
+      }
+    for (u32 i = 0; i < WALOS_TEST_THREADS; ++i)
+      {
+        test_err_t_wrap (i_thread_join (&threads[i], &e), &e);
+        test_assert_int_equal (ctx[i].ret, SUCCESS);
+      }
+
+    // Every flush either led, rode along or found its record durable
+    walos_get_stats (w, &s);
+    test_assert_int_equal (s.bytes, (1 + WALOS_TEST_THREADS * (1 + WALOS_TEST_FLUSHES)) * sizeof (rec));
+    test_assert (s.fsyncs + s.grouped <= 1 + WALOS_TEST_THREADS * (1 + WALOS_TEST_FLUSHES));
+  }
+
+  i_mutex_free (&append);
+
+  test_err_t_wrap (walos_close (w, &e), &e);
+  test_err_t_wrap (walseg_remove_from ("test.wal", 0, &e), &e);
+}
+
+TEST (TT_UNIT, walos_background_flush)
+{
+  error e = error_create ();
+  struct wal_stats s;
+  static u8 rec[WAL_SLICE / 4];
+
+  test_err_t_wrap (walseg_remove_from ("test.wal", 0, &e), &e);
+  struct wal_ostream *w = walos_open ("test.wal", WAL_SEGMENT_SIZE, 0, 0, &e);
+  test_fail_if_null (w);
+
+  TEST_CASE ("A full slice goes out without anyone asking")
+  {
+    for (u32 i = 0; i < 4; ++i)
+      {
+        test_err_t_wrap (walos_write_all (w, NULL, rec, sizeof (rec), &e), &e);
+        walos_mark_end_log (w);
+      }
+
+    for (walos_get_stats (w, &s); s.bytes < 4 * sizeof (rec); walos_get_stats (w, &s))
+      {
+        i_thread_yield ();
+      }
+    test_assert_int_equal (s.fsyncs, 1);
+  }
+
+  TEST_CASE ("Appends run past the buffer and wait for room")
+  {
+    for (u32 i = 0; i < 4 * WAL_BUFFERS * 4; ++i)
+      {
+        i_memset (rec, (int)i, sizeof (rec));
+        test_err_t_wrap (walos_write_all (w, NULL, rec, sizeof (rec), &e), &e);
+        walos_mark_end_log (w);
+      }
+    test_err_t_wrap (walos_flush_all (w, &e), &e);
+
+    walos_get_stats (w, &s);
+    test_assert_int_equal (s.bytes, (4 + 4 * WAL_BUFFERS * 4) * sizeof (rec));
+    test_assert_int_equal (walos_get_next_lsn (w), s.bytes);
+
+    // The last record is whole on disk
+    u8 got[sizeof (rec)];
+    bool iseof;
+    struct wal_istream r;
+    test_err_t_wrap (walis_open (&r, "test.wal", WAL_SEGMENT_SIZE, s.bytes - sizeof (rec), &e), &e);
+    walis_mark_start_log (&r);
+    test_err_t_wrap (walis_read_all (&r, &iseof, NULL, NULL, got, sizeof (got), &e), &e);
+    walis_mark_end_log (&r);
+    test_assert (!iseof);
+    test_assert_memequal (got, rec, sizeof (rec));
+    test_err_t_wrap (walis_close (&r, &e), &e);
+  }
+
+  test_err_t_wrap (walos_close (w, &e), &e);
+  test_err_t_wrap (walseg_remove_from ("test.wal", 0, &e), &e);
+}
+
+#define WALOS_TEST_SEG 64
+
+static bool
+walos_test_seg_exists (u64 seg)
+{
+  error e = error_create ();
+  char name[MAX_FILE_NAME];
+  bool exists = false;
+  walseg_name (name, "test.wal", seg);
+  i_file_exists (name, &exists, &e);
+  return exists;
+}
+
+TEST (TT_UNIT, walos_segments)
+{
+  error e = error_create ();
+  struct wal_stats s;
+  struct wal_istream r;
+  u8 rec[24];
+  u8 got[24];
+  bool iseof;
+
+  test_err_t_wrap (walseg_remove_from ("test.wal", 0, &e), &e);
+  struct wal_ostream *w = walos_open ("test.wal", WALOS_TEST_SEG, 0, 0, &e);
+  test_fail_if_null (w);
+
+  TEST_CASE ("Records run across segment ends")
+  {
+    // 240 bytes - segments 0 through 3
+    for (u8 i = 0; i < 10; ++i)
+      {
+        i_memset (rec, i, sizeof (rec));
+        test_err_t_wrap (walos_write_all (w, NULL, rec, sizeof (rec), &e), &e);
+        walos_mark_end_log (w);
+      }
+    test_err_t_wrap (walos_flush_all (w, &e), &e);
+    test_assert (walos_test_seg_exists (3));
+    test_assert (!walos_test_seg_exists (4));
+
+    // One flush, but every segment it wrote was synced
+    walos_get_stats (w, &s);
+    test_assert_int_equal (s.fsyncs, 4);
+    test_assert_int_equal (s.bytes, 240);
+
+    test_err_t_wrap (walis_open (&r, "test.wal", WALOS_TEST_SEG, 0, &e), &e);
+    for (u8 i = 0; i < 10; ++i)
+      {
+        i_memset (rec, i, sizeof (rec));
+        walis_mark_start_log (&r);
+        test_err_t_wrap (walis_read_all (&r, &iseof, NULL, NULL, got, sizeof (got), &e), &e);
+        walis_mark_end_log (&r);
+        test_assert (!iseof);
+        test_assert_memequal (got, rec, sizeof (rec));
+      }
+  }
+
+  TEST_CASE ("Truncated segments become spares, then go")
+  {
+    test_err_t_wrap (walos_recycle (w, 130, &e), &e);
+    walos_get_stats (w, &s);
+    test_assert_int_equal (s.recycled, 2);
+    test_assert_int_equal (s.removed, 0);
+    test_assert (!walos_test_seg_exists (0));
+    test_assert (!walos_test_seg_exists (1));
+    test_assert (walos_test_seg_exists (5));
+
+    // Through the spares and on to segment 7
+    for (u8 i = 10; i < 20; ++i)
+      {
+        i_memset (rec, i, sizeof (rec));
+        test_err_t_wrap (walos_write_all (w, NULL, rec, sizeof (rec), &e), &e);
+        walos_mark_end_log (w);
+      }
+    test_err_t_wrap (walos_flush_all (w, &e), &e);
+
+    test_err_t_wrap (walis_seek (&r, 240, &e), &e);
+    for (u8 i = 10; i < 20; ++i)
+      {
+        i_memset (rec, i, sizeof (rec));
+        walis_mark_start_log (&r);
+        test_err_t_wrap (walis_read_all (&r, &iseof, NULL, NULL, got, sizeof (got), &e), &e);
+        walis_mark_end_log (&r);
+        test_assert (!iseof);
+        test_assert_memequal (got, rec, sizeof (rec));
+      }
+
+    test_err_t_wrap (walos_recycle (w, 400, &e), &e);
+    walos_get_stats (w, &s);
+    test_assert_int_equal (s.recycled, 4);
+    test_assert_int_equal (s.removed, 2);
+    test_assert (!walos_test_seg_exists (5));
+    test_assert (walos_test_seg_exists (6));
+    test_assert (walos_test_seg_exists (9));
+    test_assert (!walos_test_seg_exists (10));
+  }
+
+  TEST_CASE ("A missing segment is the end of the log")
+  {
+    test_err_t_wrap (walis_seek (&r, 0, &e), &e);
+    walis_mark_start_log (&r);
+    test_err_t_wrap (walis_read_all (&r, &iseof, NULL, NULL, got, sizeof (got), &e), &e);
+    test_assert (iseof);
+  }
+
+  test_err_t_wrap (walis_close (&r, &e), &e);
+  test_err_t_wrap (walos_close (w, &e), &e);
+  test_err_t_wrap (walseg_remove_from ("test.wal", 6, &e), &e);
+}
+#endif
@@ -23,8 +23,13 @@
 #include <numstore/core/assert.h>
 #include <numstore/core/error.h>
 #include <numstore/intf/logging.h>
+#include <numstore/intf/stdlib.h>
 #include <numstore/pager/page.h>
 #include <numstore/pager/txn_table.h>
+#include <numstore/test/testing.h>
+
+// Range offsets and lengths are u16
+_Static_assert (PAGE_SIZE <= 65536, "Delta ranges don't fit in u16");
 
 const char *
 wal_rec_hdr_type_tostr (enum wal_rec_hdr_type type)
@@ -96,6 +101,8 @@ wrhw_from_wrhr (struct wal_rec_hdr_read *src)
       }
     case WL_UPDATE:
       {
+        // There's no write form of a delta update - it's derived from images
+        ASSERT (!src->update.delta);
         return (struct wal_rec_hdr_write){
           .type = WL_UPDATE,
           .update = {
@@ -117,6 +124,8 @@ wrhw_from_wrhr (struct wal_rec_hdr_read *src)
               .pg = src->clr.pg,
               .undo_next = src->clr.undo_next,
               .redo = src->clr.redo,
+              .delta = src->clr.delta,
+              .dlen = src->clr.dlen,
           },
         };
       }
@@ -144,6 +153,213 @@ wrhw_from_wrhr (struct wal_rec_hdr_read *src)
   UNREACHABLE ();
 }
 
+/////////////////////////////////////////////
+/// DELTAS
+
+bool
+wal_delta_encode (u8 *undo_dest, u8 *redo_dest, u32 *dlen, const u8 *undo, const u8 *redo)
+{
+  u32 len = 0;
+  u32 i = 0;
+
+  while (i < PAGE_SIZE)
+    {
+      // Skip what didn't change - a word at a time first
+      while (i + sizeof (u64) <= PAGE_SIZE && i_memcmp (undo + i, redo + i, sizeof (u64)) == 0)
+        {
+          i += sizeof (u64);
+        }
+      while (i < PAGE_SIZE && undo[i] == redo[i])
+        {
+          i++;
+        }
+      if (i == PAGE_SIZE)
+        {
+          break;
+        }
+
+      // Run over short gaps - a new range costs a header in both deltas
+      u32 start = i;
+      u32 end = i + 1;
+      for (u32 j = end; j < PAGE_SIZE && j <= end + WL_DELTA_GAP; ++j)
+        {
+          if (undo[j] != redo[j])
+            {
+              end = j + 1;
+            }
+        }
+
+      u16 ofst = (u16)start;
+      u16 rlen = (u16)(end - start);
+      if (len + 2 * sizeof (u16) + rlen > WL_DELTA_MAX)
+        {
+          return false;
+        }
+
+      i_memcpy (undo_dest + len, &ofst, sizeof (u16));
+      i_memcpy (redo_dest + len, &ofst, sizeof (u16));
+      len += sizeof (u16);
+      i_memcpy (undo_dest + len, &rlen, sizeof (u16));
+      i_memcpy (redo_dest + len, &rlen, sizeof (u16));
+      len += sizeof (u16);
+      i_memcpy (undo_dest + len, undo + start, rlen);
+      i_memcpy (redo_dest + len, redo + start, rlen);
+      len += rlen;
+
+      i = end;
+    }
+
+  *dlen = len;
+  return true;
+}
+
+err_t
+wal_delta_validate (const u8 *delta, u32 dlen, error *e)
+{
+  if (dlen > WL_DELTA_MAX)
+    {
+      return error_causef (e, ERR_CORRUPT, "Delta of %" PRIu32 " bytes is too long", dlen);
+    }
+
+  u32 head = 0;
+  while (head < dlen)
+    {
+      u16 ofst, rlen;
+      if (dlen - head < 2 * sizeof (u16))
+        {
+          return error_causef (e, ERR_CORRUPT, "Delta range header cut short");
+        }
+      i_memcpy (&ofst, delta + head, sizeof (u16));
+      i_memcpy (&rlen, delta + head + sizeof (u16), sizeof (u16));
+      head += 2 * sizeof (u16);
+
+      if (rlen > dlen - head || (u32)ofst + rlen > PAGE_SIZE)
+        {
+          return error_causef (e, ERR_CORRUPT, "Delta range [%u, %u) is out of bounds", ofst, ofst + rlen);
+        }
+      head += rlen;
+    }
+
+  return SUCCESS;
+}
+
+void
+wal_delta_apply (u8 *raw, const u8 *delta, u32 dlen)
+{
+  u32 head = 0;
+  while (head < dlen)
+    {
+      u16 ofst, rlen;
+      i_memcpy (&ofst, delta + head, sizeof (u16));
+      i_memcpy (&rlen, delta + head + sizeof (u16), sizeof (u16));
+      head += 2 * sizeof (u16);
+
+      ASSERT ((u32)ofst + rlen <= PAGE_SIZE);
+      i_memcpy (raw + ofst, delta + head, rlen);
+      head += rlen;
+    }
+  ASSERT (head == dlen);
+}
+
+void
+wal_update_undo (u8 *raw, const struct wal_update_read *r)
+{
+  if (r->delta)
+    {
+      wal_delta_apply (raw, r->undo, r->dlen);
+    }
+  else
+    {
+      i_memcpy (raw, r->undo, PAGE_SIZE);
+    }
+}
+
+void
+wal_update_redo (u8 *raw, const struct wal_update_read *r)
+{
+  if (r->delta)
+    {
+      wal_delta_apply (raw, r->redo, r->dlen);
+    }
+  else
+    {
+      i_memcpy (raw, r->redo, PAGE_SIZE);
+    }
+}
+
+void
+wal_clr_redo (u8 *raw, const struct wal_clr_read *r)
+{
+  if (r->delta)
+    {
+      wal_delta_apply (raw, r->redo, r->dlen);
+    }
+  else
+    {
+      i_memcpy (raw, r->redo, PAGE_SIZE);
+    }
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, wal_delta)
+{
+  error e = error_create ();
+  u8 before[PAGE_SIZE];
+  u8 after[PAGE_SIZE];
+  u8 raw[PAGE_SIZE];
+  u8 undo[WL_DELTA_MAX];
+  u8 redo[WL_DELTA_MAX];
+  u32 dlen;
+
+  i_memset (before, 1, PAGE_SIZE);
+  i_memcpy (after, before, PAGE_SIZE);
+
+  TEST_CASE ("Nothing changed")
+  {
+    test_assert (wal_delta_encode (undo, redo, &dlen, before, after));
+    test_assert_int_equal (dlen, 0);
+  }
+
+  TEST_CASE ("Small changes - nearby ones share a range")
+  {
+    i_memset (after + 100, 9, 8);
+    after[110] = 9;                         // 2 byte gap - same range
+    i_memset (after + PAGE_SIZE - 3, 9, 3); // Last bytes of the page
+    test_assert (wal_delta_encode (undo, redo, &dlen, before, after));
+    test_assert_int_equal (dlen, 2 * 2 * sizeof (u16) + 11 + 3);
+    test_err_t_wrap (wal_delta_validate (redo, dlen, &e), &e);
+
+    i_memcpy (raw, before, PAGE_SIZE);
+    wal_delta_apply (raw, redo, dlen);
+    test_assert_memequal (raw, after, PAGE_SIZE);
+
+    wal_delta_apply (raw, undo, dlen);
+    test_assert_memequal (raw, before, PAGE_SIZE);
+  }
+
+  TEST_CASE ("Too many changes")
+  {
+    for (u32 i = 0; i < PAGE_SIZE; i += 2)
+      {
+        after[i] = 7;
+      }
+    test_assert (!wal_delta_encode (undo, redo, &dlen, before, after));
+  }
+
+  TEST_CASE ("Bad deltas")
+  {
+    // Runs off the end of the page
+    u8 bad[2 * sizeof (u16) + 2] = { 0 };
+    u16 hdr[2] = { (u16)(PAGE_SIZE - 1), 2 };
+    i_memcpy (bad, hdr, sizeof (hdr));
+    test_err_t_check (wal_delta_validate (bad, sizeof (bad), &e), ERR_CORRUPT, &e);
+
+    // Header cut short
+    test_err_t_check (wal_delta_validate (bad, 3, &e), ERR_CORRUPT, &e);
+  }
+}
+#endif
+
 stxid
 wrh_get_tid (struct wal_rec_hdr_read *h)
 {
@@ -246,6 +462,14 @@ wal_rec_hdr_read_equal (struct wal_rec_hdr_read *left, struct wal_rec_hdr_read *
         match = match && left->update.tid == right->update.tid;
         match = match && left->update.prev == right->update.prev;
         match = match && left->update.pg == right->update.pg;
+        match = match && left->update.delta == right->update.delta;
+        if (match && left->update.delta)
+          {
+            match = match && left->update.dlen == right->update.dlen;
+            match = match && i_memcmp (left->update.undo, right->update.undo, left->update.dlen) == 0;
+            match = match && i_memcmp (left->update.redo, right->update.redo, left->update.dlen) == 0;
+            break;
+          }
         match = match && i_memcmp (left->update.undo, right->update.undo, PAGE_SIZE) == 0;
         match = match && i_memcmp (left->update.redo, right->update.redo, PAGE_SIZE) == 0;
         break;
@@ -257,7 +481,9 @@ wal_rec_hdr_read_equal (struct wal_rec_hdr_read *left, struct wal_rec_hdr_read *
         match = match && left->clr.prev == right->clr.prev;
         match = match && left->clr.pg == right->clr.pg;
         match = match && left->clr.undo_next == right->clr.undo_next;
-        match = match && i_memcmp (left->clr.redo, right->clr.redo, PAGE_SIZE) == 0;
+        match = match && left->clr.delta == right->clr.delta;
+        match = match && left->clr.dlen == right->clr.dlen;
+        match = match && i_memcmp (left->clr.redo, right->clr.redo, left->clr.delta ? left->clr.dlen : PAGE_SIZE) == 0;
         break;
       }
 
@@ -310,6 +536,12 @@ i_log_update (int log_level, const struct wal_rec_hdr_read *r)
   i_printf (log_level, "TID: %ld\n", r->update.tid);
   i_printf (log_level, "PREV: %ld\n", r->update.prev);
   i_printf (log_level, "PG: %ld\n", r->update.pg);
+  if (r->update.delta)
+    {
+      i_printf (log_level, "DELTA: %u bytes\n", r->update.dlen);
+      i_log (log_level, "------------------------------------\n");
+      return;
+    }
   page temp;
 
   i_printf (log_level, "UNDO: ");
@@ -352,6 +584,12 @@ i_log_clr (int log_level, const struct wal_rec_hdr_read *r)
   i_printf (log_level, "PREV: %ld\n", r->clr.prev);
   i_printf (log_level, "PG: %ld\n", r->clr.pg);
   i_printf (log_level, "UNDO_NEXT: %ld\n", r->clr.undo_next);
+  if (r->clr.delta)
+    {
+      i_printf (log_level, "DELTA: %u bytes\n", r->clr.dlen);
+      i_log (log_level, "------------------------------------\n");
+      return;
+    }
   i_printf (log_level, "REDO: ");
   for (u32 i = 0; i < 10; ++i)
     {
@@ -551,6 +789,9 @@ walf_decode_update (struct wal_rec_hdr_read *r, const u8 buf[WL_UPDATE_LEN])
 
   // REDO
   i_memcpy (r->update.redo, buf + head, PAGE_SIZE);
+
+  r->update.delta = false;
+  r->update.dlen = 0;
 }
 
 void
@@ -578,6 +819,9 @@ walf_decode_clr (struct wal_rec_hdr_read *r, const u8 buf[WL_CLR_LEN])
 
   // REDO only
   i_memcpy (r->clr.redo, buf + head, PAGE_SIZE);
+
+  r->clr.delta = false;
+  r->clr.dlen = 0;
 }
 
 void
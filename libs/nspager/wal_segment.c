@@ -0,0 +1,214 @@
+/*
+ * Copyright 2025 Theo Lincke
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Description:
+ *   Implements wal_stream.h. WAL segment files and the control file both streams share.
+ */
+
+#include <numstore/core/assert.h>
+#include <numstore/core/checksums.h>
+#include <numstore/core/error.h>
+#include <numstore/intf/logging.h>
+#include <numstore/intf/os.h>
+#include <numstore/intf/stdlib.h>
+#include <numstore/pager/wal_stream.h>
+#include <numstore/test/testing.h>
+
+///   [u32 WALCTL_MAGIC][u64 log_id][u64 seg_size][u64 start_lsn][u32 checksum]
+#define WALCTL_MAGIC 0x4C41574Eu
+#define WALCTL_LEN (2 * sizeof (u32) + 3 * sizeof (u64))
+
+err_t
+walctl_read (struct wal_ctl *dest, bool *exists, const char *fname, error *e)
+{
+  ASSERT (dest);
+
+  err_t_wrap (i_file_exists (fname, exists, e), e);
+  if (!*exists)
+    {
+      return SUCCESS;
+    }
+
+  i_file fd;
+  u8 buf[WALCTL_LEN];
+  err_t_wrap (i_open_r (&fd, fname, e), e);
+  i64 nread = i_pread_all (&fd, buf, sizeof (buf), 0, e);
+  i_close (&fd, e);
+  if (nread < 0)
+    {
+      return e->cause_code;
+    }
+
+  u32 magic;
+  u32 stored;
+  i_memcpy (&magic, buf, sizeof (u32));
+  i_memcpy (&stored, buf + WALCTL_LEN - sizeof (u32), sizeof (u32));
+
+  u32 checksum = checksum_init ();
+  checksum_execute (&checksum, buf, WALCTL_LEN - sizeof (u32));
+
+  if (nread < (i64)WALCTL_LEN || magic != WALCTL_MAGIC || checksum != stored)
+    {
+      return error_causef (e, ERR_CORRUPT, "%s isn't a WAL control file", fname);
+    }
+
+  i_memcpy (&dest->log_id, buf + sizeof (u32), sizeof (u64));
+  i_memcpy (&dest->seg_size, buf + sizeof (u32) + sizeof (u64), sizeof (u64));
+  i_memcpy (&dest->start_lsn, buf + sizeof (u32) + 2 * sizeof (u64), sizeof (u64));
+
+  if (dest->seg_size == 0)
+    {
+      return error_causef (e, ERR_CORRUPT, "%s has an empty segment size", fname);
+    }
+
+  return SUCCESS;
+}
+
+err_t
+walctl_write (const char *fname, const struct wal_ctl *src, error *e)
+{
+  ASSERT (src);
+  ASSERT (src->seg_size > 0);
+
+  u8 buf[WALCTL_LEN];
+  u32 magic = WALCTL_MAGIC;
+  i_memcpy (buf, &magic, sizeof (u32));
+  i_memcpy (buf + sizeof (u32), &src->log_id, sizeof (u64));
+  i_memcpy (buf + sizeof (u32) + sizeof (u64), &src->seg_size, sizeof (u64));
+  i_memcpy (buf + sizeof (u32) + 2 * sizeof (u64), &src->start_lsn, sizeof (u64));
+
+  u32 checksum = checksum_init ();
+  checksum_execute (&checksum, buf, WALCTL_LEN - sizeof (u32));
+  i_memcpy (buf + WALCTL_LEN - sizeof (u32), &checksum, sizeof (u32));
+
+  // Well inside a sector - it's written whole or not at all
+  i_file fd;
+  err_t_wrap (i_open_rw (&fd, fname, e), e);
+  err_t_wrap_goto (i_pwrite_all (&fd, buf, WALCTL_LEN, 0, e), theend, e);
+  err_t_wrap_goto (i_fsync (&fd, e), theend, e);
+
+theend:
+  i_close (&fd, e);
+  return e->cause_code;
+}
+
+void
+walseg_name (char dest[MAX_FILE_NAME], const char *fname, u64 seg)
+{
+  i_snprintf (dest, MAX_FILE_NAME, "%s.%09" PRIu64, fname, seg);
+}
+
+err_t
+walseg_open (i_file *dest, bool *exists, const char *fname, u64 seg, error *e)
+{
+  char name[MAX_FILE_NAME];
+  walseg_name (name, fname, seg);
+
+  err_t_wrap (i_file_exists (name, exists, e), e);
+  if (*exists)
+    {
+      err_t_wrap (i_open_rw (dest, name, e), e);
+    }
+
+  return SUCCESS;
+}
+
+/**
+ * A renamed spare is full size already - only a new segment pays for
+ * the allocation, and after that writes never grow the file
+ */
+err_t
+walseg_create (i_file *dest, const char *fname, u64 seg, u64 seg_size, error *e)
+{
+  char name[MAX_FILE_NAME];
+  walseg_name (name, fname, seg);
+
+  err_t_wrap (i_open_rw (dest, name, e), e);
+
+  i64 len = i_file_size (dest, e);
+  if (len < 0)
+    {
+      goto failed;
+    }
+  if ((u64)len < seg_size)
+    {
+      err_t_wrap_goto (i_fallocate (dest, seg_size, e), failed, e);
+    }
+
+  return SUCCESS;
+
+failed:
+  i_close (dest, e);
+  return e->cause_code;
+}
+
+err_t
+walseg_remove_from (const char *fname, u64 seg, error *e)
+{
+  char name[MAX_FILE_NAME];
+
+  for (bool exists = true; exists; ++seg)
+    {
+      walseg_name (name, fname, seg);
+      err_t_wrap (i_file_exists (name, &exists, e), e);
+      if (exists)
+        {
+          err_t_wrap (i_remove_quiet (name, e), e);
+        }
+    }
+
+  return SUCCESS;
+}
+
+#ifndef NTEST
+TEST (TT_UNIT, walctl_read_write)
+{
+  error e = error_create ();
+  struct wal_ctl ctl;
+  bool exists;
+
+  test_err_t_wrap (i_remove_quiet ("test.walctl", &e), &e);
+
+  TEST_CASE ("No control file")
+  {
+    test_err_t_wrap (walctl_read (&ctl, &exists, "test.walctl", &e), &e);
+    test_assert (!exists);
+  }
+
+  TEST_CASE ("Round trip")
+  {
+    struct wal_ctl src = { .log_id = 0x1234567890, .seg_size = 4096, .start_lsn = 12345 };
+    test_err_t_wrap (walctl_write ("test.walctl", &src, &e), &e);
+    test_err_t_wrap (walctl_read (&ctl, &exists, "test.walctl", &e), &e);
+    test_assert (exists);
+    test_assert_int_equal (ctl.log_id, src.log_id);
+    test_assert_int_equal (ctl.seg_size, src.seg_size);
+    test_assert_int_equal (ctl.start_lsn, src.start_lsn);
+  }
+
+  TEST_CASE ("A damaged control file is corrupt")
+  {
+    i_file fd;
+    u8 junk = 0xFF;
+    test_err_t_wrap (i_open_rw (&fd, "test.walctl", &e), &e);
+    test_err_t_wrap (i_pwrite_all (&fd, &junk, 1, 6, &e), &e);
+    test_err_t_wrap (i_close (&fd, &e), &e);
+
+    test_err_t_check (walctl_read (&ctl, &exists, "test.walctl", &e), ERR_CORRUPT, &e);
+  }
+
+  test_err_t_wrap (i_remove_quiet ("test.walctl", &e), &e);
+}
+#endif